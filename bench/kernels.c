@@ -0,0 +1,151 @@
+/*
+ * Microbenchmark for the low pass output kernels. Runs a pulse-like signal through the FIR output
+ * engine and its fixed-point version once per kernel set the CPU supports and prints the time per
+ * output sample.
+ */
+
+#include <stdio.h>
+#include <time.h>
+
+#include "fir.h"
+#include "firq.h"
+
+#define CLOCK_RATE		1789773.0
+#define SAMPLE_RATE		48000.0
+#define HP_FREQ			40.0
+#define SECONDS			4						// length of signal to render
+#define RUN_LEN			38						// input clocks between level changes
+
+typedef struct {
+	const char		*name;
+	uint32_t		taps;
+	double			beta;
+	double			cutoff;
+} Preset;
+
+static const Preset presets[] = {
+	{ "draft",		29,		2.0,	0.50 },
+	{ "standard",	57,		2.0,	0.50 },
+	{ "mastering",	2047,	8.0,	0.45 }
+};
+
+static Fir fir;
+static FirQ firq;
+static float samples[(int)SAMPLE_RATE];
+static int16_t samples_s16[(int)SAMPLE_RATE];
+
+/**
+ * Returns a monotonic time stamp
+ * @return Time in nanoseconds
+ */
+static double
+now_ns( void )
+{
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * Renders the test signal through the filter
+ * @param checksum Pointer to store the sum of all output samples in
+ * @return Number of samples output
+ */
+static size_t
+render( double *checksum )
+{
+	const size_t clocks = (size_t)CLOCK_RATE * SECONDS;
+	size_t total = 0;
+	float level = 0.0f;
+
+	*checksum = 0.0;
+
+	for ( size_t ran = 0; ran < clocks; )
+	{
+		size_t written = 0;
+
+		level = level == 0.0f ? 0.25f : 0.0f;
+		ran += fir_run( &fir, level, RUN_LEN, samples, sizeof(samples) / sizeof(samples[0]), &written );
+
+		for ( size_t i = 0; i < written; i++ )
+			*checksum += samples[i];
+
+		total += written;
+	}
+
+	return total;
+}
+
+/**
+ * Renders the test signal through the fixed-point filter
+ * @param checksum Pointer to store the sum of all output samples (scaled to floats) in
+ * @return Number of samples output
+ */
+static size_t
+render_fixed( double *checksum )
+{
+	const size_t clocks = (size_t)CLOCK_RATE * SECONDS;
+	size_t total = 0;
+	int32_t level = 0;
+
+	*checksum = 0.0;
+
+	for ( size_t ran = 0; ran < clocks; )
+	{
+		size_t written = 0;
+
+		level = level == 0 ? FIRQ_LEVEL_ONE / 4 : 0;
+		ran += firq_run( &firq, level, RUN_LEN, samples_s16, sizeof(samples_s16) / sizeof(samples_s16[0]),
+				&written );
+
+		for ( size_t i = 0; i < written; i++ )
+			*checksum += (double)samples_s16[i] / FIRQ_LEVEL_ONE;
+
+		total += written;
+	}
+
+	return total;
+}
+
+int
+main( void )
+{
+	printf( "%-10s %-8s %-6s %12s %14s\n", "preset", "kernels", "engine", "ns/sample", "checksum" );
+
+	for ( size_t p = 0; p < sizeof(presets) / sizeof(presets[0]); p++ )
+	{
+		const Preset *preset = &presets[p];
+
+		for ( int k = 0; simd_kernels( k ); k++ )
+		{
+			const SimdKernels *kernels = simd_kernels( k );
+
+			if ( !kernels->supported() )
+				continue;
+
+			fir_init( &fir, CLOCK_RATE, SAMPLE_RATE, HP_FREQ, preset->taps, preset->beta,
+					preset->cutoff );
+			fir_set_kernels( &fir, kernels );
+
+			double checksum;
+			double start = now_ns();
+			size_t total = render( &checksum );
+			double elapsed = now_ns() - start;
+
+			printf( "%-10s %-8s %-6s %12.1f %14.6f\n", preset->name, kernels->name, "float",
+					elapsed / total, checksum );
+
+			firq_init( &firq, &fir );
+
+			start	= now_ns();
+			total	= render_fixed( &checksum );
+			elapsed	= now_ns() - start;
+
+			printf( "%-10s %-8s %-6s %12.1f %14.6f\n", preset->name, kernels->name, "fixed",
+					elapsed / total, checksum );
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,604 @@
+/*
+ * End-to-end benchmark. Plays aibomb.bin through the PPMCK driver and the APU for a fixed number of
+ * frames, several times over, with no SDL and no pacing, and prints throughput statistics across
+ * the runs along with a checksum of the output. Each run starts from a fresh APU and driver, so
+ * every run of a path must produce the same checksum.
+ *
+ * Three paths are measured: "clock" steps the APU one cycle at a time with apu_clock(), "run"
+ * renders in blocks with apu_run() as the demo does, and "timeline" renders like "run" but plays
+ * the song from a timeline compiled with sound_compile() before the runs. All of them write the
+ * frame's registers right after the first cycle of each frame, so with the same output engine they
+ * should produce the same checksum.
+ *
+ * The best, median and p99 columns are taken from the runs with the shortest, the median and the
+ * 99th percentile (nearest rank) wall time. Counter rows are percentiles of the counts themselves.
+ *
+ * Built with PROFILE=1, each run is also timed stage by stage with the profiler in profile.h, and
+ * the time per output sample of the driver, channel clocking, the mixer and the output engine is
+ * printed as percentiles across the runs. apu_clock() is not instrumented, so the clock path only
+ * splits out the driver. The profiler adds a little to the wall time.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include "apu.h"
+#include "bus.h"
+#include "ppmck_driver.h"
+#include "profile.h"
+#include "timeline.h"
+
+#define CLOCK_RATE		1789773.0				// APU clock rate
+#define SONG_FILE		"aibomb.bin"
+#define MAX_RUNS		1000
+#define RUN_SAMPLES		1024					// output buffer size for the run path
+
+#define MAX_SONG_FRAMES	( 60 * 60 * 30 )		// most frames to compile (half an hour)
+
+#define DEFAULT_FRAMES	3600
+#define DEFAULT_RUNS	7
+#define DEFAULT_RATE	48000
+
+enum {
+	COUNTER_INSTRUCTIONS,
+	COUNTER_CACHE_MISSES,
+	COUNTERS
+};
+
+typedef struct {
+	double			seconds;				// wall time of run
+	uint64_t		samples;				// samples output
+	uint64_t		checksum;				// FNV-1a hash of the output samples
+	uint64_t		counters[COUNTERS];		// hardware counters over the run
+	int				counted;				// 1 = counters are valid
+#ifdef APU_PROFILE
+	double			stages[PROFILE_STAGES];	// seconds spent in each profiler stage
+#endif
+} RunResult;
+
+typedef struct {
+	const char		*name;					// path name
+	void			( *render )( Apu *apu, uint64_t cycles, RunResult *res );
+} Path;
+
+static Rom rom;								// song image
+static Ppmck *driver;						// driver playing rom
+static Timeline timeline;					// song compiled for the timeline path
+static int counter_fds[COUNTERS] = { -1, -1 };
+static float run_buf[RUN_SAMPLES];
+
+/**
+ * Returns a monotonic time stamp
+ * @return Time in seconds
+ */
+static double
+now( void )
+{
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Adds samples to a running FNV-1a hash
+ * @param hash Current hash
+ * @param samples Samples
+ * @param n Number of samples
+ * @return New hash
+ */
+static uint64_t
+hash_samples( uint64_t hash, const float *samples, size_t n )
+{
+	const uint8_t *p = (const uint8_t *)samples;
+
+	for ( size_t i = 0; i < n * sizeof(float); i++ )
+	{
+		hash ^= p[i];
+		hash *= 0x100000001b3ull;
+	}
+
+	return hash;
+}
+
+static void
+driver_tick( void *userdata )
+{
+	PROFILE_ENTER( PROFILE_DRIVER );
+	sound_driver_start( userdata );
+	PROFILE_LEAVE();
+}
+
+static void
+timeline_tick( void *userdata )
+{
+	PROFILE_ENTER( PROFILE_DRIVER );
+	timeline_player_frame( userdata );
+	PROFILE_LEAVE();
+}
+
+/**
+ * Renders with apu_clock(), one CPU cycle per call
+ * @param apu APU instance
+ * @param cycles Number of CPU cycles to run
+ * @param res Result to add samples and checksum to
+ */
+static void
+render_clock( Apu *apu, uint64_t cycles, RunResult *res )
+{
+	float sample;
+
+	sound_init( driver, apu );
+
+	// apu_clock() doesn't call the frame hook, so drive the frames here
+
+	for ( uint64_t c = 0; c < cycles; c++ )
+	{
+		if ( apu_clock( apu, &sample, NULL ) )
+		{
+			res->checksum = hash_samples( res->checksum, &sample, 1 );
+			res->samples++;
+		}
+
+		if ( c % APU_FRAME_CYCLES == 0 )
+			driver_tick( driver );
+	}
+}
+
+/**
+ * Renders with apu_run(), in blocks of up to RUN_SAMPLES samples
+ * @param apu APU instance
+ * @param cycles Number of CPU cycles to run
+ * @param res Result to add samples and checksum to
+ */
+static void
+render_run( Apu *apu, uint64_t cycles, RunResult *res )
+{
+	sound_init( driver, apu );
+	apu_set_frame_hook( apu, driver_tick, driver );
+
+	while ( cycles > 0 )
+	{
+		size_t written;
+
+		cycles -= apu_run( apu, cycles, run_buf, RUN_SAMPLES, &written );
+		res->checksum = hash_samples( res->checksum, run_buf, written );
+		res->samples += written;
+	}
+}
+
+/**
+ * Renders with apu_run() like render_run(), playing the compiled timeline instead of running the
+ * driver
+ * @param apu APU instance
+ * @param cycles Number of CPU cycles to run
+ * @param res Result to add samples and checksum to
+ */
+static void
+render_timeline( Apu *apu, uint64_t cycles, RunResult *res )
+{
+	static TimelinePlayer player;
+
+	timeline_player_start( &player, &timeline, apu, sound_bus( driver ) );
+	apu_set_frame_hook( apu, timeline_tick, &player );
+
+	while ( cycles > 0 )
+	{
+		size_t written;
+
+		cycles -= apu_run( apu, cycles, run_buf, RUN_SAMPLES, &written );
+		res->checksum = hash_samples( res->checksum, run_buf, written );
+		res->samples += written;
+	}
+}
+
+static const Path paths[] = {
+	{ "clock",		render_clock },
+	{ "run",		render_run },
+	{ "timeline",	render_timeline }
+};
+
+#ifdef __linux__
+
+/**
+ * Opens a hardware counter for this thread
+ * @param config Counter (PERF_COUNT_HW_*)
+ * @return File descriptor, or -1 if the counter is not available
+ */
+static int
+open_counter( uint64_t config )
+{
+	struct perf_event_attr attr;
+
+	memset( &attr, 0, sizeof(attr) );
+	attr.type			= PERF_TYPE_HARDWARE;
+	attr.size			= sizeof(attr);
+	attr.config			= config;
+	attr.disabled		= 1;
+	attr.exclude_kernel	= 1;
+	attr.exclude_hv		= 1;
+
+	return syscall( SYS_perf_event_open, &attr, 0, -1, -1, 0 );
+}
+
+/**
+ * Opens the hardware counters
+ * @return 0 on success, -1 if they are not available (for example in a container, or with
+ * /proc/sys/kernel/perf_event_paranoid set too high)
+ */
+static int
+counters_open( void )
+{
+	counter_fds[COUNTER_INSTRUCTIONS] = open_counter( PERF_COUNT_HW_INSTRUCTIONS );
+	counter_fds[COUNTER_CACHE_MISSES] = open_counter( PERF_COUNT_HW_CACHE_MISSES );
+
+	if ( counter_fds[COUNTER_INSTRUCTIONS] < 0 || counter_fds[COUNTER_CACHE_MISSES] < 0 )
+	{
+		for ( int i = 0; i < COUNTERS; i++ )
+		{
+			if ( counter_fds[i] >= 0 )
+				close( counter_fds[i] );
+
+			counter_fds[i] = -1;
+		}
+
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Zeroes and starts the hardware counters
+ */
+static void
+counters_start( void )
+{
+	for ( int i = 0; i < COUNTERS; i++ )
+	{
+		ioctl( counter_fds[i], PERF_EVENT_IOC_RESET, 0 );
+		ioctl( counter_fds[i], PERF_EVENT_IOC_ENABLE, 0 );
+	}
+}
+
+/**
+ * Stops the hardware counters and reads them
+ * @param res Result to store the counts in
+ */
+static void
+counters_stop( RunResult *res )
+{
+	res->counted = 1;
+
+	for ( int i = 0; i < COUNTERS; i++ )
+	{
+		ioctl( counter_fds[i], PERF_EVENT_IOC_DISABLE, 0 );
+
+		if ( read( counter_fds[i], &res->counters[i], sizeof(res->counters[i]) ) != sizeof(res->counters[i]) )
+			res->counted = 0;
+	}
+}
+
+#else
+
+static int
+counters_open( void )
+{
+	return -1;
+}
+
+static void
+counters_start( void )
+{
+}
+
+static void
+counters_stop( RunResult *res )
+{
+	res->counted = 0;
+}
+
+#endif
+
+#ifdef APU_PROFILE
+
+/**
+ * Starts timing the stages of a run
+ */
+static void
+stages_start( void )
+{
+	profile_init();
+}
+
+/**
+ * Stops timing the stages of a run. The whole run is recorded as a single profiler frame.
+ * @param res Result to store the time spent in each stage in
+ */
+static void
+stages_stop( RunResult *res )
+{
+	profile_frame();
+
+	const ProfileFrame *pf = profile_get( 0 );
+	const double us = profile_ticks_per_us();
+
+	for ( int s = 0; s < PROFILE_STAGES; s++ )
+		res->stages[s] = pf->ticks[s] / us * 1e-6;
+}
+
+#else
+
+static void
+stages_start( void )
+{
+}
+
+static void
+stages_stop( RunResult *res )
+{
+	(void)res;
+}
+
+#endif
+
+static int
+compare_doubles( const void *a, const void *b )
+{
+	const double x = *(const double *)a;
+	const double y = *(const double *)b;
+
+	return ( x > y ) - ( x < y );
+}
+
+/**
+ * Sorts values and picks the minimum, median and 99th percentile (nearest rank)
+ * @param v Values (sorted in place)
+ * @param n Number of values
+ * @param out Buffer to write minimum, median and 99th percentile to
+ */
+static void
+stats( double *v, int n, double *out )
+{
+	qsort( v, n, sizeof(double), compare_doubles );
+
+	out[0] = v[0];
+	out[1] = ( n % 2 ) ? v[n / 2] : ( v[n / 2 - 1] + v[n / 2] ) / 2;
+	out[2] = v[( 99 * n + 99 ) / 100 - 1];
+}
+
+/**
+ * Runs one path several times and prints its statistics
+ * @param path Path
+ * @param apu APU instance
+ * @param frames Number of frames per run
+ * @param runs Number of runs
+ * @param counters 1 = hardware counters are open
+ * @return 0 if every run produced the same output, otherwise -1
+ */
+static int
+bench_path( const Path *path, Apu *apu, int frames, int runs, int counters )
+{
+	static RunResult res[MAX_RUNS];
+	const uint64_t cycles = (uint64_t)frames * APU_FRAME_CYCLES;
+	int ok = 1;
+
+	for ( int r = 0; r < runs; r++ )
+	{
+		bus_reset( sound_bus( driver ) );
+		apu_reset( apu );
+		apu_set_frame_hook( apu, NULL, NULL );
+
+		memset( &res[r], 0, sizeof(res[r]) );
+		res[r].checksum = 0xcbf29ce484222325ull;
+
+		if ( counters )
+			counters_start();
+
+		stages_start();
+
+		double start = now();
+
+		path->render( apu, cycles, &res[r] );
+		res[r].seconds = now() - start;
+
+		stages_stop( &res[r] );
+
+		if ( counters )
+			counters_stop( &res[r] );
+
+		if ( res[r].checksum != res[0].checksum || res[r].samples != res[0].samples )
+			ok = 0;
+	}
+
+	static double v[MAX_RUNS];
+	double t[3];
+	double c[3];
+
+	for ( int r = 0; r < runs; r++ )
+		v[r] = res[r].seconds;
+
+	stats( v, runs, t );
+
+	printf( "%s: %llu samples, checksum %016llx%s\n", path->name, (unsigned long long)res[0].samples,
+			(unsigned long long)res[0].checksum, ok ? "" : " (MISMATCH between runs)" );
+	printf( "  %-20s %12s %12s %12s\n", "", "best", "median", "p99" );
+	printf( "  %-20s %12.3f %12.3f %12.3f\n", "Mcycles/s",
+			cycles / t[0] / 1e6, cycles / t[1] / 1e6, cycles / t[2] / 1e6 );
+	printf( "  %-20s %12.1f %12.1f %12.1f\n", "real-time factor",
+			cycles / CLOCK_RATE / t[0], cycles / CLOCK_RATE / t[1], cycles / CLOCK_RATE / t[2] );
+	printf( "  %-20s %12.1f %12.1f %12.1f\n", "ns/sample",
+			t[0] * 1e9 / res[0].samples, t[1] * 1e9 / res[0].samples, t[2] * 1e9 / res[0].samples );
+
+	for ( int k = 0; counters && k < COUNTERS; k++ )
+	{
+		static const char *names[COUNTERS] = { "instructions/sample", "cache misses/sample" };
+
+		for ( int r = 0; r < runs; r++ )
+			v[r] = res[r].counted ? (double)res[r].counters[k] / res[r].samples : 0.0;
+
+		stats( v, runs, c );
+		printf( "  %-20s %12.1f %12.1f %12.1f\n", names[k], c[0], c[1], c[2] );
+	}
+
+#ifdef APU_PROFILE
+	// stages the profiler brackets in apu_run() and the frame hooks, then the rest of the run
+	// (output checksum, loop overhead)
+
+	static const int stages[] = { PROFILE_DRIVER, PROFILE_CHANNELS, PROFILE_MIXER, PROFILE_FILTER,
+			PROFILE_OTHER };
+
+	for ( size_t k = 0; k < sizeof(stages) / sizeof(stages[0]); k++ )
+	{
+		const int s = stages[k];
+		char name[32];
+
+		if ( res[0].stages[s] == 0.0 )
+			continue;
+
+		for ( int r = 0; r < runs; r++ )
+			v[r] = res[r].stages[s] * 1e9 / res[r].samples;
+
+		stats( v, runs, c );
+		snprintf( name, sizeof(name), "%s ns/sample", profile_stage_name( s ) );
+		printf( "  %-20s %12.1f %12.1f %12.1f\n", name, c[0], c[1], c[2] );
+	}
+#endif
+
+	return ok ? 0 : -1;
+}
+
+/**
+ * Prints the command line usage and exits
+ * @param prog Program name
+ * @param status Exit status, EXIT_SUCCESS prints to stdout rather than stderr
+ */
+static void
+usage( const char *prog, int status )
+{
+	fprintf( ( status == EXIT_SUCCESS ) ? stdout : stderr,
+			"usage: %s [-f frames] [-n runs] [-r rate] [-q quality] [-o output] [-p path] [-c]\n"
+			"  -f frames   frames per run (default %d)\n"
+			"  -n runs     runs per path (default %d, at most %d)\n"
+			"  -r rate     output sample rate (default %d)\n"
+			"  -q quality  low pass preset, 0 = draft, 1 = standard, 2 = mastering (default 1)\n"
+			"  -o output   output engine, 0 = FIR, 1 = BLEP, 2 = DECIM, 3 = fixed (default 0)\n"
+			"  -p path     only run one path, clock, run or timeline\n"
+			"  -c          read hardware counters (instructions, cache misses) with perf_event_open\n"
+			"  -h          print this help\n",
+			prog, DEFAULT_FRAMES, DEFAULT_RUNS, MAX_RUNS, DEFAULT_RATE );
+	exit( status );
+}
+
+int
+main( int argc, char *argv[] )
+{
+	int frames = DEFAULT_FRAMES;
+	int runs = DEFAULT_RUNS;
+	int rate = DEFAULT_RATE;
+	int quality = APU_QUALITY_STANDARD;
+	int output = APU_OUTPUT_FIR;
+	int counters = 0;
+	const char *only = NULL;
+	int opt;
+
+	while ( ( opt = getopt( argc, argv, "f:n:r:q:o:p:ch" ) ) != -1 )
+	{
+		switch ( opt )
+		{
+		case 'f': frames = atoi( optarg ); break;
+		case 'n': runs = atoi( optarg ); break;
+		case 'r': rate = atoi( optarg ); break;
+		case 'q': quality = atoi( optarg ); break;
+		case 'o': output = atoi( optarg ); break;
+		case 'p': only = optarg; break;
+		case 'c': counters = 1; break;
+		case 'h': usage( argv[0], EXIT_SUCCESS ); break;
+		default: usage( argv[0], EXIT_FAILURE );
+		}
+	}
+
+	if ( frames < 1 || runs < 1 || runs > MAX_RUNS )
+		usage( argv[0], EXIT_FAILURE );
+
+	if ( rom_open( &rom, SONG_FILE ) != 0 )
+	{
+		fprintf( stderr, "Could not open \"%s\"\n", SONG_FILE );
+		exit( EXIT_FAILURE );
+	}
+
+	driver = sound_create( &rom );
+
+	Apu *apu = ( driver != NULL ) ? apu_create( sound_bus( driver )->pages ) : NULL;
+
+	if ( apu == NULL )
+	{
+		fprintf( stderr, "Failed to allocate APU\n" );
+		exit( EXIT_FAILURE );
+	}
+
+	if ( apu_set_sample_rate( apu, rate, quality ) != 0 )
+	{
+		fprintf( stderr, "Unsupported sample rate %d Hz or quality %d\n", rate, quality );
+		exit( EXIT_FAILURE );
+	}
+
+	if ( apu_set_output( apu, output ) != 0 )
+	{
+		fprintf( stderr, "Unsupported output engine %d\n", output );
+		exit( EXIT_FAILURE );
+	}
+
+	if ( counters && counters_open() != 0 )
+	{
+		fprintf( stderr, "Hardware counters are not available, running without them\n" );
+		counters = 0;
+	}
+
+	printf( "%d frames (%.1f s of audio) at %d Hz, quality %d, output %d, %d runs per path\n", frames,
+			frames * APU_FRAME_CYCLES / CLOCK_RATE, rate, quality, output, runs );
+
+	timeline_init( &timeline );
+
+	double start = now();
+
+	if ( sound_compile( driver, &timeline, MAX_SONG_FRAMES ) != 0 )
+	{
+		fprintf( stderr, "Failed to compile the song\n" );
+		exit( EXIT_FAILURE );
+	}
+
+	printf( "compiled %u frames, %zu events (%zu bytes) in %.3f ms, ", timeline.frames,
+			timeline.count, timeline.count * sizeof(TimelineEvent), ( now() - start ) * 1e3 );
+
+	if ( timeline.loop_frame != TIMELINE_NO_LOOP )
+		printf( "loops back to frame %u\n", timeline.loop_frame );
+	else
+		printf( "does not loop\n" );
+
+	int ret = EXIT_SUCCESS;
+
+	for ( size_t p = 0; p < sizeof(paths) / sizeof(paths[0]); p++ )
+	{
+		if ( only != NULL && strcmp( only, paths[p].name ) != 0 )
+			continue;
+
+		if ( bench_path( &paths[p], apu, frames, runs, counters ) != 0 )
+			ret = EXIT_FAILURE;
+	}
+
+	apu_destroy( apu );
+	sound_destroy( driver );
+	timeline_free( &timeline );
+	rom_close( &rom );
+	return ret;
+}
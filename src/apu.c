@@ -1,19 +1,46 @@
 #include <math.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "apu.h"
+#include "blip.h"
 #include "bus.h"
-#include "audio.h"
+#include "decim.h"
+#include "fir.h"
+#include "firq.h"
+#include "mixer.h"
+#include "noise.h"
+#include "profile.h"
+#include "simd.h"
+#include "spsc.h"
+#include "state.h"
+#include "stems.h"
+#include "trace.h"
 
 #define CLOCK_RATE	1789773.0							// APU clock rate
-#define SAMPLE_DIV	( CLOCK_RATE / SAMPLE_RATE )		// APU samples per output sample
+#define DEFAULT_RATE	48000							// output sample rate of a new APU instance
 
-#define HP_DT		( 1.0 / (float)SAMPLE_RATE )		// high pass delta time
-#define HP_CUTOFF	( 1.0 / SAMPLE_DIV * 40.0 )			// high pass cutoff frequency coefficient (= 40 Hz)
-#define HP_RC		( 1.0 / ( M_PI * 2 * HP_CUTOFF ) )	// high pass RC
-#define HP_SF		( HP_RC / ( HP_RC + HP_DT ) )		// high pass smoothing factor
+#define HP_FREQ		40.0								// high pass cutoff frequency
 
-#define LP_FILTER_W	57									// number of coefficients in low pass filter
+#ifdef APU_MIXER_USE_LOOKUP
+#define DEFAULT_MIXER	APU_MIXER_LINEAR				// mixer of a new APU instance
+#else
+#define DEFAULT_MIXER	APU_MIXER_EXACT
+#endif
+
+#ifndef APU_BLOCK_SIZE
+#define APU_BLOCK_SIZE	1024							// level runs per apu_run() block
+#endif
+
+#define BLOCK_MAX_CYCLES	APU_FRAME_CYCLES			// longest apu_run() block in cycles
+
+#define NO_EVENT	SIZE_MAX							// timer that will never reach an event
+
+#define STATE_MAGIC		0x53555041						// "APUS"
+#define STATE_VERSION	3								// bump when the save state layout changes
+
+#define STATE_CORE_START	offsetof( Apu, regs )		// first byte of emulation state
+#define STATE_CORE_SIZE		( offsetof( Apu, mixer ) - offsetof( Apu, regs ) )	// size of emulation state
 
 typedef struct {
 	uint8_t			period;					// timer reload value/constant volume value
@@ -58,7 +85,17 @@ typedef struct {
 	const uint8_t 	*sequencer_tab;			// pointer to sequencer table
 } ApuChan;
 
-static struct {
+typedef struct {
+	uint8_t			sq1;					// pulse 1 level (0-15)
+	uint8_t			sq2;					// pulse 2 level (0-15)
+	uint8_t			tri;					// triangle level (0-15)
+	uint8_t			noi;					// noise level (0-15)
+	uint8_t			dmc;					// DMC level (0-127)
+} Levels;
+
+struct Apu {
+	const uint8_t * const *mem;				// page table of the CPU address space the DMC reader sees
+
 	uint8_t			regs[0x18];				// APU register buffer
 	
 	ApuChan			chans[5];
@@ -70,7 +107,7 @@ static struct {
 
 	// noise
 
-	uint16_t		lfsr;					// noise shift register
+	uint16_t		noi_pos;				// shift register position in its noise sequence (see noise.h)
 	uint16_t		feedback;				// LFSR feedback output
 
 	// dmc
@@ -96,16 +133,66 @@ static struct {
 	uint8_t			frame_ctr_irq_set_now;	// used to emulate a quirk of reading $4015
 	int32_t			frame_ctr_cycle;		// CPU cycle tracker
 
+	// timing
+
+	uint64_t		cycle;					// CPU cycles run since reset
+	uint_fast16_t	frame_hook_ctr;			// cycles since the last frame hook call
+
+	// everything above from regs on is emulation state and is saved as is by apu_save_state(),
+	// everything below is configuration, output filters or scratch space
+
 	// mixer
 
-	float			lp_fifo[LP_FILTER_W];	// low pass filter ring buffer
-	uint32_t		lp_next;				// next write position in low pass filter buffer
-	float			dac_out;				// current APU DAC output
-	float			dac_prev;				// previous APU DAC output
-	float			hp_out;					// current output of high pass filter
-	float			hp_prev;				// previous output of high pass filter
-	float			div_ctr;				// divider for outputting samples
-} apu;
+	int				mixer;					// mixer mode (APU_MIXER_*)
+	const MixerTables *mixer_tables;		// shared mixer lookup tables
+	const NoiseTables *noise;				// shared noise sequence tables
+	const SimdKernels *kernels;				// block mixing kernels
+
+	int				sample_rate;			// output sample rate
+	int				quality;				// low pass filter preset (APU_QUALITY_*)
+
+	int				output;					// output engine (APU_OUTPUT_*)
+	Fir				fir;					// high pass and low pass FIR for APU_OUTPUT_FIR
+	Blip			blip;					// band-limited step buffer for APU_OUTPUT_BLEP
+	Decim			decim;					// multistage decimator for APU_OUTPUT_DECIM
+	FirQ			firq;					// integer version of fir for APU_OUTPUT_FIXED
+
+	Stems			*stems;					// per-channel filters, NULL unless stems are enabled
+	float			pan[APU_STEMS][2];		// left and right gain of each channel
+
+	// timestamped writes
+
+	SpscQueue		*own_writes;			// queue filled by apu_write_at()
+	SpscQueue		*writes;				// queue writes are taken from
+
+	// frame hook
+
+	ApuFrameHook	frame_hook;				// function called at the start of every frame
+	void			*frame_hook_data;		// pointer passed to frame hook
+
+	// write hook
+
+	ApuWriteHook	write_hook;				// function called on every register write
+	void			*write_hook_data;		// pointer passed to write hook
+
+	// apu_run() block. the channel levels are recorded for each run of cycles during which none
+	// of them change, then the whole block is mixed and filtered in one go
+
+	uint8_t			blk_sq1[APU_BLOCK_SIZE];	// pulse 1 level of each run
+	uint8_t			blk_sq2[APU_BLOCK_SIZE];	// pulse 2 level of each run
+	uint8_t			blk_tri[APU_BLOCK_SIZE];	// triangle level of each run
+	uint8_t			blk_noi[APU_BLOCK_SIZE];	// noise level of each run
+	uint8_t			blk_dmc[APU_BLOCK_SIZE];	// DMC level of each run
+	uint32_t		blk_len[APU_BLOCK_SIZE];	// length of each run in cycles
+	float			blk_dac[APU_BLOCK_SIZE];	// DAC output of each run
+	int16_t			blk_dacq[APU_BLOCK_SIZE];	// DAC output of each run (Q15) for APU_OUTPUT_FIXED
+	size_t			blk_runs;				// number of runs in block
+
+	// output engine samples, when they are not in the format asked for
+
+	float			blk_out[APU_BLOCK_SIZE];	// samples of a float output engine
+	int16_t			blk_out_s16[APU_BLOCK_SIZE];	// samples of APU_OUTPUT_FIXED
+};
 
 static const uint8_t len_ctr_tab[32] = {
 	 10,254, 20,  2, 40,  4, 80,  6,160,  8, 60, 10, 14, 12, 26, 24,
@@ -134,71 +221,21 @@ static const uint16_t dmc_period_tab[16] = {
 	190, 160, 142, 128, 106,  84,  66,  50
 };
 
-static const float lp_coeffs[LP_FILTER_W] = {
-    0.001849518640956687,
-    0.002940828279670894,
-    0.004082242117319950,
-    0.005267921516200974,
-    0.006491597820838475,
-    0.007746615346237941,
-    0.009025977943704931,
-    0.010322398774978651,
-    0.011628352895204809,
-    0.012936132218491396,
-    0.014237902416709077,
-    0.015525761283040954,
-    0.016791798076742259,
-    0.018028153354790733,
-    0.019227078789704255,
-    0.020380996470845691,
-    0.021482557189056169,
-    0.022524697211445895,
-    0.023500693064574064,
-    0.024404213859972788,
-    0.025229370715880550,
-    0.025970762852976014,
-    0.026623519969633091,
-    0.027183340533506847,
-    0.027646525660829369,
-    0.028010008292333979,
-    0.028271377414899983,
-    0.028428897120454221,
-    0.028481520337998785,
-    0.028428897120454221,
-    0.028271377414899983,
-    0.028010008292333979,
-    0.027646525660829369,
-    0.027183340533506847,
-    0.026623519969633091,
-    0.025970762852976014,
-    0.025229370715880550,
-    0.024404213859972788,
-    0.023500693064574064,
-    0.022524697211445895,
-    0.021482557189056169,
-    0.020380996470845691,
-    0.019227078789704255,
-    0.018028153354790733,
-    0.016791798076742259,
-    0.015525761283040954,
-    0.014237902416709077,
-    0.012936132218491396,
-    0.011628352895204809,
-    0.010322398774978651,
-    0.009025977943704931,
-    0.007746615346237941,
-    0.006491597820838475,
-    0.005267921516200974,
-    0.004082242117319950,
-    0.002940828279670894,
-    0.001849518640956687
+// low pass filter presets, as Kaiser-windowed sinc filters at the CPU clock rate. standard is a
+// plain sinc (beta 0) cut off at 30 kHz at 48 kHz, which gives back the fixed 57-tap table
+// originally used at 48 kHz (-3.4 dB at 20 kHz, -8.3 dB at 30 kHz). mastering is flat within 0.1 dB
+// to 20 kHz and attenuates by 80 dB from 24 kHz at 48 kHz
+
+static const struct {
+	uint32_t		taps;					// number of coefficients
+	double			beta;					// Kaiser window shape
+	double			cutoff;					// cutoff frequency as a fraction of the output rate
+} lp_presets[3] = {
+	{   29, 2.0, 0.50 },					// APU_QUALITY_DRAFT
+	{   57, 0.0, 0.625 },					// APU_QUALITY_STANDARD
+	{ 2047, 8.0, 0.45 }						// APU_QUALITY_MASTERING
 };
 
-#ifdef APU_MIXER_USE_LOOKUP
-static float pulse_table[31];
-static float tnd_table[203];
-#endif
-
 static void
 update_sweep_freq( ApuChan *ch )
 {
@@ -272,21 +309,21 @@ clock_length_ctr( LengthCtr *len )
 }
 
 static void
-clock_linear_ctr()
+clock_linear_ctr( Apu *apu )
 {
-	if ( apu.linear_reload )
-		apu.linear_ctr = apu.regs[APU_TRILINEAR] & 0x7f;
-	else if ( apu.linear_ctr )
-		apu.linear_ctr--;
+	if ( apu->linear_reload )
+		apu->linear_ctr = apu->regs[APU_TRILINEAR] & 0x7f;
+	else if ( apu->linear_ctr )
+		apu->linear_ctr--;
 
-	if ( !apu.chans[2].len.halt )
-		apu.linear_reload = 0;
+	if ( !apu->chans[2].len.halt )
+		apu->linear_reload = 0;
 }
 
 static uint16_t
-get_period( int chan )
+get_period( const Apu *apu, int chan )
 {
-	return ( ( apu.regs[( chan * 4 ) + 3] << 8 ) | apu.regs[( chan * 4 ) + 2] ) & 0x7ff;
+	return ( ( apu->regs[( chan * 4 ) + 3] << 8 ) | apu->regs[( chan * 4 ) + 2] ) & 0x7ff;
 }
 
 static void
@@ -301,78 +338,92 @@ clock_pulse_tri_timer( ApuChan *ch )
 }
 
 static void
-clock_noi_timer()
+clock_noi_timer( Apu *apu )
 {
-	ApuChan *ch = &apu.chans[3];
+	ApuChan *ch = &apu->chans[3];
 
 	if ( ch->timer == 0 )
 	{
 		ch->timer = ch->freq;
 
-		if ( apu.chans[3].mode )
-			apu.feedback = ( apu.lfsr << 14 ) ^ ( apu.lfsr <<  8 );
-		else
-			apu.feedback = ( apu.lfsr << 14 ) ^ ( apu.lfsr << 13 );
-
-		apu.lfsr = ( apu.lfsr >> 1 ) | ( apu.feedback & ( 1 << 14 ) );
-		apu.feedback = ( apu.feedback >> 14 ) & 1;
+		apu->noi_pos	= noise_advance( apu->noise, ch->mode, apu->noi_pos, 1 );
+		apu->feedback	= noise_output( apu->noise, ch->mode, apu->noi_pos );
 	}
 	ch->timer--;
 }
 
-static void
-clock_dmc()
+/**
+ * Runs one clock of the DMC output unit, fetching the next sample byte when the bit buffer runs out
+ * @param apu APU instance
+ * @param cycle CPU cycle of the clock, for tracing
+ */
+static inline void
+dmc_output_clock( Apu *apu, uint64_t cycle )
 {
-	ApuChan *ch = &apu.chans[4];
-
-	if ( ch->timer == 0 )
+	if ( !apu->dmc_silence )
 	{
-		ch->timer = ch->freq;
-
-		if ( !apu.dmc_silence )
+		if ( apu->dmc_bit_buf & 1 )
 		{
-			if ( apu.dmc_bit_buf & 1 )
-			{
-				if ( apu.dmc_lvl <= 125 )
-					apu.dmc_lvl += 2;
-			}
-			else if ( apu.dmc_lvl >= 2 )
-				apu.dmc_lvl -= 2;
-
-			apu.dmc_bit_buf >>= 1;
+			if ( apu->dmc_lvl <= 125 )
+				apu->dmc_lvl += 2;
 		}
+		else if ( apu->dmc_lvl >= 2 )
+			apu->dmc_lvl -= 2;
+
+		apu->dmc_bit_buf >>= 1;
+	}
+
+	if ( apu->dmc_bit == 0 )
+	{
+		apu->dmc_bit = 7;
 
-		if ( apu.dmc_bit == 0 )
+		if ( apu->dmc_len_internal != 0 )
 		{
-			apu.dmc_bit = 7;
+			apu->dmc_silence = 0;
+			apu->dmc_bit_buf = apu->mem[apu->dmc_adr_internal >> BUS_PAGE_BITS]
+					[apu->dmc_adr_internal & ( BUS_PAGE_SIZE - 1 )];
 
-			if ( apu.dmc_len_internal != 0 )
-			{
-				apu.dmc_silence = 0;
-				apu.dmc_bit_buf = cpu_bus[apu.dmc_adr_internal++];
+			TRACE_EVENT( TRACE_DMC_FETCH, cycle, apu->dmc_adr_internal, apu->dmc_bit_buf );
+			apu->dmc_adr_internal++;
 
-				if ( apu.dmc_adr_internal == 0 )
-					apu.dmc_adr_internal = 0x8000;
+			if ( apu->dmc_adr_internal == 0 )
+				apu->dmc_adr_internal = 0x8000;
 
-				apu.dmc_len_internal--;
+			apu->dmc_len_internal--;
 
-				if ( apu.dmc_len_internal == 0 && !ch->mode )
+			if ( apu->dmc_len_internal == 0 && !apu->chans[4].mode )
+			{
+				if ( apu->dmc_irq_enable )
 				{
-					if ( apu.dmc_irq_enable )
-						apu.dmc_irq_flag = 1;
+					if ( !apu->dmc_irq_flag )
+						TRACE_EVENT( TRACE_DMC_IRQ, cycle, 0, 0 );
+
+					apu->dmc_irq_flag = 1;
 				}
 			}
-			else if ( ch->mode )
-			{
-				apu.dmc_silence = 0;
-				apu.dmc_len_internal = apu.dmc_len;
-				apu.dmc_adr_internal = apu.dmc_adr;
-			}
-			else
-				apu.dmc_silence = 1;
+		}
+		else if ( apu->chans[4].mode )
+		{
+			apu->dmc_silence = 0;
+			apu->dmc_len_internal = apu->dmc_len;
+			apu->dmc_adr_internal = apu->dmc_adr;
 		}
 		else
-			apu.dmc_bit--;
+			apu->dmc_silence = 1;
+	}
+	else
+		apu->dmc_bit--;
+}
+
+static void
+clock_dmc( Apu *apu )
+{
+	ApuChan *ch = &apu->chans[4];
+
+	if ( ch->timer == 0 )
+	{
+		ch->timer = ch->freq;
+		dmc_output_clock( apu, apu->cycle );
 	}
 	else
 		ch->timer--;
@@ -384,7 +435,7 @@ clock_dmc()
  * @return Volume
  */
 static int
-volume( ApuChan *ch )
+volume( const ApuChan *ch )
 {
 	if ( ch->mute || ch->len.ctr == 0 )
 		return 0;
@@ -398,427 +449,1822 @@ volume( ApuChan *ch )
  * Frame counter quarter clocks
  */
 static void
-frame_ctr_clock_a()
+frame_ctr_clock_a( Apu *apu )
 {
-	clock_envelope( &apu.chans[0].env );
-	clock_envelope( &apu.chans[1].env );
-	clock_envelope( &apu.chans[3].env );
+	clock_envelope( &apu->chans[0].env );
+	clock_envelope( &apu->chans[1].env );
+	clock_envelope( &apu->chans[3].env );
 
-	clock_linear_ctr();
+	clock_linear_ctr( apu );
 }
 
 /**
  * Frame counter half and quarter clocks
  */
 static void
-frame_ctr_clock_b()
+frame_ctr_clock_b( Apu *apu )
 {
-	clock_envelope( &apu.chans[0].env );
-	clock_envelope( &apu.chans[1].env );
-	clock_envelope( &apu.chans[3].env );
+	clock_envelope( &apu->chans[0].env );
+	clock_envelope( &apu->chans[1].env );
+	clock_envelope( &apu->chans[3].env );
 
-	clock_linear_ctr();
+	clock_linear_ctr( apu );
 
-	clock_length_ctr( &apu.chans[0].len );
-	clock_length_ctr( &apu.chans[1].len );
-	clock_length_ctr( &apu.chans[2].len );
-	clock_length_ctr( &apu.chans[3].len );
+	clock_length_ctr( &apu->chans[0].len );
+	clock_length_ctr( &apu->chans[1].len );
+	clock_length_ctr( &apu->chans[2].len );
+	clock_length_ctr( &apu->chans[3].len );
 
-	clock_sweep_unit( &apu.chans[0] );
-	clock_sweep_unit( &apu.chans[1] );
+	clock_sweep_unit( &apu->chans[0] );
+	clock_sweep_unit( &apu->chans[1] );
 }
 
 /**
- * APU half-clock routine. Will output a sample if enough internal samples have been generated, as well
- * as the status of the frame counter and DMC interrupts.
- * @param sample_out Buffer to write outputted sample to
- * @param irq_out Pointer to value to store IRQ status in (pass NULL if this information is not needed)
- * @return 1 if a sample was output, otherwise 0
+ * Clocks the frame counter and channel timers for one CPU cycle
+ * @param apu APU instance
  */
-int
-apu_clock( float *sample_out, unsigned int *irq_out )
+static inline void
+clock_channels( Apu *apu )
 {
-	ApuChan * const sq1 = &apu.chans[0];
-	ApuChan * const sq2 = &apu.chans[1];
-	ApuChan * const tri = &apu.chans[2];
-	ApuChan * const noi = &apu.chans[3];
+	ApuChan * const sq1 = &apu->chans[0];
+	ApuChan * const sq2 = &apu->chans[1];
+	ApuChan * const tri = &apu->chans[2];
 
 	// reading $4015 on the same cycle that the frame counter IRQ flag is set will result in the flag
 	// not being cleared like it should be. here we by default assume that the IRQ flag was not set
 	// on this cycle
-	apu.frame_ctr_irq_set_now = 0;
+	apu->frame_ctr_irq_set_now = 0;
 
 	// clock frame counter
 
-	apu.frame_ctr_cycle++;
+	apu->frame_ctr_cycle++;
 
-	if ( apu.frame_ctr_restart_ctr > 0 )
+	if ( apu->frame_ctr_restart_ctr > 0 && --apu->frame_ctr_restart_ctr == 0 )
 	{
-		if ( apu.frame_ctr_restart_ctr-- == 0 )
-		{
-			apu.frame_ctr_cycle = 0;
+		apu->frame_ctr_cycle = 0;
 
-			if ( apu.frame_ctr_mode )
-				frame_ctr_clock_b();
-		}
+		if ( apu->frame_ctr_mode )
+			frame_ctr_clock_b( apu );
 	}
 
-	if ( !apu.frame_ctr_mode )
+	if ( !apu->frame_ctr_mode )
 	{
-		if ( apu.frame_ctr_cycle == 7457 )
-			frame_ctr_clock_a();
-		else if ( apu.frame_ctr_cycle == 14913 )
-			frame_ctr_clock_b();
-		else if ( apu.frame_ctr_cycle == 22371 )
-			frame_ctr_clock_a();
-		else if ( apu.frame_ctr_cycle == 29828 && !apu.frame_ctr_irq_inhibit )
+		if ( apu->frame_ctr_cycle == 7457 )
+			frame_ctr_clock_a( apu );
+		else if ( apu->frame_ctr_cycle == 14913 )
+			frame_ctr_clock_b( apu );
+		else if ( apu->frame_ctr_cycle == 22371 )
+			frame_ctr_clock_a( apu );
+		else if ( apu->frame_ctr_cycle == 29828 && !apu->frame_ctr_irq_inhibit )
 		{
-			apu.frame_ctr_irq_flag = 1;
+			if ( !apu->frame_ctr_irq_flag )
+				TRACE_EVENT( TRACE_FRAME_IRQ, apu->cycle, 0, 0 );
+
+			apu->frame_ctr_irq_flag = 1;
 
 			// indicate that the frame counter IRQ flag was set on this cycle
-			apu.frame_ctr_irq_set_now = 1;
+			apu->frame_ctr_irq_set_now = 1;
 		}
-		else if ( apu.frame_ctr_cycle == 29829 )
+		else if ( apu->frame_ctr_cycle == 29829 )
 		{
-			frame_ctr_clock_b();
-			apu.frame_ctr_cycle = 0;
+			frame_ctr_clock_b( apu );
+			apu->frame_ctr_cycle = 0;
 		}
 	}
 	else
 	{
-		if ( apu.frame_ctr_cycle == 7457 )
-			frame_ctr_clock_a();
-		else if ( apu.frame_ctr_cycle == 14913 )
-			frame_ctr_clock_b();
-		else if ( apu.frame_ctr_cycle == 22371 )
-			frame_ctr_clock_a();
-		else if ( apu.frame_ctr_cycle == 32781 )
+		if ( apu->frame_ctr_cycle == 7457 )
+			frame_ctr_clock_a( apu );
+		else if ( apu->frame_ctr_cycle == 14913 )
+			frame_ctr_clock_b( apu );
+		else if ( apu->frame_ctr_cycle == 22371 )
+			frame_ctr_clock_a( apu );
+		else if ( apu->frame_ctr_cycle == 32781 )
 		{
-			frame_ctr_clock_b();
-			apu.frame_ctr_cycle = 0;
+			frame_ctr_clock_b( apu );
+			apu->frame_ctr_cycle = 0;
 		}
 	}
 
 	/// clock channels
 
-	if ( apu.frame_ctr_cycle & 1 )
+	if ( apu->frame_ctr_cycle & 1 )
 	{
 		clock_pulse_tri_timer( sq1 );
 		clock_pulse_tri_timer( sq2 );
 	}
 			
-	if ( tri->len.ctr != 0 && apu.linear_ctr != 0 )
+	if ( tri->len.ctr != 0 && apu->linear_ctr != 0 )
 		clock_pulse_tri_timer( tri );
 
-	clock_noi_timer();
-	clock_dmc();
-
-	// calculate channel output levels
-	// (magic numbers courtesy of https://www.nesdev.org/wiki/APU_Mixer)
-
-#ifdef APU_MIXER_USE_LOOKUP
-	int sq1_out		= volume( sq1 ) * sq1->sequencer_val;
-	int sq2_out		= volume( sq2 ) * sq2->sequencer_val;
-	int tri_out		= tri->sequencer_val;
-	int noi_out		= volume( noi ) * apu.feedback;
-	int dmc_out		= apu.dmc_lvl;
-	
-	float pulse_out	= pulse_table[sq1_out + sq2_out];
-	float tnd_out	= tnd_table[3 * tri_out + 2 * noi_out + dmc_out];
-#else
-	float sq1_out	= volume( sq1 ) * sq1->sequencer_val;
-	float sq2_out	= volume( sq2 ) * sq2->sequencer_val;
-	float tri_out	= tri->sequencer_val / 8227.0f;
-	float noi_out	= volume( noi ) * apu.feedback / 12241.0f;
-	float dmc_out	= apu.dmc_lvl / 22638.0f;
-
-	float pulse_out	= 95.88f / ( 8128.0f / ( sq1_out + sq2_out ) + 100 );
-	float tnd_out	= 159.79f / ( ( 1.0f / ( tri_out + noi_out + dmc_out ) ) + 100 );
-#endif
+	clock_noi_timer( apu );
+	clock_dmc( apu );
+}
 
-	// apply high pass
+/**
+ * Returns the current output levels of all channels
+ * @param apu APU instance
+ * @return Channel levels
+ */
+static inline Levels
+levels( const Apu *apu )
+{
+	const ApuChan * const sq1 = &apu->chans[0];
+	const ApuChan * const sq2 = &apu->chans[1];
+	const ApuChan * const tri = &apu->chans[2];
+	const ApuChan * const noi = &apu->chans[3];
 
-	apu.dac_out		= pulse_out + tnd_out;
-	apu.hp_out		= HP_SF * ( apu.hp_prev + apu.dac_prev - apu.dac_out );
-	apu.dac_prev	= apu.dac_out;
-	apu.hp_prev		= apu.hp_out;
+	Levels lv;
 
-	// add high pass output to low pass filter buffer
+	lv.sq1	= volume( sq1 ) * sq1->sequencer_val;
+	lv.sq2	= volume( sq2 ) * sq2->sequencer_val;
+	lv.tri	= tri->sequencer_val;
+	lv.noi	= volume( noi ) * apu->feedback;
+	lv.dmc	= apu->dmc_lvl;
 
-	apu.lp_fifo[apu.lp_next++] = -apu.hp_out;
-	apu.lp_next %= LP_FILTER_W;
+	return lv;
+}
 
-	// signal IRQ (or lack thereof)
+/**
+ * Calculates the APU DAC output for a set of channel output levels
+ * @param apu APU instance
+ * @param lv Channel levels
+ * @return DAC output
+ */
+static inline float
+mix_levels( const Apu *apu, Levels lv )
+{
+	float pulse_out;
+	float tnd_out;
 
-	if ( irq_out != NULL )
-		*irq_out = apu.frame_ctr_irq_flag | apu.dmc_irq_flag;
+	switch ( apu->mixer )
+	{
+	case APU_MIXER_EXACT:
+		pulse_out	= apu->mixer_tables->pulse_exact[lv.sq1 + lv.sq2];
+		tnd_out		= apu->mixer_tables->tnd_exact[MIXER_TND_INDEX( lv.tri, lv.noi, lv.dmc )];
+		break;
+	case APU_MIXER_LINEAR:
+		pulse_out	= apu->mixer_tables->pulse_linear[lv.sq1 + lv.sq2];
+		tnd_out		= apu->mixer_tables->tnd_linear[3 * lv.tri + 2 * lv.noi + lv.dmc];
+		break;
+	default:
+		pulse_out	= mixer_pulse_formula( lv.sq1, lv.sq2 );
+		tnd_out		= mixer_tnd_formula( lv.tri, lv.noi, lv.dmc );
+		break;
+	}
 
-	// try to output a sample
+	return pulse_out + tnd_out;
+}
 
-	apu.div_ctr++;
+/**
+ * Calculates the APU DAC output for a set of channel output levels in Q15, for APU_OUTPUT_FIXED
+ * @param apu APU instance
+ * @param lv Channel levels
+ * @return DAC output (Q15)
+ */
+static inline int32_t
+mix_levels_q15( const Apu *apu, Levels lv )
+{
+	const MixerTables * const tables = apu->mixer_tables;
 
-	if ( apu.div_ctr >= SAMPLE_DIV )
+	switch ( apu->mixer )
 	{
-		float out = 0.0f;
+	case APU_MIXER_EXACT:
+		return tables->pulse_exact_q15[lv.sq1 + lv.sq2] +
+				tables->tnd_exact_q15[MIXER_TND_INDEX( lv.tri, lv.noi, lv.dmc )];
+	case APU_MIXER_LINEAR:
+		return tables->pulse_linear_q15[lv.sq1 + lv.sq2] +
+				tables->tnd_linear_q15[3 * lv.tri + 2 * lv.noi + lv.dmc];
+	default:
+		return mixer_q15( mixer_pulse_formula( lv.sq1, lv.sq2 ) ) +
+				mixer_q15( mixer_tnd_formula( lv.tri, lv.noi, lv.dmc ) );
+	}
+}
+
+/**
+ * Calculates the current APU DAC output from the channel output levels
+ * @param apu APU instance
+ * @return DAC output
+ */
+static inline float
+mix( const Apu *apu )
+{
+	return mix_levels( apu, levels( apu ) );
+}
 
-		for ( unsigned k = 0; k < LP_FILTER_W; k++ )
-			out += lp_coeffs[k] * apu.lp_fifo[( k + apu.lp_next ) % LP_FILTER_W];
+/**
+ * Converts a float sample to int16, rounding and clipping
+ * @param sample Sample
+ * @return Sample as int16
+ */
+static inline int16_t
+sample_to_s16( float sample )
+{
+	const long v = lrintf( sample * FIRQ_LEVEL_ONE );
 
-		*sample_out = out;
-		apu.div_ctr -= SAMPLE_DIV;
-		return 1;
-	}
+	if ( v > INT16_MAX )
+		return INT16_MAX;
+	if ( v < INT16_MIN )
+		return INT16_MIN;
 
-	return 0;
+	return v;
 }
 
 /**
- * Writes to an APU register and handles side-effects of the write
- * @param reg Target register
- * @param val Value to write to register
+ * Designs the output filters for the current sample rate and quality preset and clears their state
+ * @param apu APU instance
  */
-void
-apu_write( uint_fast16_t reg, uint8_t val )
+static void
+design_filters( Apu *apu )
 {
-	apu.regs[reg] = val;
+	fir_init( &apu->fir, CLOCK_RATE, apu->sample_rate, HP_FREQ, lp_presets[apu->quality].taps,
+			lp_presets[apu->quality].beta, lp_presets[apu->quality].cutoff );
+	firq_init( &apu->firq, &apu->fir );
+	blip_init( &apu->blip, CLOCK_RATE, apu->sample_rate, HP_FREQ );
+	decim_init( &apu->decim, CLOCK_RATE, apu->sample_rate, HP_FREQ );
+
+	if ( apu->stems != NULL )
+		stems_init( apu->stems, &apu->fir );
+}
 
-	// update state variables
-	switch ( reg )
-	{
-	case APU_SQ1VOL:
-		apu.chans[0].sequencer_tab = duty_seq_tab[val >> 6];
-		apu.chans[0].env.loop = ( val & 0x20 ) != 0;
-		apu.chans[0].len.halt = ( val & 0x20 ) != 0;
-		apu.chans[0].env.constant = ( val & 0x10 ) != 0;
-		apu.chans[0].env.period = val & 0x0f;
-		break;
-	case APU_SQ1SWEEP:
-		apu.chans[0].sweep.reload = 1;
-		apu.chans[0].sweep.enabled = ( val & 0x80 ) != 0;
-		apu.chans[0].sweep.period = ( val >> 4 ) & 7;
-		apu.chans[0].sweep.negate = ( val & 0x08 ) != 0;
-		apu.chans[0].sweep.shift = val & 7;
-		break;
-	case APU_SQ1LO:
-		apu.chans[0].freq = get_period( 0 );
-		apu.chans[0].sweep.target = apu.chans[0].freq;
-		break;
-	case APU_SQ1HI:
-		apu.chans[0].freq = get_period( 0 );
-		apu.chans[0].sweep.target = apu.chans[0].freq;
-		apu.chans[0].env.start = 1;
+/**
+ * Runs the APU for one CPU cycle
+ * @param apu APU instance
+ * @param sample_out Buffer to write outputted sample to
+ * @return 1 if a sample was output, otherwise 0
+ */
+static inline int
+step( Apu *apu, float *sample_out )
+{
+	int16_t s16;
 
-		if ( apu.regs[APU_SNDCHN] & 1 )
-			apu.chans[0].len.ctr = len_ctr_tab[val >> 3];
+	clock_channels( apu );
 
-		// sequencer is reset by write to $4003
-		apu.chans[0].timer = apu.chans[0].freq;
-		apu.chans[0].index = 0;
-		break;
+	switch ( apu->output )
+	{
+	case APU_OUTPUT_FIXED:
+		if ( !firq_clock( &apu->firq, mix_levels_q15( apu, levels( apu ) ), &s16 ) )
+			return 0;
 
-	case APU_SQ2VOL:
-		apu.chans[1].sequencer_tab = duty_seq_tab[val >> 6];
-		apu.chans[1].env.loop = ( val & 0x20 ) != 0;
-		apu.chans[1].len.halt = ( val & 0x20 ) != 0;
-		apu.chans[1].env.constant = ( val & 0x10 ) != 0;
-		apu.chans[1].env.period = val & 0x0f;
-		break;
-	case APU_SQ2SWEEP:
-		apu.chans[1].sweep.reload = 1;
-		apu.chans[1].sweep.enabled = ( val & 0x80 ) != 0;
-		apu.chans[1].sweep.period = ( val >> 4 ) & 7;
-		apu.chans[1].sweep.negate = ( val & 0x08 ) != 0;
-		apu.chans[1].sweep.shift = val & 7;
-		break;
-	case APU_SQ2LO:
-		apu.chans[1].freq = get_period( 1 );
-		apu.chans[1].sweep.target = apu.chans[1].freq;
-		break;
-	case APU_SQ2HI:
-		apu.chans[1].freq = get_period( 1 );
-		apu.chans[1].sweep.target = apu.chans[1].freq;
-		apu.chans[1].env.start = 1;
+		*sample_out = (float)s16 / FIRQ_LEVEL_ONE;
+		return 1;
+	case APU_OUTPUT_BLEP:
+		return blip_clock( &apu->blip, mix( apu ), sample_out );
+	case APU_OUTPUT_DECIM:
+		return decim_clock( &apu->decim, mix( apu ), sample_out );
+	default:
+		return fir_clock( &apu->fir, mix( apu ), sample_out );
+	}
+}
 
-		if ( apu.regs[APU_SNDCHN] & 2 )
-			apu.chans[1].len.ctr = len_ctr_tab[val >> 3];
+/**
+ * Returns the number of cycles until a timer reaches zero
+ * @param timer Current timer value
+ * @return Cycles until the timer does real work, or NO_EVENT if it never will
+ */
+static inline size_t
+timer_event( uint_fast16_t timer )
+{
+	// a timer that wrapped around because its period was 0 will not reach 0 again until reloaded
+	return ( timer > 0xffff ) ? NO_EVENT : timer + 1;
+}
 
-		// sequencer is reset by write to $4003
-		apu.chans[1].timer = apu.chans[1].freq;
-		apu.chans[1].index = 0;
-		break;
+/**
+ * Works out how many cycles it will be until the APU has to do anything other than count its
+ * timers down. Every cycle before that one only decrements timers and leaves the DAC output as is.
+ * @param apu APU instance
+ * @param silent 1 = the output is not needed, so only state changes other than levels count
+ * @return Number of cycles until (and including) the next cycle that must be run with step()
+ */
+static inline size_t
+cycles_to_event( const Apu *apu, int silent )
+{
+	static const int32_t frame_events[2][5] = {
+		{ 7457, 14913, 22371, 29828, 29829 },
+		{ 7457, 14913, 22371, 32781, 32781 }
+	};
 
-	case APU_TRILINEAR:
-		apu.chans[2].len.halt = ( val & 0x80 ) != 0;
-		apu.linear_ctr = val & 0x7f;
-		break;
-	case APU_TRILO:
-		apu.chans[2].freq = get_period( 2 );
-		break;
-	case APU_TRIHI:
-		apu.chans[2].freq = get_period( 2 );
+	const ApuChan * const sq1 = &apu->chans[0];
+	const ApuChan * const sq2 = &apu->chans[1];
+	const ApuChan * const tri = &apu->chans[2];
+	const ApuChan * const noi = &apu->chans[3];
 
-		if ( apu.regs[APU_SNDCHN] & 4 )
-			apu.chans[2].len.ctr = len_ctr_tab[val >> 3];
+	size_t next = NO_EVENT;
+	size_t n;
 
-		apu.linear_reload = 1;
-		break;
+	// the pending $4017 restart is only a few cycles long, so just run it a cycle at a time
 
-	case APU_NOIVOL:
-		apu.chans[3].env.loop = ( val & 0x20 ) != 0;
-		apu.chans[3].len.halt = ( val & 0x20 ) != 0;
-		apu.chans[3].env.constant = ( val & 0x10 ) != 0;
-		apu.chans[3].env.period = val & 0x0f;
-		break;
-	case APU_NOIFREQ:
-		apu.chans[3].mode = ( val & 0x80 ) != 0;
-		apu.chans[3].freq = noi_period_tab[val & 0x0f];
-		break;
-	case APU_NOILEN:
-		apu.chans[3].env.start = 1;
+	if ( apu->frame_ctr_restart_ctr > 0 )
+		return 1;
 
-		if ( apu.regs[APU_SNDCHN] & 8 )
-			apu.chans[3].len.ctr = len_ctr_tab[val >> 3];
+	// frame counter
 
-		break;
+	for ( int i = 0; i < 5; i++ )
+	{
+		if ( frame_events[apu->frame_ctr_mode][i] > apu->frame_ctr_cycle )
+		{
+			next = frame_events[apu->frame_ctr_mode][i] - apu->frame_ctr_cycle;
+			break;
+		}
+	}
 
-	case APU_DMCFREQ:
-		apu.chans[4].mode = ( val & 0x40 ) != 0;
-		apu.chans[4].freq = dmc_period_tab[val & 0x0f] - 1;
-		apu.dmc_irq_enable = ( val & 0x80 ) != 0;
+	// the channel timers can all be run through in one go by skip_idle(). they only have to be
+	// stopped at where they change the levels
 
-		if ( !apu.dmc_irq_enable )
-			apu.dmc_irq_flag = 0;
-		break;
-	case APU_DMCRAW:
-		apu.dmc_lvl = val & 0x7f;
-		break;
-	case APU_DMCADDR:
-		apu.dmc_adr = 0xc000 + ( val << 6 );
-		break;
-	case APU_DMCLEN:
-		apu.dmc_len = ( val << 4 ) + 1;
-		break;
+	if ( silent )
+		return next;
 
-	case APU_SNDCHN:
-		apu.chans[0].mute = ( val & 0x01 ) == 0;
-		if ( !( val & 0x01 ) )
-			apu.chans[0].len.ctr = 0;
+	// pulse timers are clocked on odd frame counter cycles only. the timer does work on the clock
+	// where it is 0, which is its (timer + 1)th clock from now. a silent pulse can be left to run
 
-		apu.chans[1].mute = ( val & 0x02 ) == 0;
-		if ( !( val & 0x02 ) )
-			apu.chans[1].len.ctr = 0;
+	for ( int i = 0; i < 2; i++ )
+	{
+		const ApuChan *ch = ( i == 0 ) ? sq1 : sq2;
 
-		apu.chans[2].mute = ( val & 0x04 ) == 0;
-		if ( !( val & 0x04 ) )
-			apu.chans[2].len.ctr = 0;
+		if ( volume( ch ) == 0 )
+			continue;
 
-		apu.chans[3].mute = ( val & 0x08 ) == 0;
-		if ( !( val & 0x08 ) )
-			apu.chans[3].len.ctr = 0;
+		n = timer_event( ch->timer );
 
-		if ( !( val & 0x10 ) )
-			apu.dmc_len_internal = 0;
-		else if ( apu.dmc_len_internal == 0 )
+		if ( n != NO_EVENT )
 		{
-			apu.dmc_len_internal = apu.dmc_len;
-			apu.dmc_adr_internal = apu.dmc_adr;
+			n = 2 * n - 1 + ( apu->frame_ctr_cycle & 1 );
+			if ( n < next ) next = n;
 		}
+	}
 
-		apu.dmc_irq_flag = 0;
-		break;
+	// triangle timer is only clocked while both its counters are nonzero
 
-	case APU_APUFRAME:
-		if ( apu.frame_ctr_cycle & 1 )
-			apu.frame_ctr_restart_ctr = 3;
-		else
-			apu.frame_ctr_restart_ctr = 4;
+	if ( tri->len.ctr != 0 && apu->linear_ctr != 0 )
+	{
+		n = timer_event( tri->timer );
+		if ( n < next ) next = n;
+	}
 
-		apu.frame_ctr_mode = val >> 7;
-		apu.frame_ctr_irq_inhibit = ( val & 0x40 ) != 0;
+	// noise timer. its clocks only matter while it is audible and its output bit changes, which
+	// happens within a few clocks, so look up how many clocks away the next change is
 
-		if ( apu.frame_ctr_irq_inhibit )
-			apu.frame_ctr_irq_flag = 0;
-			
-		break;
+	n = timer_event( noi->timer );
+
+	if ( n != NO_EVENT && volume( noi ) != 0 )
+	{
+		n += ( noise_run_length( apu->noise, noi->mode, apu->noi_pos ) - 1 ) * (size_t)noi->freq;
+		if ( n < next ) next = n;
 	}
+
+	// DMC timer
+
+	n = timer_event( apu->chans[4].timer );
+	if ( n < next ) next = n;
+
+	return next;
 }
 
 /**
- * Emulates the behavior of APU registers when read
- * @param reg Register to read
- * @return 0 for anything other than $4015, else the status of the IRQ flags and length counters
+ * Applies every queued write that is due on the current cycle
+ * @param apu APU instance
+ * @return Number of cycles that can be run before the next queued write or the queue's horizon
  */
-uint8_t
-apu_read( uint_fast16_t reg )
+static size_t
+apply_writes( Apu *apu )
 {
-	if ( reg == APU_SNDCHN )
-	{
-		int b0 = apu.chans[0].len.ctr > 0;
-		int b1 = apu.chans[1].len.ctr > 0;
-		int b2 = apu.chans[2].len.ctr > 0;
-		int b3 = apu.chans[3].len.ctr > 0;
-		int b4 = apu.dmc_len_internal > 0;
-		int b6 = apu.frame_ctr_irq_flag;
-		int b7 = apu.dmc_irq_flag;
+	// the horizon has to be read before the writes, so that every write before it is visible
 
-		if ( !apu.frame_ctr_irq_set_now )
-			apu.frame_ctr_irq_flag = 0;
+	const uint64_t horizon = spsc_horizon( apu->writes );
+	const ApuWrite *w;
 
-		return b0 | ( b1 << 1 ) | ( b2 << 2 ) | ( b3 << 3 ) | ( b4 << 4 ) | ( b6 << 6 ) | ( b7 << 7 );
+	while ( ( w = spsc_peek( apu->writes ) ) != NULL && w->cycle <= apu->cycle )
+	{
+		apu_write( apu, w->reg, w->val );
+		spsc_pop( apu->writes );
 	}
 
-	return 0;
+	uint64_t end = ( w != NULL ) ? w->cycle : horizon;
+
+	if ( end <= apu->cycle )
+		return 0;
+
+	return ( end - apu->cycle > SIZE_MAX ) ? SIZE_MAX : (size_t)( end - apu->cycle );
 }
 
 /**
- * Returns the last value written to an APU register
- * @param reg Register
- * @return Value last written to the register
+ * Clocks a pulse or triangle timer a number of times in one go
+ * @param ch Channel
+ * @param clocks Number of timer clocks
  */
-uint8_t
-apu_read_internal( uint_fast16_t reg )
+static inline void
+skip_timer( ApuChan *ch, size_t clocks )
 {
-	return apu.regs[reg];
+	if ( ch->timer > 0xffff || clocks <= ch->timer )
+	{
+		ch->timer -= clocks;
+		return;
+	}
+
+	// the first clock reaches 0, after that the timer goes round every freq clocks. with a period
+	// of 0 the timer wraps around on the first clock instead and stops
+
+	size_t rest = clocks - ch->timer - 1;
+
+	if ( ch->freq == 0 )
+	{
+		ch->timer = (uint_fast16_t)0 - 1 - rest;
+		return;
+	}
+
+	ch->index			+= (uint8_t)( 1 + rest / ch->freq );
+	ch->timer			= ch->freq - 1 - rest % ch->freq;
+	ch->sequencer_val	= ch->sequencer_tab[(uint8_t)( ch->index - 1 ) & ch->sequencer_len];
 }
 
 /**
- * Initializes internal control parameters
+ * Runs the APU through cycles in which nothing but channel timer clocks happen, so that the channel
+ * state can be advanced in one go. Must not be asked to run into the cycle returned by
+ * cycles_to_event().
+ * @param apu APU instance
+ * @param cycles Number of cycles to run
  */
-void
-apu_init()
+static void
+skip_idle( Apu *apu, size_t cycles )
 {
-	memset( &apu, 0, sizeof(apu) );
+	apu->frame_ctr_irq_set_now = 0;
 
-	for ( int i = 0; i < 0x14; i++ )
-		apu_write( i, 0 );
+	// count the odd frame counter cycles in ( cycle, cycle + cycles ] to get the pulse timer clocks
 
-	apu.chans[0].is_sq1			= 1;
+	int32_t end = apu->frame_ctr_cycle + (int32_t)cycles;
+	uint_fast16_t pulse_clocks = ( end + 1 ) / 2 - ( apu->frame_ctr_cycle + 1 ) / 2;
 
-	apu.chans[0].sequencer_val	= apu.chans[0].sequencer_tab[0];
-	apu.chans[0].sequencer_len	= 7;
-	apu.chans[1].sequencer_val	= apu.chans[1].sequencer_tab[0];
-	apu.chans[1].sequencer_len	= 7;
+	apu->frame_ctr_cycle = end;
 
-	apu.chans[2].sequencer_tab	= tri_seq_tab;
-	apu.chans[2].sequencer_val	= apu.chans[2].sequencer_tab[0];
-	apu.chans[2].sequencer_len	= 31;
+	skip_timer( &apu->chans[0], pulse_clocks );
+	skip_timer( &apu->chans[1], pulse_clocks );
 
-	apu.lfsr = 1;
+	if ( apu->chans[2].len.ctr != 0 && apu->linear_ctr != 0 )
+		skip_timer( &apu->chans[2], cycles );
 
-	apu.dmc_adr_internal		= 0xc000;
-	apu.dmc_len_internal		= 0;
-	apu.chans[4].freq			= dmc_period_tab[0] - 1;
+	ApuChan * const noi = &apu->chans[3];
 
-#ifdef APU_MIXER_USE_LOOKUP
-	// generate mixer lookup tables
+	if ( noi->timer > 0xffff || cycles <= noi->timer )
+		noi->timer -= cycles;
+	else
+	{
+		size_t rest = cycles - noi->timer - 1;
+		size_t clocks = 1;
+
+		if ( noi->freq != 0 )
+		{
+			clocks += rest / noi->freq;
+			rest %= noi->freq;
+		}
+
+		noi->timer		= noi->freq - 1 - rest;
+		apu->noi_pos	= noise_advance( apu->noise, noi->mode, apu->noi_pos, clocks );
+		apu->feedback	= noise_output( apu->noise, noi->mode, apu->noi_pos );
+	}
+
+	// the DMC timer goes round every freq + 1 cycles
 
-	for ( int i = 0; i < 31; i++ )
+	ApuChan * const dmc = &apu->chans[4];
+
+	if ( dmc->timer > 0xffff || cycles <= dmc->timer )
+		dmc->timer -= cycles;
+	else
 	{
-		pulse_table[i] = 95.52f / ( 8128.0f / i + 100 );
+		size_t rest = cycles - dmc->timer - 1;
+		uint64_t at = apu->cycle + dmc->timer;
+
+		dmc_output_clock( apu, at );
+
+		for ( ; rest > dmc->freq; rest -= dmc->freq + 1 )
+			dmc_output_clock( apu, at += dmc->freq + 1 );
+
+		dmc->timer = dmc->freq - rest;
 	}
-	for ( int i = 0; i < 203; i++ )
+}
+
+/**
+ * Adds a run of cycles at the current channel levels to the block, merging it with the previous
+ * run if the levels are the same
+ * @param apu APU instance
+ * @param cycles Length of run in cycles
+ */
+static inline void
+record_run( Apu *apu, uint32_t cycles )
+{
+	const Levels lv = levels( apu );
+	size_t i = apu->blk_runs;
+
+	if ( i > 0 && apu->blk_sq1[i - 1] == lv.sq1 && apu->blk_sq2[i - 1] == lv.sq2 &&
+			apu->blk_tri[i - 1] == lv.tri && apu->blk_noi[i - 1] == lv.noi &&
+			apu->blk_dmc[i - 1] == lv.dmc )
 	{
-		tnd_table[i] = 163.67f / ( 24329.0f / i + 100 );
+		apu->blk_len[i - 1] += cycles;
+		return;
 	}
-#endif
+
+	apu->blk_sq1[i]	= lv.sq1;
+	apu->blk_sq2[i]	= lv.sq2;
+	apu->blk_tri[i]	= lv.tri;
+	apu->blk_noi[i]	= lv.noi;
+	apu->blk_dmc[i]	= lv.dmc;
+	apu->blk_len[i]	= cycles;
+	apu->blk_runs++;
+}
+
+/**
+ * Steps the channels through a number of cycles, running idle stretches in one go. The frame hook
+ * is called as it would be by a cycle-by-cycle run, since it only touches channel state. Stops
+ * after max_cycles cycles, when the block is full, or at a cycle the write queue has not reached.
+ * @param apu APU instance
+ * @param max_cycles Maximum number of CPU cycles to run
+ * @param record 1 = record the channel levels of every run of cycles in the block, 0 = levels are
+ * not needed, so only cycles that change other state have to be stopped at
+ * @return Number of CPU cycles run
+ */
+static inline size_t
+run_channels( Apu *apu, size_t max_cycles, int record )
+{
+	size_t cycles = 0;
+
+	apu->blk_runs = 0;
+
+	while ( cycles < max_cycles && apu->blk_runs < APU_BLOCK_SIZE )
+	{
+		// stop at the next queued write, or where the queue's producer has not got to yet
+
+		size_t limit = apply_writes( apu );
+
+		if ( limit == 0 )
+			break;
+
+		// the frame hook cycle has to be run on its own as well, since the hook may write registers
+
+		size_t next = cycles_to_event( apu, !record );
+		size_t hook = APU_FRAME_CYCLES - apu->frame_hook_ctr + 1;
+
+		if ( apu->frame_hook_ctr == 0 )
+			hook = 1;
+		if ( hook < next )
+			next = hook;
+
+		if ( next > 1 )
+		{
+			size_t idle = next - 1;
+
+			if ( idle > max_cycles - cycles )
+				idle = max_cycles - cycles;
+			if ( idle > limit )
+				idle = limit;
+
+			if ( record )
+				record_run( apu, idle );
+
+			skip_idle( apu, idle );
+			cycles += idle;
+			apu->cycle += idle;
+			apu->frame_hook_ctr = ( apu->frame_hook_ctr + idle ) % APU_FRAME_CYCLES;
+			continue;
+		}
+
+		clock_channels( apu );
+
+		if ( record )
+			record_run( apu, 1 );
+
+		cycles++;
+		apu->cycle++;
+
+		if ( apu->frame_hook_ctr == 0 && apu->frame_hook != NULL )
+			apu->frame_hook( apu->frame_hook_data );
+
+		if ( ++apu->frame_hook_ctr == APU_FRAME_CYCLES )
+			apu->frame_hook_ctr = 0;
+	}
+
+	return cycles;
+}
+
+/**
+ * Block phase one: steps the channels and records their levels, without mixing or filtering.
+ * Stops after max_cycles cycles or when the block is full.
+ * @param apu APU instance
+ * @param max_cycles Maximum number of CPU cycles to run
+ * @return Number of CPU cycles run
+ */
+static size_t
+render_levels( Apu *apu, size_t max_cycles )
+{
+	return run_channels( apu, max_cycles, 1 );
+}
+
+/**
+ * Works out each channel's share of the mixer output, which is what the mixer would output with
+ * the other channels silent
+ * @param apu APU instance
+ * @param lv Channel levels
+ * @param levels_out Buffer to write the share of each channel to (APU_STEMS values)
+ */
+static inline void
+stem_levels( const Apu *apu, Levels lv, float *levels_out )
+{
+	const MixerTables * const tables = apu->mixer_tables;
+
+	levels_out[0] = tables->pulse_exact[lv.sq1];
+	levels_out[1] = tables->pulse_exact[lv.sq2];
+	levels_out[2] = tables->tnd_exact[MIXER_TND_INDEX( lv.tri, 0, 0 )];
+	levels_out[3] = tables->tnd_exact[MIXER_TND_INDEX( 0, lv.noi, 0 )];
+	levels_out[4] = tables->tnd_exact[MIXER_TND_INDEX( 0, 0, lv.dmc )];
+}
+
+/**
+ * Block phase two: mixes the recorded channel levels into DAC outputs
+ * @param apu APU instance
+ */
+static void
+mix_block( Apu *apu )
+{
+	if ( apu->output == APU_OUTPUT_FIXED )
+	{
+		for ( size_t i = 0; i < apu->blk_runs; i++ )
+		{
+			const Levels lv = { apu->blk_sq1[i], apu->blk_sq2[i], apu->blk_tri[i], apu->blk_noi[i],
+					apu->blk_dmc[i] };
+
+			apu->blk_dacq[i] = mix_levels_q15( apu, lv );
+		}
+
+		return;
+	}
+
+	if ( apu->mixer == APU_MIXER_EXACT )
+	{
+		const SimdLevels lv = { apu->blk_sq1, apu->blk_sq2, apu->blk_tri, apu->blk_noi, apu->blk_dmc };
+
+		apu->kernels->mix( apu->blk_dac, &lv, apu->mixer_tables->pulse_exact,
+				apu->mixer_tables->tnd_exact, apu->blk_runs );
+		return;
+	}
+
+	for ( size_t i = 0; i < apu->blk_runs; i++ )
+	{
+		const Levels lv = { apu->blk_sq1[i], apu->blk_sq2[i], apu->blk_tri[i], apu->blk_noi[i],
+				apu->blk_dmc[i] };
+
+		apu->blk_dac[i] = mix_levels( apu, lv );
+	}
+}
+
+/**
+ * Feeds cycles of a block run through the output engine
+ * @param apu APU instance
+ * @param run Index of run in the block
+ * @param cycles Number of cycles to run
+ * @param samples_out Buffer of samples in the output engine's format (int16_t for
+ * APU_OUTPUT_FIXED, otherwise float)
+ * @param max_samples Size of samples_out in samples
+ * @param samples_written Pointer to the number of samples in samples_out so far, which new samples
+ * are written after and added to
+ * @return Number of cycles run
+ */
+static inline size_t
+run_output( Apu *apu, size_t run, size_t cycles, void *samples_out, size_t max_samples,
+		size_t *samples_written )
+{
+	const size_t at = *samples_written;
+
+	switch ( apu->output )
+	{
+	case APU_OUTPUT_FIXED:
+		return firq_run( &apu->firq, apu->blk_dacq[run], cycles, (int16_t *)samples_out + at,
+				max_samples - at, samples_written );
+	case APU_OUTPUT_BLEP:
+		return blip_run( &apu->blip, apu->blk_dac[run], cycles, (float *)samples_out + at,
+				max_samples - at, samples_written );
+	case APU_OUTPUT_DECIM:
+		return decim_run( &apu->decim, apu->blk_dac[run], cycles, (float *)samples_out + at,
+				max_samples - at, samples_written );
+	default:
+		return fir_run( &apu->fir, apu->blk_dac[run], cycles, (float *)samples_out + at,
+				max_samples - at, samples_written );
+	}
+}
+
+/**
+ * Block phase two: feeds the mixed runs through the output engine
+ * @param apu APU instance
+ * @param samples_out Buffer to write outputted samples to, in the output engine's format
+ * @param max_samples Size of samples_out in samples
+ * @param samples_written Pointer to value to add the number of outputted samples to
+ */
+static void
+filter_block( Apu *apu, void *samples_out, size_t max_samples, size_t *samples_written )
+{
+	size_t samples = 0;
+
+	for ( size_t i = 0; i < apu->blk_runs; i++ )
+		run_output( apu, i, apu->blk_len[i], samples_out, max_samples, &samples );
+
+	*samples_written += samples;
+}
+
+/**
+ * Works out how many cycles can be run before the output engine outputs a number of samples
+ * @param apu APU instance
+ * @param samples Number of samples (at least 1)
+ * @param max_cycles Most cycles to look ahead
+ * @return Cycles until and including the one that outputs the last sample, at most max_cycles
+ */
+static size_t
+cycles_until_samples( const Apu *apu, size_t samples, size_t max_cycles )
+{
+	switch ( apu->output )
+	{
+	case APU_OUTPUT_FIXED:
+		return firq_clocks_until( &apu->firq, samples, max_cycles );
+	case APU_OUTPUT_BLEP:
+		return blip_clocks_until( &apu->blip, samples, max_cycles );
+	case APU_OUTPUT_DECIM:
+		return decim_clocks_until( &apu->decim, samples, max_cycles );
+	default:
+		return fir_clocks_until( &apu->fir, samples, max_cycles );
+	}
+}
+
+/**
+ * Works out how many cycles apu_run() can run before it has output a number of samples, so that
+ * whatever feeds the APU writes can be kept from running further ahead than the APU will get
+ * @param apu APU instance
+ * @param samples Number of samples (at least 1)
+ * @param max_cycles Most cycles to look ahead
+ * @return Cycles until and including the one that outputs the last sample, at most max_cycles
+ */
+size_t
+apu_cycles_until_samples( const Apu *apu, size_t samples, size_t max_cycles )
+{
+	return cycles_until_samples( apu, samples, max_cycles );
+}
+
+/**
+ * Block phase two with stems: feeds the mixed runs through the output engine, and each channel's
+ * share of them through the stem filters. Stem and stereo samples are taken at the same cycles as
+ * the output engine's samples.
+ * @param apu APU instance
+ * @param samples_out Buffer to write outputted samples to, in the output engine's format
+ * @param stems_out Buffer to write APU_STEMS interleaved stem samples per sample to (may be NULL)
+ * @param stereo_out Buffer to write interleaved left and right samples to (may be NULL)
+ * @param max_samples Size of samples_out in samples
+ * @param samples_written Pointer to value to add the number of outputted samples to
+ */
+static void
+filter_block_stems( Apu *apu, void *samples_out, float *stems_out, float *stereo_out,
+		size_t max_samples, size_t *samples_written )
+{
+	size_t samples = 0;
+
+	for ( size_t i = 0; i < apu->blk_runs; i++ )
+	{
+		const Levels lv = {
+			apu->blk_sq1[i], apu->blk_sq2[i], apu->blk_tri[i], apu->blk_noi[i], apu->blk_dmc[i]
+		};
+		float levels[APU_STEMS];
+
+		stem_levels( apu, lv, levels );
+
+		size_t left = apu->blk_len[i];
+
+		while ( left > 0 )
+		{
+			// run up to and including the cycle of the next output sample
+
+			size_t n = cycles_until_samples( apu, 1, left );
+			size_t before = samples;
+
+			run_output( apu, i, n, samples_out, max_samples, &samples );
+			stems_push( apu->stems, levels, n );
+			left -= n;
+
+			if ( samples == before )
+				continue;
+
+			float stem[APU_STEMS];
+			float l = 0.0f;
+			float r = 0.0f;
+
+			stems_output( apu->stems, stem );
+
+			for ( int c = 0; c < APU_STEMS; c++ )
+			{
+				l += apu->pan[c][0] * stem[c];
+				r += apu->pan[c][1] * stem[c];
+			}
+
+			if ( stems_out != NULL )
+				memcpy( &stems_out[before * APU_STEMS], stem, sizeof(stem) );
+
+			if ( stereo_out != NULL )
+			{
+				stereo_out[before * 2 + 0] = l;
+				stereo_out[before * 2 + 1] = r;
+			}
+		}
+	}
+
+	*samples_written += samples;
+}
+
+/**
+ * Runs the APU for a block of CPU cycles, as apu_run_stems(). Samples are output either as float or
+ * as int16, whichever buffer is given. When that is not the output engine's own format, each block
+ * is filtered into a scratch buffer and converted.
+ * @param apu APU instance
+ * @param max_cycles Maximum number of CPU cycles to run
+ * @param samples_out Buffer to write float samples to (NULL if s16_out is given)
+ * @param s16_out Buffer to write int16 samples to (NULL if samples_out is given)
+ * @param stems_out Buffer to write APU_STEMS interleaved stem samples per sample to (may be NULL)
+ * @param stereo_out Buffer to write interleaved left and right samples to (may be NULL)
+ * @param max_samples Size of samples_out or s16_out in samples
+ * @param samples_written Pointer to value to store the number of outputted samples in (may be NULL)
+ * @return Number of CPU cycles run
+ */
+static size_t
+render( Apu *apu, size_t max_cycles, float *samples_out, int16_t *s16_out, float *stems_out,
+		float *stereo_out, size_t max_samples, size_t *samples_written )
+{
+	const int stems = apu->stems != NULL && ( stems_out != NULL || stereo_out != NULL );
+	const int convert = ( apu->output == APU_OUTPUT_FIXED ) != ( s16_out != NULL );
+
+	size_t cycles = 0;
+	size_t samples = 0;
+
+	while ( cycles < max_cycles && samples < max_samples )
+	{
+		size_t room = max_samples - samples;
+		void *out;
+
+		if ( !convert )
+			out = ( s16_out != NULL ) ? (void *)&s16_out[samples] : (void *)&samples_out[samples];
+		else
+		{
+			if ( room > APU_BLOCK_SIZE )
+				room = APU_BLOCK_SIZE;
+
+			out = ( s16_out != NULL ) ? (void *)apu->blk_out : (void *)apu->blk_out_s16;
+		}
+
+		// size the block so that it ends on the cycle that fills the output buffer, if it gets that
+		// far
+
+		size_t block = max_cycles - cycles;
+
+		if ( block > BLOCK_MAX_CYCLES )
+			block = BLOCK_MAX_CYCLES;
+
+		block = cycles_until_samples( apu, room, block );
+
+		PROFILE_ENTER( PROFILE_CHANNELS );
+		block = render_levels( apu, block );
+		PROFILE_LEAVE();
+
+		if ( block == 0 )
+			break;
+
+		PROFILE_ENTER( PROFILE_MIXER );
+		mix_block( apu );
+		PROFILE_LEAVE();
+
+		size_t n = 0;
+
+		PROFILE_ENTER( PROFILE_FILTER );
+
+		if ( stems )
+		{
+			filter_block_stems( apu, out, stems_out ? &stems_out[samples * APU_STEMS] : NULL,
+					stereo_out ? &stereo_out[samples * 2] : NULL, room, &n );
+		}
+		else
+			filter_block( apu, out, room, &n );
+
+		PROFILE_LEAVE();
+
+		if ( convert && s16_out != NULL )
+		{
+			for ( size_t i = 0; i < n; i++ )
+				s16_out[samples + i] = sample_to_s16( apu->blk_out[i] );
+		}
+		else if ( convert )
+		{
+			for ( size_t i = 0; i < n; i++ )
+				samples_out[samples + i] = (float)apu->blk_out_s16[i] / FIRQ_LEVEL_ONE;
+		}
+
+		samples += n;
+		cycles += block;
+	}
+
+	if ( samples_written != NULL )
+		*samples_written = samples;
+
+	return cycles;
+}
+
+/**
+ * APU half-clock routine. Will output a sample if enough internal samples have been generated, as well
+ * as the status of the frame counter and DMC interrupts. Queued writes due on this cycle are applied
+ * first, without waiting for the write queue's horizon.
+ * @param apu APU instance
+ * @param sample_out Buffer to write outputted sample to
+ * @param irq_out Pointer to value to store IRQ status in (pass NULL if this information is not needed)
+ * @return 1 if a sample was output, otherwise 0
+ */
+int
+apu_clock( Apu *apu, float *sample_out, unsigned int *irq_out )
+{
+	apply_writes( apu );
+
+	int ret = step( apu, sample_out );
+
+	apu->cycle++;
+
+	// signal IRQ (or lack thereof)
+
+	if ( irq_out != NULL )
+		*irq_out = apu_irq( apu );
+
+	return ret;
+}
+
+/**
+ * Runs the APU for a block of CPU cycles. Stops after max_cycles cycles or as soon as max_samples
+ * samples have been output, whichever comes first. The frame hook, if set, is called once every
+ * APU_FRAME_CYCLES cycles, right after the first cycle of each frame has been run.
+ *
+ * Work is done in blocks of up to APU_BLOCK_SIZE runs of unchanged channel levels. The channels
+ * are stepped through a whole block first, then the block is mixed and filtered.
+ *
+ * Queued writes (see apu_write_at() and apu_set_write_queue()) are applied right before the cycle
+ * they are tagged with. Also stops early on reaching a cycle that the write queue's producer has
+ * not published yet.
+ * @param apu APU instance
+ * @param max_cycles Maximum number of CPU cycles to run
+ * @param samples_out Buffer to write outputted samples to
+ * @param max_samples Size of samples_out in samples
+ * @param samples_written Pointer to value to store the number of outputted samples in (may be NULL)
+ * @return Number of CPU cycles run
+ */
+size_t
+apu_run( Apu *apu, size_t max_cycles, float *samples_out, size_t max_samples, size_t *samples_written )
+{
+	return apu_run_stems( apu, max_cycles, samples_out, NULL, NULL, max_samples, samples_written );
+}
+
+/**
+ * Same as apu_run(), but outputs 16-bit samples. With APU_OUTPUT_FIXED these come straight from
+ * the integer pipeline, otherwise float samples are rounded and clipped to 16 bits.
+ * @param apu APU instance
+ * @param max_cycles Maximum number of CPU cycles to run
+ * @param samples_out Buffer to write outputted samples to
+ * @param max_samples Size of samples_out in samples
+ * @param samples_written Pointer to value to store the number of outputted samples in (may be NULL)
+ * @return Number of CPU cycles run
+ */
+size_t
+apu_run_s16( Apu *apu, size_t max_cycles, int16_t *samples_out, size_t max_samples,
+		size_t *samples_written )
+{
+	return render( apu, max_cycles, NULL, samples_out, NULL, NULL, max_samples, samples_written );
+}
+
+/**
+ * Same as apu_run(), but also outputs each channel filtered on its own and a stereo mix of them
+ * panned with the gains set by apu_set_pan(). All outputs come from the same emulation pass and
+ * have one sample for every sample in samples_out. Stems must have been enabled with
+ * apu_set_stems(), otherwise stems_out and stereo_out are left alone. Stems use the FIR high pass
+ * and low pass design whichever output engine is selected.
+ * @param apu APU instance
+ * @param max_cycles Maximum number of CPU cycles to run
+ * @param samples_out Buffer to write outputted samples to
+ * @param stems_out Buffer to write APU_STEMS interleaved stem samples per sample to (may be NULL)
+ * @param stereo_out Buffer to write interleaved left and right samples to (may be NULL)
+ * @param max_samples Size of samples_out in samples
+ * @param samples_written Pointer to value to store the number of outputted samples in (may be NULL)
+ * @return Number of CPU cycles run
+ */
+size_t
+apu_run_stems( Apu *apu, size_t max_cycles, float *samples_out, float *stems_out, float *stereo_out,
+		size_t max_samples, size_t *samples_written )
+{
+	return render( apu, max_cycles, samples_out, NULL, stems_out, stereo_out, max_samples,
+			samples_written );
+}
+
+/**
+ * Runs the APU without producing any output. Only the state that affects what comes later is
+ * stepped: timers, sequencers, envelopes, sweeps, length and linear counters, the noise shift
+ * register, the DMC reader and the IRQ flags. The frame hook and queued writes are handled as by
+ * apu_run(). Pulse, triangle and noise clocks are run through in bulk, so this runs many times
+ * faster than apu_run(). The channel state afterwards is the same as after apu_run().
+ *
+ * The output filters are then set up as if the channels had been at their current levels for
+ * ever, so that output picks up from there without a pop. Their sample clock is moved on by the
+ * cycles skipped, so the samples that follow fall on the same cycles as in an apu_run() of the
+ * whole stretch.
+ * @param apu APU instance
+ * @param max_cycles Maximum number of CPU cycles to run
+ * @return Number of CPU cycles run (less than max_cycles if the write queue ran dry)
+ */
+size_t
+apu_skip( Apu *apu, size_t max_cycles )
+{
+	size_t cycles = 0;
+
+	while ( cycles < max_cycles )
+	{
+		size_t n = run_channels( apu, max_cycles - cycles, 0 );
+
+		if ( n == 0 )
+			break;
+
+		cycles += n;
+	}
+
+	const float dac_out = mix( apu );
+
+	if ( apu->output == APU_OUTPUT_FIXED )
+	{
+		firq_advance( &apu->firq, cycles );
+		firq_prime( &apu->firq, mix_levels_q15( apu, levels( apu ) ) );
+	}
+	else if ( apu->output == APU_OUTPUT_FIR )
+	{
+		fir_advance( &apu->fir, cycles );
+		fir_prime( &apu->fir, dac_out );
+	}
+	else if ( apu->output == APU_OUTPUT_BLEP )
+	{
+		blip_advance( &apu->blip, cycles );
+		blip_prime( &apu->blip, dac_out );
+	}
+	else if ( apu->output == APU_OUTPUT_DECIM )
+	{
+		decim_advance( &apu->decim, cycles );
+		decim_prime( &apu->decim, dac_out );
+	}
+
+	if ( apu->stems != NULL )
+	{
+		float shares[APU_STEMS];
+
+		stem_levels( apu, levels( apu ), shares );
+		stems_prime( apu->stems, shares );
+	}
+
+	return cycles;
+}
+
+/**
+ * Enables or disables per-channel stem output for apu_run_stems(). Enabling allocates the stem
+ * filters and starts them from silence.
+ * @param apu APU instance
+ * @param enable 1 to enable, 0 to disable and free the stem filters
+ * @return 0 on success, -1 if allocation failed
+ */
+int
+apu_set_stems( Apu *apu, int enable )
+{
+	if ( !enable )
+	{
+		if ( apu->stems != NULL )
+		{
+			stems_destroy( apu->stems );
+			free( apu->stems );
+			apu->stems = NULL;
+		}
+
+		return 0;
+	}
+
+	if ( apu->stems != NULL )
+		return 0;
+
+	Stems *stems = malloc( sizeof(Stems) );
+
+	if ( stems == NULL )
+		return -1;
+
+	if ( stems_create( stems ) != 0 )
+	{
+		free( stems );
+		return -1;
+	}
+
+	stems_init( stems, &apu->fir );
+	apu->stems = stems;
+	return 0;
+}
+
+/**
+ * Sets the gains a channel is mixed with into the left and right outputs of apu_run_stems().
+ * Every channel defaults to a gain of 1 on both sides.
+ * @param apu APU instance
+ * @param chan Channel (0 = pulse 1, 1 = pulse 2, 2 = triangle, 3 = noise, 4 = DMC)
+ * @param left Gain in left output
+ * @param right Gain in right output
+ */
+void
+apu_set_pan( Apu *apu, int chan, float left, float right )
+{
+	if ( chan < 0 || chan >= APU_STEMS )
+		return;
+
+	apu->pan[chan][0] = left;
+	apu->pan[chan][1] = right;
+}
+
+/**
+ * Sets a function to be called at the start of every frame run by apu_run(). The hook may write to
+ * APU registers.
+ * @param apu APU instance
+ * @param hook Function to call (pass NULL to disable)
+ * @param userdata Pointer passed to the hook
+ */
+void
+apu_set_frame_hook( Apu *apu, ApuFrameHook hook, void *userdata )
+{
+	apu->frame_hook			= hook;
+	apu->frame_hook_data	= userdata;
+	apu->frame_hook_ctr		= 0;
+}
+
+/**
+ * Sets a function to be called on every register write, with the cycle the write lands on, before
+ * the write takes effect. Writes queued with apu_write_at() are passed on when they are rendered.
+ * @param apu APU instance
+ * @param hook Function to call (pass NULL to disable)
+ * @param userdata Pointer passed to the hook
+ */
+void
+apu_set_write_hook( Apu *apu, ApuWriteHook hook, void *userdata )
+{
+	apu->write_hook			= hook;
+	apu->write_hook_data	= userdata;
+}
+
+/**
+ * Sets the output sample rate and low pass filter quality preset, redesigning the output filters
+ * to match. Clears any output filter state.
+ * @param apu APU instance
+ * @param sample_rate Output sample rate, from APU_SAMPLE_RATE_MIN to APU_SAMPLE_RATE_MAX
+ * @param quality Low pass filter preset for APU_OUTPUT_FIR (APU_QUALITY_*)
+ * @return 0 on success, -1 if the sample rate or preset is not supported
+ */
+int
+apu_set_sample_rate( Apu *apu, int sample_rate, int quality )
+{
+	if ( sample_rate < APU_SAMPLE_RATE_MIN || sample_rate > APU_SAMPLE_RATE_MAX )
+		return -1;
+	if ( quality < APU_QUALITY_DRAFT || quality > APU_QUALITY_MASTERING )
+		return -1;
+
+	apu->sample_rate	= sample_rate;
+	apu->quality		= quality;
+
+	design_filters( apu );
+	return 0;
+}
+
+/**
+ * Selects how the DAC output is filtered and resampled to the output rate. APU_OUTPUT_FIR runs a
+ * high pass and a low pass FIR at the CPU clock rate. APU_OUTPUT_BLEP only does work when the DAC
+ * output changes, injecting a band-limited step which is integrated and high passed at the output
+ * rate. APU_OUTPUT_DECIM runs an integer CIC at the CPU clock rate followed by half-band and
+ * fractional resampling stages (see decim.h). APU_OUTPUT_FIXED is APU_OUTPUT_FIR in integer
+ * arithmetic, with 16-bit samples as its native output (see apu_run_s16() and firq.h for how far
+ * it can stray from APU_OUTPUT_FIR).
+ * @param apu APU instance
+ * @param output Output engine (APU_OUTPUT_*)
+ * @return 0 on success, -1 if the output engine is not supported
+ */
+int
+apu_set_output( Apu *apu, int output )
+{
+	if ( output < APU_OUTPUT_FIR || output > APU_OUTPUT_FIXED )
+		return -1;
+	if ( output == apu->output )
+		return 0;
+
+	if ( output == APU_OUTPUT_FIR )
+		fir_clear( &apu->fir );
+	else if ( output == APU_OUTPUT_FIXED )
+		firq_clear( &apu->firq );
+	else if ( output == APU_OUTPUT_BLEP )
+		blip_clear( &apu->blip );
+	else if ( output == APU_OUTPUT_DECIM )
+		decim_clear( &apu->decim );
+
+	apu->output = output;
+	return 0;
+}
+
+/**
+ * Selects how the channel levels are combined into the DAC output. APU_MIXER_FORMULA evaluates the
+ * nonlinear mixer formula every cycle. APU_MIXER_EXACT reads the same values from tables covering
+ * every combination of levels, and APU_MIXER_LINEAR reads the linearized approximation.
+ * @param apu APU instance
+ * @param mixer Mixer mode (APU_MIXER_*)
+ * @return 0 on success, -1 if the mixer mode is not supported
+ */
+int
+apu_set_mixer( Apu *apu, int mixer )
+{
+	if ( mixer < APU_MIXER_FORMULA || mixer > APU_MIXER_EXACT )
+		return -1;
+
+	apu->mixer = mixer;
+	return 0;
+}
+
+/**
+ * Queues a register write to be applied right before the given CPU cycle is run. Writes must be
+ * queued in cycle order; a write for a cycle that has already been run is applied before the next
+ * one. Not thread safe, see apu_set_write_queue() for feeding writes from another thread.
+ * @param apu APU instance
+ * @param cycle CPU cycle to apply the write on (as counted by apu_cycle())
+ * @param reg Target register
+ * @param val Value to write
+ * @return 0 on success, -1 if the queue is full or another queue is being used
+ */
+int
+apu_write_at( Apu *apu, uint64_t cycle, uint_fast16_t reg, uint8_t val )
+{
+	const ApuWrite w = { cycle, reg, val };
+
+	if ( apu->writes != apu->own_writes )
+		return -1;
+
+	return spsc_push( apu->own_writes, &w );
+}
+
+/**
+ * Takes queued writes from a queue filled by another thread instead of apu_write_at(). The APU
+ * renders up to the queue's published horizon and no further, so the producer can run ahead of
+ * the APU on another core. The APU is the queue's only consumer.
+ * @param apu APU instance
+ * @param queue Queue to consume (pass NULL to go back to apu_write_at())
+ */
+void
+apu_set_write_queue( Apu *apu, SpscQueue *queue )
+{
+	apu->writes = ( queue != NULL ) ? queue : apu->own_writes;
+}
+
+/**
+ * Returns the number of CPU cycles run since the APU was reset
+ * @param apu APU instance
+ * @return CPU cycle count
+ */
+uint64_t
+apu_cycle( const Apu *apu )
+{
+	return apu->cycle;
+}
+
+/**
+ * Returns the status of the frame counter and DMC interrupts
+ * @param apu APU instance
+ * @return Nonzero if an IRQ is pending
+ */
+unsigned int
+apu_irq( const Apu *apu )
+{
+	return apu->frame_ctr_irq_flag | apu->dmc_irq_flag;
+}
+
+/**
+ * Writes to an APU register and handles side-effects of the write
+ * @param apu APU instance
+ * @param reg Target register
+ * @param val Value to write to register
+ */
+void
+apu_write( Apu *apu, uint_fast16_t reg, uint8_t val )
+{
+	TRACE_EVENT( TRACE_WRITE, apu->cycle, reg, val );
+
+	if ( apu->write_hook != NULL )
+		apu->write_hook( apu->write_hook_data, apu->cycle, reg, val );
+
+	apu->regs[reg] = val;
+
+	// update state variables
+	switch ( reg )
+	{
+	case APU_SQ1VOL:
+		apu->chans[0].sequencer_tab = duty_seq_tab[val >> 6];
+		apu->chans[0].env.loop = ( val & 0x20 ) != 0;
+		apu->chans[0].len.halt = ( val & 0x20 ) != 0;
+		apu->chans[0].env.constant = ( val & 0x10 ) != 0;
+		apu->chans[0].env.period = val & 0x0f;
+		break;
+	case APU_SQ1SWEEP:
+		apu->chans[0].sweep.reload = 1;
+		apu->chans[0].sweep.enabled = ( val & 0x80 ) != 0;
+		apu->chans[0].sweep.period = ( val >> 4 ) & 7;
+		apu->chans[0].sweep.negate = ( val & 0x08 ) != 0;
+		apu->chans[0].sweep.shift = val & 7;
+		break;
+	case APU_SQ1LO:
+		apu->chans[0].freq = get_period( apu, 0 );
+		apu->chans[0].sweep.target = apu->chans[0].freq;
+		break;
+	case APU_SQ1HI:
+		apu->chans[0].freq = get_period( apu, 0 );
+		apu->chans[0].sweep.target = apu->chans[0].freq;
+		apu->chans[0].env.start = 1;
+
+		if ( apu->regs[APU_SNDCHN] & 1 )
+			apu->chans[0].len.ctr = len_ctr_tab[val >> 3];
+
+		// sequencer is reset by write to $4003
+		apu->chans[0].timer = apu->chans[0].freq;
+		apu->chans[0].index = 0;
+		break;
+
+	case APU_SQ2VOL:
+		apu->chans[1].sequencer_tab = duty_seq_tab[val >> 6];
+		apu->chans[1].env.loop = ( val & 0x20 ) != 0;
+		apu->chans[1].len.halt = ( val & 0x20 ) != 0;
+		apu->chans[1].env.constant = ( val & 0x10 ) != 0;
+		apu->chans[1].env.period = val & 0x0f;
+		break;
+	case APU_SQ2SWEEP:
+		apu->chans[1].sweep.reload = 1;
+		apu->chans[1].sweep.enabled = ( val & 0x80 ) != 0;
+		apu->chans[1].sweep.period = ( val >> 4 ) & 7;
+		apu->chans[1].sweep.negate = ( val & 0x08 ) != 0;
+		apu->chans[1].sweep.shift = val & 7;
+		break;
+	case APU_SQ2LO:
+		apu->chans[1].freq = get_period( apu, 1 );
+		apu->chans[1].sweep.target = apu->chans[1].freq;
+		break;
+	case APU_SQ2HI:
+		apu->chans[1].freq = get_period( apu, 1 );
+		apu->chans[1].sweep.target = apu->chans[1].freq;
+		apu->chans[1].env.start = 1;
+
+		if ( apu->regs[APU_SNDCHN] & 2 )
+			apu->chans[1].len.ctr = len_ctr_tab[val >> 3];
+
+		// sequencer is reset by write to $4003
+		apu->chans[1].timer = apu->chans[1].freq;
+		apu->chans[1].index = 0;
+		break;
+
+	case APU_TRILINEAR:
+		apu->chans[2].len.halt = ( val & 0x80 ) != 0;
+		apu->linear_ctr = val & 0x7f;
+		break;
+	case APU_TRILO:
+		apu->chans[2].freq = get_period( apu, 2 );
+		break;
+	case APU_TRIHI:
+		apu->chans[2].freq = get_period( apu, 2 );
+
+		if ( apu->regs[APU_SNDCHN] & 4 )
+			apu->chans[2].len.ctr = len_ctr_tab[val >> 3];
+
+		apu->linear_reload = 1;
+		break;
+
+	case APU_NOIVOL:
+		apu->chans[3].env.loop = ( val & 0x20 ) != 0;
+		apu->chans[3].len.halt = ( val & 0x20 ) != 0;
+		apu->chans[3].env.constant = ( val & 0x10 ) != 0;
+		apu->chans[3].env.period = val & 0x0f;
+		break;
+	case APU_NOIFREQ:
+		if ( apu->chans[3].mode != ( ( val & 0x80 ) != 0 ) )
+			apu->noi_pos = noise_convert( apu->noise, apu->chans[3].mode, !apu->chans[3].mode, apu->noi_pos );
+
+		apu->chans[3].mode = ( val & 0x80 ) != 0;
+		apu->chans[3].freq = noi_period_tab[val & 0x0f];
+		break;
+	case APU_NOILEN:
+		apu->chans[3].env.start = 1;
+
+		if ( apu->regs[APU_SNDCHN] & 8 )
+			apu->chans[3].len.ctr = len_ctr_tab[val >> 3];
+
+		break;
+
+	case APU_DMCFREQ:
+		apu->chans[4].mode = ( val & 0x40 ) != 0;
+		apu->chans[4].freq = dmc_period_tab[val & 0x0f] - 1;
+		apu->dmc_irq_enable = ( val & 0x80 ) != 0;
+
+		if ( !apu->dmc_irq_enable )
+			apu->dmc_irq_flag = 0;
+		break;
+	case APU_DMCRAW:
+		apu->dmc_lvl = val & 0x7f;
+		break;
+	case APU_DMCADDR:
+		apu->dmc_adr = 0xc000 + ( val << 6 );
+		break;
+	case APU_DMCLEN:
+		apu->dmc_len = ( val << 4 ) + 1;
+		break;
+
+	case APU_SNDCHN:
+		apu->chans[0].mute = ( val & 0x01 ) == 0;
+		if ( !( val & 0x01 ) )
+			apu->chans[0].len.ctr = 0;
+
+		apu->chans[1].mute = ( val & 0x02 ) == 0;
+		if ( !( val & 0x02 ) )
+			apu->chans[1].len.ctr = 0;
+
+		apu->chans[2].mute = ( val & 0x04 ) == 0;
+		if ( !( val & 0x04 ) )
+			apu->chans[2].len.ctr = 0;
+
+		apu->chans[3].mute = ( val & 0x08 ) == 0;
+		if ( !( val & 0x08 ) )
+			apu->chans[3].len.ctr = 0;
+
+		if ( !( val & 0x10 ) )
+			apu->dmc_len_internal = 0;
+		else if ( apu->dmc_len_internal == 0 )
+		{
+			apu->dmc_len_internal = apu->dmc_len;
+			apu->dmc_adr_internal = apu->dmc_adr;
+		}
+
+		apu->dmc_irq_flag = 0;
+		break;
+
+	case APU_APUFRAME:
+		if ( apu->frame_ctr_cycle & 1 )
+			apu->frame_ctr_restart_ctr = 3;
+		else
+			apu->frame_ctr_restart_ctr = 4;
+
+		apu->frame_ctr_mode = val >> 7;
+		apu->frame_ctr_irq_inhibit = ( val & 0x40 ) != 0;
+
+		if ( apu->frame_ctr_irq_inhibit )
+			apu->frame_ctr_irq_flag = 0;
+			
+		break;
+	}
+}
+
+/**
+ * Emulates the behavior of APU registers when read
+ * @param apu APU instance
+ * @param reg Register to read
+ * @return 0 for anything other than $4015, else the status of the IRQ flags and length counters
+ */
+uint8_t
+apu_read( Apu *apu, uint_fast16_t reg )
+{
+	if ( reg == APU_SNDCHN )
+	{
+		int b0 = apu->chans[0].len.ctr > 0;
+		int b1 = apu->chans[1].len.ctr > 0;
+		int b2 = apu->chans[2].len.ctr > 0;
+		int b3 = apu->chans[3].len.ctr > 0;
+		int b4 = apu->dmc_len_internal > 0;
+		int b6 = apu->frame_ctr_irq_flag;
+		int b7 = apu->dmc_irq_flag;
+
+		if ( !apu->frame_ctr_irq_set_now )
+			apu->frame_ctr_irq_flag = 0;
+
+		return b0 | ( b1 << 1 ) | ( b2 << 2 ) | ( b3 << 3 ) | ( b4 << 4 ) | ( b6 << 6 ) | ( b7 << 7 );
+	}
+
+	return 0;
+}
+
+/**
+ * Returns the last value written to an APU register
+ * @param apu APU instance
+ * @param reg Register
+ * @return Value last written to the register
+ */
+uint8_t
+apu_read_internal( const Apu *apu, uint_fast16_t reg )
+{
+	return apu->regs[reg];
+}
+
+/**
+ * Writes a save state: a header with the output configuration, the emulation state, then the
+ * running state of the selected output engine. Filter designs are not saved, they are rebuilt from
+ * the configuration on load.
+ * @param apu APU instance
+ * @param w State writer
+ */
+static void
+save_state( const Apu *apu, StateWriter *w )
+{
+	const uint32_t header[7] = {
+		STATE_MAGIC, STATE_VERSION, STATE_CORE_SIZE,
+		apu->output, apu->sample_rate, apu->quality, apu->mixer
+	};
+	uint8_t core[STATE_CORE_SIZE];
+
+	memcpy( core, (const uint8_t *)apu + STATE_CORE_START, STATE_CORE_SIZE );
+
+	// the sequencer table pointers are rebuilt from the registers on load, so leave them out to
+	// keep states from identical runs identical
+
+	for ( int i = 0; i < 5; i++ )
+	{
+		size_t at = offsetof( Apu, chans ) + i * sizeof(ApuChan) + offsetof( ApuChan, sequencer_tab );
+
+		memset( &core[at - STATE_CORE_START], 0, sizeof(apu->chans[i].sequencer_tab) );
+	}
+
+	state_write( w, header, sizeof(header) );
+	state_write( w, core, sizeof(core) );
+
+	if ( apu->output == APU_OUTPUT_FIR )
+		fir_save_state( &apu->fir, w );
+	else if ( apu->output == APU_OUTPUT_FIXED )
+		firq_save_state( &apu->firq, w );
+	else if ( apu->output == APU_OUTPUT_BLEP )
+		blip_save_state( &apu->blip, w );
+	else if ( apu->output == APU_OUTPUT_DECIM )
+		decim_save_state( &apu->decim, w );
+}
+
+/**
+ * Returns the size of a save state of an APU instance in its current configuration
+ * @param apu APU instance
+ * @return Size of save state in bytes
+ */
+size_t
+apu_state_size( const Apu *apu )
+{
+	StateWriter w = { NULL, 0 };
+
+	save_state( apu, &w );
+	return w.pos;
+}
+
+/**
+ * Saves the emulation state of an APU instance, including its output filter state, so that it can
+ * be restored with apu_load_state() and carry on producing exactly the same output. Save states
+ * are specific to the build they were made with. The memory view, frame hook, write queue and stem
+ * settings are not part of the state.
+ * @param apu APU instance
+ * @param buf Buffer to write the state to
+ * @param size Size of buf in bytes
+ * @return Size of the state in bytes, or 0 if buf is too small (see apu_state_size())
+ */
+size_t
+apu_save_state( const Apu *apu, void *buf, size_t size )
+{
+	StateWriter w = { buf, 0 };
+
+	if ( size < apu_state_size( apu ) )
+		return 0;
+
+	save_state( apu, &w );
+	return w.pos;
+}
+
+/**
+ * Checks the core of a loaded state for values the emulation uses as table indexes or relies on
+ * staying in range, so a damaged state cannot make it read out of bounds
+ * @param apu APU instance the core was loaded into
+ * @return 1 if all values are in range, 0 if not
+ */
+static int
+core_state_valid( const Apu *apu )
+{
+	static const uint8_t sequencer_len[3] = { 7, 7, 31 };
+	static const uint8_t sequencer_max[3] = { 1, 1, 15 };
+
+	for ( int i = 0; i < 4; i++ )
+	{
+		const ApuChan *ch = &apu->chans[i];
+
+		if ( ch->env.period > 15 || ch->env.level > 15 || ch->sweep.shift > 7 )
+			return 0;
+		if ( i < 3 && ( ch->sequencer_len != sequencer_len[i] || ch->sequencer_val > sequencer_max[i] ) )
+			return 0;
+	}
+
+	if ( apu->chans[3].mode > 1 || apu->noi_pos >= NOISE_STATES || apu->feedback > 1 )
+		return 0;
+	if ( apu->dmc_lvl > 127 || apu->dmc_bit > 7 )
+		return 0;
+
+	return apu->frame_ctr_mode <= 1 && apu->frame_ctr_cycle >= 0 && apu->frame_ctr_cycle <= 32781;
+}
+
+/**
+ * Restores a state saved with apu_save_state(). The output engine, mixer, sample rate and quality
+ * preset are switched to the ones the state was saved with. Writes queued with apu_write_at() are
+ * dropped and stems restart from silence.
+ * @param apu APU instance
+ * @param buf Save state
+ * @param size Size of save state in bytes
+ * @return 0 on success, -1 if the state is invalid or from another build (the APU is reset if
+ * the state turns out to be invalid after the configuration was changed)
+ */
+int
+apu_load_state( Apu *apu, const void *buf, size_t size )
+{
+	StateReader r = { buf, size, 0, 0 };
+	uint32_t header[7];
+
+	state_read( &r, header, sizeof(header) );
+
+	if ( r.error || header[0] != STATE_MAGIC || header[1] != STATE_VERSION ||
+			header[2] != STATE_CORE_SIZE )
+		return -1;
+	if ( header[3] > APU_OUTPUT_FIXED || header[6] > APU_MIXER_EXACT )
+		return -1;
+
+	if ( (int)header[4] != apu->sample_rate || (int)header[5] != apu->quality )
+	{
+		if ( apu_set_sample_rate( apu, header[4], header[5] ) != 0 )
+			return -1;
+	}
+
+	apu_set_output( apu, (int)header[3] );
+	apu_set_mixer( apu, (int)header[6] );
+
+	state_read( &r, (uint8_t *)apu + STATE_CORE_START, STATE_CORE_SIZE );
+
+	int ret = -1;
+
+	if ( apu->output == APU_OUTPUT_FIR )
+		ret = fir_load_state( &apu->fir, &r );
+	else if ( apu->output == APU_OUTPUT_FIXED )
+		ret = firq_load_state( &apu->firq, &r );
+	else if ( apu->output == APU_OUTPUT_BLEP )
+		ret = blip_load_state( &apu->blip, &r );
+	else if ( apu->output == APU_OUTPUT_DECIM )
+		ret = decim_load_state( &apu->decim, &r );
+
+	if ( ret != 0 || r.error || r.pos != size || !core_state_valid( apu ) )
+	{
+		apu_reset( apu );
+		return -1;
+	}
+
+	apu->chans[0].sequencer_tab = duty_seq_tab[apu->regs[APU_SQ1VOL] >> 6];
+	apu->chans[1].sequencer_tab = duty_seq_tab[apu->regs[APU_SQ2VOL] >> 6];
+	apu->chans[2].sequencer_tab = tri_seq_tab;
+	apu->chans[3].sequencer_tab = NULL;
+	apu->chans[4].sequencer_tab = NULL;
+
+	if ( apu->stems != NULL )
+		stems_clear( apu->stems );
+
+	spsc_clear( apu->own_writes );
+	spsc_publish( apu->own_writes, UINT64_MAX );
+	return 0;
+}
+
+/**
+ * Resets an APU instance to its power-on state. The memory view, frame and write hooks, output
+ * engine, sample rate and quality preset are kept.
+ * @param apu APU instance
+ */
+void
+apu_reset( Apu *apu )
+{
+	const uint8_t * const *mem = apu->mem;
+	ApuFrameHook hook = apu->frame_hook;
+	void *hook_data = apu->frame_hook_data;
+	ApuWriteHook write_hook = apu->write_hook;
+	void *write_hook_data = apu->write_hook_data;
+	int output = apu->output;
+	int mixer = apu->mixer;
+	const MixerTables *tables = apu->mixer_tables;
+	const NoiseTables *noise = apu->noise;
+	const SimdKernels *kernels = apu->kernels;
+	int sample_rate = apu->sample_rate;
+	int quality = apu->quality;
+	Stems *stems = apu->stems;
+	SpscQueue *own_writes = apu->own_writes;
+	SpscQueue *writes = apu->writes;
+	float pan[APU_STEMS][2];
+
+	memcpy( pan, apu->pan, sizeof(pan) );
+
+	memset( apu, 0, sizeof(*apu) );
+	apu->mem				= mem;
+	apu->frame_hook			= hook;
+	apu->frame_hook_data	= hook_data;
+	apu->write_hook			= write_hook;
+	apu->write_hook_data	= write_hook_data;
+	apu->output				= output;
+	apu->mixer				= mixer;
+	apu->mixer_tables		= tables;
+	apu->noise				= noise;
+	apu->kernels			= kernels;
+	apu->sample_rate		= sample_rate;
+	apu->quality			= quality;
+	apu->stems				= stems;
+	apu->own_writes			= own_writes;
+	apu->writes				= writes;
+
+	memcpy( apu->pan, pan, sizeof(pan) );
+
+	// writes queued with apu_write_at() never have to be waited for
+
+	spsc_clear( apu->own_writes );
+	spsc_publish( apu->own_writes, UINT64_MAX );
+
+	design_filters( apu );
+
+	for ( int i = 0; i < 0x14; i++ )
+		apu_write( apu, i, 0 );
+
+	apu->chans[0].is_sq1		= 1;
+
+	apu->chans[0].sequencer_val	= apu->chans[0].sequencer_tab[0];
+	apu->chans[0].sequencer_len	= 7;
+	apu->chans[1].sequencer_val	= apu->chans[1].sequencer_tab[0];
+	apu->chans[1].sequencer_len	= 7;
+
+	apu->chans[2].sequencer_tab	= tri_seq_tab;
+	apu->chans[2].sequencer_val	= apu->chans[2].sequencer_tab[0];
+	apu->chans[2].sequencer_len	= 31;
+
+	apu->noi_pos = apu->noise->pos[apu->chans[3].mode][1];
+
+	apu->dmc_adr_internal		= 0xc000;
+	apu->dmc_len_internal		= 0;
+	apu->chans[4].freq			= dmc_period_tab[0] - 1;
+}
+
+/**
+ * Allocates and resets a new APU instance. Instances share no mutable state, so separate
+ * instances may be run on separate threads. Output is at 48 kHz and standard quality until changed
+ * with apu_set_sample_rate().
+ * @param mem Page table of the CPU address space that DMC sample fetches read from (BUS_PAGES
+ * pointers to BUS_PAGE_SIZE bytes, see bus.h). Only the table pointer is kept, so bank switches
+ * made in the table are seen by the next fetch.
+ * @return New APU instance, or NULL if allocation failed
+ */
+Apu *
+apu_create( const uint8_t * const *mem )
+{
+	Apu *apu = malloc( sizeof(Apu) );
+
+	if ( apu == NULL )
+		return NULL;
+
+	apu->own_writes = spsc_create( APU_WRITE_QUEUE_SIZE );
+
+	if ( apu->own_writes == NULL )
+	{
+		free( apu );
+		return NULL;
+	}
+
+	apu->writes				= apu->own_writes;
+
+	apu->mem				= mem;
+	apu->frame_hook			= NULL;
+	apu->frame_hook_data	= NULL;
+	apu->write_hook			= NULL;
+	apu->write_hook_data	= NULL;
+	apu->output				= APU_OUTPUT_FIR;
+	apu->mixer				= DEFAULT_MIXER;
+	apu->mixer_tables		= mixer_tables();
+	apu->noise				= noise_tables();
+	apu->kernels			= simd_best();
+	apu->stems				= NULL;
+
+	for ( int i = 0; i < APU_STEMS; i++ )
+	{
+		apu->pan[i][0] = 1.0f;
+		apu->pan[i][1] = 1.0f;
+	}
+
+	apu->sample_rate		= DEFAULT_RATE;
+	apu->quality			= APU_QUALITY_STANDARD;
+	apu_reset( apu );
+	return apu;
+}
+
+/**
+ * Frees an APU instance
+ * @param apu APU instance
+ */
+void
+apu_destroy( Apu *apu )
+{
+	apu_set_stems( apu, 0 );
+	spsc_destroy( apu->own_writes );
+	free( apu );
 }
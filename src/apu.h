@@ -1,6 +1,7 @@
 #ifndef APU_H
 #define APU_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #define APU_SQ1VOL		0x00
@@ -29,10 +30,65 @@
 #define APU_SNDCHN		0x15
 #define APU_APUFRAME	0x17
 
-void 		apu_init();
-void		apu_write( uint_fast16_t reg, uint8_t val );
-int			apu_clock( float *sample_out, unsigned int *irq_out );
-uint8_t		apu_read( uint_fast16_t reg );
-uint8_t		apu_read_internal( uint_fast16_t reg );
+#define APU_FRAME_CYCLES	29781			// CPU cycles per NTSC video frame
+
+#define APU_OUTPUT_FIR		0				// high pass and FIR low pass at the CPU clock rate
+#define APU_OUTPUT_BLEP		1				// band-limited steps, filtered at the output rate
+#define APU_OUTPUT_DECIM	2				// CIC, half-band and fractional resampler stages
+#define APU_OUTPUT_FIXED	3				// integer high pass and FIR low pass, native int16 output
+
+#define APU_MIXER_FORMULA	0				// nonlinear mixer formula, evaluated every cycle
+#define APU_MIXER_LINEAR	1				// linearized lookup approximation
+#define APU_MIXER_EXACT		2				// nonlinear mixer formula, precomputed for every level
+
+#define APU_STEMS			5				// per-channel stems: pulse 1, pulse 2, triangle, noise, DMC
+
+#define APU_QUALITY_DRAFT		0			// 29-tap low pass
+#define APU_QUALITY_STANDARD	1			// 57-tap low pass
+#define APU_QUALITY_MASTERING	2			// 2047-tap low pass
+
+#define APU_SAMPLE_RATE_MIN	8000			// lowest supported output sample rate
+#define APU_SAMPLE_RATE_MAX	192000			// highest supported output sample rate
+
+#define APU_WRITE_QUEUE_SIZE	4096		// writes apu_write_at() can hold
+
+typedef struct Apu Apu;
+typedef struct SpscQueue SpscQueue;
+
+typedef struct {
+	uint64_t		cycle;					// CPU cycle the write lands on
+	uint16_t		reg;					// target register
+	uint8_t			val;					// value to write
+} ApuWrite;
+
+typedef void ( *ApuFrameHook )( void *userdata );
+typedef void ( *ApuWriteHook )( void *userdata, uint64_t cycle, uint_fast16_t reg, uint8_t val );
+
+Apu *		apu_create( const uint8_t * const *mem );
+void		apu_destroy( Apu *apu );
+void		apu_reset( Apu *apu );
+void		apu_write( Apu *apu, uint_fast16_t reg, uint8_t val );
+int			apu_write_at( Apu *apu, uint64_t cycle, uint_fast16_t reg, uint8_t val );
+void		apu_set_write_queue( Apu *apu, SpscQueue *queue );
+uint64_t	apu_cycle( const Apu *apu );
+int			apu_clock( Apu *apu, float *sample_out, unsigned int *irq_out );
+size_t		apu_run( Apu *apu, size_t max_cycles, float *samples_out, size_t max_samples, size_t *samples_written );
+size_t		apu_run_s16( Apu *apu, size_t max_cycles, int16_t *samples_out, size_t max_samples, size_t *samples_written );
+size_t		apu_skip( Apu *apu, size_t max_cycles );
+size_t		apu_cycles_until_samples( const Apu *apu, size_t samples, size_t max_cycles );
+size_t		apu_run_stems( Apu *apu, size_t max_cycles, float *samples_out, float *stems_out, float *stereo_out, size_t max_samples, size_t *samples_written );
+int			apu_set_stems( Apu *apu, int enable );
+void		apu_set_pan( Apu *apu, int chan, float left, float right );
+void		apu_set_frame_hook( Apu *apu, ApuFrameHook hook, void *userdata );
+void		apu_set_write_hook( Apu *apu, ApuWriteHook hook, void *userdata );
+int			apu_set_output( Apu *apu, int output );
+int			apu_set_mixer( Apu *apu, int mixer );
+int			apu_set_sample_rate( Apu *apu, int sample_rate, int quality );
+size_t		apu_state_size( const Apu *apu );
+size_t		apu_save_state( const Apu *apu, void *buf, size_t size );
+int			apu_load_state( Apu *apu, const void *buf, size_t size );
+unsigned int	apu_irq( const Apu *apu );
+uint8_t		apu_read( Apu *apu, uint_fast16_t reg );
+uint8_t		apu_read_internal( const Apu *apu, uint_fast16_t reg );
 
 #endif // APU_H
@@ -1,64 +1,152 @@
+#include <stdint.h>
 #include <stdlib.h>
 
 #include "audio.h"
 #include "apu.h"
-#include "ppmck_driver.h"
+#include "profile.h"
+#include "trace.h"
 #include "wav_file.h"
 #include "SDL2/SDL_audio.h"
 
-float sample_buffer[SAMPLE_RATE / 60];
+float sample_buffer[APU_SAMPLE_RATE_MAX / 60];
+size_t sample_buffer_len;
 static SDL_AudioDeviceID device;
+static Apu *apu;
+
+#ifdef AUDIO_OUTPUT_S16
+static int16_t s16_buffer[APU_SAMPLE_RATE_MAX / 60];
+#endif
 
 FILE *audio_out;
 
+static void
+driver_tick( void *userdata )
+{
+	PROFILE_ENTER( PROFILE_DRIVER );
+	sound_driver_start( userdata );
+	PROFILE_LEAVE();
+}
+
+/**
+ * Submits samples to the audio device. When tracing, also records the submission, and an underrun
+ * if the device had already played out everything queued before
+ * @param samples Samples in the device's format
+ * @param size Size of samples in bytes
+ */
+static void
+queue_audio( const void *samples, Uint32 size )
+{
+#ifdef APU_TRACE
+	static int started = 0;
+	const Uint32 queued = SDL_GetQueuedAudioSize( device );
+
+	if ( started && queued == 0 )
+		TRACE_EVENT( TRACE_UNDERRUN, apu_cycle( apu ), 0, 0 );
+
+	TRACE_EVENT( TRACE_AUDIO_QUEUE, apu_cycle( apu ), size, queued );
+	started = 1;
+#endif
+
+	SDL_QueueAudio( device, samples, size );
+}
+
+#ifdef AUDIO_OUTPUT_S16
+
 void
 audio_run_2a03()
 {
-	static int cpu_cycle = 0;
+	const size_t size = sample_buffer_len * sizeof(int16_t);
 
-	if ( SDL_GetQueuedAudioSize( device ) > sizeof(sample_buffer) )
+	if ( SDL_GetQueuedAudioSize( device ) > size )
 		return;
 
-	size_t i = 0;
+	apu_run_s16( apu, SIZE_MAX, s16_buffer, sample_buffer_len, NULL );
 
-	while ( i < sizeof(sample_buffer) / sizeof(float) )
-	{
-		if ( apu_clock( &sample_buffer[i], NULL ) )
-			i++;
+	PROFILE_ENTER( PROFILE_QUEUE );
+	queue_audio( s16_buffer, size );
+	PROFILE_LEAVE();
 
-		if ( cpu_cycle == 0 )
-			sound_driver_start();
+	PROFILE_ENTER( PROFILE_WAV );
+	wav_file_write_samples( audio_out, s16_buffer, size );
+	PROFILE_LEAVE();
 
-		if ( cpu_cycle++ == 29780 )
-			cpu_cycle = 0;
-	}
+	// the oscilloscope still draws from sample_buffer
+
+	for ( size_t i = 0; i < sample_buffer_len; i++ )
+		sample_buffer[i] = s16_buffer[i] / 32768.0f;
+}
+
+#else
 
-	SDL_QueueAudio( device, sample_buffer, sizeof(sample_buffer) );
-	wav_file_write_samples( audio_out, sample_buffer, sizeof(sample_buffer) );
+void
+audio_run_2a03()
+{
+	const size_t size = sample_buffer_len * sizeof(float);
+
+	if ( SDL_GetQueuedAudioSize( device ) > size )
+		return;
+
+	apu_run( apu, SIZE_MAX, sample_buffer, sample_buffer_len, NULL );
+
+	PROFILE_ENTER( PROFILE_QUEUE );
+	queue_audio( sample_buffer, size );
+	PROFILE_LEAVE();
+
+	PROFILE_ENTER( PROFILE_WAV );
+	wav_file_write_samples( audio_out, sample_buffer, size );
+	PROFILE_LEAVE();
 }
 
+#endif
+
 void
-audio_init()
+audio_init( Apu *apu_2a03, Ppmck *driver, int sample_rate, int quality )
 {
 	static SDL_AudioSpec *desired, *got;
 
 	desired	= malloc( sizeof(SDL_AudioSpec) );
 	got		= malloc( sizeof(SDL_AudioSpec) );
 
-	desired->freq		= SAMPLE_RATE;
+	desired->freq		= sample_rate;
+#ifdef AUDIO_OUTPUT_S16
+	desired->format		= AUDIO_S16SYS;
+#else
 	desired->format		= AUDIO_F32SYS;
+#endif
 	desired->channels	= 1;
-	desired->samples	= sizeof(sample_buffer) / sizeof(float);
+	desired->samples	= sample_rate / 60;
 	desired->callback	= NULL;
 	desired->userdata	= NULL;
 
-	device = SDL_OpenAudioDevice( NULL, 0, desired, got, 0 );
+	device = SDL_OpenAudioDevice( NULL, 0, desired, got, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE );
+	sample_rate = got->freq;
 	free( desired );
 	free( got );
 
-	sound_init();
+	if ( device == 0 )
+	{
+		fprintf( stderr, "%s: Could not open audio device: %s\n", __func__, SDL_GetError() );
+		exit( EXIT_FAILURE );
+	}
+
+	apu = apu_2a03;
+
+	if ( apu_set_sample_rate( apu, sample_rate, quality ) != 0 )
+	{
+		fprintf( stderr, "%s: Unsupported sample rate %d Hz\n", __func__, sample_rate );
+		exit( EXIT_FAILURE );
+	}
+
+	sample_buffer_len = sample_rate / 60;
+	sound_init( driver, apu );
+	apu_set_frame_hook( apu, driver_tick, driver );
 
-	audio_out = wav_file_open( "audio_out.wav", SAMPLE_RATE, WAV_FMT_PCM_FLOAT, 32, 1 );
+#ifdef AUDIO_OUTPUT_S16
+	apu_set_output( apu, APU_OUTPUT_FIXED );
+	audio_out = wav_file_open( "audio_out.wav", sample_rate, WAV_FMT_PCM_INT, 16, 1 );
+#else
+	audio_out = wav_file_open( "audio_out.wav", sample_rate, WAV_FMT_PCM_FLOAT, 32, 1 );
+#endif
 }
 
 void
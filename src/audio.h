@@ -5,10 +5,14 @@
 
 #include <stdio.h>
 
-extern float sample_buffer[SAMPLE_RATE / 60];
+#include "apu.h"
+#include "ppmck_driver.h"
+
+extern float sample_buffer[APU_SAMPLE_RATE_MAX / 60];
+extern size_t sample_buffer_len;
 extern FILE *audio_out;
 
-void audio_init();
+void audio_init( Apu *apu_2a03, Ppmck *driver, int sample_rate, int quality );
 void audio_start_playback();
 void audio_run_2a03();
 
@@ -0,0 +1,279 @@
+#include <math.h>
+#include <string.h>
+
+#include "blip.h"
+
+#define BLIP_CUTOFF		0.42					// step kernel cutoff as a fraction of the output rate
+#define BLIP_ONE		( (uint64_t)1 << 32 )	// one output sample in 32.32 fixed point
+
+/**
+ * Band-limited impulse: Blackman-windowed sinc spanning BLIP_TAPS output samples
+ * @param x Time relative to the center of the impulse in output samples
+ * @return Impulse value
+ */
+static double
+impulse( double x )
+{
+	double t = x / ( BLIP_TAPS / 2 );
+	double s = ( x == 0.0 ) ? 1.0 : sin( M_PI * 2 * BLIP_CUTOFF * x ) / ( M_PI * 2 * BLIP_CUTOFF * x );
+
+	if ( t <= -1.0 || t >= 1.0 )
+		return 0.0;
+
+	return s * ( 0.42 + 0.5 * cos( M_PI * t ) + 0.08 * cos( M_PI * 2 * t ) );
+}
+
+/**
+ * Sets up a band-limited step buffer
+ * @param b Buffer
+ * @param clock_rate Input clock rate
+ * @param sample_rate Output sample rate
+ * @param hp_cutoff Cutoff frequency of the DC blocking high pass applied to the output
+ */
+void
+blip_init( Blip *b, double clock_rate, double sample_rate, double hp_cutoff )
+{
+	// row p holds the impulse for a step that lands p / BLIP_PHASES of the way between the last
+	// output sample and the next one. rows are normalized so that every step settles at its full
+	// height once integrated
+
+	for ( int p = 0; p <= BLIP_PHASES; p++ )
+	{
+		double frac = (double)p / BLIP_PHASES;
+		double sum = 0.0;
+
+		for ( int j = 0; j < BLIP_TAPS; j++ )
+			sum += impulse( j + 1 - frac - BLIP_TAPS / 2 );
+
+		for ( int j = 0; j < BLIP_TAPS; j++ )
+			b->kernel[p][j] = impulse( j + 1 - frac - BLIP_TAPS / 2 ) / sum;
+	}
+
+	double rc = 1.0 / ( M_PI * 2 * hp_cutoff );
+	double dt = 1.0 / sample_rate;
+
+	b->factor	= (uint64_t)( sample_rate / clock_rate * BLIP_ONE );
+	b->hp_coeff	= rc / ( rc + dt );
+
+	blip_clear( b );
+}
+
+/**
+ * Clears all pending output and filter state
+ * @param b Buffer
+ */
+void
+blip_clear( Blip *b )
+{
+	memset( b->acc, 0, sizeof(b->acc) );
+
+	b->read			= 0;
+	b->offset		= 0;
+	b->level		= 0.0f;
+	b->integrator	= 0.0f;
+	b->hp_in_prev	= 0.0f;
+	b->hp_out		= 0.0f;
+}
+
+/**
+ * Clears all buffer state as if the input had been at a level for ever, so that running on from
+ * that level does not cause a pop. The time to the next output sample is kept.
+ * @param b Buffer
+ * @param level Input level
+ */
+void
+blip_prime( Blip *b, float level )
+{
+	const uint64_t offset = b->offset;
+
+	blip_clear( b );
+
+	b->offset		= offset;
+	b->level		= level;
+	b->integrator	= level;
+	b->hp_in_prev	= level;
+}
+
+/**
+ * Moves the time to the next output sample on by a number of input clocks, as running the buffer
+ * for them would, without outputting anything
+ * @param b Buffer
+ * @param clocks Number of input clocks
+ */
+void
+blip_advance( Blip *b, uint64_t clocks )
+{
+	b->offset = ( b->offset + ( clocks & ( BLIP_ONE - 1 ) ) * b->factor ) & ( BLIP_ONE - 1 );
+}
+
+/**
+ * Saves the buffer state. The design is not saved, so it has to match when the state is loaded.
+ * @param b Buffer
+ * @param w State writer
+ */
+void
+blip_save_state( const Blip *b, StateWriter *w )
+{
+	state_write( w, b->acc, sizeof(b->acc) );
+	state_write( w, &b->read, sizeof(b->read) );
+	state_write( w, &b->offset, sizeof(b->offset) );
+	state_write( w, &b->level, sizeof(b->level) );
+	state_write( w, &b->integrator, sizeof(b->integrator) );
+	state_write( w, &b->hp_in_prev, sizeof(b->hp_in_prev) );
+	state_write( w, &b->hp_out, sizeof(b->hp_out) );
+}
+
+/**
+ * Loads the buffer state
+ * @param b Buffer
+ * @param r State reader
+ * @return 0 on success, -1 if the state is truncated
+ */
+int
+blip_load_state( Blip *b, StateReader *r )
+{
+	state_read( r, b->acc, sizeof(b->acc) );
+	state_read( r, &b->read, sizeof(b->read) );
+	state_read( r, &b->offset, sizeof(b->offset) );
+	state_read( r, &b->level, sizeof(b->level) );
+	state_read( r, &b->integrator, sizeof(b->integrator) );
+	state_read( r, &b->hp_in_prev, sizeof(b->hp_in_prev) );
+	state_read( r, &b->hp_out, sizeof(b->hp_out) );
+
+	b->read &= BLIP_BUF_SIZE - 1;
+	return r->error ? -1 : 0;
+}
+
+/**
+ * Adds a band-limited step at the current time if the input level changed
+ * @param b Buffer
+ * @param level New input level
+ */
+static void
+set_level( Blip *b, float level )
+{
+	float delta = level - b->level;
+
+	if ( delta == 0.0f )
+		return;
+
+	b->level = level;
+
+	// position of the step between phases, interpolated linearly
+
+	uint32_t pos	= b->offset >> ( 32 - 16 );
+	uint32_t phase	= ( pos * BLIP_PHASES ) >> 16;
+	float interp	= (float)( ( pos * BLIP_PHASES ) & 0xffff ) / 0x10000;
+	float d0		= delta * ( 1.0f - interp );
+	float d1		= delta * interp;
+
+	const float *k0 = b->kernel[phase];
+	const float *k1 = b->kernel[phase + 1];
+
+	for ( unsigned j = 0; j < BLIP_TAPS; j++ )
+		b->acc[( b->read + j ) & ( BLIP_BUF_SIZE - 1 )] += d0 * k0[j] + d1 * k1[j];
+}
+
+/**
+ * Integrates and high passes the next output sample
+ * @param b Buffer
+ * @return Output sample
+ */
+static float
+read_sample( Blip *b )
+{
+	b->integrator += b->acc[b->read];
+	b->acc[b->read] = 0.0f;
+	b->read = ( b->read + 1 ) & ( BLIP_BUF_SIZE - 1 );
+	b->offset -= BLIP_ONE;
+
+	b->hp_out = b->hp_coeff * ( b->hp_out + b->integrator - b->hp_in_prev );
+	b->hp_in_prev = b->integrator;
+
+	return b->hp_out;
+}
+
+/**
+ * Works out how many input clocks it will take to output a number of samples
+ * @param b Buffer
+ * @param samples Number of samples (at least 1)
+ * @param max_clocks Most clocks to look ahead
+ * @return Clocks until and including the one that outputs the last sample, at most max_clocks
+ */
+size_t
+blip_clocks_until( const Blip *b, size_t samples, size_t max_clocks )
+{
+	// there is never more than one output sample per input clock
+
+	if ( samples > max_clocks )
+		return max_clocks;
+
+	size_t clocks = ( samples * BLIP_ONE - b->offset + b->factor - 1 ) / b->factor;
+
+	return ( clocks < max_clocks ) ? clocks : max_clocks;
+}
+
+/**
+ * Runs the buffer for one input clock. Will output a sample if enough time has passed.
+ * @param b Buffer
+ * @param level Input level for this clock
+ * @param sample_out Buffer to write outputted sample to
+ * @return 1 if a sample was output, otherwise 0
+ */
+int
+blip_clock( Blip *b, float level, float *sample_out )
+{
+	set_level( b, level );
+
+	b->offset += b->factor;
+
+	if ( b->offset >= BLIP_ONE )
+	{
+		*sample_out = read_sample( b );
+		return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Runs the buffer for a number of input clocks at a constant input level. Stops early as soon as
+ * max_samples samples have been output.
+ * @param b Buffer
+ * @param level Input level for these clocks
+ * @param clocks Number of input clocks to run
+ * @param samples_out Buffer to write outputted samples to
+ * @param max_samples Size of samples_out in samples
+ * @param samples_written Pointer to value to add the number of outputted samples to
+ * @return Number of input clocks run
+ */
+size_t
+blip_run( Blip *b, float level, size_t clocks, float *samples_out, size_t max_samples,
+		size_t *samples_written )
+{
+	size_t ran = 0;
+	size_t samples = 0;
+
+	set_level( b, level );
+
+	while ( ran < clocks && samples < max_samples )
+	{
+		// clocks until the next output sample is due
+
+		size_t need = ( BLIP_ONE - b->offset + b->factor - 1 ) / b->factor;
+
+		if ( need > clocks - ran )
+		{
+			b->offset += ( clocks - ran ) * b->factor;
+			ran = clocks;
+			break;
+		}
+
+		b->offset += need * b->factor;
+		ran += need;
+		samples_out[samples++] = read_sample( b );
+	}
+
+	*samples_written += samples;
+	return ran;
+}
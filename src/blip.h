@@ -0,0 +1,39 @@
+#ifndef BLIP_H
+#define BLIP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "state.h"
+
+#define BLIP_TAPS		32						// output samples each step is spread over
+#define BLIP_PHASES		64						// sub-sample positions in step kernel table
+#define BLIP_BUF_SIZE	64						// size of delta ring buffer (power of 2, > BLIP_TAPS)
+
+typedef struct {
+	float			kernel[BLIP_PHASES + 1][BLIP_TAPS];	// band-limited impulse for each phase
+	float			acc[BLIP_BUF_SIZE];		// delta ring buffer
+	uint32_t		read;					// next read position in delta ring buffer
+
+	uint64_t		factor;					// output samples per input clock (32.32 fixed point)
+	uint64_t		offset;					// time since last output sample (32.32 fixed point)
+
+	float			level;					// current input level
+	float			integrator;				// running sum of deltas
+	float			hp_coeff;				// high pass smoothing factor
+	float			hp_in_prev;				// previous input of high pass filter
+	float			hp_out;					// current output of high pass filter
+} Blip;
+
+void	blip_init( Blip *b, double clock_rate, double sample_rate, double hp_cutoff );
+void	blip_clear( Blip *b );
+void	blip_prime( Blip *b, float level );
+void	blip_advance( Blip *b, uint64_t clocks );
+void	blip_save_state( const Blip *b, StateWriter *w );
+int		blip_load_state( Blip *b, StateReader *r );
+size_t	blip_clocks_until( const Blip *b, size_t samples, size_t max_clocks );
+int		blip_clock( Blip *b, float level, float *sample_out );
+size_t	blip_run( Blip *b, float level, size_t clocks, float *samples_out, size_t max_samples,
+		size_t *samples_written );
+
+#endif // BLIP_H
@@ -1,3 +1,58 @@
 #include "bus.h"
 
-uint8_t cpu_bus[0x10000];
+static const uint8_t open_bus[BUS_PAGE_SIZE];	// page for unmapped addresses
+
+/**
+ * Sets up a bus over a ROM image, with banks mapped as by bus_reset()
+ * @param bus Bus
+ * @param rom Image to map banks from
+ */
+void
+bus_init( Bus *bus, const Rom *rom )
+{
+	bus->rom = rom;
+	bus_reset( bus );
+}
+
+/**
+ * Maps the first BUS_ROM_PAGES banks of the image in order from $8000, as a 32 KiB image loaded
+ * there without bank switching would be
+ * @param bus Bus
+ */
+void
+bus_reset( Bus *bus )
+{
+	for ( int i = 0; i < BUS_ROM_PAGE; i++ )
+		bus->pages[i] = open_bus;
+
+	for ( int i = 0; i < BUS_ROM_PAGES; i++ )
+		bus_switch( bus, i, i );
+}
+
+/**
+ * Switches a bank of the image into a page
+ * @param bus Bus
+ * @param page ROM page (0 = $8000, 7 = $f000)
+ * @param bank Bank number
+ */
+void
+bus_switch( Bus *bus, int page, uint8_t bank )
+{
+	const uint8_t *data = rom_bank( bus->rom, bank );
+
+	bus->banks[page]				= bank;
+	bus->pages[BUS_ROM_PAGE + page]	= ( data != NULL ) ? data : open_bus;
+}
+
+/**
+ * Writes a byte to the CPU address space. Only the bank registers at BUS_BANK_REG do anything.
+ * @param bus Bus
+ * @param addr CPU address
+ * @param val Value to write
+ */
+void
+bus_write( Bus *bus, uint16_t addr, uint8_t val )
+{
+	if ( addr >= BUS_BANK_REG && addr < BUS_BANK_REG + BUS_ROM_PAGES )
+		bus_switch( bus, addr - BUS_BANK_REG, val );
+}
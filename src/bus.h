@@ -3,6 +3,42 @@
 
 #include <stdint.h>
 
-extern uint8_t cpu_bus[0x10000];
+#include "rom.h"
+
+#define BUS_PAGE_BITS	12						// CPU address bits within a page
+#define BUS_PAGE_SIZE	( 1 << BUS_PAGE_BITS )	// 4 KiB, same as ROM_BANK_SIZE
+#define BUS_PAGES		16						// pages in the 64 KiB CPU address space
+#define BUS_ROM_PAGE	8						// first page ROM banks are switched into ($8000)
+#define BUS_ROM_PAGES	( BUS_PAGES - BUS_ROM_PAGE )
+#define BUS_BANK_REG	0x5ff8					// NSF bank registers, one per page from $8000
+
+/*
+ * Read-only view of the CPU address space through a table of 4 KiB pages. The pages from $8000
+ * point straight into the ROM image, so switching banks only changes a pointer. Everything below
+ * $8000, and any bank the ROM does not have, reads as zero.
+ */
+
+typedef struct {
+	const uint8_t	*pages[BUS_PAGES];		// memory behind each page
+	uint8_t			banks[BUS_ROM_PAGES];	// bank switched into each page from $8000
+	const Rom		*rom;					// image banks are taken from
+} Bus;
+
+void	bus_init( Bus *bus, const Rom *rom );
+void	bus_reset( Bus *bus );
+void	bus_switch( Bus *bus, int page, uint8_t bank );
+void	bus_write( Bus *bus, uint16_t addr, uint8_t val );
+
+/**
+ * Reads a byte from the CPU address space
+ * @param bus Bus
+ * @param addr CPU address
+ * @return Byte at addr
+ */
+static inline uint8_t
+bus_read( const Bus *bus, uint16_t addr )
+{
+	return bus->pages[addr >> BUS_PAGE_BITS][addr & ( BUS_PAGE_SIZE - 1 )];
+}
 
 #endif // BUS_H
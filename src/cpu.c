@@ -0,0 +1,663 @@
+#include <string.h>
+
+#include "cpu.h"
+
+// cycles taken by each opcode, not counting page crossings and taken branches
+
+static const uint8_t cycle_tab[256] = {
+//	0  1  2  3  4  5  6  7  8  9  a  b  c  d  e  f
+	7, 6, 0, 8, 3, 3, 5, 5, 3, 2, 2, 2, 4, 4, 6, 6,	// 0
+	2, 5, 0, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7,	// 1
+	6, 6, 0, 8, 3, 3, 5, 5, 4, 2, 2, 2, 4, 4, 6, 6,	// 2
+	2, 5, 0, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7,	// 3
+	6, 6, 0, 8, 3, 3, 5, 5, 3, 2, 2, 2, 3, 4, 6, 6,	// 4
+	2, 5, 0, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7,	// 5
+	6, 6, 0, 8, 3, 3, 5, 5, 4, 2, 2, 2, 5, 4, 6, 6,	// 6
+	2, 5, 0, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7,	// 7
+	2, 6, 2, 6, 3, 3, 3, 3, 2, 2, 2, 2, 4, 4, 4, 4,	// 8
+	2, 6, 0, 6, 4, 4, 4, 4, 2, 5, 2, 5, 5, 5, 5, 5,	// 9
+	2, 6, 2, 6, 3, 3, 3, 3, 2, 2, 2, 2, 4, 4, 4, 4,	// a
+	2, 5, 0, 5, 4, 4, 4, 4, 2, 4, 2, 4, 4, 4, 4, 4,	// b
+	2, 6, 2, 8, 3, 3, 5, 5, 2, 2, 2, 2, 4, 4, 6, 6,	// c
+	2, 5, 0, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7,	// d
+	2, 6, 2, 8, 3, 3, 5, 5, 2, 2, 2, 2, 4, 4, 6, 6,	// e
+	2, 5, 0, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7,	// f
+};
+
+/**
+ * Sets up a CPU and resets it
+ * @param cpu CPU
+ * @param bus Bus to read $8000-$ffff through
+ * @param io_read Called for reads of $2000-$5fff
+ * @param io_write Called for writes to $2000-$5fff
+ * @param io_data Userdata passed to io_read and io_write
+ */
+void
+cpu_init( Cpu *cpu, const Bus *bus, CpuReadFn io_read, CpuWriteFn io_write, void *io_data )
+{
+	cpu->bus		= bus;
+	cpu->io_read	= io_read;
+	cpu->io_write	= io_write;
+	cpu->io_data	= io_data;
+
+	cpu_reset( cpu );
+}
+
+/**
+ * Clears the registers, RAM and cycle count
+ * @param cpu CPU
+ */
+void
+cpu_reset( Cpu *cpu )
+{
+	memset( cpu->ram, 0, sizeof(cpu->ram) );
+	memset( cpu->wram, 0, sizeof(cpu->wram) );
+
+	cpu->pc			= 0;
+	cpu->a			= 0;
+	cpu->x			= 0;
+	cpu->y			= 0;
+	cpu->s			= 0xfd;
+	cpu->p			= CPU_FLAG_I | CPU_FLAG_U;
+	cpu->jammed		= 0;
+	cpu->cycle		= 0;
+	cpu->halt_pc	= 0;
+}
+
+/**
+ * Sets the CPU up to run a subroutine, as if it had been called with JSR from just before
+ * return_addr. cpu_run() stops when the subroutine returns.
+ * @param cpu CPU
+ * @param addr Address of subroutine
+ * @param return_addr Address to return to, which should not hold code the subroutine runs
+ */
+void
+cpu_call( Cpu *cpu, uint16_t addr, uint16_t return_addr )
+{
+	const uint16_t ret = return_addr - 1;
+
+	cpu->ram[0x100 | cpu->s--] = ret >> 8;
+	cpu->ram[0x100 | cpu->s--] = ret & 0xff;
+
+	cpu->pc			= addr;
+	cpu->halt_pc	= return_addr;
+}
+
+/**
+ * Returns whether the CPU has stopped, either by returning to the halt address or by jamming
+ * @param cpu CPU
+ * @return 1 if halted, otherwise 0
+ */
+int
+cpu_halted( const Cpu *cpu )
+{
+	return cpu->pc == cpu->halt_pc || cpu->jammed;
+}
+
+/**
+ * Reads a byte
+ * @param cpu CPU
+ * @param addr Address
+ * @param cycle Cycle the read happens on
+ * @return Byte read
+ */
+static inline uint8_t
+mem_read( Cpu *cpu, uint16_t addr, uint64_t cycle )
+{
+	if ( addr >= 0x8000 )
+		return bus_read( cpu->bus, addr );
+	if ( addr < 0x2000 )
+		return cpu->ram[addr & ( CPU_RAM_SIZE - 1 )];
+	if ( addr >= 0x6000 )
+		return cpu->wram[addr - 0x6000];
+
+	return cpu->io_read( cpu->io_data, addr, cycle );
+}
+
+/**
+ * Writes a byte. Writes to ROM are dropped.
+ * @param cpu CPU
+ * @param addr Address
+ * @param val Byte to write
+ * @param cycle Cycle the write happens on
+ */
+static inline void
+mem_write( Cpu *cpu, uint16_t addr, uint8_t val, uint64_t cycle )
+{
+	if ( addr < 0x2000 )
+		cpu->ram[addr & ( CPU_RAM_SIZE - 1 )] = val;
+	else if ( addr >= 0x6000 )
+	{
+		if ( addr < 0x8000 )
+			cpu->wram[addr - 0x6000] = val;
+	}
+	else
+		cpu->io_write( cpu->io_data, addr, val, cycle );
+}
+
+// the instruction's cycles are added before it runs, so accesses happen on its last cycle
+
+#define RD( addr )			mem_read( cpu, ( addr ), cycle - 1 )
+#define WR( addr, val )		mem_write( cpu, ( addr ), ( val ), cycle - 1 )
+#define RD16( addr )		( RD( addr ) | ( RD( (uint16_t)( ( addr ) + 1 ) ) << 8 ) )
+#define ZP16( zp )			( cpu->ram[(uint8_t)( zp )] |							\
+		( cpu->ram[(uint8_t)( ( zp ) + 1 )] << 8 ) )
+
+#define PUSH( val )			( cpu->ram[0x100 | s--] = ( val ) )
+#define PULL()				( cpu->ram[0x100 | ++s] )
+
+#define SET_NZ( val )		( p = ( p & ~( CPU_FLAG_N | CPU_FLAG_Z ) ) |					\
+		( ( val ) & CPU_FLAG_N ) | ( ( val ) == 0 ? CPU_FLAG_Z : 0 ) )
+#define SET_C( cond )		( p = ( p & ~CPU_FLAG_C ) | ( ( cond ) ? CPU_FLAG_C : 0 ) )
+#define PAGE_CROSS( a, b )	( ( ( ( a ) ^ ( b ) ) & 0xff00 ) != 0 )
+
+// addressing modes, which leave the effective address in ea. the _R variants are for reads,
+// which take an extra cycle when indexing crosses a page
+
+#define IMM()		( ea = pc++ )
+#define ZP()		( ea = RD( pc ), pc++ )
+#define ZPX()		( ea = (uint8_t)( RD( pc ) + x ), pc++ )
+#define ZPY()		( ea = (uint8_t)( RD( pc ) + y ), pc++ )
+#define ABS()		( ea = RD16( pc ), pc += 2 )
+#define ABX()		( base = RD16( pc ), ea = base + x, pc += 2 )
+#define ABY()		( base = RD16( pc ), ea = base + y, pc += 2 )
+#define ABX_R()		( ABX(), cycle += PAGE_CROSS( base, ea ) )
+#define ABY_R()		( ABY(), cycle += PAGE_CROSS( base, ea ) )
+#define IZX()		( ea = ZP16( RD( pc ) + x ), pc++ )
+#define IZY()		( base = ZP16( RD( pc ) ), ea = base + y, pc++ )
+#define IZY_R()		( IZY(), cycle += PAGE_CROSS( base, ea ) )
+
+// operations on the byte at ea
+
+#define ADC_V( val )	do {											\
+		const uint8_t v_ = ( val );										\
+		const unsigned t_ = a + v_ + ( p & CPU_FLAG_C );				\
+		p = ( p & ~CPU_FLAG_V ) | ( ( ~( a ^ v_ ) & ( a ^ t_ ) & 0x80 ) >> 1 );	\
+		SET_C( t_ > 0xff );												\
+		a = t_;															\
+		SET_NZ( a );													\
+	} while ( 0 )
+
+#define CMP_V( reg, val )	do {										\
+		const uint8_t v_ = ( val );										\
+		SET_C( ( reg ) >= v_ );											\
+		SET_NZ( (uint8_t)( ( reg ) - v_ ) );							\
+	} while ( 0 )
+
+#define ORA()		( a |= RD( ea ), SET_NZ( a ) )
+#define AND()		( a &= RD( ea ), SET_NZ( a ) )
+#define EOR()		( a ^= RD( ea ), SET_NZ( a ) )
+#define ADC()		ADC_V( RD( ea ) )
+#define SBC()		ADC_V( RD( ea ) ^ 0xff )
+#define CMP()		CMP_V( a, RD( ea ) )
+#define CPX()		CMP_V( x, RD( ea ) )
+#define CPY()		CMP_V( y, RD( ea ) )
+#define LDA()		( a = RD( ea ), SET_NZ( a ) )
+#define LDX()		( x = RD( ea ), SET_NZ( x ) )
+#define LDY()		( y = RD( ea ), SET_NZ( y ) )
+#define LAX()		( a = x = RD( ea ), SET_NZ( a ) )
+#define STA()		WR( ea, a )
+#define STX()		WR( ea, x )
+#define STY()		WR( ea, y )
+#define SAX()		WR( ea, a & x )
+#define NOP()		( (void)RD( ea ) )
+
+#define BIT()		do {												\
+		const uint8_t v_ = RD( ea );									\
+		p = ( p & ~( CPU_FLAG_N | CPU_FLAG_V | CPU_FLAG_Z ) ) |			\
+				( v_ & ( CPU_FLAG_N | CPU_FLAG_V ) ) |					\
+				( ( a & v_ ) == 0 ? CPU_FLAG_Z : 0 );					\
+	} while ( 0 )
+
+// read-modify-write operations, on the byte at ea or on the accumulator
+
+#define ASL_V( v )	( SET_C( ( v ) & 0x80 ), ( v ) <<= 1, SET_NZ( v ) )
+#define LSR_V( v )	( SET_C( ( v ) & 0x01 ), ( v ) >>= 1, SET_NZ( v ) )
+#define ROL_V( v )	do {												\
+		const uint8_t c_ = p & CPU_FLAG_C;								\
+		SET_C( ( v ) & 0x80 );											\
+		( v ) = ( ( v ) << 1 ) | c_;									\
+		SET_NZ( v );													\
+	} while ( 0 )
+#define ROR_V( v )	do {												\
+		const uint8_t c_ = p & CPU_FLAG_C;								\
+		SET_C( ( v ) & 0x01 );											\
+		( v ) = ( ( v ) >> 1 ) | ( c_ << 7 );							\
+		SET_NZ( v );													\
+	} while ( 0 )
+#define INC_V( v )	( ( v )++, SET_NZ( v ) )
+#define DEC_V( v )	( ( v )--, SET_NZ( v ) )
+
+#define RMW( OP )	do {												\
+		uint8_t m_ = RD( ea );											\
+		OP( m_ );														\
+		WR( ea, m_ );													\
+	} while ( 0 )
+
+// undocumented combinations of a read-modify-write operation and an ALU operation
+
+#define RMW_ALU( OP, ALU )	do {										\
+		uint8_t m_ = RD( ea );											\
+		OP( m_ );														\
+		WR( ea, m_ );													\
+		ALU( m_ );														\
+	} while ( 0 )
+
+#define ORA_V( v )	( a |= ( v ), SET_NZ( a ) )
+#define AND_V( v )	( a &= ( v ), SET_NZ( a ) )
+#define EOR_V( v )	( a ^= ( v ), SET_NZ( a ) )
+#define CMP_A( v )	CMP_V( a, v )
+#define SBC_V( v )	ADC_V( ( v ) ^ 0xff )
+#define DEC_M( v )	( ( v )-- )
+#define INC_M( v )	( ( v )++ )
+
+#define SLO()		RMW_ALU( ASL_V, ORA_V )
+#define RLA()		RMW_ALU( ROL_V, AND_V )
+#define SRE()		RMW_ALU( LSR_V, EOR_V )
+#define RRA()		RMW_ALU( ROR_V, ADC_V )
+#define DCP()		RMW_ALU( DEC_M, CMP_A )
+#define ISC()		RMW_ALU( INC_M, SBC_V )
+
+// the unstable stores AND the value with the high byte of the target address plus one
+
+#define SH( val )	WR( ea, ( val ) & (uint8_t)( ( base >> 8 ) + 1 ) )
+
+#define BRANCH( cond )	do {											\
+		const uint16_t from_ = pc + 1;									\
+		const uint16_t to_ = from_ + (int8_t)RD( pc );					\
+		pc = from_;														\
+		if ( cond )														\
+		{																\
+			cycle += 1 + PAGE_CROSS( from_, to_ );						\
+			pc = to_;													\
+		}																\
+	} while ( 0 )
+
+/**
+ * Runs instructions until the cycle count reaches end_cycle or the CPU halts (see cpu_halted()).
+ * The last instruction may run a few cycles past end_cycle.
+ * @param cpu CPU
+ * @param end_cycle Cycle count to stop at
+ * @return Number of cycles run
+ */
+uint64_t
+cpu_run( Cpu *cpu, uint64_t end_cycle )
+{
+	uint16_t pc = cpu->pc;
+	uint8_t a = cpu->a;
+	uint8_t x = cpu->x;
+	uint8_t y = cpu->y;
+	uint8_t s = cpu->s;
+	uint8_t p = cpu->p;
+	uint64_t cycle = cpu->cycle;
+
+	const uint64_t start = cycle;
+	const uint16_t halt_pc = cpu->halt_pc;
+
+	if ( cpu->jammed )
+		return 0;
+
+	while ( cycle < end_cycle && pc != halt_pc )
+	{
+		const uint8_t op = mem_read( cpu, pc, cycle );
+		uint16_t ea;
+		uint16_t base;
+
+		(void)base;
+
+		pc++;
+		cycle += cycle_tab[op];
+
+		switch ( op )
+		{
+		// loads and stores
+
+		case 0xa9: IMM();	LDA(); break;
+		case 0xa5: ZP();	LDA(); break;
+		case 0xb5: ZPX();	LDA(); break;
+		case 0xad: ABS();	LDA(); break;
+		case 0xbd: ABX_R();	LDA(); break;
+		case 0xb9: ABY_R();	LDA(); break;
+		case 0xa1: IZX();	LDA(); break;
+		case 0xb1: IZY_R();	LDA(); break;
+
+		case 0xa2: IMM();	LDX(); break;
+		case 0xa6: ZP();	LDX(); break;
+		case 0xb6: ZPY();	LDX(); break;
+		case 0xae: ABS();	LDX(); break;
+		case 0xbe: ABY_R();	LDX(); break;
+
+		case 0xa0: IMM();	LDY(); break;
+		case 0xa4: ZP();	LDY(); break;
+		case 0xb4: ZPX();	LDY(); break;
+		case 0xac: ABS();	LDY(); break;
+		case 0xbc: ABX_R();	LDY(); break;
+
+		case 0x85: ZP();	STA(); break;
+		case 0x95: ZPX();	STA(); break;
+		case 0x8d: ABS();	STA(); break;
+		case 0x9d: ABX();	STA(); break;
+		case 0x99: ABY();	STA(); break;
+		case 0x81: IZX();	STA(); break;
+		case 0x91: IZY();	STA(); break;
+
+		case 0x86: ZP();	STX(); break;
+		case 0x96: ZPY();	STX(); break;
+		case 0x8e: ABS();	STX(); break;
+
+		case 0x84: ZP();	STY(); break;
+		case 0x94: ZPX();	STY(); break;
+		case 0x8c: ABS();	STY(); break;
+
+		// arithmetic and logic
+
+		case 0x09: IMM();	ORA(); break;
+		case 0x05: ZP();	ORA(); break;
+		case 0x15: ZPX();	ORA(); break;
+		case 0x0d: ABS();	ORA(); break;
+		case 0x1d: ABX_R();	ORA(); break;
+		case 0x19: ABY_R();	ORA(); break;
+		case 0x01: IZX();	ORA(); break;
+		case 0x11: IZY_R();	ORA(); break;
+
+		case 0x29: IMM();	AND(); break;
+		case 0x25: ZP();	AND(); break;
+		case 0x35: ZPX();	AND(); break;
+		case 0x2d: ABS();	AND(); break;
+		case 0x3d: ABX_R();	AND(); break;
+		case 0x39: ABY_R();	AND(); break;
+		case 0x21: IZX();	AND(); break;
+		case 0x31: IZY_R();	AND(); break;
+
+		case 0x49: IMM();	EOR(); break;
+		case 0x45: ZP();	EOR(); break;
+		case 0x55: ZPX();	EOR(); break;
+		case 0x4d: ABS();	EOR(); break;
+		case 0x5d: ABX_R();	EOR(); break;
+		case 0x59: ABY_R();	EOR(); break;
+		case 0x41: IZX();	EOR(); break;
+		case 0x51: IZY_R();	EOR(); break;
+
+		case 0x69: IMM();	ADC(); break;
+		case 0x65: ZP();	ADC(); break;
+		case 0x75: ZPX();	ADC(); break;
+		case 0x6d: ABS();	ADC(); break;
+		case 0x7d: ABX_R();	ADC(); break;
+		case 0x79: ABY_R();	ADC(); break;
+		case 0x61: IZX();	ADC(); break;
+		case 0x71: IZY_R();	ADC(); break;
+
+		case 0xe9: IMM();	SBC(); break;
+		case 0xeb: IMM();	SBC(); break;
+		case 0xe5: ZP();	SBC(); break;
+		case 0xf5: ZPX();	SBC(); break;
+		case 0xed: ABS();	SBC(); break;
+		case 0xfd: ABX_R();	SBC(); break;
+		case 0xf9: ABY_R();	SBC(); break;
+		case 0xe1: IZX();	SBC(); break;
+		case 0xf1: IZY_R();	SBC(); break;
+
+		case 0xc9: IMM();	CMP(); break;
+		case 0xc5: ZP();	CMP(); break;
+		case 0xd5: ZPX();	CMP(); break;
+		case 0xcd: ABS();	CMP(); break;
+		case 0xdd: ABX_R();	CMP(); break;
+		case 0xd9: ABY_R();	CMP(); break;
+		case 0xc1: IZX();	CMP(); break;
+		case 0xd1: IZY_R();	CMP(); break;
+
+		case 0xe0: IMM();	CPX(); break;
+		case 0xe4: ZP();	CPX(); break;
+		case 0xec: ABS();	CPX(); break;
+
+		case 0xc0: IMM();	CPY(); break;
+		case 0xc4: ZP();	CPY(); break;
+		case 0xcc: ABS();	CPY(); break;
+
+		case 0x24: ZP();	BIT(); break;
+		case 0x2c: ABS();	BIT(); break;
+
+		// read-modify-write
+
+		case 0x0a: ASL_V( a ); break;
+		case 0x06: ZP();	RMW( ASL_V ); break;
+		case 0x16: ZPX();	RMW( ASL_V ); break;
+		case 0x0e: ABS();	RMW( ASL_V ); break;
+		case 0x1e: ABX();	RMW( ASL_V ); break;
+
+		case 0x4a: LSR_V( a ); break;
+		case 0x46: ZP();	RMW( LSR_V ); break;
+		case 0x56: ZPX();	RMW( LSR_V ); break;
+		case 0x4e: ABS();	RMW( LSR_V ); break;
+		case 0x5e: ABX();	RMW( LSR_V ); break;
+
+		case 0x2a: ROL_V( a ); break;
+		case 0x26: ZP();	RMW( ROL_V ); break;
+		case 0x36: ZPX();	RMW( ROL_V ); break;
+		case 0x2e: ABS();	RMW( ROL_V ); break;
+		case 0x3e: ABX();	RMW( ROL_V ); break;
+
+		case 0x6a: ROR_V( a ); break;
+		case 0x66: ZP();	RMW( ROR_V ); break;
+		case 0x76: ZPX();	RMW( ROR_V ); break;
+		case 0x6e: ABS();	RMW( ROR_V ); break;
+		case 0x7e: ABX();	RMW( ROR_V ); break;
+
+		case 0xe6: ZP();	RMW( INC_V ); break;
+		case 0xf6: ZPX();	RMW( INC_V ); break;
+		case 0xee: ABS();	RMW( INC_V ); break;
+		case 0xfe: ABX();	RMW( INC_V ); break;
+
+		case 0xc6: ZP();	RMW( DEC_V ); break;
+		case 0xd6: ZPX();	RMW( DEC_V ); break;
+		case 0xce: ABS();	RMW( DEC_V ); break;
+		case 0xde: ABX();	RMW( DEC_V ); break;
+
+		// registers
+
+		case 0xe8: INC_V( x ); break;
+		case 0xc8: INC_V( y ); break;
+		case 0xca: DEC_V( x ); break;
+		case 0x88: DEC_V( y ); break;
+
+		case 0xaa: x = a; SET_NZ( x ); break;
+		case 0xa8: y = a; SET_NZ( y ); break;
+		case 0x8a: a = x; SET_NZ( a ); break;
+		case 0x98: a = y; SET_NZ( a ); break;
+		case 0xba: x = s; SET_NZ( x ); break;
+		case 0x9a: s = x; break;
+
+		case 0x18: p &= ~CPU_FLAG_C; break;
+		case 0x38: p |= CPU_FLAG_C; break;
+		case 0x58: p &= ~CPU_FLAG_I; break;
+		case 0x78: p |= CPU_FLAG_I; break;
+		case 0xb8: p &= ~CPU_FLAG_V; break;
+		case 0xd8: p &= ~CPU_FLAG_D; break;
+		case 0xf8: p |= CPU_FLAG_D; break;
+
+		// stack
+
+		case 0x48: PUSH( a ); break;
+		case 0x08: PUSH( p | CPU_FLAG_B | CPU_FLAG_U ); break;
+		case 0x68: a = PULL(); SET_NZ( a ); break;
+		case 0x28: p = ( PULL() & ~CPU_FLAG_B ) | CPU_FLAG_U; break;
+
+		// jumps, subroutines and interrupts
+
+		case 0x4c:
+			pc = RD16( pc );
+			break;
+		case 0x6c:
+			// the pointer's high byte is read from the same page as its low byte
+			ea = RD16( pc );
+			pc = RD( ea ) | ( RD( ( ea & 0xff00 ) | (uint8_t)( ea + 1 ) ) << 8 );
+			break;
+		case 0x20:
+			ea = RD16( pc );
+			pc++;
+			PUSH( pc >> 8 );
+			PUSH( pc & 0xff );
+			pc = ea;
+			break;
+		case 0x60:
+			pc = PULL();
+			pc |= PULL() << 8;
+			pc++;
+			break;
+		case 0x40:
+			p = ( PULL() & ~CPU_FLAG_B ) | CPU_FLAG_U;
+			pc = PULL();
+			pc |= PULL() << 8;
+			break;
+		case 0x00:
+			pc++;
+			PUSH( pc >> 8 );
+			PUSH( pc & 0xff );
+			PUSH( p | CPU_FLAG_B | CPU_FLAG_U );
+			p |= CPU_FLAG_I;
+			pc = RD16( 0xfffe );
+			break;
+
+		// branches
+
+		case 0x10: BRANCH( !( p & CPU_FLAG_N ) ); break;
+		case 0x30: BRANCH( p & CPU_FLAG_N ); break;
+		case 0x50: BRANCH( !( p & CPU_FLAG_V ) ); break;
+		case 0x70: BRANCH( p & CPU_FLAG_V ); break;
+		case 0x90: BRANCH( !( p & CPU_FLAG_C ) ); break;
+		case 0xb0: BRANCH( p & CPU_FLAG_C ); break;
+		case 0xd0: BRANCH( !( p & CPU_FLAG_Z ) ); break;
+		case 0xf0: BRANCH( p & CPU_FLAG_Z ); break;
+
+		// undocumented: NOPs that still fetch their operands
+
+		case 0xea: case 0x1a: case 0x3a: case 0x5a: case 0x7a: case 0xda: case 0xfa:
+			break;
+		case 0x80: case 0x82: case 0x89: case 0xc2: case 0xe2:
+			IMM(); NOP(); break;
+		case 0x04: case 0x44: case 0x64:
+			ZP(); NOP(); break;
+		case 0x14: case 0x34: case 0x54: case 0x74: case 0xd4: case 0xf4:
+			ZPX(); NOP(); break;
+		case 0x0c:
+			ABS(); NOP(); break;
+		case 0x1c: case 0x3c: case 0x5c: case 0x7c: case 0xdc: case 0xfc:
+			ABX_R(); NOP(); break;
+
+		// undocumented: combined read-modify-write and ALU operations
+
+		case 0x07: ZP();	SLO(); break;
+		case 0x17: ZPX();	SLO(); break;
+		case 0x0f: ABS();	SLO(); break;
+		case 0x1f: ABX();	SLO(); break;
+		case 0x1b: ABY();	SLO(); break;
+		case 0x03: IZX();	SLO(); break;
+		case 0x13: IZY();	SLO(); break;
+
+		case 0x27: ZP();	RLA(); break;
+		case 0x37: ZPX();	RLA(); break;
+		case 0x2f: ABS();	RLA(); break;
+		case 0x3f: ABX();	RLA(); break;
+		case 0x3b: ABY();	RLA(); break;
+		case 0x23: IZX();	RLA(); break;
+		case 0x33: IZY();	RLA(); break;
+
+		case 0x47: ZP();	SRE(); break;
+		case 0x57: ZPX();	SRE(); break;
+		case 0x4f: ABS();	SRE(); break;
+		case 0x5f: ABX();	SRE(); break;
+		case 0x5b: ABY();	SRE(); break;
+		case 0x43: IZX();	SRE(); break;
+		case 0x53: IZY();	SRE(); break;
+
+		case 0x67: ZP();	RRA(); break;
+		case 0x77: ZPX();	RRA(); break;
+		case 0x6f: ABS();	RRA(); break;
+		case 0x7f: ABX();	RRA(); break;
+		case 0x7b: ABY();	RRA(); break;
+		case 0x63: IZX();	RRA(); break;
+		case 0x73: IZY();	RRA(); break;
+
+		case 0xc7: ZP();	DCP(); break;
+		case 0xd7: ZPX();	DCP(); break;
+		case 0xcf: ABS();	DCP(); break;
+		case 0xdf: ABX();	DCP(); break;
+		case 0xdb: ABY();	DCP(); break;
+		case 0xc3: IZX();	DCP(); break;
+		case 0xd3: IZY();	DCP(); break;
+
+		case 0xe7: ZP();	ISC(); break;
+		case 0xf7: ZPX();	ISC(); break;
+		case 0xef: ABS();	ISC(); break;
+		case 0xff: ABX();	ISC(); break;
+		case 0xfb: ABY();	ISC(); break;
+		case 0xe3: IZX();	ISC(); break;
+		case 0xf3: IZY();	ISC(); break;
+
+		case 0xa7: ZP();	LAX(); break;
+		case 0xb7: ZPY();	LAX(); break;
+		case 0xaf: ABS();	LAX(); break;
+		case 0xbf: ABY_R();	LAX(); break;
+		case 0xa3: IZX();	LAX(); break;
+		case 0xb3: IZY_R();	LAX(); break;
+
+		case 0x87: ZP();	SAX(); break;
+		case 0x97: ZPY();	SAX(); break;
+		case 0x8f: ABS();	SAX(); break;
+		case 0x83: IZX();	SAX(); break;
+
+		// undocumented: immediate operations
+
+		case 0x0b: case 0x2b:
+			IMM(); AND(); SET_C( a & 0x80 ); break;
+		case 0x4b:
+			IMM(); AND(); LSR_V( a ); break;
+		case 0x6b:
+			IMM();
+			a &= RD( ea );
+			a = ( a >> 1 ) | ( ( p & CPU_FLAG_C ) << 7 );
+			SET_NZ( a );
+			SET_C( a & 0x40 );
+			p = ( p & ~CPU_FLAG_V ) | ( ( ( a >> 6 ) ^ ( a >> 5 ) ) & 1 ? CPU_FLAG_V : 0 );
+			break;
+		case 0xcb:
+			IMM();
+			ea = RD( ea );
+			SET_C( ( a & x ) >= ea );
+			x = ( a & x ) - ea;
+			SET_NZ( x );
+			break;
+		case 0x8b:
+			IMM(); a = x & RD( ea ); SET_NZ( a ); break;
+		case 0xab:
+			IMM(); a = x = RD( ea ); SET_NZ( a ); break;
+
+		// undocumented: unstable stores and LAS
+
+		case 0x93: IZY();	SH( a & x ); break;
+		case 0x9f: ABY();	SH( a & x ); break;
+		case 0x9c: ABX();	SH( y ); break;
+		case 0x9e: ABY();	SH( x ); break;
+		case 0x9b: ABY();	s = a & x; SH( s ); break;
+		case 0xbb: ABY_R();	a = x = s = RD( ea ) & s; SET_NZ( a ); break;
+
+		// JAM: the CPU locks up until reset
+
+		default:
+			pc--;
+			cpu->jammed = 1;
+			end_cycle = cycle;
+			break;
+		}
+	}
+
+	cpu->pc		= pc;
+	cpu->a		= a;
+	cpu->x		= x;
+	cpu->y		= y;
+	cpu->s		= s;
+	cpu->p		= p;
+	cpu->cycle	= cycle;
+
+	return cycle - start;
+}
@@ -0,0 +1,66 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bus.h"
+
+#define CPU_FLAG_C		0x01					// carry
+#define CPU_FLAG_Z		0x02					// zero
+#define CPU_FLAG_I		0x04					// interrupt disable
+#define CPU_FLAG_D		0x08					// decimal (ignored by the 2A03)
+#define CPU_FLAG_B		0x10					// break (only exists on the stack)
+#define CPU_FLAG_U		0x20					// unused, always reads as 1
+#define CPU_FLAG_V		0x40					// overflow
+#define CPU_FLAG_N		0x80					// negative
+
+#define CPU_RAM_SIZE	0x0800					// internal RAM at $0000, mirrored up to $1fff
+#define CPU_WRAM_SIZE	0x2000					// cartridge RAM at $6000-$7fff
+
+/*
+ * 2A03 CPU core: a 6502 without decimal mode. Reads of $8000-$ffff go straight through the bus
+ * page table, RAM at $0000-$1fff and $6000-$7fff is part of the core, and only accesses to
+ * $2000-$5fff are passed to the I/O callbacks, stamped with the CPU cycle they happen on. That is
+ * taken to be the last cycle of the instruction, which is where the access of every load, store
+ * and read-modify-write instruction falls on the real CPU; dummy reads and the double write of
+ * read-modify-write instructions are not emulated.
+ *
+ * cpu_run() keeps the registers in locals and dispatches on a switch over the opcode, which
+ * compilers turn into a jump table. Every documented opcode and the stable undocumented ones are
+ * supported; the unstable ones use their usual approximations, and the JAM opcodes stop the CPU.
+ * Interrupts are not emulated.
+ */
+
+typedef uint8_t	( *CpuReadFn )( void *userdata, uint16_t addr, uint64_t cycle );
+typedef void	( *CpuWriteFn )( void *userdata, uint16_t addr, uint8_t val, uint64_t cycle );
+
+typedef struct {
+	uint16_t		pc;						// program counter
+	uint8_t			a;						// accumulator
+	uint8_t			x;						// index registers
+	uint8_t			y;
+	uint8_t			s;						// stack pointer
+	uint8_t			p;						// status flags (CPU_FLAG_*)
+	uint8_t			jammed;					// 1 = a JAM opcode was run, the CPU is stopped
+	uint64_t		cycle;					// CPU cycles run
+
+	uint16_t		halt_pc;				// cpu_run() stops when the program counter gets here
+
+	const Bus		*bus;					// $8000-$ffff
+	CpuReadFn		io_read;				// $2000-$5fff
+	CpuWriteFn		io_write;
+	void			*io_data;				// userdata for io_read and io_write
+
+	uint8_t			ram[CPU_RAM_SIZE];
+	uint8_t			wram[CPU_WRAM_SIZE];
+} Cpu;
+
+void		cpu_init( Cpu *cpu, const Bus *bus, CpuReadFn io_read, CpuWriteFn io_write,
+		void *io_data );
+void		cpu_reset( Cpu *cpu );
+void		cpu_call( Cpu *cpu, uint16_t addr, uint16_t return_addr );
+uint64_t	cpu_run( Cpu *cpu, uint64_t end_cycle );
+int			cpu_halted( const Cpu *cpu );
+
+#endif // CPU_H
@@ -0,0 +1,554 @@
+#include <math.h>
+#include <string.h>
+
+#include "decim.h"
+#include "dsp.h"
+
+#define DECIM_LEVEL_SCALE	1048576.0f				// CIC input units per unit of input level
+#define DECIM_KAISER_BETA	8.0						// Kaiser window shape of half-band and resampler
+#define DECIM_RS_CUTOFF		0.45					// resampler cutoff as a fraction of the output rate
+#define DECIM_ONE			( (int64_t)1 << 32 )	// one resampler input in 32.32 fixed point
+
+/**
+ * Sets up a decimator
+ * @param d Decimator
+ * @param clock_rate Input clock rate
+ * @param sample_rate Output sample rate
+ * @param hp_cutoff Cutoff frequency of the DC blocking high pass applied to the output
+ */
+void
+decim_init( Decim *d, double clock_rate, double sample_rate, double hp_cutoff )
+{
+	double rate = clock_rate / DECIM_CIC_RATIO;
+	double gain = 1.0;
+
+	// CIC gain is ratio ^ order
+
+	for ( int i = 0; i < DECIM_CIC_ORDER; i++ )
+		gain *= DECIM_CIC_RATIO;
+
+	d->cic_scale = 1.0 / ( gain * DECIM_LEVEL_SCALE );
+
+	// half-band taps. every other tap of a half-band filter is 0 apart from the center one, which
+	// is 1/2. the rest are scaled so that the DC gain is exactly 1
+
+	double half = ( DECIM_HB_TAPS - 1 ) / 2;
+	double sum = 0.0;
+
+	for ( int k = 0; k < DECIM_HB_PAIRS; k++ )
+	{
+		double x = 2 * k + 1;
+
+		d->hb_coeffs[k] = dsp_sinc( x / 2 ) * dsp_kaiser( x / ( half + 1 ), DECIM_KAISER_BETA );
+		sum += d->hb_coeffs[k];
+	}
+
+	for ( int k = 0; k < DECIM_HB_PAIRS; k++ )
+		d->hb_coeffs[k] *= 0.25 / sum;
+
+	d->stages = 0;
+
+	while ( rate / 2 >= sample_rate && d->stages < DECIM_HB_STAGES )
+	{
+		rate /= 2;
+		d->stages++;
+	}
+
+	// resampler taps. row p is for an output that lies p / DECIM_RS_PHASES of an input period
+	// before the newest input, and tap i is applied to the ith oldest input in the history
+
+	double fc = DECIM_RS_CUTOFF * sample_rate / rate;
+	double c = DECIM_RS_TAPS / 2;
+
+	for ( int p = 0; p <= DECIM_RS_PHASES; p++ )
+	{
+		double frac = (double)p / DECIM_RS_PHASES;
+		double taps[DECIM_RS_TAPS];
+
+		sum = 0.0;
+
+		for ( int i = 0; i < DECIM_RS_TAPS; i++ )
+		{
+			double x = i - ( DECIM_RS_TAPS - 1 ) / 2.0 + frac - 0.5;
+
+			taps[i] = dsp_sinc( 2 * fc * x ) * dsp_kaiser( x / c, DECIM_KAISER_BETA );
+			sum += taps[i];
+		}
+
+		for ( int i = 0; i < DECIM_RS_TAPS; i++ )
+			d->rs_kernel[p][i] = taps[i] / sum;
+	}
+
+	d->rs_step = (int64_t)( rate / sample_rate * DECIM_ONE );
+
+	double rc = 1.0 / ( M_PI * 2 * hp_cutoff );
+	double dt = 1.0 / sample_rate;
+
+	d->hp_coeff = rc / ( rc + dt );
+
+	decim_clear( d );
+}
+
+/**
+ * Clears all filter state
+ * @param d Decimator
+ */
+void
+decim_clear( Decim *d )
+{
+	d->level		= 0.0f;
+	d->ilevel		= 0;
+	d->cic_phase	= 0;
+
+	memset( d->integ, 0, sizeof(d->integ) );
+	memset( d->comb, 0, sizeof(d->comb) );
+	memset( d->hb, 0, sizeof(d->hb) );
+	memset( d->rs_hist, 0, sizeof(d->rs_hist) );
+
+	d->rs_pos		= 0;
+	d->rs_time		= d->rs_step;
+	d->hp_in_prev	= 0.0f;
+	d->hp_out		= 0.0f;
+}
+
+/**
+ * Saves the decimator state. The design is not saved, so it has to match when the state is loaded.
+ * @param d Decimator
+ * @param w State writer
+ */
+void
+decim_save_state( const Decim *d, StateWriter *w )
+{
+	state_write( w, &d->stages, sizeof(d->stages) );
+	state_write( w, &d->level, sizeof(d->level) );
+	state_write( w, &d->ilevel, sizeof(d->ilevel) );
+	state_write( w, d->integ, sizeof(d->integ) );
+	state_write( w, d->comb, sizeof(d->comb) );
+	state_write( w, &d->cic_phase, sizeof(d->cic_phase) );
+
+	for ( int s = 0; s < d->stages; s++ )
+	{
+		state_write( w, d->hb[s].hist, DECIM_HB_TAPS * sizeof(float) );
+		state_write( w, &d->hb[s].pos, sizeof(d->hb[s].pos) );
+		state_write( w, &d->hb[s].odd, sizeof(d->hb[s].odd) );
+	}
+
+	state_write( w, d->rs_hist, DECIM_RS_TAPS * sizeof(float) );
+	state_write( w, &d->rs_pos, sizeof(d->rs_pos) );
+	state_write( w, &d->rs_time, sizeof(d->rs_time) );
+	state_write( w, &d->hp_in_prev, sizeof(d->hp_in_prev) );
+	state_write( w, &d->hp_out, sizeof(d->hp_out) );
+}
+
+/**
+ * Loads the decimator state
+ * @param d Decimator
+ * @param r State reader
+ * @return 0 on success, -1 if the state is truncated or was saved with a different stage count
+ */
+int
+decim_load_state( Decim *d, StateReader *r )
+{
+	int stages;
+
+	state_read( r, &stages, sizeof(stages) );
+
+	if ( r->error || stages != d->stages )
+		return -1;
+
+	state_read( r, &d->level, sizeof(d->level) );
+	state_read( r, &d->ilevel, sizeof(d->ilevel) );
+	state_read( r, d->integ, sizeof(d->integ) );
+	state_read( r, d->comb, sizeof(d->comb) );
+	state_read( r, &d->cic_phase, sizeof(d->cic_phase) );
+
+	for ( int s = 0; s < d->stages; s++ )
+	{
+		DecimHalfband *hb = &d->hb[s];
+
+		state_read( r, hb->hist, DECIM_HB_TAPS * sizeof(float) );
+		state_read( r, &hb->pos, sizeof(hb->pos) );
+		state_read( r, &hb->odd, sizeof(hb->odd) );
+
+		if ( hb->pos >= DECIM_HB_TAPS )
+			return -1;
+
+		memcpy( &hb->hist[DECIM_HB_TAPS], hb->hist, DECIM_HB_TAPS * sizeof(float) );
+	}
+
+	state_read( r, d->rs_hist, DECIM_RS_TAPS * sizeof(float) );
+	state_read( r, &d->rs_pos, sizeof(d->rs_pos) );
+	state_read( r, &d->rs_time, sizeof(d->rs_time) );
+	state_read( r, &d->hp_in_prev, sizeof(d->hp_in_prev) );
+	state_read( r, &d->hp_out, sizeof(d->hp_out) );
+
+	if ( r->error || d->rs_pos >= DECIM_RS_TAPS || d->cic_phase >= DECIM_CIC_RATIO )
+		return -1;
+
+	memcpy( &d->rs_hist[DECIM_RS_TAPS], d->rs_hist, DECIM_RS_TAPS * sizeof(float) );
+	return 0;
+}
+
+/**
+ * Feeds one input to a half-band stage
+ * @param d Decimator
+ * @param hb Half-band stage
+ * @param in Input sample
+ * @param out Pointer to store output sample in
+ * @return 1 if an output was produced, otherwise 0
+ */
+static int
+halfband( const Decim *d, DecimHalfband *hb, float in, float *out )
+{
+	hb->hist[hb->pos] = in;
+	hb->hist[hb->pos + DECIM_HB_TAPS] = in;
+
+	if ( ++hb->pos == DECIM_HB_TAPS )
+		hb->pos = 0;
+
+	hb->odd ^= 1;
+
+	if ( hb->odd )
+		return 0;
+
+	// hist[pos] is now the oldest input and the filter center sits DECIM_HB_TAPS / 2 inputs later
+
+	const float *w = &hb->hist[hb->pos];
+	const int center = DECIM_HB_TAPS / 2;
+	float acc = 0.5f * w[center];
+
+	for ( int k = 0; k < DECIM_HB_PAIRS; k++ )
+		acc += d->hb_coeffs[k] * ( w[center - 1 - 2 * k] + w[center + 1 + 2 * k] );
+
+	*out = acc;
+	return 1;
+}
+
+/**
+ * Feeds one input to the fractional resampler and high pass
+ * @param d Decimator
+ * @param in Input sample
+ * @param out Pointer to store output sample in
+ * @return 1 if an output was produced, otherwise 0
+ */
+static int
+resample( Decim *d, float in, float *out )
+{
+	d->rs_hist[d->rs_pos] = in;
+	d->rs_hist[d->rs_pos + DECIM_RS_TAPS] = in;
+
+	if ( ++d->rs_pos == DECIM_RS_TAPS )
+		d->rs_pos = 0;
+
+	d->rs_time -= DECIM_ONE;
+
+	if ( d->rs_time > 0 )
+		return 0;
+
+	// the output lies -rs_time before the newest input. interpolate between the two nearest phases
+
+	uint32_t pos	= (uint32_t)( -d->rs_time >> 16 );
+	uint32_t phase	= ( pos * DECIM_RS_PHASES ) >> 16;
+	float interp	= (float)( ( pos * DECIM_RS_PHASES ) & 0xffff ) / 0x10000;
+
+	const float *w	= &d->rs_hist[d->rs_pos];
+	const float *k0	= d->rs_kernel[phase];
+	const float *k1	= d->rs_kernel[phase + 1];
+	float acc0 = 0.0f;
+	float acc1 = 0.0f;
+
+	for ( int i = 0; i < DECIM_RS_TAPS; i++ )
+	{
+		acc0 += k0[i] * w[i];
+		acc1 += k1[i] * w[i];
+	}
+
+	d->rs_time += d->rs_step;
+
+	// apply high pass
+
+	float x = acc0 + interp * ( acc1 - acc0 );
+
+	d->hp_out		= d->hp_coeff * ( d->hp_out + x - d->hp_in_prev );
+	d->hp_in_prev	= x;
+
+	*out = d->hp_out;
+	return 1;
+}
+
+/**
+ * Runs the CIC combs and the later stages on the integrator output
+ * @param d Decimator
+ * @param sample_out Buffer to write outputted sample to
+ * @return 1 if a sample was output, otherwise 0
+ */
+static int
+cic_output( Decim *d, float *sample_out )
+{
+	uint32_t v = d->integ[DECIM_CIC_ORDER - 1];
+
+	for ( int k = 0; k < DECIM_CIC_ORDER; k++ )
+	{
+		uint32_t t = v - d->comb[k];
+		d->comb[k] = v;
+		v = t;
+	}
+
+	float x = (float)v * d->cic_scale;
+
+	for ( int s = 0; s < d->stages; s++ )
+	{
+		if ( !halfband( d, &d->hb[s], x, &x ) )
+			return 0;
+	}
+
+	return resample( d, x, sample_out );
+}
+
+/**
+ * Updates the CIC input level
+ * @param d Decimator
+ * @param level New input level
+ */
+static inline void
+set_level( Decim *d, float level )
+{
+	if ( level != d->level )
+	{
+		d->level = level;
+		d->ilevel = (uint32_t)lrintf( level * DECIM_LEVEL_SCALE );
+	}
+}
+
+/**
+ * Runs the CIC integrators for a number of input clocks
+ * @param d Decimator
+ * @param clocks Number of input clocks
+ */
+static inline void
+integrate( Decim *d, uint32_t clocks )
+{
+	// integrators wrap around, which the combs undo as long as the output fits in 32 bits
+
+	for ( uint32_t i = 0; i < clocks; i++ )
+	{
+		d->integ[0] += d->ilevel;
+
+		for ( int k = 1; k < DECIM_CIC_ORDER; k++ )
+			d->integ[k] += d->integ[k - 1];
+	}
+}
+
+/**
+ * Clears all decimator state as if the input had been at a level for ever, so that running on
+ * from that level does not cause a pop. The stage counters, and so the time to the next output
+ * sample, are kept.
+ * @param d Decimator
+ * @param level Input level
+ */
+void
+decim_prime( Decim *d, float level )
+{
+	const uint32_t cic_phase = d->cic_phase;
+	const int64_t rs_time = d->rs_time;
+	uint32_t odd[DECIM_HB_STAGES];
+
+	for ( int s = 0; s < d->stages; s++ )
+		odd[s] = d->hb[s].odd;
+
+	decim_clear( d );
+	set_level( d, level );
+
+	// the CIC is an FIR over its last ORDER * RATIO inputs, so after that many its integrators and
+	// combs hold the values a constant input would leave them at
+
+	uint32_t v = 0;
+
+	for ( int i = 0; i <= DECIM_CIC_ORDER; i++ )
+	{
+		integrate( d, DECIM_CIC_RATIO );
+		v = d->integ[DECIM_CIC_ORDER - 1];
+
+		for ( int k = 0; k < DECIM_CIC_ORDER; k++ )
+		{
+			uint32_t t = v - d->comb[k];
+			d->comb[k] = v;
+			v = t;
+		}
+	}
+
+	// the half-band and resampler filters all have a DC gain of 1
+
+	const float x = (float)v * d->cic_scale;
+
+	for ( int s = 0; s < d->stages; s++ )
+	{
+		for ( int i = 0; i < 2 * DECIM_HB_TAPS; i++ )
+			d->hb[s].hist[i] = x;
+	}
+
+	for ( int i = 0; i < 2 * DECIM_RS_TAPS; i++ )
+		d->rs_hist[i] = x;
+
+	d->hp_in_prev = x;
+
+	// the integrators run on past the last CIC output by the clocks the phase says
+
+	integrate( d, cic_phase );
+	d->cic_phase	= cic_phase;
+	d->rs_time		= rs_time;
+
+	for ( int s = 0; s < d->stages; s++ )
+		d->hb[s].odd = odd[s];
+}
+
+/**
+ * Moves the stage counters, and so the time to the next output sample, on by a number of input
+ * clocks, as running the decimator for them would, without filtering anything
+ * @param d Decimator
+ * @param clocks Number of input clocks
+ */
+void
+decim_advance( Decim *d, uint64_t clocks )
+{
+	// the odd flags of the half-band stages count CIC outputs in binary, the carries out of the
+	// last stage going to the resampler
+
+	const uint64_t total = d->cic_phase + clocks;
+	uint64_t count = total / DECIM_CIC_RATIO;
+
+	d->cic_phase = total % DECIM_CIC_RATIO;
+
+	for ( int s = 0; s < d->stages; s++ )
+		count += (uint64_t)d->hb[s].odd << s;
+
+	for ( int s = 0; s < d->stages; s++ )
+		d->hb[s].odd = ( count >> s ) & 1;
+
+	// each resampler input takes DECIM_ONE off the time, each output adds rs_step back, which
+	// leaves it in ( 0, rs_step ]. inputs * DECIM_ONE is taken modulo rs_step in two steps so it
+	// can not overflow
+
+	const uint64_t step = d->rs_step;
+	uint64_t taken = ( count >> d->stages ) % step;
+
+	taken = ( taken << 16 ) % step;
+	taken = ( taken << 16 ) % step;
+
+	int64_t time = d->rs_time - (int64_t)taken;
+
+	if ( time <= 0 )
+		time += d->rs_step;
+
+	d->rs_time = time;
+}
+
+/**
+ * Works out how many input clocks it will take to output a number of samples. Which input clocks
+ * produce an output does not depend on the input, so this only has to step the stage counters.
+ * @param d Decimator
+ * @param samples Number of samples (at least 1)
+ * @param max_clocks Most clocks to look ahead
+ * @return Clocks until and including the one that outputs the last sample, at most max_clocks
+ */
+size_t
+decim_clocks_until( const Decim *d, size_t samples, size_t max_clocks )
+{
+	uint32_t odd[DECIM_HB_STAGES];
+	int64_t rs_time = d->rs_time;
+	size_t clocks = DECIM_CIC_RATIO - d->cic_phase;
+
+	for ( int s = 0; s < d->stages; s++ )
+		odd[s] = d->hb[s].odd;
+
+	// step through the CIC outputs
+
+	for ( ; clocks < max_clocks; clocks += DECIM_CIC_RATIO )
+	{
+		int s;
+
+		for ( s = 0; s < d->stages; s++ )
+		{
+			odd[s] ^= 1;
+			if ( odd[s] )
+				break;
+		}
+
+		if ( s < d->stages )
+			continue;
+
+		rs_time -= DECIM_ONE;
+
+		if ( rs_time <= 0 )
+		{
+			rs_time += d->rs_step;
+
+			if ( --samples == 0 )
+				return clocks;
+		}
+	}
+
+	return max_clocks;
+}
+
+/**
+ * Runs the decimator for one input clock. Will output a sample if enough time has passed.
+ * @param d Decimator
+ * @param level Input level for this clock
+ * @param sample_out Buffer to write outputted sample to
+ * @return 1 if a sample was output, otherwise 0
+ */
+int
+decim_clock( Decim *d, float level, float *sample_out )
+{
+	set_level( d, level );
+	integrate( d, 1 );
+
+	if ( ++d->cic_phase < DECIM_CIC_RATIO )
+		return 0;
+
+	d->cic_phase = 0;
+	return cic_output( d, sample_out );
+}
+
+/**
+ * Runs the decimator for a number of input clocks at a constant input level. Stops early as soon
+ * as max_samples samples have been output.
+ * @param d Decimator
+ * @param level Input level for these clocks
+ * @param clocks Number of input clocks to run
+ * @param samples_out Buffer to write outputted samples to
+ * @param max_samples Size of samples_out in samples
+ * @param samples_written Pointer to value to add the number of outputted samples to
+ * @return Number of input clocks run
+ */
+size_t
+decim_run( Decim *d, float level, size_t clocks, float *samples_out, size_t max_samples,
+		size_t *samples_written )
+{
+	size_t ran = 0;
+	size_t samples = 0;
+
+	set_level( d, level );
+
+	while ( ran < clocks && samples < max_samples )
+	{
+		size_t n = DECIM_CIC_RATIO - d->cic_phase;
+
+		if ( n > clocks - ran )
+		{
+			integrate( d, clocks - ran );
+			d->cic_phase += clocks - ran;
+			ran = clocks;
+			break;
+		}
+
+		integrate( d, n );
+		ran += n;
+		d->cic_phase = 0;
+		samples += cic_output( d, &samples_out[samples] );
+	}
+
+	*samples_written += samples;
+	return ran;
+}
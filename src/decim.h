@@ -0,0 +1,75 @@
+#ifndef DECIM_H
+#define DECIM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "state.h"
+
+/*
+ * Multistage decimator from the CPU clock rate to the output rate:
+ *
+ * 1. Order 3 CIC decimating by 8 (1789773 Hz -> 223722 Hz). Three integer adds per CPU cycle.
+ *    Droop at 20 kHz is -0.34 dB; bands that alias into 0-20 kHz are attenuated by 60 dB or more.
+ * 2. 35-tap Kaiser (beta 8) half-band stages decimating by 2, as many as keep the rate at or above
+ *    the output rate (two for 44.1/48 kHz, one for 96 kHz, none for 192 kHz). Only the 9 nonzero
+ *    tap pairs are evaluated, once per output. Passband ripple is under 0.001 dB to 20 kHz and
+ *    aliasing into 0-20 kHz is attenuated by 80 dB or more.
+ * 3. 64-tap Kaiser (beta 8) windowed sinc fractional resampler to the output rate with 64 phases,
+ *    interpolated linearly, cut off at 0.45x the output rate. At 48 kHz it is flat within 0.1 dB
+ *    to 19.9 kHz and attenuates by 80 dB from 23.9 kHz; at 44.1 kHz, 18.1 and 22.1 kHz.
+ * 4. 40 Hz DC blocking high pass at the output rate.
+ *
+ * CPU cost can be traded for fidelity with DECIM_CIC_ORDER (alias rejection of stage 1),
+ * DECIM_HB_TAPS (stage 2 stopband) and DECIM_RS_TAPS (stage 3 transition width).
+ */
+
+#define DECIM_CIC_ORDER		3						// CIC integrator/comb pairs
+#define DECIM_CIC_RATIO		8						// CIC decimation ratio
+#define DECIM_HB_TAPS		35						// half-band filter length (4n + 3)
+#define DECIM_HB_PAIRS		( ( DECIM_HB_TAPS + 1 ) / 4 )	// nonzero half-band tap pairs
+#define DECIM_HB_STAGES		4						// maximum half-band stages
+#define DECIM_RS_TAPS		64						// resampler filter length
+#define DECIM_RS_PHASES		64						// resampler sub-sample positions
+
+typedef struct {
+	float			hist[2 * DECIM_HB_TAPS];	// input history (mirrored so it can be read linearly)
+	uint32_t		pos;					// next write position in input history
+	uint32_t		odd;					// 1 = next input produces an output
+} DecimHalfband;
+
+typedef struct {
+	float			level;					// current input level
+	uint32_t		ilevel;					// current input level as CIC input
+	uint32_t		integ[DECIM_CIC_ORDER];	// CIC integrators
+	uint32_t		comb[DECIM_CIC_ORDER];	// CIC comb delays
+	uint32_t		cic_phase;				// input clocks since last CIC output
+	float			cic_scale;				// CIC output to float scale
+
+	int				stages;					// number of half-band stages in use
+	float			hb_coeffs[DECIM_HB_PAIRS];	// nonzero half-band taps besides the center one
+	DecimHalfband	hb[DECIM_HB_STAGES];
+
+	float			rs_kernel[DECIM_RS_PHASES + 1][DECIM_RS_TAPS];	// resampler taps for each phase
+	float			rs_hist[2 * DECIM_RS_TAPS];	// resampler input history (mirrored)
+	uint32_t		rs_pos;					// next write position in resampler history
+	int64_t			rs_time;				// time of next output after newest input (32.32 fixed point)
+	int64_t			rs_step;				// resampler inputs per output (32.32 fixed point)
+
+	float			hp_coeff;				// high pass smoothing factor
+	float			hp_in_prev;				// previous input of high pass filter
+	float			hp_out;					// current output of high pass filter
+} Decim;
+
+void	decim_init( Decim *d, double clock_rate, double sample_rate, double hp_cutoff );
+void	decim_clear( Decim *d );
+void	decim_prime( Decim *d, float level );
+void	decim_advance( Decim *d, uint64_t clocks );
+void	decim_save_state( const Decim *d, StateWriter *w );
+int		decim_load_state( Decim *d, StateReader *r );
+size_t	decim_clocks_until( const Decim *d, size_t samples, size_t max_clocks );
+int		decim_clock( Decim *d, float level, float *sample_out );
+size_t	decim_run( Decim *d, float level, size_t clocks, float *samples_out, size_t max_samples,
+		size_t *samples_written );
+
+#endif // DECIM_H
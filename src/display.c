@@ -4,6 +4,7 @@
 #include "apu.h"
 #include "SDL2/SDL_image.h"
 #include "audio.h"
+#include "profile.h"
 
 static const Uint32 rmask = 0x000000ff;
 static const Uint32 gmask = 0x0000ff00;
@@ -119,14 +120,79 @@ draw_oscilloscope()
 
 	for ( int i = 0; i < 512; i++ )
 	{
-		SDL_RenderDrawPoint( m_renderer, i, 176 + ( 160 * sample_buffer[(int)( 800.0 / 512 ) * i] ) );
+		SDL_RenderDrawPoint( m_renderer, i, 176 + ( 160 * sample_buffer[( sample_buffer_len * i ) / 512] ) );
 	}
 
 	SDL_SetRenderDrawColor( m_renderer, 0, 0, 0, 255 );
 }
 
+#ifdef APU_PROFILE
+
+#define PROFILE_X		208						// left of profiler overlay, right of register view
+#define PROFILE_Y		144
+#define PROFILE_BAR_W	32						// bar width of a stage taking all of the busy time
+#define PROFILE_AVERAGE	60						// frames averaged over
+
+static const struct {
+	char			*label;
+	Uint8			r, g, b;
+} profile_bars[PROFILE_STAGES] = {
+	[PROFILE_DRIVER]	= { "DR", 255,  96,  96 },
+	[PROFILE_CHANNELS]	= { "CH", 255, 192,  64 },
+	[PROFILE_MIXER]		= { "MX", 224, 255,  64 },
+	[PROFILE_FILTER]	= { "FI",  64, 255, 128 },
+	[PROFILE_QUEUE]		= { "QU",  64, 192, 255 },
+	[PROFILE_WAV]		= { "WV", 128, 128, 255 },
+	[PROFILE_DISPLAY]	= { "DS", 255, 128, 255 },
+};
+
+/**
+ * Draws the profiler overlay next to the register view: one bar per stage for its share of the
+ * time spent in all stages over the last PROFILE_AVERAGE frames, and below them that time as a
+ * percentage of the frame time
+ */
+static void
+draw_profile()
+{
+	uint64_t ticks[PROFILE_STAGES] = { 0 };
+	uint64_t busy = 0;
+	uint64_t total = 0;
+	const ProfileFrame *pf;
+
+	for ( size_t age = 0; age < PROFILE_AVERAGE && ( pf = profile_get( age ) ) != NULL; age++ )
+	{
+		for ( int s = PROFILE_OTHER + 1; s < PROFILE_STAGES; s++ )
+		{
+			ticks[s] += pf->ticks[s];
+			busy += pf->ticks[s];
+		}
+
+		total += pf->total;
+	}
+
+	if ( busy == 0 || total == 0 )
+		return;
+
+	for ( int s = PROFILE_OTHER + 1; s < PROFILE_STAGES; s++ )
+	{
+		const int y = PROFILE_Y + 8 * ( s - 1 );
+		SDL_Rect bar = { PROFILE_X + 16, y + 1, ( ticks[s] * PROFILE_BAR_W + busy / 2 ) / busy, 6 };
+
+		draw_text( profile_bars[s].label, PROFILE_X, y );
+		SDL_FillRect( m_surface, &bar, SDL_MapRGB( m_surface->format,
+				profile_bars[s].r, profile_bars[s].g, profile_bars[s].b ) );
+	}
+
+	char busy_str[8];
+
+	snprintf( busy_str, sizeof(busy_str), "%3d%%", (int)( ( busy * 100 + total / 2 ) / total ) );
+	draw_text( busy_str, PROFILE_X + 16, PROFILE_Y + 8 * ( PROFILE_STAGES - 1 ) );
+}
+
+#endif // APU_PROFILE
+
 void
-display_update()
+display_update( const Apu *apu )
 {
 	SDL_DestroyTexture( m_texture );
 	SDL_RenderClear( m_renderer );
@@ -139,15 +205,19 @@ display_update()
 	{
 		sprintf(
 			regs_str, "$%02x $%02x $%02x $%02x $%02x",
-			apu_read_internal( i ),
-			apu_read_internal( i +  4 ),
-			apu_read_internal( i +  8 ),
-			apu_read_internal( i + 12 ),
-			apu_read_internal( i + 16 )
+			apu_read_internal( apu, i ),
+			apu_read_internal( apu, i +  4 ),
+			apu_read_internal( apu, i +  8 ),
+			apu_read_internal( apu, i + 12 ),
+			apu_read_internal( apu, i + 16 )
 		);
 		draw_text( regs_str, 48, 144 + ( 16 * i ) );
 	}
 
+#ifdef APU_PROFILE
+	draw_profile();
+#endif
+
 	draw_oscilloscope();
 
 	m_texture = SDL_CreateTextureFromSurface( m_renderer, m_surface );
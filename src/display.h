@@ -3,6 +3,7 @@
 
 #include "SDL2/SDL_video.h"
 #include "SDL2/SDL_render.h"
+#include "apu.h"
 
 #define SCREEN_W	256
 #define SCREEN_H	240
@@ -13,6 +14,6 @@ extern SDL_Surface	*m_surface;
 extern SDL_Texture	*m_texture;
 
 extern void display_init();
-extern void display_update();
+extern void display_update( const Apu *apu );
 
 #endif // DISPLAY_H
@@ -0,0 +1,52 @@
+#include <math.h>
+
+#include "dsp.h"
+
+/**
+ * Zeroth order modified Bessel function of the first kind
+ * @param x Argument
+ * @return I0(x)
+ */
+static double
+bessel_i0( double x )
+{
+	double sum = 1.0;
+	double term = 1.0;
+
+	for ( int k = 1; term > sum * 1e-12; k++ )
+	{
+		term *= ( x / ( 2 * k ) ) * ( x / ( 2 * k ) );
+		sum += term;
+	}
+
+	return sum;
+}
+
+/**
+ * Normalized sinc function
+ * @param x Argument
+ * @return sin(pi x) / (pi x)
+ */
+double
+dsp_sinc( double x )
+{
+	if ( x == 0.0 )
+		return 1.0;
+
+	return sin( M_PI * x ) / ( M_PI * x );
+}
+
+/**
+ * Kaiser window
+ * @param t Position in window, from -1 to 1
+ * @param beta Window shape parameter (higher = lower sidelobes, wider main lobe)
+ * @return Window value, 0 outside of the window
+ */
+double
+dsp_kaiser( double t, double beta )
+{
+	if ( t <= -1.0 || t >= 1.0 )
+		return 0.0;
+
+	return bessel_i0( beta * sqrt( 1.0 - t * t ) ) / bessel_i0( beta );
+}
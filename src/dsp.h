@@ -0,0 +1,7 @@
+#ifndef DSP_H
+#define DSP_H
+
+double	dsp_sinc( double x );
+double	dsp_kaiser( double t, double beta );
+
+#endif // DSP_H
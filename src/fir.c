@@ -0,0 +1,523 @@
+#include <math.h>
+#include <string.h>
+
+#include "fir.h"
+#include "dsp.h"
+
+#define FIR_HP_FLOOR	1e-20f					// high pass output treated as fully decayed
+
+/**
+ * Works out a low pass coefficient before normalization
+ * @param x Position from the middle of the filter in input clocks
+ * @param fc Cutoff frequency as a fraction of the input clock rate
+ * @param half Position of the last coefficient
+ * @param beta Kaiser window shape
+ * @return Coefficient
+ */
+static double
+lp_tap( double x, double fc, double half, double beta )
+{
+	return dsp_sinc( 2 * fc * x ) * dsp_kaiser( x / ( half + 1 ), beta );
+}
+
+/**
+ * Sets up a high pass and Kaiser-windowed sinc low pass running at the input clock rate
+ * @param f Filter
+ * @param clock_rate Input clock rate
+ * @param sample_rate Output sample rate
+ * @param hp_cutoff Cutoff frequency of the DC blocking high pass
+ * @param taps Number of low pass coefficients (at most FIR_MAX_TAPS)
+ * @param beta Kaiser window shape
+ * @param cutoff Low pass cutoff frequency as a fraction of the output rate
+ */
+void
+fir_init( Fir *f, double clock_rate, double sample_rate, double hp_cutoff, uint32_t taps,
+		double beta, double cutoff )
+{
+	const double fc = cutoff * sample_rate / clock_rate;
+	const double half = ( taps - 1 ) / 2.0;
+
+	// pad up to a whole number of SIMD blocks. the padding goes at the oldest end of the history,
+	// so it does not change the filter delay
+
+	f->taps = ( taps + SIMD_TAPS_ALIGN - 1 ) & ~( SIMD_TAPS_ALIGN - 1 );
+
+	const uint32_t pad = f->taps - taps;
+	double sum = 0.0;
+
+	memset( f->coeffs, 0, sizeof(f->coeffs) );
+
+	for ( uint32_t k = 0; k < taps; k++ )
+		sum += lp_tap( k - half, fc, half, beta );
+
+	// normalize for unity gain at DC, rounding each coefficient to float only once
+
+	for ( uint32_t k = 0; k < taps; k++ )
+		f->coeffs[pad + k] = lp_tap( k - half, fc, half, beta ) / sum;
+
+	double rc = 1.0 / ( M_PI * 2 * hp_cutoff );
+	double a = rc / ( rc + 1.0 / clock_rate );
+
+	f->hp_coeff = a;
+
+	for ( int i = 0; i < SIMD_MAX_LANES; i++ )
+		f->hp_powers[i] = pow( a, i );
+
+	f->hp_block = pow( a, SIMD_MAX_LANES );
+
+	f->timer.div	= clock_rate / sample_rate;
+	f->kernels		= simd_best();
+
+	fir_clear( f );
+}
+
+/**
+ * Clears all filter state
+ * @param f Filter
+ */
+void
+fir_clear( Fir *f )
+{
+	memset( f->hist, 0, sizeof(f->hist) );
+
+	f->pos		= 0;
+	f->level	= 0.0f;
+	f->hp_out	= 0.0f;
+	f->hp_base	= 0.0f;
+	f->hp_phase	= 0;
+
+	fir_timer_reset( &f->timer );
+}
+
+/**
+ * Clears all filter state as if the input had been at a level for ever, so that running on from
+ * that level does not cause a pop. The time to the next output sample is kept.
+ * @param f Filter
+ * @param level Input level
+ */
+void
+fir_prime( Fir *f, float level )
+{
+	const FirTimer timer = f->timer;
+
+	fir_clear( f );
+	f->timer	= timer;
+	f->level	= level;
+}
+
+/**
+ * Moves the time to the next output sample on by a number of input clocks, as running the filter
+ * for them would, without filtering anything
+ * @param f Filter
+ * @param clocks Number of input clocks
+ */
+void
+fir_advance( Fir *f, uint64_t clocks )
+{
+	fir_timer_advance( &f->timer, clocks );
+}
+
+/**
+ * Saves the filter state. The design is not saved, so it has to match when the state is loaded.
+ * @param f Filter
+ * @param w State writer
+ */
+void
+fir_save_state( const Fir *f, StateWriter *w )
+{
+	state_write( w, &f->taps, sizeof(f->taps) );
+	state_write( w, &f->pos, sizeof(f->pos) );
+	state_write( w, &f->level, sizeof(f->level) );
+	state_write( w, &f->hp_out, sizeof(f->hp_out) );
+	state_write( w, &f->hp_base, sizeof(f->hp_base) );
+	state_write( w, &f->hp_phase, sizeof(f->hp_phase) );
+	state_write( w, f->hist, f->taps * sizeof(float) );
+	fir_timer_save_state( &f->timer, w );
+}
+
+/**
+ * Loads the filter state
+ * @param f Filter
+ * @param r State reader
+ * @return 0 on success, -1 if the state is truncated or was saved with a different filter length
+ */
+int
+fir_load_state( Fir *f, StateReader *r )
+{
+	uint32_t taps;
+
+	state_read( r, &taps, sizeof(taps) );
+
+	if ( r->error || taps != f->taps )
+		return -1;
+
+	state_read( r, &f->pos, sizeof(f->pos) );
+	state_read( r, &f->level, sizeof(f->level) );
+	state_read( r, &f->hp_out, sizeof(f->hp_out) );
+	state_read( r, &f->hp_base, sizeof(f->hp_base) );
+	state_read( r, &f->hp_phase, sizeof(f->hp_phase) );
+	state_read( r, f->hist, f->taps * sizeof(float) );
+
+	if ( r->error || f->pos >= f->taps || f->hp_phase >= SIMD_MAX_LANES )
+		return -1;
+	if ( fir_timer_load_state( &f->timer, r ) != 0 )
+		return -1;
+
+	memcpy( &f->hist[f->taps], f->hist, f->taps * sizeof(float) );
+	return 0;
+}
+
+/**
+ * Overrides the kernel set picked for the CPU
+ * @param f Filter
+ * @param kernels Kernel set (must be supported by the CPU)
+ */
+void
+fir_set_kernels( Fir *f, const SimdKernels *kernels )
+{
+	f->kernels = kernels;
+}
+
+/**
+ * Moves the high pass decay on to the next block of SIMD_MAX_LANES clocks
+ * @param f Filter
+ */
+static inline void
+next_block( Fir *f )
+{
+	f->hp_base *= f->hp_block;
+	f->hp_phase = 0;
+
+	// don't let the tail of the decay turn into denormals
+
+	if ( fabsf( f->hp_base ) < FIR_HP_FLOOR )
+		f->hp_base = 0.0f;
+}
+
+/**
+ * Adds a run of high pass outputs for a constant input to the history. Each output is computed
+ * as hp_base * hp_powers[hp_phase], so the values only depend on the number of clocks since the
+ * last input step, not on how the run is split up between calls.
+ * @param f Filter
+ * @param n Number of input clocks
+ */
+static void
+push_decay( Fir *f, size_t n )
+{
+	while ( n > 0 )
+	{
+		size_t seg = SIMD_MAX_LANES - f->hp_phase;
+
+		if ( seg > f->taps - f->pos )
+			seg = f->taps - f->pos;
+		if ( seg > n )
+			seg = n;
+
+		float *out = &f->hist[f->pos];
+
+		f->kernels->scale( out, f->hp_base, &f->hp_powers[f->hp_phase], seg );
+		memcpy( out + f->taps, out, seg * sizeof(float) );
+		f->hp_out = out[seg - 1];
+
+		f->hp_phase += seg;
+		if ( f->hp_phase == SIMD_MAX_LANES )
+			next_block( f );
+
+		f->pos += seg;
+		if ( f->pos == f->taps )
+			f->pos = 0;
+
+		n -= seg;
+	}
+}
+
+/**
+ * Runs the low pass over the history. hist[pos] is the oldest input after the last push.
+ * @param f Filter
+ * @return Output sample
+ */
+static inline float
+convolve( const Fir *f )
+{
+	return f->kernels->dot( f->coeffs, &f->hist[f->pos], f->taps );
+}
+
+/**
+ * Works out how many input clocks it will take to output a number of samples
+ * @param f Filter
+ * @param samples Number of samples (at least 1)
+ * @param max_clocks Most clocks to look ahead
+ * @return Clocks until and including the one that outputs the last sample, at most max_clocks
+ */
+size_t
+fir_clocks_until( const Fir *f, size_t samples, size_t max_clocks )
+{
+	return fir_timer_clocks_until( &f->timer, samples, max_clocks );
+}
+
+/**
+ * Runs the filter for one input clock. Will output a sample if enough time has passed.
+ * @param f Filter
+ * @param level Input level for this clock
+ * @param sample_out Buffer to write outputted sample to
+ * @return 1 if a sample was output, otherwise 0
+ */
+int
+fir_clock( Fir *f, float level, float *sample_out )
+{
+	// apply high pass. an input step starts a new decay, otherwise carry on with the current one
+
+	if ( level != f->level )
+	{
+		f->hp_out	= f->hp_coeff * ( f->hp_out + level - f->level );
+		f->level	= level;
+		f->hp_base	= f->hp_out;
+		f->hp_phase	= 1;
+	}
+	else
+	{
+		f->hp_out = f->hp_base * f->hp_powers[f->hp_phase];
+
+		if ( ++f->hp_phase == SIMD_MAX_LANES )
+			next_block( f );
+	}
+
+	f->hist[f->pos] = f->hp_out;
+	f->hist[f->pos + f->taps] = f->hp_out;
+
+	if ( ++f->pos == f->taps )
+		f->pos = 0;
+
+	if ( ++f->timer.elapsed == f->timer.due )
+	{
+		fir_timer_next( &f->timer );
+		*sample_out = convolve( f );
+		return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Runs the filter for a number of input clocks at a constant input level. Stops early as soon as
+ * max_samples samples have been output.
+ * @param f Filter
+ * @param level Input level for these clocks
+ * @param clocks Number of input clocks to run
+ * @param samples_out Buffer to write outputted samples to
+ * @param max_samples Size of samples_out in samples
+ * @param samples_written Pointer to value to add the number of outputted samples to
+ * @return Number of input clocks run
+ */
+size_t
+fir_run( Fir *f, float level, size_t clocks, float *samples_out, size_t max_samples,
+		size_t *samples_written )
+{
+	size_t ran = 0;
+	size_t samples = 0;
+
+	// the first clock sees the input step, after that the high pass output just decays
+
+	if ( level != f->level && clocks > 0 && max_samples > 0 )
+	{
+		samples += fir_clock( f, level, samples_out );
+		ran++;
+	}
+
+	while ( ran < clocks && samples < max_samples )
+	{
+		size_t need = f->timer.due - f->timer.elapsed;
+
+		if ( need > clocks - ran )
+		{
+			push_decay( f, clocks - ran );
+			f->timer.elapsed += clocks - ran;
+			ran = clocks;
+			break;
+		}
+
+		push_decay( f, need );
+		fir_timer_next( &f->timer );
+		ran += need;
+		samples_out[samples++] = convolve( f );
+	}
+
+	*samples_written += samples;
+	return ran;
+}
+
+/**
+ * Counts input clocks on a sample counter until it reaches the divider, leaving the counter where
+ * adding them one at a time in float would. Adding 1 is exact until the sum passes a power of two,
+ * so each run of clocks up to the next power of two only rounds once, on its last clock, and can
+ * be added as one.
+ * @param ctr Sample counter as left after an output sample (at least 0 and below 2)
+ * @param div Input clocks per output sample (at least 2)
+ * @return Clocks until and including the one that reaches div
+ */
+static uint32_t
+count_clocks( float *ctr, double div )
+{
+	float c = *ctr;
+	uint32_t n = 0;
+
+	// below 1 the counter can have bits finer than any sum with 1 keeps, so add the first clock on
+	// its own
+
+	if ( c < 1.0f )
+	{
+		c++;
+		n++;
+	}
+
+	// at the start of each run the counter is between top / 2 and top / 2 + 1, and the run lands
+	// it between top and top + 1
+
+	float top;
+
+	for ( top = 2.0f; top < div; top *= 2.0f )
+	{
+		const float k = ( c < top / 2 + 1 ) ? top / 2 : top / 2 - 1;
+
+		c += k;
+		n += (uint32_t)k;
+
+		if ( c >= div )
+		{
+			*ctr = c;
+			return n;
+		}
+	}
+
+	// the rest of the way the sums stay below top, so they are exact. the counter is on a grid at
+	// least as coarse as div's, so div - c is exact too
+
+	const double left = div - c;
+	uint32_t k = (uint32_t)left;
+
+	k += ( k < left );
+
+	*ctr = c + (float)k;
+	return n + k;
+}
+
+/**
+ * Works out when the next output sample is due from the sample counter after the last one
+ * @param t Timer
+ */
+static void
+schedule( FirTimer *t )
+{
+	t->due_ctr	= t->ctr;
+	t->due		= count_clocks( &t->due_ctr, t->div );
+	t->due_ctr	-= t->div;
+}
+
+/**
+ * Starts timing output samples from scratch, as when the sample counter was first set up
+ * @param t Timer (with div set)
+ */
+void
+fir_timer_reset( FirTimer *t )
+{
+	t->ctr		= 0.0f;
+	t->elapsed	= 0;
+	schedule( t );
+}
+
+/**
+ * Moves the sample counter on to just after the next output sample. Call this when elapsed
+ * reaches due.
+ * @param t Timer
+ */
+void
+fir_timer_next( FirTimer *t )
+{
+	t->ctr		= t->due_ctr;
+	t->elapsed	= 0;
+	schedule( t );
+}
+
+/**
+ * Moves the sample counter on by a number of input clocks
+ * @param t Timer
+ * @param clocks Number of input clocks
+ */
+void
+fir_timer_advance( FirTimer *t, uint64_t clocks )
+{
+	while ( clocks >= t->due - t->elapsed )
+	{
+		clocks -= t->due - t->elapsed;
+		fir_timer_next( t );
+	}
+
+	t->elapsed += clocks;
+}
+
+/**
+ * Works out how many input clocks it will take to output a number of samples
+ * @param t Timer
+ * @param samples Number of samples (at least 1)
+ * @param max_clocks Most clocks to look ahead
+ * @return Clocks until and including the one that outputs the last sample, at most max_clocks
+ */
+size_t
+fir_timer_clocks_until( const FirTimer *t, size_t samples, size_t max_clocks )
+{
+	// there is never more than one output sample per input clock
+
+	if ( samples > max_clocks )
+		return max_clocks;
+
+	size_t clocks = t->due - t->elapsed;
+
+	// every sample after the first takes more than div - 1 clocks, which is usually enough to tell
+	// that they don't all fit
+
+	const size_t least = (size_t)t->div - 1;
+
+	if ( clocks >= max_clocks || samples - 1 > ( max_clocks - clocks - 1 ) / least )
+		return max_clocks;
+
+	float ctr = t->due_ctr;
+
+	while ( --samples > 0 && clocks < max_clocks )
+	{
+		clocks += count_clocks( &ctr, t->div );
+		ctr -= t->div;
+	}
+
+	return ( clocks < max_clocks ) ? clocks : max_clocks;
+}
+
+/**
+ * Saves the timer state
+ * @param t Timer
+ * @param w State writer
+ */
+void
+fir_timer_save_state( const FirTimer *t, StateWriter *w )
+{
+	state_write( w, &t->ctr, sizeof(t->ctr) );
+	state_write( w, &t->elapsed, sizeof(t->elapsed) );
+}
+
+/**
+ * Loads the timer state
+ * @param t Timer (with div set)
+ * @param r State reader
+ * @return 0 on success, -1 if the state is truncated or out of range
+ */
+int
+fir_timer_load_state( FirTimer *t, StateReader *r )
+{
+	state_read( r, &t->ctr, sizeof(t->ctr) );
+	state_read( r, &t->elapsed, sizeof(t->elapsed) );
+
+	if ( r->error || !( t->ctr >= 0.0f && t->ctr < 2.0f ) )
+		return -1;
+
+	schedule( t );
+	return ( t->elapsed < t->due ) ? 0 : -1;
+}
@@ -0,0 +1,66 @@
+#ifndef FIR_H
+#define FIR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "simd.h"
+#include "state.h"
+
+#define FIR_MAX_TAPS	2048					// max low pass length (multiple of SIMD_TAPS_ALIGN)
+
+/*
+ * High pass and Kaiser-windowed sinc low pass output engine, for APU_OUTPUT_FIR. Output samples
+ * are timed by a float counter of input clocks, which is worked out a whole sample ahead but lands
+ * exactly where adding one clock at a time would. While the input holds still, the high pass
+ * output is the output at the last input step times a power of the smoothing factor.
+ */
+
+typedef struct {
+	double			div;					// input clocks per output sample
+	float			ctr;					// sample counter after the last output sample
+	float			due_ctr;				// sample counter after the next output sample
+	uint32_t		elapsed;				// input clocks since the last output sample
+	uint32_t		due;					// input clocks from the last output sample to the next
+} FirTimer;
+
+typedef struct {
+	float			coeffs[FIR_MAX_TAPS];	// low pass coefficients, zero padded at the oldest end
+	float			hist[2 * FIR_MAX_TAPS];	// high pass output history, mirrored so it can be read linearly
+	uint32_t		taps;					// low pass length after padding
+	uint32_t		pos;					// next write position in history
+
+	FirTimer		timer;					// output sample timing
+
+	float			level;					// previous input level
+	float			hp_coeff;				// high pass smoothing factor
+	float			hp_powers[SIMD_MAX_LANES];	// hp_coeff ^ 0 .. hp_coeff ^ ( SIMD_MAX_LANES - 1 )
+	float			hp_block;				// hp_coeff ^ SIMD_MAX_LANES
+	float			hp_out;					// current output of high pass filter
+	float			hp_base;				// high pass output at the start of the current decay block
+	uint32_t		hp_phase;				// position within the current decay block
+
+	const SimdKernels *kernels;				// convolution and filter kernels
+} Fir;
+
+void	fir_init( Fir *f, double clock_rate, double sample_rate, double hp_cutoff, uint32_t taps,
+		double beta, double cutoff );
+void	fir_clear( Fir *f );
+void	fir_prime( Fir *f, float level );
+void	fir_advance( Fir *f, uint64_t clocks );
+void	fir_set_kernels( Fir *f, const SimdKernels *kernels );
+void	fir_save_state( const Fir *f, StateWriter *w );
+int		fir_load_state( Fir *f, StateReader *r );
+size_t	fir_clocks_until( const Fir *f, size_t samples, size_t max_clocks );
+int		fir_clock( Fir *f, float level, float *sample_out );
+size_t	fir_run( Fir *f, float level, size_t clocks, float *samples_out, size_t max_samples,
+		size_t *samples_written );
+
+void	fir_timer_reset( FirTimer *t );
+void	fir_timer_next( FirTimer *t );
+void	fir_timer_advance( FirTimer *t, uint64_t clocks );
+size_t	fir_timer_clocks_until( const FirTimer *t, size_t samples, size_t max_clocks );
+void	fir_timer_save_state( const FirTimer *t, StateWriter *w );
+int		fir_timer_load_state( FirTimer *t, StateReader *r );
+
+#endif // FIR_H
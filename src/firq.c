@@ -0,0 +1,388 @@
+#include <math.h>
+#include <string.h>
+
+#include "firq.h"
+
+#define FIRQ_Q30_ONE	1073741824.0			// 1.0 in Q30
+
+/**
+ * Sets up an integer filter with the same high pass and low pass as a float one, and clears its
+ * state
+ * @param q Filter
+ * @param f Filter to quantize the design of
+ */
+void
+firq_init( FirQ *q, const Fir *f )
+{
+	double sum = 0.0;
+	double error = 0.0;
+	double peak = 0.0;
+
+	for ( uint32_t k = 0; k < f->taps; k++ )
+		peak = fmax( peak, fabs( f->coeffs[k] ) );
+
+	// the dot product is summed in 64 bits, so the only limit is fitting the largest coefficient in
+	// 16 bits. -32768 is left out so that the kernels' pairs of products fit in 32 bits
+
+	q->coeff_shift = FIRQ_MAX_COEFF_SHIFT;
+
+	while ( q->coeff_shift > 0 && peak * ( (int64_t)1 << q->coeff_shift ) >= INT16_MAX - 0.5 )
+		q->coeff_shift--;
+
+	memset( q->coeffs, 0, sizeof(q->coeffs) );
+
+	for ( uint32_t k = 0; k < f->taps; k++ )
+	{
+		const double scale = (double)( (int64_t)1 << q->coeff_shift );
+		const long c = lrint( f->coeffs[k] * scale );
+
+		q->coeffs[k] = c;
+		sum += fabs( c / scale );
+		error += fabs( f->coeffs[k] - c / scale );
+	}
+
+	const double a = f->hp_coeff;
+
+	for ( int i = 0; i < SIMD_MAX_LANES; i++ )
+		q->hp_powers[i] = lrint( pow( a, i ) * FIRQ_Q30_ONE );
+
+	q->hp_coeff	= q->hp_powers[1];
+	q->hp_block	= lrint( pow( a, SIMD_MAX_LANES ) * FIRQ_Q30_ONE );
+	q->taps		= f->taps;
+	q->timer.div	= f->timer.div;
+	q->kernels		= f->kernels;
+
+	// see firq.h. everything before the low pass goes through it at a gain of at most sum, the
+	// high pass output it sees never exceeds 1 in magnitude. changing the high pass coefficient by
+	// d changes the output by at most 2 d / ( e ( 1 - a ) ) for inputs between 0 and 1
+
+	const double hp_round = 1.0 / 65536.0 / ( 1.0 - a );
+	const double hp_coeff_round = 2.0 * ( 0.5 / FIRQ_Q30_ONE ) / ( M_E * ( 1.0 - a ) ) * FIRQ_LEVEL_ONE;
+	const double before = 2.0 + hp_round + hp_coeff_round + 0.5;
+
+	q->error_bound = before * sum + error * FIRQ_LEVEL_ONE + 0.5;
+
+	firq_clear( q );
+}
+
+/**
+ * Clears all filter state
+ * @param q Filter
+ */
+void
+firq_clear( FirQ *q )
+{
+	memset( q->hist, 0, sizeof(q->hist) );
+
+	q->pos		= 0;
+	q->level	= 0;
+	q->hp_out	= 0;
+	q->hp_base	= 0;
+	q->hp_phase	= 0;
+
+	fir_timer_reset( &q->timer );
+}
+
+/**
+ * Clears all filter state as if the input had been at a level for ever, so that running on from
+ * that level does not cause a pop. The time to the next output sample is kept.
+ * @param q Filter
+ * @param level Input level (Q15)
+ */
+void
+firq_prime( FirQ *q, int32_t level )
+{
+	const FirTimer timer = q->timer;
+
+	firq_clear( q );
+	q->timer	= timer;
+	q->level	= level;
+}
+
+/**
+ * Moves the time to the next output sample on by a number of input clocks, as running the filter
+ * for them would, without filtering anything
+ * @param q Filter
+ * @param clocks Number of input clocks
+ */
+void
+firq_advance( FirQ *q, uint64_t clocks )
+{
+	fir_timer_advance( &q->timer, clocks );
+}
+
+/**
+ * Returns the worst-case difference between the output of the filter and that of the float filter
+ * it was made from, for any input
+ * @param q Filter
+ * @return Error bound in int16 LSBs
+ */
+double
+firq_error_bound( const FirQ *q )
+{
+	return q->error_bound;
+}
+
+/**
+ * Saves the filter state. The design is not saved, so it has to match when the state is loaded.
+ * @param q Filter
+ * @param w State writer
+ */
+void
+firq_save_state( const FirQ *q, StateWriter *w )
+{
+	state_write( w, &q->taps, sizeof(q->taps) );
+	state_write( w, &q->pos, sizeof(q->pos) );
+	state_write( w, &q->level, sizeof(q->level) );
+	state_write( w, &q->hp_out, sizeof(q->hp_out) );
+	state_write( w, &q->hp_base, sizeof(q->hp_base) );
+	state_write( w, &q->hp_phase, sizeof(q->hp_phase) );
+	state_write( w, q->hist, q->taps * sizeof(int16_t) );
+	fir_timer_save_state( &q->timer, w );
+}
+
+/**
+ * Loads the filter state
+ * @param q Filter
+ * @param r State reader
+ * @return 0 on success, -1 if the state is truncated or was saved with a different filter length
+ */
+int
+firq_load_state( FirQ *q, StateReader *r )
+{
+	uint32_t taps;
+
+	state_read( r, &taps, sizeof(taps) );
+
+	if ( r->error || taps != q->taps )
+		return -1;
+
+	state_read( r, &q->pos, sizeof(q->pos) );
+	state_read( r, &q->level, sizeof(q->level) );
+	state_read( r, &q->hp_out, sizeof(q->hp_out) );
+	state_read( r, &q->hp_base, sizeof(q->hp_base) );
+	state_read( r, &q->hp_phase, sizeof(q->hp_phase) );
+	state_read( r, q->hist, q->taps * sizeof(int16_t) );
+
+	if ( r->error || q->pos >= q->taps || q->hp_phase >= SIMD_MAX_LANES )
+		return -1;
+	if ( fir_timer_load_state( &q->timer, r ) != 0 )
+		return -1;
+
+	memcpy( &q->hist[q->taps], q->hist, q->taps * sizeof(int16_t) );
+	return 0;
+}
+
+/**
+ * Multiplies a high pass value by a Q30 factor, rounding to nearest
+ * @param x High pass value (Q30)
+ * @param c Factor (Q30, at most 1.0)
+ * @return Product (Q30)
+ */
+static inline int32_t
+mul_q30( int64_t x, int32_t c )
+{
+	return (int32_t)( ( x * c + ( (int64_t)1 << 29 ) ) >> 30 );
+}
+
+/**
+ * Rounds a high pass output to the Q15 history format
+ * @param hp High pass output (Q30)
+ * @return High pass output (Q15)
+ */
+static inline int16_t
+hist_value( int32_t hp )
+{
+	int32_t v = ( hp + ( 1 << ( FIRQ_HP_SHIFT - 16 ) ) ) >> ( FIRQ_HP_SHIFT - 15 );
+
+	if ( v > INT16_MAX )
+		return INT16_MAX;
+	if ( v < INT16_MIN )
+		return INT16_MIN;
+
+	return v;
+}
+
+/**
+ * Moves the high pass decay on to the next block of SIMD_MAX_LANES clocks
+ * @param q Filter
+ */
+static inline void
+next_block( FirQ *q )
+{
+	q->hp_base	= mul_q30( q->hp_base, q->hp_block );
+	q->hp_phase	= 0;
+}
+
+/**
+ * Adds a run of high pass outputs for a constant input to the history. As in fir.c, each output is
+ * computed as hp_base * hp_powers[hp_phase], so the values only depend on the number of clocks
+ * since the last input step, not on how the run is split up between calls. The products are
+ * rounded straight to Q15 rather than through Q30.
+ * @param q Filter
+ * @param n Number of input clocks
+ */
+static void
+push_decay( FirQ *q, size_t n )
+{
+	while ( n > 0 )
+	{
+		size_t seg = SIMD_MAX_LANES - q->hp_phase;
+
+		if ( seg > q->taps - q->pos )
+			seg = q->taps - q->pos;
+		if ( seg > n )
+			seg = n;
+
+		int16_t *out = &q->hist[q->pos];
+
+		if ( mul_q30( q->hp_base, q->hp_block ) == q->hp_base )
+		{
+			// rounding has stopped the decay, every output from here on is hp_base
+
+			const int16_t v = hist_value( q->hp_base );
+
+			for ( size_t i = 0; i < seg; i++ )
+				out[i] = v;
+
+			q->hp_out = q->hp_base;
+		}
+		else
+		{
+			q->kernels->decay_q15( out, q->hp_base, &q->hp_powers[q->hp_phase], seg );
+			q->hp_out = mul_q30( q->hp_base, q->hp_powers[q->hp_phase + seg - 1] );
+		}
+
+		memcpy( out + q->taps, out, seg * sizeof(int16_t) );
+
+		q->hp_phase += seg;
+		if ( q->hp_phase == SIMD_MAX_LANES )
+			next_block( q );
+
+		q->pos += seg;
+		if ( q->pos == q->taps )
+			q->pos = 0;
+
+		n -= seg;
+	}
+}
+
+/**
+ * Runs the low pass over the history. hist[pos] is the oldest input after the last push.
+ * @param q Filter
+ * @return Output sample
+ */
+static inline int16_t
+convolve( const FirQ *q )
+{
+	const int64_t acc = q->kernels->dot_q15( q->coeffs, &q->hist[q->pos], q->taps );
+	const int64_t v = ( acc + ( (int64_t)1 << q->coeff_shift >> 1 ) ) >> q->coeff_shift;
+
+	if ( v > INT16_MAX )
+		return INT16_MAX;
+	if ( v < INT16_MIN )
+		return INT16_MIN;
+
+	return v;
+}
+
+/**
+ * Works out how many input clocks it will take to output a number of samples
+ * @param q Filter
+ * @param samples Number of samples (at least 1)
+ * @param max_clocks Most clocks to look ahead
+ * @return Clocks until and including the one that outputs the last sample, at most max_clocks
+ */
+size_t
+firq_clocks_until( const FirQ *q, size_t samples, size_t max_clocks )
+{
+	return fir_timer_clocks_until( &q->timer, samples, max_clocks );
+}
+
+/**
+ * Runs the filter for one input clock. Will output a sample if enough time has passed.
+ * @param q Filter
+ * @param level Input level for this clock (Q15)
+ * @param sample_out Buffer to write outputted sample to
+ * @return 1 if a sample was output, otherwise 0
+ */
+int
+firq_clock( FirQ *q, int32_t level, int16_t *sample_out )
+{
+	// apply high pass. an input step starts a new decay, otherwise carry on with the current one
+
+	if ( level != q->level )
+	{
+		const int64_t step = (int64_t)( level - q->level ) << ( FIRQ_HP_SHIFT - 15 );
+
+		q->hp_out	= mul_q30( q->hp_out + step, q->hp_coeff );
+		q->level	= level;
+		q->hp_base	= q->hp_out;
+		q->hp_phase	= 1;
+
+		q->hist[q->pos] = hist_value( q->hp_out );
+		q->hist[q->pos + q->taps] = q->hist[q->pos];
+
+		if ( ++q->pos == q->taps )
+			q->pos = 0;
+	}
+	else
+		push_decay( q, 1 );
+
+	if ( ++q->timer.elapsed == q->timer.due )
+	{
+		fir_timer_next( &q->timer );
+		*sample_out = convolve( q );
+		return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Runs the filter for a number of input clocks at a constant input level. Stops early as soon as
+ * max_samples samples have been output.
+ * @param q Filter
+ * @param level Input level for these clocks (Q15)
+ * @param clocks Number of input clocks to run
+ * @param samples_out Buffer to write outputted samples to
+ * @param max_samples Size of samples_out in samples
+ * @param samples_written Pointer to value to add the number of outputted samples to
+ * @return Number of input clocks run
+ */
+size_t
+firq_run( FirQ *q, int32_t level, size_t clocks, int16_t *samples_out, size_t max_samples,
+		size_t *samples_written )
+{
+	size_t ran = 0;
+	size_t samples = 0;
+
+	// the first clock sees the input step, after that the high pass output just decays
+
+	if ( level != q->level && clocks > 0 && max_samples > 0 )
+	{
+		samples += firq_clock( q, level, samples_out );
+		ran++;
+	}
+
+	while ( ran < clocks && samples < max_samples )
+	{
+		size_t need = q->timer.due - q->timer.elapsed;
+
+		if ( need > clocks - ran )
+		{
+			push_decay( q, clocks - ran );
+			q->timer.elapsed += clocks - ran;
+			ran = clocks;
+			break;
+		}
+
+		push_decay( q, need );
+		fir_timer_next( &q->timer );
+		ran += need;
+		samples_out[samples++] = convolve( q );
+	}
+
+	*samples_written += samples;
+	return ran;
+}
@@ -0,0 +1,71 @@
+#ifndef FIRQ_H
+#define FIRQ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fir.h"
+#include "simd.h"
+#include "state.h"
+
+#define FIRQ_LEVEL_ONE		32768				// input level 1.0 in Q15
+#define FIRQ_HP_SHIFT		30					// high pass state is Q30, so it can swing between -2 and 2
+#define FIRQ_MAX_COEFF_SHIFT	30				// most fractional bits of the low pass coefficients
+
+/*
+ * Integer version of the FIR output engine, for APU_OUTPUT_FIXED. Input levels and the high pass
+ * output history are Q15, the high pass state and coefficients are Q30, and the low pass
+ * coefficients are quantized from a Fir design to as many fractional bits as still fit the largest
+ * one in 16 bits. The dot product is summed in 64 bits. Output samples are 16-bit.
+ *
+ * Error against the float engine, in units of 2^-15 (one int16 LSB), for a worst-case input:
+ *
+ *   mixer tables rounded to Q15              0.5 each for pulse and TND, doubled by the high pass
+ *   high pass rounding, decaying at rate a   2^-16 / ( 1 - a ), about 0.11 at 40 Hz
+ *   high pass coefficient rounded to Q30     2^-31 * 2 / ( e ( 1 - a ) ), about 0.08
+ *   history rounded to Q15                   0.5
+ *   all of the above through the low pass    times sum( |c| )
+ *   coefficient rounding                     sum( |c - c_q| ) * 32768, see firq_error_bound()
+ *   output rounding                          0.5
+ *
+ * which at 48 kHz comes to about 3.7 LSB for the draft and standard presets and 22 LSB for
+ * mastering, where the rounding of 2047 small coefficients dominates. That takes an input made to
+ * line up with every rounding error; on the demo song the largest error is about 2 LSB for every
+ * preset, with an RMS error of about 0.43 LSB.
+ */
+
+typedef struct {
+	int16_t			coeffs[FIR_MAX_TAPS];	// low pass coefficients, zero padded at the oldest end
+	int16_t			hist[2 * FIR_MAX_TAPS];	// high pass output history (Q15), mirrored
+	uint32_t		taps;					// low pass length after padding
+	uint32_t		pos;					// next write position in history
+	int				coeff_shift;			// fractional bits of coeffs (at most FIRQ_MAX_COEFF_SHIFT)
+
+	FirTimer		timer;					// output sample timing, as in fir.h
+
+	int32_t			level;					// previous input level (Q15)
+	int32_t			hp_coeff;				// high pass smoothing factor (Q30)
+	int32_t			hp_powers[SIMD_MAX_LANES];	// hp_coeff ^ 0 .. hp_coeff ^ ( SIMD_MAX_LANES - 1 ) (Q30)
+	int32_t			hp_block;				// hp_coeff ^ SIMD_MAX_LANES (Q30)
+	int32_t			hp_out;					// current output of high pass filter (Q30)
+	int32_t			hp_base;				// high pass output at the start of the current decay block (Q30)
+	uint32_t		hp_phase;				// position within the current decay block
+
+	double			error_bound;			// worst-case error against the float engine in LSBs
+
+	const SimdKernels *kernels;				// convolution kernels
+} FirQ;
+
+void	firq_init( FirQ *q, const Fir *f );
+void	firq_clear( FirQ *q );
+void	firq_prime( FirQ *q, int32_t level );
+void	firq_advance( FirQ *q, uint64_t clocks );
+double	firq_error_bound( const FirQ *q );
+void	firq_save_state( const FirQ *q, StateWriter *w );
+int		firq_load_state( FirQ *q, StateReader *r );
+size_t	firq_clocks_until( const FirQ *q, size_t samples, size_t max_clocks );
+int		firq_clock( FirQ *q, int32_t level, int16_t *sample_out );
+size_t	firq_run( FirQ *q, int32_t level, size_t clocks, int16_t *samples_out, size_t max_samples,
+		size_t *samples_written );
+
+#endif // FIRQ_H
@@ -0,0 +1,271 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "keyframes.h"
+
+#define KEYFRAMES_MAGIC		0x5849464b				// "KFIX"
+#define KEYFRAMES_VERSION	1
+#define CATCH_UP_SAMPLES	1024					// scratch buffer size for catching up after a seek
+
+/**
+ * Sets up an empty keyframe index
+ * @param idx Index
+ * @param interval Frames between keyframes (0 picks KEYFRAMES_DEFAULT_INTERVAL)
+ */
+void
+keyframes_init( KeyframeIndex *idx, uint32_t interval )
+{
+	memset( idx, 0, sizeof(*idx) );
+	idx->interval = ( interval != 0 ) ? interval : KEYFRAMES_DEFAULT_INTERVAL;
+}
+
+/**
+ * Frees all keyframes of an index and leaves it empty
+ * @param idx Index
+ */
+void
+keyframes_free( KeyframeIndex *idx )
+{
+	free( idx->frames );
+	free( idx->offsets );
+	free( idx->data );
+	keyframes_init( idx, idx->interval );
+}
+
+/**
+ * Makes room for one more keyframe
+ * @param idx Index
+ * @param size Size of keyframe in bytes
+ * @return 0 on success, -1 if allocation failed
+ */
+static int
+reserve( KeyframeIndex *idx, size_t size )
+{
+	if ( idx->count == idx->capacity )
+	{
+		size_t capacity = ( idx->capacity != 0 ) ? 2 * idx->capacity : 64;
+		uint64_t *frames = realloc( idx->frames, capacity * sizeof(*frames) );
+
+		if ( frames == NULL )
+			return -1;
+
+		idx->frames = frames;
+
+		uint64_t *offsets = realloc( idx->offsets, capacity * sizeof(*offsets) );
+
+		if ( offsets == NULL )
+			return -1;
+
+		idx->offsets	= offsets;
+		idx->capacity	= capacity;
+	}
+
+	if ( idx->data_capacity - idx->data_size < size )
+	{
+		size_t capacity = ( idx->data_capacity != 0 ) ? 2 * idx->data_capacity : 64 * size;
+
+		while ( capacity - idx->data_size < size )
+			capacity *= 2;
+
+		uint8_t *data = realloc( idx->data, capacity );
+
+		if ( data == NULL )
+			return -1;
+
+		idx->data			= data;
+		idx->data_capacity	= capacity;
+	}
+
+	return 0;
+}
+
+/**
+ * Records a keyframe if the APU is at the start of a frame that is due one. Call this between
+ * apu_run() calls that stop on frame boundaries, for example by running at most
+ * APU_FRAME_CYCLES - apu_cycle() % APU_FRAME_CYCLES cycles at a time. Frames are counted from
+ * cycle 0, so the frame hook must have been set up before anything was run. Frames at or before the
+ * last keyframe are ignored, so playback that seeks backwards can keep recording.
+ * @param idx Index
+ * @param apu APU instance
+ * @param driver PPMCK driver playing on apu
+ * @return 1 if a keyframe was recorded, 0 if none was due, -1 if allocation failed
+ */
+int
+keyframes_record( KeyframeIndex *idx, const Apu *apu, const Ppmck *driver )
+{
+	const uint64_t cycle = apu_cycle( apu );
+	const uint64_t frame = cycle / APU_FRAME_CYCLES;
+
+	if ( cycle % APU_FRAME_CYCLES != 0 || frame % idx->interval != 0 )
+		return 0;
+	if ( idx->count > 0 && idx->frames[idx->count - 1] >= frame )
+		return 0;
+
+	const size_t apu_size = apu_state_size( apu );
+	const size_t size = apu_size + sound_state_size();
+
+	if ( reserve( idx, size ) != 0 )
+		return -1;
+
+	uint8_t *at = &idx->data[idx->data_size];
+
+	apu_save_state( apu, at, apu_size );
+	sound_save_state( driver, at + apu_size, size - apu_size );
+
+	idx->frames[idx->count]		= frame;
+	idx->offsets[idx->count]	= idx->data_size;
+	idx->count++;
+	idx->data_size += size;
+	return 1;
+}
+
+/**
+ * Moves playback to a CPU cycle: restores the last keyframe at or before it, then emulates up to
+ * it with the output thrown away
+ * @param idx Index
+ * @param apu APU instance
+ * @param driver PPMCK driver playing on apu
+ * @param cycle CPU cycle to seek to (as counted by apu_cycle())
+ * @return 0 on success, -1 if there is no keyframe to start from or it could not be restored
+ */
+int
+keyframes_seek( const KeyframeIndex *idx, Apu *apu, Ppmck *driver, uint64_t cycle )
+{
+	const uint64_t frame = cycle / APU_FRAME_CYCLES;
+	size_t lo = 0, hi = idx->count;
+
+	// find the first keyframe after the target, the one before it is the one to restore
+
+	while ( lo < hi )
+	{
+		size_t mid = lo + ( hi - lo ) / 2;
+
+		if ( idx->frames[mid] <= frame )
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if ( lo == 0 )
+		return -1;
+
+	const size_t i = lo - 1;
+	const size_t end = ( i + 1 < idx->count ) ? idx->offsets[i + 1] : idx->data_size;
+	const size_t apu_size = end - idx->offsets[i] - sound_state_size();
+	const uint8_t *at = &idx->data[idx->offsets[i]];
+
+	if ( apu_load_state( apu, at, apu_size ) != 0 )
+		return -1;
+	if ( sound_load_state( driver, at + apu_size, sound_state_size() ) != 0 )
+		return -1;
+
+	float scratch[CATCH_UP_SAMPLES];
+
+	while ( apu_cycle( apu ) < cycle )
+	{
+		uint64_t left = cycle - apu_cycle( apu );
+
+		if ( apu_run( apu, ( left > SIZE_MAX ) ? SIZE_MAX : left, scratch, CATCH_UP_SAMPLES, NULL ) == 0 )
+			return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Writes a keyframe index to a file. The file is only usable with the build that wrote it.
+ * @param idx Index
+ * @param filename File to write
+ * @return 0 on success, -1 if the file could not be written
+ */
+int
+keyframes_save( const KeyframeIndex *idx, const char *filename )
+{
+	const uint64_t header[5] = {
+		KEYFRAMES_MAGIC, KEYFRAMES_VERSION, idx->interval, idx->count, idx->data_size
+	};
+	FILE *f = fopen( filename, "wb" );
+
+	if ( f == NULL )
+		return -1;
+
+	int ok = fwrite( header, sizeof(header), 1, f ) == 1;
+
+	if ( idx->count > 0 )
+	{
+		ok = ok && fwrite( idx->frames, sizeof(*idx->frames), idx->count, f ) == idx->count;
+		ok = ok && fwrite( idx->offsets, sizeof(*idx->offsets), idx->count, f ) == idx->count;
+		ok = ok && fwrite( idx->data, 1, idx->data_size, f ) == idx->data_size;
+	}
+
+	if ( fclose( f ) != 0 )
+		ok = 0;
+
+	return ok ? 0 : -1;
+}
+
+/**
+ * Reads a keyframe index written by keyframes_save(), replacing the contents of an index
+ * @param idx Index (set up with keyframes_init())
+ * @param filename File to read
+ * @return 0 on success, -1 if the file could not be read or is not a keyframe index
+ */
+int
+keyframes_load( KeyframeIndex *idx, const char *filename )
+{
+	uint64_t header[5];
+	FILE *f = fopen( filename, "rb" );
+
+	if ( f == NULL )
+		return -1;
+
+	keyframes_free( idx );
+
+	if ( fread( header, sizeof(header), 1, f ) != 1 || header[0] != KEYFRAMES_MAGIC ||
+			header[1] != KEYFRAMES_VERSION || header[2] == 0 || header[2] > UINT32_MAX ||
+			header[3] > SIZE_MAX / sizeof(uint64_t) || header[4] > SIZE_MAX )
+	{
+		fclose( f );
+		return -1;
+	}
+
+	const size_t count = header[3];
+	const size_t data_size = header[4];
+
+	idx->interval		= header[2];
+	idx->frames			= malloc( count * sizeof(*idx->frames) + 1 );
+	idx->offsets		= malloc( count * sizeof(*idx->offsets) + 1 );
+	idx->data			= malloc( data_size + 1 );
+
+	int ok = idx->frames != NULL && idx->offsets != NULL && idx->data != NULL;
+
+	ok = ok && fread( idx->frames, sizeof(*idx->frames), count, f ) == count;
+	ok = ok && fread( idx->offsets, sizeof(*idx->offsets), count, f ) == count;
+	ok = ok && fread( idx->data, 1, data_size, f ) == data_size;
+	fclose( f );
+
+	// every keyframe has to lie within the data and be big enough to hold a driver state
+
+	for ( size_t i = 0; ok && i < count; i++ )
+	{
+		const uint64_t end = ( i + 1 < count ) ? idx->offsets[i + 1] : data_size;
+
+		if ( idx->offsets[i] > end || end > data_size || end - idx->offsets[i] <= sound_state_size() )
+			ok = 0;
+		if ( i > 0 && idx->frames[i] <= idx->frames[i - 1] )
+			ok = 0;
+	}
+
+	if ( !ok )
+	{
+		keyframes_free( idx );
+		return -1;
+	}
+
+	idx->count			= count;
+	idx->capacity		= count;
+	idx->data_size		= data_size;
+	idx->data_capacity	= data_size;
+	return 0;
+}
@@ -0,0 +1,40 @@
+#ifndef KEYFRAMES_H
+#define KEYFRAMES_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "apu.h"
+#include "ppmck_driver.h"
+
+#define KEYFRAMES_DEFAULT_INTERVAL	1			// frames between keyframes (every frame)
+
+/*
+ * Index of save states of the APU and the PPMCK driver, taken every so many frames while rendering.
+ * Seeking restores the nearest keyframe before the target and emulates the rest of the way, so
+ * the cost of a seek is bounded by the keyframe interval rather than the position in the track.
+ * With a keyframe every frame, a seek emulates less than one frame. A keyframe is under 1 KiB with
+ * the standard low pass, and about 9 KiB with the mastering one, which has a much longer history.
+ * All keyframes are stored back to back in one buffer, so the index can be written to and read
+ * from disk in one go.
+ */
+
+typedef struct {
+	uint32_t		interval;				// frames between keyframes
+	size_t			count;					// number of keyframes
+	size_t			capacity;				// number of keyframes that fit in frames and offsets
+	uint64_t		*frames;				// frame number of each keyframe, ascending
+	uint64_t		*offsets;				// start of each keyframe in data
+	uint8_t			*data;					// APU and driver save states
+	size_t			data_size;				// bytes used in data
+	size_t			data_capacity;			// size of data
+} KeyframeIndex;
+
+void	keyframes_init( KeyframeIndex *idx, uint32_t interval );
+void	keyframes_free( KeyframeIndex *idx );
+int		keyframes_record( KeyframeIndex *idx, const Apu *apu, const Ppmck *driver );
+int		keyframes_seek( const KeyframeIndex *idx, Apu *apu, Ppmck *driver, uint64_t cycle );
+int		keyframes_save( const KeyframeIndex *idx, const char *filename );
+int		keyframes_load( KeyframeIndex *idx, const char *filename );
+
+#endif // KEYFRAMES_H
@@ -1,47 +1,253 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "apu.h"
+#include "offline.h"
+
+#ifndef APU_HEADLESS
 #include "audio.h"
 #include "bus.h"
 #include "display.h"
-#include "apu.h"
 #include "ppmck_driver.h"
+#include "profile.h"
+#include "rom.h"
+#include "trace.h"
 #include "wav_file.h"
 #include "SDL2/SDL.h"
+#endif
 
-int
-main( int argc, char *argv[] )
+#define CLOCK_RATE		1789773.0				// APU clock rate
+#define RENDER_RATE		48000					// default sample rate of offline renders
+
+typedef struct {
+	int				done;					// jobs finished
+	int				failed;					// jobs that failed
+	int				count;					// jobs in the batch
+} BatchProgress;
+
+/**
+ * Prints the command line usage and exits
+ * @param name Program name
+ * @param status Exit status, EXIT_SUCCESS prints to stdout rather than stderr
+ */
+static void
+usage( const char *name, int status )
+{
+	fprintf( ( status == EXIT_SUCCESS ) ? stdout : stderr,
+			"usage: %s [options] input\n"
+			"Renders a PPMCK song image, NSF or register log to a file as fast as possible,\n"
+			"with no window or audio device.\n"
+			"  -o file     output file (default audio_out.wav), - for stdout with a raw format\n"
+			"  -F format   wav, wav16, raw or raw16 (default wav, 32-bit float)\n"
+			"  -t seconds  length in seconds (default a register log's own, or 180 s)\n"
+			"  -n frames   length in frames of %d cycles\n"
+			"  -s song     NSF song, from 1 (default the file's start song)\n"
+			"  -r rate     output sample rate in Hz (default %d)\n"
+			"  -q quality  filter quality, 0 draft, 1 standard, 2 mastering (default 1)\n"
+			"  -l file     also record a register log of the song\n"
+			"  -j threads  render a PPMCK song on this many threads, 0 for one per core\n"
+			"              (default 1)\n"
+			"  -b          input is a manifest of jobs, one per line: input output\n"
+			"              [seconds [song]], rendered on the threads -j gives. -F, -r, -q,\n"
+			"              -t, -n and -s apply to every job, the lengths and songs as defaults\n"
+			"  -P          with -b, pin each thread to a core of its own\n"
+			"  -h          print this help\n",
+			name, APU_FRAME_CYCLES, RENDER_RATE );
+	exit( status );
+}
+
+/**
+ * Reports a finished batch job. Has the signature of an OfflineDoneHook.
+ * @param userdata BatchProgress
+ * @param job Job
+ * @param stats Length rendered and time taken
+ * @param ok 1 if the job succeeded
+ */
+static void
+report_job( void *userdata, const OfflineJob *job, const OfflineStats *stats, int ok )
+{
+	BatchProgress *progress = userdata;
+
+	progress->done++;
+	progress->failed += !ok;
+
+	if ( ok )
+		fprintf( stderr, "[%d/%d] %s -> %s: %.1f s in %.3f s, %.1fx real time\n", progress->done,
+				progress->count, job->input, job->output, stats->cycles / CLOCK_RATE,
+				stats->seconds, ( stats->seconds > 0 ) ? stats->cycles / CLOCK_RATE / stats->seconds
+				: 0.0 );
+	else
+		fprintf( stderr, "[%d/%d] %s -> %s: failed\n", progress->done, progress->count,
+				job->input, job->output );
+}
+
+/**
+ * Renders the jobs of a manifest on a pool of threads
+ * @param manifest Manifest file
+ * @param defaults Job with the settings for every job, and the defaults for the rest
+ * @param pin 1 to pin each thread to a core
+ * @return Exit status
+ */
+static int
+render_batch( const char *manifest, const OfflineJob *defaults, int pin )
 {
-	(void)argc;
-	(void)argv;
+	OfflineManifest m;
 
-	FILE *song_f = fopen( "aibomb.bin", "rb" );
+	if ( offline_read_manifest( &m, manifest, defaults ) != 0 )
+		return EXIT_FAILURE;
 
-	if ( !song_f )
+	BatchProgress progress = { 0, 0, m.count };
+	OfflineBatch batch = {
+		.jobs		= m.jobs,
+		.count		= m.count,
+		.threads	= defaults->threads,
+		.pin		= pin,
+		.done		= report_job,
+		.userdata	= &progress
+	};
+	OfflineStats stats;
+	const int ok = offline_render_batch( &batch, &stats ) == 0;
+	int threads = ( defaults->threads < m.count ) ? defaults->threads : m.count;
+
+	// offline_render_batch() only uses one thread when profiling
+
+#ifdef APU_PROFILE
+	threads = 1;
+#endif
+
+	fprintf( stderr, "%d jobs, %d failed: rendered %.1f s (%llu samples) in %.3f s on %d threads, "
+			"%.1fx real time\n", m.count, progress.failed, stats.cycles / CLOCK_RATE,
+			(unsigned long long)stats.samples, stats.seconds, threads,
+			( stats.seconds > 0 ) ? stats.cycles / CLOCK_RATE / stats.seconds : 0.0 );
+
+	offline_free_manifest( &m );
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * Renders a song to a file as the command line says, without initializing SDL
+ * @param argc Argument count
+ * @param argv Arguments
+ * @return Exit status
+ */
+static int
+render_command( int argc, char *argv[] )
+{
+	static const char *formats[] = { "wav", "wav16", "raw", "raw16" };
+	OfflineJob job = {
+		.output			= "audio_out.wav",
+		.format			= OFFLINE_WAV_F32,
+		.sample_rate	= RENDER_RATE,
+		.quality		= APU_QUALITY_STANDARD,
+		.song			= OFFLINE_START_SONG,
+		.threads		= 1
+	};
+	int batch = 0;
+	int pin = 0;
+	int opt;
+
+	while ( ( opt = getopt( argc, argv, "o:F:t:n:s:r:q:l:j:bPh" ) ) != -1 )
 	{
-		fprintf( stderr, "Could not open \"aibomb.bin\" to play back\n" );
-		exit( EXIT_FAILURE );
+		switch ( opt )
+		{
+		case 'o': job.output = optarg; break;
+		case 't': job.cycles = atof( optarg ) * CLOCK_RATE; break;
+		case 'n': job.cycles = (uint64_t)strtoull( optarg, NULL, 10 ) * APU_FRAME_CYCLES; break;
+		case 's': job.song = atoi( optarg ) - 1; break;
+		case 'r': job.sample_rate = atoi( optarg ); break;
+		case 'q': job.quality = atoi( optarg ); break;
+		case 'l': job.log = optarg; break;
+		case 'j': job.threads = atoi( optarg ); break;
+		case 'b': batch = 1; break;
+		case 'P': pin = 1; break;
+		case 'h': usage( argv[0], EXIT_SUCCESS ); break;
+		case 'F':
+			job.format = -1;
+
+			for ( int i = 0; i < (int)( sizeof(formats) / sizeof(formats[0]) ); i++ )
+			{
+				if ( strcmp( optarg, formats[i] ) == 0 )
+					job.format = i;
+			}
+
+			if ( job.format < 0 )
+				usage( argv[0], EXIT_FAILURE );
+
+			break;
+		default: usage( argv[0], EXIT_FAILURE );
+		}
 	}
 
-	size_t bytes_read = fread( &cpu_bus[0x8000], 1, 0x8000, song_f );
-	fclose( song_f );
+	if ( optind != argc - 1 || ( job.song < 0 && job.song != OFFLINE_START_SONG ) ||
+			( batch && job.log != NULL ) )
+		usage( argv[0], EXIT_FAILURE );
 
-	if ( bytes_read != 0x8000 )
+	job.input = argv[optind];
+
+	if ( job.threads <= 0 )
+		job.threads = sysconf( _SC_NPROCESSORS_ONLN );
+
+	if ( batch )
+		return render_batch( job.input, &job, pin );
+
+	OfflineStats stats;
+
+	if ( offline_render( &job, &stats ) != 0 )
+		return EXIT_FAILURE;
+
+	// the output may be stdout, so the summary goes to stderr
+
+	fprintf( stderr, "rendered %.1f s (%llu samples) in %.3f s, %.1fx real time\n",
+			stats.cycles / CLOCK_RATE, (unsigned long long)stats.samples, stats.seconds,
+			( stats.seconds > 0 ) ? stats.cycles / CLOCK_RATE / stats.seconds : 0.0 );
+
+	return EXIT_SUCCESS;
+}
+
+#ifndef APU_HEADLESS
+
+/**
+ * Plays aibomb.bin in a window, through the audio device, until the window is closed
+ * @return Exit status
+ */
+static int
+play_demo( void )
+{
+	Rom rom;
+
+	if ( rom_open( &rom, "aibomb.bin" ) != 0 )
 	{
-		fprintf( stderr, "Failed to read \"aibomb.bin\" into buffer\n" );
+		fprintf( stderr, "Could not open \"aibomb.bin\" to play back\n" );
 		exit( EXIT_FAILURE );
 	}
 
 	SDL_Init( SDL_INIT_AUDIO | SDL_INIT_VIDEO );
 	atexit( SDL_Quit );
 
-	apu_init();
+	Ppmck *driver = sound_create( &rom );
+	Apu *apu = ( driver != NULL ) ? apu_create( sound_bus( driver )->pages ) : NULL;
+
+	if ( apu == NULL )
+	{
+		fprintf( stderr, "Failed to allocate APU\n" );
+		exit( EXIT_FAILURE );
+	}
+
+#ifdef APU_TRACE
+	if ( trace_init( TRACE_DEFAULT_CAPACITY ) != 0 )
+		fprintf( stderr, "Failed to allocate trace buffer\n" );
+#endif
 
 	display_init();	
-	audio_init();
+	audio_init( apu, driver, SAMPLE_RATE, APU_QUALITY_STANDARD );
 	audio_start_playback();
 
+#ifdef APU_PROFILE
+	profile_init();
+#endif
+
 	int stop = 0;
 	SDL_Event event;
 
@@ -55,12 +261,49 @@ main( int argc, char *argv[] )
 		if ( stop ) break;
 
 		audio_run_2a03();
-		display_update();
+
+		PROFILE_ENTER( PROFILE_DISPLAY );
+		display_update( apu );
+		PROFILE_LEAVE();
 		
 		// sleep for a teensy bit so we don't totally consume the core
 		SDL_Delay( 10 );
+
+#ifdef APU_PROFILE
+		profile_frame();
+#endif
 	}
 
+#ifdef APU_PROFILE
+	if ( profile_write_csv( "profile.csv" ) != 0 )
+		fprintf( stderr, "Failed to write \"profile.csv\"\n" );
+#endif
+#ifdef APU_TRACE
+	if ( trace_write_json( "trace.json" ) != 0 )
+		fprintf( stderr, "Failed to write \"trace.json\"\n" );
+
+	trace_free();
+#endif
+
 	wav_file_close( audio_out );
-	return 0;
+	apu_destroy( apu );
+	sound_destroy( driver );
+	rom_close( &rom );
+	return EXIT_SUCCESS;
+}
+
+#endif // APU_HEADLESS
+
+int
+main( int argc, char *argv[] )
+{
+	if ( argc > 1 )
+		return render_command( argc, argv );
+
+#ifdef APU_HEADLESS
+	usage( argv[0], EXIT_FAILURE );
+	return EXIT_FAILURE;
+#else
+	return play_demo();
+#endif
 }
@@ -0,0 +1,74 @@
+#include <stdatomic.h>
+
+#include "mixer.h"
+
+static MixerTables tables;
+static atomic_int tables_state;			// 0 = not built, 1 = being built, 2 = ready
+
+/**
+ * Fills in the mixer lookup tables
+ */
+static void
+build_tables( void )
+{
+	for ( int i = 0; i < MIXER_PULSE_SIZE; i++ )
+	{
+		tables.pulse_exact[i]	= mixer_pulse_formula( i, 0 );
+		tables.pulse_linear[i]	= 95.52f / ( 8128.0f / i + 100 );
+	}
+
+	for ( int tri = 0; tri < 16; tri++ )
+	{
+		for ( int noi = 0; noi < 16; noi++ )
+		{
+			for ( int dmc = 0; dmc < 128; dmc++ )
+				tables.tnd_exact[MIXER_TND_INDEX( tri, noi, dmc )] = mixer_tnd_formula( tri, noi, dmc );
+		}
+	}
+
+	for ( int i = 0; i < MIXER_TND_LINEAR_SIZE; i++ )
+		tables.tnd_linear[i] = 163.67f / ( 24329.0f / i + 100 );
+
+	// for APU_OUTPUT_FIXED. the largest output is about 0.74, well inside the Q15 range
+
+	for ( int i = 0; i < MIXER_PULSE_SIZE; i++ )
+	{
+		tables.pulse_exact_q15[i]	= mixer_q15( tables.pulse_exact[i] );
+		tables.pulse_linear_q15[i]	= mixer_q15( tables.pulse_linear[i] );
+	}
+
+	for ( int i = 0; i < MIXER_TND_SIZE; i++ )
+		tables.tnd_exact_q15[i] = mixer_q15( tables.tnd_exact[i] );
+
+	for ( int i = 0; i < MIXER_TND_LINEAR_SIZE; i++ )
+		tables.tnd_linear_q15[i] = mixer_q15( tables.tnd_linear[i] );
+}
+
+/**
+ * Returns the mixer lookup tables, building them on the first call. The tables are shared by all
+ * APU instances and never change afterwards. Safe to call from several threads at once.
+ * @return Mixer lookup tables
+ */
+const MixerTables *
+mixer_tables( void )
+{
+	int expected = 0;
+
+	if ( atomic_load_explicit( &tables_state, memory_order_acquire ) == 2 )
+		return &tables;
+
+	if ( atomic_compare_exchange_strong( &tables_state, &expected, 1 ) )
+	{
+		build_tables();
+		atomic_store_explicit( &tables_state, 2, memory_order_release );
+	}
+	else
+	{
+		// another thread is building them
+
+		while ( atomic_load_explicit( &tables_state, memory_order_acquire ) != 2 )
+			;
+	}
+
+	return &tables;
+}
@@ -0,0 +1,75 @@
+#ifndef MIXER_H
+#define MIXER_H
+
+#include <math.h>
+#include <stdint.h>
+
+#define MIXER_PULSE_SIZE	31						// sq1 + sq2 levels 0-30
+#define MIXER_TND_LINEAR_SIZE	203					// 3 * tri + 2 * noi + dmc levels 0-202
+#define MIXER_TND_SIZE		( 16 * 16 * 128 )		// every triangle, noise and DMC level
+
+// index into tnd_exact. DMC varies fastest since it changes most often
+
+#define MIXER_TND_INDEX( tri, noi, dmc )	( ( (tri) << 11 ) | ( (noi) << 7 ) | (dmc) )
+
+#define MIXER_Q15_ONE		32768					// mixer output 1.0 in the Q15 tables
+
+typedef struct {
+	float			pulse_exact[MIXER_PULSE_SIZE];	// pulse formula for each pulse level sum
+	float			tnd_exact[MIXER_TND_SIZE];		// TND formula, indexed by MIXER_TND_INDEX()
+	float			pulse_linear[MIXER_PULSE_SIZE];	// linearized pulse approximation
+	float			tnd_linear[MIXER_TND_LINEAR_SIZE];	// linearized TND approximation
+	int16_t			pulse_exact_q15[MIXER_PULSE_SIZE];	// pulse_exact rounded to Q15
+	int16_t			tnd_exact_q15[MIXER_TND_SIZE];		// tnd_exact rounded to Q15
+	int16_t			pulse_linear_q15[MIXER_PULSE_SIZE];	// pulse_linear rounded to Q15
+	int16_t			tnd_linear_q15[MIXER_TND_LINEAR_SIZE];	// tnd_linear rounded to Q15
+} MixerTables;
+
+// magic numbers courtesy of https://www.nesdev.org/wiki/APU_Mixer
+
+/**
+ * Calculates the pulse mixer output with the nonlinear formula
+ * @param sq1 Pulse 1 level (0-15)
+ * @param sq2 Pulse 2 level (0-15)
+ * @return Pulse mixer output
+ */
+static inline float
+mixer_pulse_formula( int sq1, int sq2 )
+{
+	float sq1_out	= sq1;
+	float sq2_out	= sq2;
+
+	return 95.88f / ( 8128.0f / ( sq1_out + sq2_out ) + 100 );
+}
+
+/**
+ * Calculates the triangle/noise/DMC mixer output with the nonlinear formula
+ * @param tri Triangle level (0-15)
+ * @param noi Noise level (0-15)
+ * @param dmc DMC level (0-127)
+ * @return TND mixer output
+ */
+static inline float
+mixer_tnd_formula( int tri, int noi, int dmc )
+{
+	float tri_out	= tri / 8227.0f;
+	float noi_out	= noi / 12241.0f;
+	float dmc_out	= dmc / 22638.0f;
+
+	return 159.79f / ( ( 1.0f / ( tri_out + noi_out + dmc_out ) ) + 100 );
+}
+
+/**
+ * Rounds a mixer output to Q15
+ * @param out Mixer output (0.0 to 1.0)
+ * @return Mixer output (Q15)
+ */
+static inline int16_t
+mixer_q15( float out )
+{
+	return (int16_t)lrintf( out * MIXER_Q15_ONE );
+}
+
+const MixerTables	*mixer_tables( void );
+
+#endif // MIXER_H
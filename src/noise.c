@@ -0,0 +1,103 @@
+#include <stdatomic.h>
+
+#include "noise.h"
+
+static NoiseTables tables;
+static atomic_int tables_state;			// 0 = not built, 1 = being built, 2 = ready
+
+/**
+ * Clocks the noise shift register once
+ * @param lfsr Shift register state
+ * @param mode Noise mode (0 = long, 1 = short)
+ * @return New shift register state
+ */
+static uint16_t
+lfsr_step( uint16_t lfsr, int mode )
+{
+	uint16_t feedback;
+
+	if ( mode )
+		feedback = ( lfsr << 14 ) ^ ( lfsr <<  8 );
+	else
+		feedback = ( lfsr << 14 ) ^ ( lfsr << 13 );
+
+	return ( lfsr >> 1 ) | ( feedback & ( 1 << 14 ) );
+}
+
+/**
+ * Fills in the sequence tables of one noise mode
+ * @param mode Noise mode (0 = long, 1 = short)
+ */
+static void
+build_mode( int mode )
+{
+	uint8_t seen[NOISE_STATES + 1] = { 0 };
+	uint32_t pos = 0;
+	uint32_t bit = 0;
+	int cycles = 0;
+
+	// start from state 1, the power-on state, so that it gets position 0 in long mode
+
+	for ( uint32_t first = 1; first <= NOISE_STATES; first++ )
+	{
+		if ( seen[first] )
+			continue;
+
+		NoiseCycle *c = &tables.cycles[mode][cycles];
+		uint16_t lfsr = first;
+
+		c->start = pos;
+
+		do
+		{
+			seen[lfsr] = 1;
+			tables.seq[mode][pos]	= lfsr;
+			tables.pos[mode][lfsr]	= pos;
+			tables.cycle[mode][pos]	= cycles;
+			pos++;
+
+			lfsr = lfsr_step( lfsr, mode );
+		} while ( lfsr != first );
+
+		c->len	= pos - c->start;
+		c->bits	= bit;
+
+		for ( uint32_t i = 0; i < c->len + NOISE_PAD_BITS; i++, bit++ )
+		{
+			if ( ( tables.seq[mode][c->start + i % c->len] >> 14 ) & 1 )
+				tables.bits[mode][bit >> 6] |= (uint64_t)1 << ( bit & 63 );
+		}
+
+		cycles++;
+	}
+}
+
+/**
+ * Returns the noise sequence tables, building them on the first call. The tables are shared by all
+ * APU instances and never change afterwards. Safe to call from several threads at once.
+ * @return Noise sequence tables
+ */
+const NoiseTables *
+noise_tables( void )
+{
+	int expected = 0;
+
+	if ( atomic_load_explicit( &tables_state, memory_order_acquire ) == 2 )
+		return &tables;
+
+	if ( atomic_compare_exchange_strong( &tables_state, &expected, 1 ) )
+	{
+		build_mode( 0 );
+		build_mode( 1 );
+		atomic_store_explicit( &tables_state, 2, memory_order_release );
+	}
+	else
+	{
+		// another thread is building them
+
+		while ( atomic_load_explicit( &tables_state, memory_order_acquire ) != 2 )
+			;
+	}
+
+	return &tables;
+}
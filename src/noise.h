@@ -0,0 +1,123 @@
+#ifndef NOISE_H
+#define NOISE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define NOISE_STATES		32767					// nonzero 15-bit shift register states
+#define NOISE_MAX_CYCLES	353						// cycles the states fall into in short mode
+#define NOISE_PAD_BITS		64						// wrap-around bits stored after each cycle
+#define NOISE_BIT_WORDS		( ( NOISE_STATES + NOISE_MAX_CYCLES * NOISE_PAD_BITS ) / 64 + 2 )
+
+/*
+ * Precomputed noise shift register sequences. Every nonzero shift register state lies on one
+ * cycle of states for each noise mode: a single 32767-step cycle in long mode (mode 0), and 352
+ * 93-step cycles plus one 31-step cycle in short mode (mode 1). The noise channel is tracked as a
+ * position in the sequence of its mode, the cycles of which are stored back to back, so running k
+ * clocks is an index add within the cycle. Switching modes goes through the actual register state,
+ * so it lands on exactly the state the hardware would be in.
+ *
+ * The output bit of each position is also stored packed, each cycle followed by the first bits of
+ * its next lap, so the next NOISE_PAD_BITS outputs from any position can be read as one word.
+ */
+
+typedef struct {
+	uint32_t		start;					// position of the first state of the cycle
+	uint32_t		len;					// number of states in the cycle
+	uint32_t		bits;					// bit index of the first state's output in bits
+} NoiseCycle;
+
+typedef struct {
+	uint16_t		seq[2][NOISE_STATES];	// shift register state at each position
+	uint16_t		pos[2][NOISE_STATES + 1];	// position of each state (state 0 is never used)
+	uint16_t		cycle[2][NOISE_STATES];	// cycle each position lies on
+	NoiseCycle		cycles[2][NOISE_MAX_CYCLES];	// cycles of each mode
+	uint64_t		bits[2][NOISE_BIT_WORDS];	// output bit of each position, packed per cycle
+} NoiseTables;
+
+const NoiseTables	*noise_tables( void );
+
+/**
+ * Advances a sequence position
+ * @param t Noise tables
+ * @param mode Noise mode (0 = long, 1 = short)
+ * @param pos Current position
+ * @param clocks Number of shift register clocks to advance by
+ * @return New position
+ */
+static inline uint32_t
+noise_advance( const NoiseTables *t, int mode, uint32_t pos, uint64_t clocks )
+{
+	const NoiseCycle *c = &t->cycles[mode][t->cycle[mode][pos]];
+	uint32_t off = pos - c->start + (uint32_t)( clocks % c->len );
+
+	if ( off >= c->len )
+		off -= c->len;
+
+	return c->start + off;
+}
+
+/**
+ * Returns the noise output bit at a sequence position (the bit last shifted into the register)
+ * @param t Noise tables
+ * @param mode Noise mode (0 = long, 1 = short)
+ * @param pos Position
+ * @return Output bit
+ */
+static inline uint8_t
+noise_output( const NoiseTables *t, int mode, uint32_t pos )
+{
+	return ( t->seq[mode][pos] >> 14 ) & 1;
+}
+
+/**
+ * Returns the outputs of the clocks following a sequence position
+ * @param t Noise tables
+ * @param mode Noise mode (0 = long, 1 = short)
+ * @param pos Position
+ * @return Output after one clock in bit 0, after two clocks in bit 1 and so on up to 64 clocks
+ */
+static inline uint64_t
+noise_output_bits( const NoiseTables *t, int mode, uint32_t pos )
+{
+	const NoiseCycle *c = &t->cycles[mode][t->cycle[mode][pos]];
+	const uint64_t *bits = t->bits[mode];
+	const size_t i = c->bits + ( pos - c->start ) + 1;
+	const unsigned int shift = i & 63;
+
+	if ( shift == 0 )
+		return bits[i >> 6];
+
+	return ( bits[i >> 6] >> shift ) | ( bits[( i >> 6 ) + 1] << ( 64 - shift ) );
+}
+
+/**
+ * Returns the number of clocks until the noise output changes
+ * @param t Noise tables
+ * @param mode Noise mode (0 = long, 1 = short)
+ * @param pos Position
+ * @return Clocks until the output differs from the output at pos, capped at 64
+ */
+static inline unsigned int
+noise_run_length( const NoiseTables *t, int mode, uint32_t pos )
+{
+	const uint64_t changed = noise_output_bits( t, mode, pos ) ^ ( 0 - (uint64_t)noise_output( t, mode, pos ) );
+
+	return ( changed != 0 ) ? (unsigned int)__builtin_ctzll( changed ) + 1 : 64;
+}
+
+/**
+ * Converts a sequence position to the position of the same shift register state in the other mode
+ * @param t Noise tables
+ * @param from Mode pos belongs to
+ * @param to Mode to convert to
+ * @param pos Position
+ * @return Position in the sequence of the new mode
+ */
+static inline uint32_t
+noise_convert( const NoiseTables *t, int from, int to, uint32_t pos )
+{
+	return t->pos[to][t->seq[from][pos]];
+}
+
+#endif // NOISE_H
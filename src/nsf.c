@@ -0,0 +1,503 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "nsf.h"
+
+#define CLOCK_RATE_HZ		1789773				// NTSC CPU clock rate
+#define DEFAULT_SPEED		16639				// PLAY interval in µs if the header gives none
+#define PLAY_FRAC_BITS		16					// fraction bits of PLAY times
+#define MAX_PENDING			BUS_ROM_PAGES		// most bank switches waiting for the APU
+
+typedef struct {
+	uint64_t		cycle;					// cycle the CPU wrote the bank register on
+	uint8_t			page;					// page from $8000
+	uint8_t			bank;					// bank switched in
+} BankSwitch;
+
+struct NsfPlayer {
+	const Nsf		*nsf;					// file being played
+	Apu				*apu;
+	Bus				bus;					// this player's banks of the shared image
+	Bus				dmc_bus;				// same, as the APU's DMC sees them
+	Cpu				cpu;
+
+	// bank switches the CPU has made on cycles the APU has not rendered yet
+
+	BankSwitch		pending[MAX_PENDING];
+	size_t			pending_count;
+
+	uint64_t		play_period;			// cycles between PLAY calls, PLAY_FRAC_BITS fixed point
+	uint64_t		next_play;				// cycle of next PLAY call, same fixed point
+	int				started;				// 1 = nsf_start() has been called
+
+	// output buffer of the nsf_run() call in progress, which $4015 reads render into
+
+	float			*out;					// float buffer, or NULL
+	int16_t			*out_s16;				// int16 buffer, or NULL
+	size_t			out_size;				// size of buffer in samples
+	size_t			out_written;			// samples written to buffer
+};
+
+/**
+ * Reads a little-endian 16-bit value
+ * @param p Bytes
+ * @return Value
+ */
+static uint16_t
+get16( const uint8_t *p )
+{
+	return p[0] | ( p[1] << 8 );
+}
+
+/**
+ * Copies a text field of the header and terminates it
+ * @param dst Buffer of NSF_TEXT_SIZE + 1 chars
+ * @param src Field
+ */
+static void
+get_text( char *dst, const uint8_t *src )
+{
+	memcpy( dst, src, NSF_TEXT_SIZE );
+	dst[NSF_TEXT_SIZE] = '\0';
+}
+
+/**
+ * Parses an NSF header
+ * @param h Header to fill in
+ * @param data Start of file
+ * @param size Size of data in bytes
+ * @return 0 on success, -1 if data is not an NSF header this player can use
+ */
+int
+nsf_parse_header( NsfHeader *h, const uint8_t *data, size_t size )
+{
+	if ( size < NSF_HEADER_SIZE || memcmp( data, "NESM\x1a", 5 ) != 0 )
+		return -1;
+
+	memset( h, 0, sizeof(*h) );
+
+	h->version		= data[0x05];
+	h->songs		= data[0x06];
+	h->start_song	= data[0x07] - 1;
+	h->load_addr	= get16( &data[0x08] );
+	h->init_addr	= get16( &data[0x0a] );
+	h->play_addr	= get16( &data[0x0c] );
+	h->ntsc_speed	= get16( &data[0x6e] );
+	h->pal_speed	= get16( &data[0x78] );
+	h->region		= data[0x7a];
+	h->chips		= data[0x7b];
+
+	get_text( h->name, &data[0x0e] );
+	get_text( h->artist, &data[0x2e] );
+	get_text( h->copyright, &data[0x4e] );
+	memcpy( h->banks, &data[0x70], sizeof(h->banks) );
+
+	if ( h->songs == 0 || h->load_addr < 0x8000 )
+		return -1;
+
+	if ( h->start_song >= h->songs )
+		h->start_song = 0;
+
+	return 0;
+}
+
+/**
+ * Opens an NSF file and maps its image. The image is laid out in banks from the load address, so
+ * that bank 0 starts at the 4 KiB boundary below it.
+ * @param nsf NSF to fill in
+ * @param filename Path of file
+ * @return 0 on success, -1 if the file could not be opened or is not an NSF file
+ */
+int
+nsf_open( Nsf *nsf, const char *filename )
+{
+	memset( nsf, 0, sizeof(*nsf) );
+
+	if ( rom_open( &nsf->rom, filename ) != 0 )
+		return -1;
+
+	const NsfHeader *h = &nsf->header;
+
+	if ( nsf_parse_header( &nsf->header, nsf->rom.data, nsf->rom.size ) != 0 ||
+			rom_set_layout( &nsf->rom, NSF_HEADER_SIZE, h->load_addr % ROM_BANK_SIZE ) != 0 )
+	{
+		rom_close( &nsf->rom );
+		return -1;
+	}
+
+	for ( int i = 0; i < BUS_ROM_PAGES; i++ )
+	{
+		if ( h->banks[i] != 0 )
+			nsf->banked = 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Closes an NSF file. Players of it must be destroyed first.
+ * @param nsf NSF
+ */
+void
+nsf_close( Nsf *nsf )
+{
+	rom_close( &nsf->rom );
+	memset( nsf, 0, sizeof(*nsf) );
+}
+
+/**
+ * Renders the APU up to a cycle, into the output buffer of the nsf_run() call in progress. Stops
+ * short if the buffer fills.
+ * @param p Player
+ * @param cycle Cycle to render up to
+ */
+static void
+render_to( NsfPlayer *p, uint64_t cycle )
+{
+	const uint64_t now = apu_cycle( p->apu );
+
+	if ( cycle <= now || p->out_written >= p->out_size )
+		return;
+
+	const size_t room = p->out_size - p->out_written;
+	size_t n = 0;
+
+	if ( p->out_s16 != NULL )
+		apu_run_s16( p->apu, cycle - now, &p->out_s16[p->out_written], room, &n );
+	else
+		apu_run( p->apu, cycle - now, &p->out[p->out_written], room, &n );
+
+	p->out_written += n;
+}
+
+/**
+ * Renders the APU up to a cycle as render_to() does, switching the banks the DMC fetches from on
+ * the cycles the CPU switched them on along the way
+ * @param p Player
+ * @param cycle Cycle to render up to
+ */
+static void
+catch_up( NsfPlayer *p, uint64_t cycle )
+{
+	size_t done = 0;
+
+	for ( ; done < p->pending_count && p->pending[done].cycle <= cycle; done++ )
+	{
+		const BankSwitch *sw = &p->pending[done];
+
+		render_to( p, sw->cycle );
+
+		if ( apu_cycle( p->apu ) < sw->cycle )
+			break;
+
+		bus_switch( &p->dmc_bus, sw->page, sw->bank );
+	}
+
+	if ( done != 0 )
+	{
+		p->pending_count -= done;
+		memmove( p->pending, &p->pending[done], p->pending_count * sizeof(p->pending[0]) );
+	}
+
+	render_to( p, cycle );
+}
+
+/**
+ * Switches a bank. The CPU sees the new bank straight away, and the APU from the cycle of the
+ * switch on, which it may not have reached yet: the APU is caught up to the switch first, and if
+ * the output buffer fills before it gets there, the switch waits for the next nsf_run() call.
+ * @param p Player
+ * @param cycle Cycle the bank register is written on
+ * @param page Page from $8000
+ * @param bank Bank to switch in
+ */
+static void
+switch_bank( NsfPlayer *p, uint64_t cycle, int page, uint8_t bank )
+{
+	bus_switch( &p->bus, page, bank );
+	catch_up( p, cycle );
+
+	if ( p->pending_count == 0 && apu_cycle( p->apu ) >= cycle )
+	{
+		bus_switch( &p->dmc_bus, page, bank );
+		return;
+	}
+
+	// switches have to reach the APU in order, so with no room left they all do, a little early
+
+	if ( p->pending_count == MAX_PENDING )
+	{
+		for ( size_t i = 0; i < p->pending_count; i++ )
+			bus_switch( &p->dmc_bus, p->pending[i].page, p->pending[i].bank );
+
+		p->pending_count = 0;
+	}
+
+	p->pending[p->pending_count++] = (BankSwitch){ cycle, page, bank };
+}
+
+static uint8_t
+io_read( void *userdata, uint16_t addr, uint64_t cycle )
+{
+	NsfPlayer *p = userdata;
+
+	if ( addr == 0x4000 + APU_SNDCHN )
+	{
+		catch_up( p, cycle );
+		return apu_read( p->apu, APU_SNDCHN );
+	}
+
+	// open bus, which usually holds the high byte of the address
+
+	return addr >> 8;
+}
+
+static void
+io_write( void *userdata, uint16_t addr, uint8_t val, uint64_t cycle )
+{
+	NsfPlayer *p = userdata;
+
+	if ( addr >= 0x4000 && addr <= 0x4000 + APU_APUFRAME && addr != 0x4014 && addr != 0x4016 )
+	{
+		const uint_fast16_t reg = addr - 0x4000;
+
+		// a full queue only holds writes from before this one, so catching up drains it
+
+		if ( apu_write_at( p->apu, cycle, reg, val ) != 0 )
+		{
+			catch_up( p, cycle );
+
+			if ( apu_write_at( p->apu, cycle, reg, val ) != 0 )
+				apu_write( p->apu, reg, val );
+		}
+	}
+	else if ( p->nsf->banked && addr >= BUS_BANK_REG && addr < BUS_BANK_REG + BUS_ROM_PAGES )
+		switch_bank( p, cycle, addr - BUS_BANK_REG, val );
+}
+
+/**
+ * Creates a player for an NSF file. Its APU starts with the default output settings, which can be
+ * changed through nsf_player_apu().
+ * @param nsf NSF to play, which must stay open while the player exists
+ * @return Player, or NULL if out of memory
+ */
+NsfPlayer *
+nsf_player_create( const Nsf *nsf )
+{
+	NsfPlayer *p = calloc( 1, sizeof(NsfPlayer) );
+
+	if ( p == NULL )
+		return NULL;
+
+	p->nsf = nsf;
+	bus_init( &p->bus, &nsf->rom );
+	bus_init( &p->dmc_bus, &nsf->rom );
+	cpu_init( &p->cpu, &p->bus, io_read, io_write, p );
+
+	p->apu = apu_create( p->dmc_bus.pages );
+
+	if ( p->apu == NULL )
+	{
+		free( p );
+		return NULL;
+	}
+
+	return p;
+}
+
+/**
+ * Destroys a player
+ * @param p Player
+ */
+void
+nsf_player_destroy( NsfPlayer *p )
+{
+	if ( p == NULL )
+		return;
+
+	apu_destroy( p->apu );
+	free( p );
+}
+
+/**
+ * Returns the APU a player renders with, for setting its output engine, sample rate and so on
+ * @param p Player
+ * @return APU instance
+ */
+Apu *
+nsf_player_apu( NsfPlayer *p )
+{
+	return p->apu;
+}
+
+/**
+ * Returns the bus a player's APU fetches DMC samples through, for logging them with
+ * reglog_writer_create()
+ * @param p Player
+ * @return Bus
+ */
+const Bus *
+nsf_player_bus( const NsfPlayer *p )
+{
+	return &p->dmc_bus;
+}
+
+/**
+ * Starts a song from the beginning: resets the CPU, APU and banks as an NSF player does and calls
+ * INIT. INIT runs on the same timeline as PLAY during nsf_run(), with the first PLAY call as soon
+ * as it returns and the rest at the header's NTSC interval from cycle 0.
+ * @param p Player
+ * @param song Song number (0-based)
+ * @return 0 on success, -1 if the file has no such song
+ */
+int
+nsf_start( NsfPlayer *p, int song )
+{
+	const NsfHeader *h = &p->nsf->header;
+
+	if ( song < 0 || song >= h->songs )
+		return -1;
+
+	cpu_reset( &p->cpu );
+	apu_reset( p->apu );
+
+	for ( uint_fast16_t reg = APU_SQ1VOL; reg <= APU_DMCLEN; reg++ )
+		apu_write( p->apu, reg, 0x00 );
+
+	apu_write( p->apu, APU_SNDCHN, 0x0f );
+	apu_write( p->apu, APU_APUFRAME, 0x40 );
+
+	// files without bank switching are mapped as loaded at the load address, with open bus below
+
+	const int first = ( h->load_addr >> 12 ) - BUS_ROM_PAGE;
+
+	for ( int i = 0; i < BUS_ROM_PAGES; i++ )
+	{
+		const uint8_t bank = p->nsf->banked ? h->banks[i] : ( i >= first ) ? i - first : 0xff;
+
+		bus_switch( &p->bus, i, bank );
+		bus_switch( &p->dmc_bus, i, bank );
+	}
+
+	p->pending_count = 0;
+
+	const uint64_t speed = ( h->ntsc_speed != 0 ) ? h->ntsc_speed : DEFAULT_SPEED;
+
+	p->play_period	= ( speed * CLOCK_RATE_HZ << PLAY_FRAC_BITS ) / 1000000;
+	p->next_play	= 0;
+	p->started		= 1;
+
+	p->cpu.a = song;
+	p->cpu.x = 0;
+	cpu_call( &p->cpu, h->init_addr, NSF_RETURN_ADDR );
+
+	return 0;
+}
+
+/**
+ * Runs the CPU and renders the APU, stopping when max_cycles cycles have been rendered or the
+ * output buffer is full, as apu_run() does
+ * @param p Player
+ * @param max_cycles Maximum number of CPU cycles to render
+ * @param samples_out Buffer to write float samples to (NULL if s16_out is given)
+ * @param s16_out Buffer to write int16 samples to (NULL if samples_out is given)
+ * @param max_samples Size of the buffer in samples
+ * @param samples_written Pointer to value to store the number of outputted samples in (may be NULL)
+ * @return Number of CPU cycles rendered
+ */
+static size_t
+run( NsfPlayer *p, size_t max_cycles, float *samples_out, int16_t *s16_out, size_t max_samples,
+		size_t *samples_written )
+{
+	Cpu *cpu = &p->cpu;
+	const uint64_t start = apu_cycle( p->apu );
+	const uint64_t end = start + max_cycles;
+
+	p->out			= samples_out;
+	p->out_s16		= s16_out;
+	p->out_size		= max_samples;
+	p->out_written	= 0;
+
+	while ( p->started && p->out_written < max_samples )
+	{
+		const uint64_t now = apu_cycle( p->apu );
+
+		if ( now >= end )
+			break;
+
+		// the CPU may run up to the cycle the APU fills the buffer on, and no further
+
+		const uint64_t limit = now + apu_cycles_until_samples( p->apu, max_samples - p->out_written,
+				end - now );
+
+		if ( cpu->jammed )
+		{
+			catch_up( p, limit );
+			continue;
+		}
+
+		if ( cpu_halted( cpu ) )
+		{
+			uint64_t play = p->next_play >> PLAY_FRAC_BITS;
+
+			if ( play < cpu->cycle )
+				play = cpu->cycle;
+
+			if ( play >= limit )
+			{
+				catch_up( p, limit );
+				continue;
+			}
+
+			cpu->cycle = play;
+			cpu_call( cpu, p->nsf->header.play_addr, NSF_RETURN_ADDR );
+			p->next_play += p->play_period;
+		}
+
+		cpu_run( cpu, limit );
+		catch_up( p, ( cpu->cycle < limit ) ? cpu->cycle : limit );
+	}
+
+	p->out = NULL;
+	p->out_s16 = NULL;
+
+	if ( samples_written != NULL )
+		*samples_written = p->out_written;
+
+	return apu_cycle( p->apu ) - start;
+}
+
+/**
+ * Plays the song started by nsf_start(): runs INIT and PLAY on the CPU and renders the APU. The
+ * CPU runs ahead of the APU by up to the rest of the output buffer; writes it makes past the last
+ * cycle rendered are kept for the next call.
+ * @param p Player
+ * @param max_cycles Maximum number of CPU cycles to render
+ * @param samples_out Buffer to write outputted samples to
+ * @param max_samples Size of samples_out in samples
+ * @param samples_written Pointer to value to store the number of outputted samples in (may be NULL)
+ * @return Number of CPU cycles rendered (0 if no song has been started)
+ */
+size_t
+nsf_run( NsfPlayer *p, size_t max_cycles, float *samples_out, size_t max_samples,
+		size_t *samples_written )
+{
+	return run( p, max_cycles, samples_out, NULL, max_samples, samples_written );
+}
+
+/**
+ * Same as nsf_run(), but outputs 16-bit samples as apu_run_s16() does
+ * @param p Player
+ * @param max_cycles Maximum number of CPU cycles to render
+ * @param samples_out Buffer to write outputted samples to
+ * @param max_samples Size of samples_out in samples
+ * @param samples_written Pointer to value to store the number of outputted samples in (may be NULL)
+ * @return Number of CPU cycles rendered (0 if no song has been started)
+ */
+size_t
+nsf_run_s16( NsfPlayer *p, size_t max_cycles, int16_t *samples_out, size_t max_samples,
+		size_t *samples_written )
+{
+	return run( p, max_cycles, NULL, samples_out, max_samples, samples_written );
+}
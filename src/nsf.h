@@ -0,0 +1,77 @@
+#ifndef NSF_H
+#define NSF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "apu.h"
+#include "bus.h"
+#include "rom.h"
+
+#define NSF_HEADER_SIZE		0x80
+#define NSF_TEXT_SIZE		32					// size of the name, artist and copyright fields
+#define NSF_RETURN_ADDR		0x4100				// where INIT and PLAY return to (I/O, not code)
+
+#define NSF_REGION_PAL		0x01				// region bits (the file plays on PAL machines)
+#define NSF_REGION_DUAL		0x02				// (the file plays on both)
+
+#define NSF_CHIP_VRC6		0x01				// expansion sound chip bits
+#define NSF_CHIP_VRC7		0x02
+#define NSF_CHIP_FDS		0x04
+#define NSF_CHIP_MMC5		0x08
+#define NSF_CHIP_N163		0x10
+#define NSF_CHIP_S5B		0x20
+
+/*
+ * NSF files: the header, and a player that runs a file's own INIT and PLAY routines on the 6502
+ * core. The CPU runs ahead of the APU, and its register writes are queued with apu_write_at()
+ * tagged with the cycle they happen on, so the APU renders them in long blocks and still lands
+ * every write on its exact cycle. The CPU never gets further ahead than the APU can render into
+ * the output buffer, so a $4015 read only has to catch the APU up to the cycle of the read. The
+ * APU fetches DMC samples through banks of its own, and a bank switch catches it up to the cycle
+ * of the switch before switching its bank too, so DMC fetches see the bank the CPU had switched
+ * in on the cycle they are made on.
+ *
+ * An Nsf holds the header and the memory-mapped image, which any number of players can share.
+ * Only the NTSC clock and the 2A03's own channels are emulated: expansion chips are ignored, PAL
+ * files play at NTSC pitch, and IRQs and DMC DMA stalls are not emulated.
+ */
+
+typedef struct {
+	uint8_t			version;				// format version
+	uint8_t			songs;					// number of songs
+	uint8_t			start_song;				// song to play first (0-based)
+	uint16_t		load_addr;				// where the image is loaded
+	uint16_t		init_addr;				// INIT routine, called with the song in A
+	uint16_t		play_addr;				// PLAY routine, called every frame
+	char			name[NSF_TEXT_SIZE + 1];
+	char			artist[NSF_TEXT_SIZE + 1];
+	char			copyright[NSF_TEXT_SIZE + 1];
+	uint16_t		ntsc_speed;				// microseconds between PLAY calls on NTSC
+	uint8_t			banks[BUS_ROM_PAGES];	// initial banks from $8000, all 0 if not bank switched
+	uint16_t		pal_speed;				// microseconds between PLAY calls on PAL
+	uint8_t			region;					// NSF_REGION_*
+	uint8_t			chips;					// NSF_CHIP_*
+} NsfHeader;
+
+typedef struct {
+	NsfHeader		header;
+	Rom				rom;					// image, after the header
+	int				banked;					// 1 = the file uses bank switching
+} Nsf;
+
+typedef struct NsfPlayer NsfPlayer;
+
+int			nsf_parse_header( NsfHeader *h, const uint8_t *data, size_t size );
+int			nsf_open( Nsf *nsf, const char *filename );
+void		nsf_close( Nsf *nsf );
+
+NsfPlayer *	nsf_player_create( const Nsf *nsf );
+void		nsf_player_destroy( NsfPlayer *p );
+Apu *		nsf_player_apu( NsfPlayer *p );
+const Bus *	nsf_player_bus( const NsfPlayer *p );
+int			nsf_start( NsfPlayer *p, int song );
+size_t		nsf_run( NsfPlayer *p, size_t max_cycles, float *samples_out, size_t max_samples, size_t *samples_written );
+size_t		nsf_run_s16( NsfPlayer *p, size_t max_cycles, int16_t *samples_out, size_t max_samples, size_t *samples_written );
+
+#endif // NSF_H
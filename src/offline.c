@@ -0,0 +1,1531 @@
+#ifdef __linux__
+#define _GNU_SOURCE								// for pthread_setaffinity_np()
+#endif
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "apu.h"
+#include "bus.h"
+#include "nsf.h"
+#include "offline.h"
+#include "ppmck_driver.h"
+#include "reglog.h"
+#include "rom.h"
+#include "timeline.h"
+#include "wav_file.h"
+
+#define CLOCK_RATE_HZ		1789773				// NTSC CPU clock rate
+#define DEFAULT_SECONDS		180					// length of a job without one, if not a log
+#define BUFFER_SAMPLES		65536				// samples rendered per run
+
+#define SEGMENT_PREROLL		( CLOCK_RATE_HZ / 4 )		// cycles rendered before a segment's output
+#define SEGMENT_MIN_CYCLES	( 5 * CLOCK_RATE_HZ )		// shortest segment worth its pre-roll
+#define SEGMENTS_PER_THREAD	4					// to even out the time segments take
+
+#define MANIFEST_FIELDS		4					// input, output, seconds and song
+
+// a worker's run of jobs, as the positions in the batch's order of its first and past its last
+#define RANGE( first, end )	( (uint64_t)( end ) << 32 | (uint32_t)( first ) )
+#define RANGE_FIRST( r )	( (uint32_t)( r ) )
+#define RANGE_END( r )		( (uint32_t)( ( r ) >> 32 ) )
+
+enum {
+	SOURCE_PPMCK,
+	SOURCE_NSF,
+	SOURCE_REGLOG
+};
+
+typedef struct {
+	int				type;					// SOURCE_*
+	Rom				rom;					// song image of a PPMCK input
+	Timeline		timeline;				// song compiled from the image
+	Nsf				nsf;
+	RegLog			log;
+} Input;
+
+typedef struct {
+	const Input		*in;
+	Bus				bus;					// bus of a PPMCK input
+	Apu				*apu;					// APU of a PPMCK input
+	TimelinePlayer	player;					// player of a PPMCK input
+	NsfPlayer		*nsf_player;
+	RegLogPlayer	*log_player;
+} Source;
+
+typedef struct {
+	RegLogWriter	*writer;
+	uint64_t		loop_cycle;				// cycle the song's loop point is on
+	uint64_t		end_cycle;				// cycle the log ends on, writes after it are left out
+	int				looped;					// 1 = the loop point has been marked
+	int				failed;					// 1 = the loop point could not be marked
+} Recorder;
+
+enum {
+	SEGMENT_PENDING,
+	SEGMENT_DONE,
+	SEGMENT_FAILED
+};
+
+typedef struct {
+	uint64_t		begin;					// cycle the pre-roll starts on
+	uint64_t		start;					// first cycle output is kept from
+	uint64_t		end;					// cycle after the last one
+	uint8_t			*state;					// APU state at begin, NULL for the start of the song
+	uint64_t		frame;					// next timeline frame at begin
+	Bus				bus;					// banks switched in at begin
+	void			*samples;				// output, once rendered
+	size_t			count;					// number of samples in samples
+	int				status;					// SEGMENT_*
+} Segment;
+
+typedef struct {
+	const OfflineJob	*job;
+	const Rom		*rom;					// song image
+	const Timeline	*timeline;				// song compiled from the image
+	size_t			state_size;				// size of the APU states
+	Segment			*segments;
+	int				count;					// number of segments
+	atomic_int		next;					// next segment for a thread to take
+	pthread_mutex_t	lock;					// guards the status of the segments
+	pthread_cond_t	finished;				// signalled when a segment is done or failed
+} Segments;
+
+enum {
+	INPUT_CLOSED,
+	INPUT_OPEN,
+	INPUT_FAILED
+};
+
+typedef struct {
+	const char		*filename;
+	uint64_t		cycles;					// longest job on the input, to compile a song for
+	int				jobs_left;				// jobs on the input that have not finished
+	int				status;					// INPUT_*
+	pthread_mutex_t	lock;					// guards status and jobs_left, held while opening
+	Input			in;
+} BatchInput;
+
+typedef struct Batch Batch;
+
+typedef struct {
+	Batch			*batch;
+	int				index;					// thread number
+	atomic_uint_least64_t	range;			// jobs left in order: first in the low, end in the high half
+	pthread_t		id;
+} BatchWorker;
+
+struct Batch {
+	const OfflineBatch	*desc;
+	BatchInput		*inputs;
+	int				input_count;			// number of inputs
+	int				*input_of;				// input of each job
+	int				*order;					// jobs, in a run for each worker
+	BatchWorker		*workers;
+	int				threads;				// number of workers
+	pthread_mutex_t	lock;					// guards total, failed and the done hook
+	OfflineStats	total;					// length of all the jobs rendered
+	int				failed;					// number of jobs that failed
+};
+
+typedef struct {
+	uint64_t		cycles;					// length of a job, as far as is known before playing it
+	int				job;
+} JobLength;
+
+/**
+ * Returns a monotonic time stamp
+ * @return Time in seconds
+ */
+static double
+now( void )
+{
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Tells what kind of input a file is from its first bytes
+ * @param filename Input file
+ * @return SOURCE_*, or -1 if the file could not be read
+ */
+static int
+detect( const char *filename )
+{
+	uint8_t magic[5] = { 0 };
+	FILE *f = fopen( filename, "rb" );
+
+	if ( f == NULL )
+		return -1;
+
+	const size_t n = fread( magic, 1, sizeof(magic), f );
+
+	fclose( f );
+
+	if ( n == sizeof(magic) && memcmp( magic, "NESM\x1a", 5 ) == 0 )
+		return SOURCE_NSF;
+	if ( n >= 4 && memcmp( magic, "APUL", 4 ) == 0 )
+		return SOURCE_REGLOG;
+
+	return SOURCE_PPMCK;
+}
+
+/**
+ * Opens an input. A PPMCK song image is compiled into a timeline by a driver of its own, so
+ * inputs can be opened on several threads at once, and the timeline can be played on any number
+ * of threads. Everything opened is only read from then on.
+ * @param in Input to fill in
+ * @param filename Input file
+ * @param cycles Length to compile a PPMCK song for, in CPU cycles (0 = DEFAULT_SECONDS)
+ * @return 0 on success, -1 if the file could not be opened or out of memory
+ */
+static int
+input_open( Input *in, const char *filename, uint64_t cycles )
+{
+	memset( in, 0, sizeof(*in) );
+	in->type = detect( filename );
+	timeline_init( &in->timeline );
+
+	switch ( in->type )
+	{
+	case SOURCE_PPMCK:
+	{
+		if ( rom_open( &in->rom, filename ) != 0 )
+			return -1;
+
+		if ( cycles == 0 )
+			cycles = (uint64_t)DEFAULT_SECONDS * CLOCK_RATE_HZ;
+
+		const uint64_t frames = cycles / APU_FRAME_CYCLES + 2;
+
+		Ppmck *driver = sound_create( &in->rom );
+		const int ok = driver != NULL && sound_compile( driver, &in->timeline,
+				( frames < UINT32_MAX - 2 ) ? frames : UINT32_MAX - 2 ) == 0;
+
+		sound_destroy( driver );
+
+		if ( !ok )
+		{
+			rom_close( &in->rom );
+			return -1;
+		}
+
+		return 0;
+	}
+
+	case SOURCE_NSF:
+		return nsf_open( &in->nsf, filename );
+
+	case SOURCE_REGLOG:
+		return reglog_open( &in->log, filename );
+	}
+
+	return -1;
+}
+
+/**
+ * Closes an input
+ * @param in Input
+ */
+static void
+input_close( Input *in )
+{
+	switch ( in->type )
+	{
+	case SOURCE_PPMCK:
+		timeline_free( &in->timeline );
+		rom_close( &in->rom );
+		break;
+	case SOURCE_NSF:
+		nsf_close( &in->nsf );
+		break;
+	case SOURCE_REGLOG:
+		reglog_close( &in->log );
+		break;
+	}
+}
+
+/**
+ * Creates a player for an input
+ * @param s Source to fill in (not to be moved until closed, as the APU of a PPMCK input reads
+ * through s->bus)
+ * @param in Input
+ * @return 0 on success, -1 if out of memory
+ */
+static int
+source_open( Source *s, const Input *in )
+{
+	memset( s, 0, sizeof(*s) );
+	s->in = in;
+
+	switch ( in->type )
+	{
+	case SOURCE_PPMCK:
+		bus_init( &s->bus, &in->rom );
+		s->apu = apu_create( s->bus.pages );
+		return ( s->apu != NULL ) ? 0 : -1;
+
+	case SOURCE_NSF:
+		s->nsf_player = nsf_player_create( &in->nsf );
+		return ( s->nsf_player != NULL ) ? 0 : -1;
+
+	case SOURCE_REGLOG:
+		s->log_player = reglog_player_create( &in->log );
+		return ( s->log_player != NULL ) ? 0 : -1;
+	}
+
+	return -1;
+}
+
+/**
+ * Destroys the player of an input
+ * @param s Source
+ */
+static void
+source_close( Source *s )
+{
+	if ( s->apu != NULL )
+		apu_destroy( s->apu );
+
+	nsf_player_destroy( s->nsf_player );
+	reglog_player_destroy( s->log_player );
+}
+
+/**
+ * Returns the APU an input plays on
+ * @param s Source
+ * @return APU instance
+ */
+static Apu *
+source_apu( Source *s )
+{
+	switch ( s->in->type )
+	{
+	case SOURCE_NSF:	return nsf_player_apu( s->nsf_player );
+	case SOURCE_REGLOG:	return reglog_player_apu( s->log_player );
+	default:			return s->apu;
+	}
+}
+
+/**
+ * Returns the bus an input's DMC samples are read through
+ * @param s Source
+ * @return Bus, or NULL for a register log, whose player has none
+ */
+static const Bus *
+source_bus( const Source *s )
+{
+	switch ( s->in->type )
+	{
+	case SOURCE_PPMCK:	return &s->bus;
+	case SOURCE_NSF:	return nsf_player_bus( s->nsf_player );
+	default:			return NULL;
+	}
+}
+
+/**
+ * Starts playing an input from the beginning
+ * @param s Source
+ * @param song NSF song (0-based) or OFFLINE_START_SONG
+ * @return 0 on success, -1 if an NSF has no such song
+ */
+static int
+source_start( Source *s, int song )
+{
+	switch ( s->in->type )
+	{
+	case SOURCE_PPMCK:
+		timeline_player_start( &s->player, &s->in->timeline, s->apu, &s->bus );
+		apu_set_frame_hook( s->apu, timeline_player_frame, &s->player );
+		return 0;
+
+	case SOURCE_NSF:
+		if ( song == OFFLINE_START_SONG )
+			song = s->in->nsf.header.start_song;
+
+		return nsf_start( s->nsf_player, song );
+
+	case SOURCE_REGLOG:
+		reglog_start( s->log_player );
+		return 0;
+	}
+
+	return -1;
+}
+
+/**
+ * Renders an input, as apu_run() or apu_run_s16() does
+ * @param s Source
+ * @param s16 1 to render int16 samples, 0 to render float samples
+ * @param max_cycles Maximum number of CPU cycles to render
+ * @param samples_out Buffer to write samples to
+ * @param max_samples Size of the buffer in samples
+ * @param samples_written Pointer to value to store the number of outputted samples in
+ * @return Number of CPU cycles rendered
+ */
+static size_t
+source_run( Source *s, int s16, size_t max_cycles, void *samples_out, size_t max_samples,
+		size_t *samples_written )
+{
+	switch ( s->in->type )
+	{
+	case SOURCE_NSF:
+		return s16
+			? nsf_run_s16( s->nsf_player, max_cycles, samples_out, max_samples, samples_written )
+			: nsf_run( s->nsf_player, max_cycles, samples_out, max_samples, samples_written );
+
+	case SOURCE_REGLOG:
+		return s16
+			? reglog_run_s16( s->log_player, max_cycles, samples_out, max_samples, samples_written )
+			: reglog_run( s->log_player, max_cycles, samples_out, max_samples, samples_written );
+
+	default:
+		return s16
+			? apu_run_s16( s->apu, max_cycles, samples_out, max_samples, samples_written )
+			: apu_run( s->apu, max_cycles, samples_out, max_samples, samples_written );
+	}
+}
+
+/**
+ * Tells whether a job is rendered to 16-bit samples
+ * @param job Job
+ * @return 1 for int16 samples, 0 for float samples
+ */
+static int
+is_s16( const OfflineJob *job )
+{
+	return job->format == OFFLINE_WAV_S16 || job->format == OFFLINE_RAW_S16;
+}
+
+/**
+ * Sets an APU up to render the samples a job asks for
+ * @param apu APU instance
+ * @param job Job
+ * @return 0 on success, -1 if the sample rate or quality is not supported
+ */
+static int
+setup_apu( Apu *apu, const OfflineJob *job )
+{
+	if ( apu_set_sample_rate( apu, job->sample_rate, job->quality ) != 0 )
+		return -1;
+
+	if ( is_s16( job ) )
+		apu_set_output( apu, APU_OUTPUT_FIXED );
+
+	return 0;
+}
+
+/**
+ * Renders on an APU, as apu_run() or apu_run_s16() does
+ * @param apu APU instance
+ * @param s16 1 to render int16 samples, 0 to render float samples
+ * @param max_cycles Maximum number of CPU cycles to render
+ * @param samples_out Buffer to write samples to
+ * @param max_samples Size of the buffer in samples
+ * @param samples_written Pointer to value to store the number of outputted samples in
+ * @return Number of CPU cycles rendered
+ */
+static size_t
+run_apu( Apu *apu, int s16, uint64_t max_cycles, void *samples_out, size_t max_samples,
+		size_t *samples_written )
+{
+	const size_t cycles = ( max_cycles < SIZE_MAX ) ? max_cycles : SIZE_MAX;
+
+	*samples_written = 0;
+
+	return s16 ? apu_run_s16( apu, cycles, samples_out, max_samples, samples_written )
+			: apu_run( apu, cycles, samples_out, max_samples, samples_written );
+}
+
+/**
+ * Writes samples to the output
+ * @param out Output file
+ * @param wav 1 if out is a WAV file
+ * @param samples Samples
+ * @param size Size of samples in bytes
+ */
+static void
+write_samples( FILE *out, int wav, void *samples, size_t size )
+{
+	if ( wav )
+		wav_file_write_samples( out, samples, size );
+	else
+		fwrite( samples, 1, size, out );
+}
+
+/**
+ * Renders an input into the output in one go
+ * @param s Source, started
+ * @param s16 1 to render int16 samples, 0 to render float samples
+ * @param cycles Length in CPU cycles
+ * @param out Output file
+ * @param wav 1 if out is a WAV file
+ * @param buffer Buffer of BUFFER_SAMPLES samples to render into
+ * @param samples Pointer to value to store the number of samples written in
+ * @return Number of CPU cycles rendered
+ */
+static uint64_t
+render_serial( Source *s, int s16, uint64_t cycles, FILE *out, int wav, void *buffer,
+		uint64_t *samples )
+{
+	uint64_t rendered = 0;
+
+	*samples = 0;
+
+	while ( rendered < cycles )
+	{
+		const uint64_t left = cycles - rendered;
+		const size_t max_cycles = ( left < SIZE_MAX ) ? left : SIZE_MAX;
+		size_t written = 0;
+		const size_t ran = source_run( s, s16, max_cycles, buffer, BUFFER_SAMPLES, &written );
+
+		write_samples( out, wav, buffer, written * ( s16 ? sizeof(int16_t) : sizeof(float) ) );
+
+		rendered	+= ran;
+		*samples	+= written;
+
+		if ( ran == 0 )
+			break;
+	}
+
+	return rendered;
+}
+
+/**
+ * Splits a job into segments and takes a snapshot at the start of each one's pre-roll. The
+ * snapshots come from one pass through the song with apu_skip(), which leaves the APU and the
+ * timeline player where rendering would, with the output filters settled on the current levels
+ * and the sample clock where it would be.
+ * @param segs Segments, with the job, the song and the timeline filled in
+ * @param cycles Length of the job in CPU cycles
+ * @param length Length of a segment in CPU cycles (more than SEGMENT_PREROLL)
+ * @return 0 on success, -1 if out of memory
+ */
+static int
+scan_segments( Segments *segs, uint64_t cycles, uint64_t length )
+{
+	segs->count		= ( cycles + length - 1 ) / length;
+	segs->segments	= calloc( segs->count, sizeof(*segs->segments) );
+
+	if ( segs->segments == NULL )
+		return -1;
+
+	for ( int k = 0; k < segs->count; k++ )
+	{
+		Segment *seg = &segs->segments[k];
+
+		seg->start	= k * length;
+		seg->end	= ( cycles - seg->start > length ) ? seg->start + length : cycles;
+		seg->begin	= ( k > 0 ) ? seg->start - SEGMENT_PREROLL : 0;
+		seg->status	= SEGMENT_PENDING;
+	}
+
+	Bus bus;
+	TimelinePlayer player;
+
+	bus_init( &bus, segs->rom );
+
+	Apu *apu = apu_create( bus.pages );
+
+	if ( apu == NULL || setup_apu( apu, segs->job ) != 0 )
+	{
+		if ( apu != NULL )
+			apu_destroy( apu );
+
+		return -1;
+	}
+
+	timeline_player_start( &player, segs->timeline, apu, &bus );
+	apu_set_frame_hook( apu, timeline_player_frame, &player );
+	segs->state_size = apu_state_size( apu );
+
+	// the first segment starts from the start of the song, so it needs no snapshot
+
+	uint64_t at = 0;
+	int ok = 1;
+
+	for ( int k = 1; ok && k < segs->count; k++ )
+	{
+		Segment *seg = &segs->segments[k];
+
+		while ( at < seg->begin )
+		{
+			const uint64_t left = seg->begin - at;
+
+			at += apu_skip( apu, ( left < SIZE_MAX ) ? left : SIZE_MAX );
+		}
+
+		seg->state	= malloc( segs->state_size );
+		seg->frame	= player.frame;
+		seg->bus	= bus;
+		ok = seg->state != NULL && apu_save_state( apu, seg->state, segs->state_size ) != 0;
+	}
+
+	apu_destroy( apu );
+	return ok ? 0 : -1;
+}
+
+/**
+ * Renders a segment from its snapshot, dropping the output of its pre-roll. By the end of the
+ * pre-roll the output filters hold what they would have in a render of the whole song, so the
+ * samples kept are the same as that render's.
+ * @param segs Segments
+ * @param seg Segment to render
+ * @param apu APU instance of the calling thread, set up for the job
+ * @param bus Bus the APU reads DMC samples through
+ * @param player Timeline player of the calling thread
+ * @param scratch Buffer of BUFFER_SAMPLES samples to render the pre-roll into
+ * @return 0 on success, -1 if the snapshot could not be loaded or out of memory
+ */
+static int
+render_segment( const Segments *segs, Segment *seg, Apu *apu, Bus *bus, TimelinePlayer *player,
+		void *scratch )
+{
+	const int s16 = is_s16( segs->job );
+	const size_t size = s16 ? sizeof(int16_t) : sizeof(float);
+	size_t written;
+
+	if ( seg->state == NULL )
+	{
+		apu_reset( apu );
+		timeline_player_start( player, segs->timeline, apu, bus );
+		apu_set_frame_hook( apu, timeline_player_frame, player );
+	}
+	else
+	{
+		// setting the frame hook restarts its counter, so it has to come before the state
+
+		apu_set_frame_hook( apu, timeline_player_frame, player );
+
+		if ( apu_load_state( apu, seg->state, segs->state_size ) != 0 )
+			return -1;
+
+		*bus = seg->bus;
+
+		player->timeline	= segs->timeline;
+		player->apu			= apu;
+		player->bus			= bus;
+		player->frame		= seg->frame;
+	}
+
+	for ( uint64_t at = seg->begin; at < seg->start; )
+		at += run_apu( apu, s16, seg->start - at, scratch, BUFFER_SAMPLES, &written );
+
+	// room for the samples of the segment and a few more, in case of rounding
+
+	size_t capacity = ( seg->end - seg->start ) * segs->job->sample_rate / CLOCK_RATE_HZ + 16;
+
+	seg->samples = malloc( capacity * size );
+
+	for ( uint64_t at = seg->start; at < seg->end && seg->samples != NULL; )
+	{
+		if ( seg->count == capacity )
+		{
+			void *samples = realloc( seg->samples, 2 * capacity * size );
+
+			if ( samples == NULL )
+				return -1;
+
+			seg->samples	= samples;
+			capacity		*= 2;
+		}
+
+		at += run_apu( apu, s16, seg->end - at, (uint8_t *)seg->samples + seg->count * size,
+				capacity - seg->count, &written );
+		seg->count += written;
+	}
+
+	return ( seg->samples != NULL ) ? 0 : -1;
+}
+
+/**
+ * Renders segments until none are left, on an emulator instance of its own. Runs as a thread.
+ * @param arg Segments
+ * @return NULL
+ */
+static void *
+segment_worker( void *arg )
+{
+	Segments *segs = arg;
+	Bus bus;
+	TimelinePlayer player;
+	void *scratch = malloc( BUFFER_SAMPLES * sizeof(float) );
+
+	bus_init( &bus, segs->rom );
+
+	Apu *apu = apu_create( bus.pages );
+	const int ready = scratch != NULL && apu != NULL && setup_apu( apu, segs->job ) == 0;
+
+	// a thread that could not set up still takes segments, so that none are waited for in vain
+
+	for ( ; ; )
+	{
+		const int k = atomic_fetch_add( &segs->next, 1 );
+
+		if ( k >= segs->count )
+			break;
+
+		Segment *seg = &segs->segments[k];
+		const int status = ( ready && render_segment( segs, seg, apu, &bus, &player, scratch ) == 0 )
+				? SEGMENT_DONE : SEGMENT_FAILED;
+
+		pthread_mutex_lock( &segs->lock );
+		seg->status = status;
+		pthread_cond_broadcast( &segs->finished );
+		pthread_mutex_unlock( &segs->lock );
+	}
+
+	if ( apu != NULL )
+		apu_destroy( apu );
+
+	free( scratch );
+	return NULL;
+}
+
+/**
+ * Renders a PPMCK song on several threads and writes it out. Each thread plays the song's
+ * timeline on an APU and bus of its own. A quick pass takes snapshots along the song, then the
+ * threads render segments from them while this one writes the finished segments out in order.
+ * @param job Job
+ * @param in Input, a PPMCK song
+ * @param cycles Length in CPU cycles
+ * @param length Length of a segment in CPU cycles (more than SEGMENT_PREROLL)
+ * @param out Output file
+ * @param wav 1 if out is a WAV file
+ * @param samples Pointer to value to store the number of samples written in
+ * @return Number of CPU cycles rendered, less than cycles on failure (reported on stderr)
+ */
+static uint64_t
+render_segments( const OfflineJob *job, const Input *in, uint64_t cycles, uint64_t length,
+		FILE *out, int wav, uint64_t *samples )
+{
+	const size_t size = is_s16( job ) ? sizeof(int16_t) : sizeof(float);
+	Segments segs;
+	uint64_t rendered = 0;
+
+	*samples = 0;
+	memset( &segs, 0, sizeof(segs) );
+	segs.job		= job;
+	segs.rom		= &in->rom;
+	segs.timeline	= &in->timeline;
+
+	if ( scan_segments( &segs, cycles, length ) != 0 )
+	{
+		fprintf( stderr, "Out of memory splitting \"%s\" into segments\n", job->input );
+		segs.count = 0;
+	}
+
+	const int threads = ( job->threads < segs.count ) ? job->threads : segs.count;
+	pthread_t *ids = malloc( threads * sizeof(*ids) );
+	int started = 0;
+
+	atomic_init( &segs.next, 0 );
+	pthread_mutex_init( &segs.lock, NULL );
+	pthread_cond_init( &segs.finished, NULL );
+
+	while ( ids != NULL && started < threads &&
+			pthread_create( &ids[started], NULL, segment_worker, &segs ) == 0 )
+		started++;
+
+	if ( segs.count > 0 && started == 0 )
+		fprintf( stderr, "Could not start any render threads\n" );
+
+	for ( int k = 0; started > 0 && k < segs.count; k++ )
+	{
+		Segment *seg = &segs.segments[k];
+
+		pthread_mutex_lock( &segs.lock );
+
+		while ( seg->status == SEGMENT_PENDING )
+			pthread_cond_wait( &segs.finished, &segs.lock );
+
+		pthread_mutex_unlock( &segs.lock );
+
+		if ( seg->status == SEGMENT_FAILED )
+		{
+			fprintf( stderr, "Could not render \"%s\" from %.1f s on\n", job->input,
+					(double)seg->start / CLOCK_RATE_HZ );
+			atomic_store( &segs.next, segs.count );
+			break;
+		}
+
+		write_samples( out, wav, seg->samples, seg->count * size );
+
+		rendered	= seg->end;
+		*samples	+= seg->count;
+
+		free( seg->samples );
+		seg->samples = NULL;
+	}
+
+	for ( int i = 0; i < started; i++ )
+		pthread_join( ids[i], NULL );
+
+	for ( int k = 0; k < segs.count; k++ )
+	{
+		free( segs.segments[k].state );
+		free( segs.segments[k].samples );
+	}
+
+	pthread_cond_destroy( &segs.finished );
+	pthread_mutex_destroy( &segs.lock );
+	free( segs.segments );
+	free( ids );
+	return rendered;
+}
+
+/**
+ * Works out how long the segments of a job should be, if it is to be rendered on several threads
+ * @param job Job
+ * @param in Input
+ * @param cycles Length of the job in CPU cycles
+ * @return Length of a segment in CPU cycles, or 0 to render the job on this thread
+ */
+static uint64_t
+segment_length( const OfflineJob *job, const Input *in, uint64_t cycles )
+{
+	// the NSF and log players are not split up, a register log has to be recorded in order, and
+	// the profiler only follows one thread
+
+#ifdef APU_PROFILE
+	return 0;
+#endif
+
+	if ( job->threads < 2 || in->type != SOURCE_PPMCK || job->log != NULL )
+		return 0;
+
+	uint64_t length = cycles / ( (uint64_t)job->threads * SEGMENTS_PER_THREAD );
+
+	if ( length < SEGMENT_MIN_CYCLES )
+		length = SEGMENT_MIN_CYCLES;
+
+	return ( length < cycles ) ? length : 0;
+}
+
+/**
+ * Sets up the recording of a register log. A PPMCK song that loops and is rendered past the end
+ * of its first time round is logged up to the end of its last whole time round, with the loop
+ * point marked, so the log plays on for ever like the song does. Anything else is logged as it
+ * is rendered, with no loop point.
+ * @param rec Recorder to fill in
+ * @param writer Writer to log to
+ * @param in Input being recorded
+ * @param cycles Length to render, in CPU cycles
+ */
+static void
+recorder_init( Recorder *rec, RegLogWriter *writer, const Input *in, uint64_t cycles )
+{
+	const Timeline *tl = &in->timeline;
+
+	memset( rec, 0, sizeof(*rec) );
+	rec->writer		= writer;
+	rec->looped		= 1;
+	rec->end_cycle	= cycles;
+
+	if ( in->type != SOURCE_PPMCK || tl->loop_frame == TIMELINE_NO_LOOP )
+		return;
+
+	// the frames from the loop point to the end repeat for as long as the song plays
+
+	const uint64_t loop_cycle = (uint64_t)tl->loop_frame * APU_FRAME_CYCLES;
+	const uint64_t period = (uint64_t)( tl->frames - tl->loop_frame ) * APU_FRAME_CYCLES;
+
+	if ( cycles < loop_cycle + period )
+		return;
+
+	rec->loop_cycle	= loop_cycle;
+	rec->end_cycle	= loop_cycle + ( cycles - loop_cycle ) / period * period;
+	rec->looped		= 0;
+}
+
+/**
+ * Marks the loop point of a log being recorded, if it is due and has not been marked yet
+ * @param rec Recorder
+ * @param cycle Cycle reached
+ */
+static void
+recorder_mark_loop( Recorder *rec, uint64_t cycle )
+{
+	if ( rec->looped || cycle <= rec->loop_cycle )
+		return;
+
+	if ( reglog_mark_loop( rec->writer, rec->loop_cycle ) != 0 )
+		rec->failed = 1;
+
+	rec->looped = 1;
+}
+
+/**
+ * Logs a register write, marking the loop point before the first write of the frame it is on.
+ * The writes of a frame land just after its first cycle, while the writes made when the song
+ * starts land on cycle 0. Has the signature of an ApuWriteHook.
+ * @param userdata Recorder
+ * @param cycle Cycle the write lands on
+ * @param reg APU register
+ * @param val Value written
+ */
+static void
+recorder_write( void *userdata, uint64_t cycle, uint_fast16_t reg, uint8_t val )
+{
+	Recorder *rec = userdata;
+
+	if ( cycle > rec->end_cycle )
+		return;
+
+	recorder_mark_loop( rec, cycle );
+	reglog_write( rec->writer, cycle, reg, val );
+}
+
+/**
+ * Renders a job from an open input into a file. Errors are reported on stderr. Safe to call from
+ * several threads at once, as long as each passes a buffer of its own.
+ * @param job What to render and where to
+ * @param in Input the job plays, opened for at least the job's length
+ * @param buffer Buffer of BUFFER_SAMPLES float samples to render into
+ * @param stats Pointer to value to store the length rendered and the time taken in
+ * @return 0 on success, -1 on failure
+ */
+static int
+render_job( const OfflineJob *job, const Input *in, void *buffer, OfflineStats *stats )
+{
+	const int s16 = is_s16( job );
+	const int wav = job->format == OFFLINE_WAV_F32 || job->format == OFFLINE_WAV_S16;
+	const double start = now();
+	Source src;
+
+	memset( stats, 0, sizeof(*stats) );
+
+	if ( wav && strcmp( job->output, "-" ) == 0 )
+	{
+		fprintf( stderr, "WAV output can not go to stdout, use a raw format\n" );
+		return -1;
+	}
+
+	if ( source_open( &src, in ) != 0 )
+	{
+		fprintf( stderr, "Out of memory playing \"%s\"\n", job->input );
+		source_close( &src );
+		return -1;
+	}
+
+	Apu *apu = source_apu( &src );
+	RegLogWriter *writer = NULL;
+	Recorder rec;
+	uint64_t cycles = job->cycles;
+
+	if ( cycles == 0 )
+		cycles = ( in->type == SOURCE_REGLOG ) ? in->log.cycles
+				: (uint64_t)DEFAULT_SECONDS * CLOCK_RATE_HZ;
+
+	if ( setup_apu( apu, job ) != 0 )
+	{
+		fprintf( stderr, "Unsupported sample rate %d Hz or quality %d\n", job->sample_rate,
+				job->quality );
+		source_close( &src );
+		return -1;
+	}
+
+	// a log of a log would have no DMC samples, since its player has no bus to take them from
+
+	if ( job->log != NULL )
+	{
+		const Bus *bus = source_bus( &src );
+
+		writer = ( bus != NULL ) ? reglog_writer_create( bus ) : NULL;
+
+		if ( writer == NULL )
+		{
+			fprintf( stderr, "Could not record a register log of \"%s\"\n", job->input );
+			source_close( &src );
+			return -1;
+		}
+
+		recorder_init( &rec, writer, in, cycles );
+		apu_set_write_hook( apu, recorder_write, &rec );
+	}
+
+	if ( source_start( &src, job->song ) != 0 )
+	{
+		fprintf( stderr, "\"%s\" has no song %d\n", job->input, job->song + 1 );
+		reglog_writer_destroy( writer );
+		source_close( &src );
+		return -1;
+	}
+
+	FILE *out;
+
+	if ( wav )
+		out = wav_file_open( (char *)job->output, job->sample_rate,
+				s16 ? WAV_FMT_PCM_INT : WAV_FMT_PCM_FLOAT, s16 ? 16 : 32, 1 );
+	else if ( strcmp( job->output, "-" ) == 0 )
+		out = stdout;
+	else
+		out = fopen( job->output, "wb" );
+
+	if ( out == NULL )
+	{
+		fprintf( stderr, "Could not open \"%s\" for writing\n", job->output );
+		reglog_writer_destroy( writer );
+		source_close( &src );
+		return -1;
+	}
+
+	const uint64_t length = segment_length( job, in, cycles );
+	uint64_t samples;
+	const uint64_t rendered = ( length != 0 )
+			? render_segments( job, in, cycles, length, out, wav, &samples )
+			: render_serial( &src, s16, cycles, out, wav, buffer, &samples );
+
+	int ok = !ferror( out );
+
+	if ( wav )
+		wav_file_close( out );
+	else if ( out == stdout )
+		ok = ok && fflush( out ) == 0;
+	else if ( fclose( out ) != 0 )
+		ok = 0;
+
+	if ( !ok )
+		fprintf( stderr, "Could not write \"%s\"\n", job->output );
+
+	// a segmented render that stopped short has already said why
+
+	if ( length != 0 && rendered < cycles )
+		ok = 0;
+
+	if ( writer != NULL )
+	{
+		const uint64_t log_end = ( rec.end_cycle < rendered ) ? rec.end_cycle : rendered;
+
+		if ( log_end == rec.end_cycle )
+			recorder_mark_loop( &rec, log_end );
+
+		if ( rec.failed || reglog_writer_save( writer, log_end, job->log ) != 0 )
+		{
+			fprintf( stderr, "Could not write \"%s\"\n", job->log );
+			ok = 0;
+		}
+	}
+
+	reglog_writer_destroy( writer );
+	source_close( &src );
+
+	stats->cycles	= rendered;
+	stats->samples	= samples;
+	stats->seconds	= now() - start;
+
+	return ok ? 0 : -1;
+}
+
+/**
+ * Renders a song into a file. Errors are reported on stderr.
+ * @param job What to render and where to
+ * @param stats Pointer to value to store the length rendered and the time taken in (may be NULL)
+ * @return 0 on success, -1 on failure
+ */
+int
+offline_render( const OfflineJob *job, OfflineStats *stats )
+{
+	const double start = now();
+	OfflineStats job_stats = { 0 };
+	Input in;
+
+	if ( input_open( &in, job->input, job->cycles ) != 0 )
+	{
+		fprintf( stderr, "Could not open \"%s\" to play back\n", job->input );
+		return -1;
+	}
+
+	void *buffer = malloc( BUFFER_SAMPLES * sizeof(float) );
+	int ok = buffer != NULL;
+
+	if ( !ok )
+		fprintf( stderr, "Out of memory playing \"%s\"\n", job->input );
+
+	ok = ok && render_job( job, &in, buffer, &job_stats ) == 0;
+
+	free( buffer );
+	input_close( &in );
+
+	if ( stats != NULL )
+	{
+		*stats = job_stats;
+		stats->seconds = now() - start;
+	}
+
+	return ok ? 0 : -1;
+}
+
+/**
+ * Opens the input of a batch job, unless another job already has
+ * @param bi Input
+ * @return Input, or NULL if it could not be opened (reported on stderr the first time)
+ */
+static const Input *
+batch_input_get( BatchInput *bi )
+{
+	pthread_mutex_lock( &bi->lock );
+
+	if ( bi->status == INPUT_CLOSED )
+	{
+		bi->status = ( input_open( &bi->in, bi->filename, bi->cycles ) == 0 )
+				? INPUT_OPEN : INPUT_FAILED;
+
+		if ( bi->status == INPUT_FAILED )
+			fprintf( stderr, "Could not open \"%s\" to play back\n", bi->filename );
+	}
+
+	const int status = bi->status;
+
+	pthread_mutex_unlock( &bi->lock );
+	return ( status == INPUT_OPEN ) ? &bi->in : NULL;
+}
+
+/**
+ * Marks a batch job on an input as finished, and closes the input after the last of them
+ * @param bi Input
+ */
+static void
+batch_input_put( BatchInput *bi )
+{
+	pthread_mutex_lock( &bi->lock );
+
+	if ( --bi->jobs_left == 0 && bi->status == INPUT_OPEN )
+	{
+		input_close( &bi->in );
+		bi->status = INPUT_CLOSED;
+	}
+
+	pthread_mutex_unlock( &bi->lock );
+}
+
+/**
+ * Pins the calling thread to one of the cores the process may run on
+ * @param n Thread number, which picks the core
+ * @return 0 on success, -1 if pinning failed or is not supported
+ */
+static int
+pin_thread( int n )
+{
+#ifdef __linux__
+	cpu_set_t allowed;
+	cpu_set_t set;
+
+	if ( sched_getaffinity( 0, sizeof(allowed), &allowed ) != 0 || CPU_COUNT( &allowed ) == 0 )
+		return -1;
+
+	int skip = n % CPU_COUNT( &allowed );
+
+	for ( int cpu = 0; cpu < CPU_SETSIZE; cpu++ )
+	{
+		if ( !CPU_ISSET( cpu, &allowed ) || skip-- > 0 )
+			continue;
+
+		CPU_ZERO( &set );
+		CPU_SET( cpu, &set );
+		return ( pthread_setaffinity_np( pthread_self(), sizeof(set), &set ) == 0 ) ? 0 : -1;
+	}
+
+	return -1;
+#else
+	(void)n;
+	return -1;
+#endif
+}
+
+/**
+ * Takes the next job from the front of a worker's run. Once the run is empty, steals the back half
+ * of the longest run left and carries on with that.
+ * @param w Worker
+ * @return Job, or -1 if no jobs are left
+ */
+static int
+next_job( BatchWorker *w )
+{
+	const Batch *b = w->batch;
+	uint64_t r = atomic_load( &w->range );
+
+	while ( RANGE_FIRST( r ) < RANGE_END( r ) )
+	{
+		if ( atomic_compare_exchange_weak( &w->range, &r,
+				RANGE( RANGE_FIRST( r ) + 1, RANGE_END( r ) ) ) )
+			return b->order[RANGE_FIRST( r )];
+	}
+
+	// jobs are never added to a run, so once every run is empty the batch is done
+
+	for ( ; ; )
+	{
+		BatchWorker *victim = NULL;
+		uint32_t most = 0;
+
+		for ( int i = 0; i < b->threads; i++ )
+		{
+			r = atomic_load( &b->workers[i].range );
+
+			if ( RANGE_FIRST( r ) < RANGE_END( r ) && RANGE_END( r ) - RANGE_FIRST( r ) > most )
+			{
+				victim	= &b->workers[i];
+				most	= RANGE_END( r ) - RANGE_FIRST( r );
+			}
+		}
+
+		if ( victim == NULL )
+			return -1;
+
+		r = atomic_load( &victim->range );
+
+		const uint32_t first = RANGE_FIRST( r );
+		const uint32_t end = RANGE_END( r );
+		const uint32_t half = ( end - first + 1 ) / 2;
+
+		if ( first >= end || !atomic_compare_exchange_strong( &victim->range, &r,
+				RANGE( first, end - half ) ) )
+			continue;
+
+		// the run of this worker is empty, so no other worker writes it
+
+		atomic_store( &w->range, RANGE( end - half + 1, end ) );
+		return b->order[end - half];
+	}
+}
+
+/**
+ * Renders batch jobs until none are left. Runs as a thread.
+ * @param arg Worker
+ * @return NULL
+ */
+static void *
+batch_worker( void *arg )
+{
+	BatchWorker *w = arg;
+	Batch *b = w->batch;
+	void *buffer = malloc( BUFFER_SAMPLES * sizeof(float) );
+
+	if ( b->desc->pin && pin_thread( w->index ) != 0 )
+		fprintf( stderr, "Could not pin render thread %d to a core\n", w->index );
+
+	for ( int k; ( k = next_job( w ) ) >= 0; )
+	{
+		const OfflineJob *job = &b->desc->jobs[k];
+		BatchInput *bi = &b->inputs[b->input_of[k]];
+		const Input *in = batch_input_get( bi );
+		OfflineStats stats = { 0 };
+		int ok = 0;
+
+		if ( buffer == NULL )
+			fprintf( stderr, "Out of memory playing \"%s\"\n", job->input );
+		else if ( in != NULL )
+			ok = render_job( job, in, buffer, &stats ) == 0;
+
+		batch_input_put( bi );
+
+		pthread_mutex_lock( &b->lock );
+		b->total.cycles		+= stats.cycles;
+		b->total.samples	+= stats.samples;
+		b->failed			+= !ok;
+
+		if ( b->desc->done != NULL )
+			b->desc->done( b->desc->userdata, job, &stats, ok );
+
+		pthread_mutex_unlock( &b->lock );
+	}
+
+	free( buffer );
+	return NULL;
+}
+
+/**
+ * Orders job lengths longest first, for qsort()
+ * @param a First JobLength
+ * @param b Second JobLength
+ * @return Less than, equal to or greater than 0 as a goes before, with or after b
+ */
+static int
+longest_first( const void *a, const void *b )
+{
+	const JobLength *x = a;
+	const JobLength *y = b;
+
+	if ( x->cycles != y->cycles )
+		return ( x->cycles > y->cycles ) ? -1 : 1;
+
+	return x->job - y->job;
+}
+
+/**
+ * Finds the inputs of a batch's jobs, one per file however many jobs play it, and deals the jobs
+ * out to the workers
+ * @param b Batch, with the description and the arrays allocated
+ * @param lengths Array of one JobLength per job to sort the jobs in
+ */
+static void
+batch_plan( Batch *b, JobLength *lengths )
+{
+	const OfflineBatch *desc = b->desc;
+
+	for ( int k = 0; k < desc->count; k++ )
+	{
+		const OfflineJob *job = &desc->jobs[k];
+		const uint64_t cycles = ( job->cycles != 0 ) ? job->cycles
+				: (uint64_t)DEFAULT_SECONDS * CLOCK_RATE_HZ;
+		int i;
+
+		for ( i = 0; i < b->input_count; i++ )
+		{
+			if ( strcmp( b->inputs[i].filename, job->input ) == 0 )
+				break;
+		}
+
+		if ( i == b->input_count )
+		{
+			BatchInput *bi = &b->inputs[b->input_count++];
+
+			bi->filename	= job->input;
+			bi->status		= INPUT_CLOSED;
+			pthread_mutex_init( &bi->lock, NULL );
+		}
+
+		if ( cycles > b->inputs[i].cycles )
+			b->inputs[i].cycles = cycles;
+
+		b->inputs[i].jobs_left++;
+		b->input_of[k]		= i;
+		lengths[k].cycles	= cycles;
+		lengths[k].job		= k;
+	}
+
+	// every worker gets every threads-th job, longest first, so the runs come out about as long as
+	// each other and the jobs stolen off their backs are short ones
+
+	qsort( lengths, desc->count, sizeof(*lengths), longest_first );
+
+	int pos = 0;
+
+	for ( int w = 0; w < b->threads; w++ )
+	{
+		const int first = pos;
+
+		for ( int i = w; i < desc->count; i += b->threads )
+			b->order[pos++] = lengths[i].job;
+
+		b->workers[w].batch	= b;
+		b->workers[w].index	= w;
+		atomic_init( &b->workers[w].range, RANGE( first, pos ) );
+	}
+}
+
+/**
+ * Renders a batch of jobs on a pool of threads. Errors are reported on stderr, and a failed job
+ * does not stop the others.
+ * @param batch Jobs and how to run them
+ * @param stats Pointer to value to store the length of all the jobs rendered and the wall time
+ * taken in (may be NULL)
+ * @return 0 if every job succeeded, -1 if any failed or out of memory
+ */
+int
+offline_render_batch( const OfflineBatch *batch, OfflineStats *stats )
+{
+	const double start = now();
+	const int count = ( batch->count > 0 ) ? batch->count : 0;
+	Batch b;
+
+	memset( &b, 0, sizeof(b) );
+	b.desc		= batch;
+	b.threads	= ( batch->threads < count ) ? batch->threads : count;
+
+	// the profiler only follows one thread, as in segment_length()
+
+#ifdef APU_PROFILE
+	b.threads = 1;
+#endif
+
+	if ( b.threads < 1 )
+		b.threads = 1;
+
+	b.inputs	= calloc( count + 1, sizeof(*b.inputs) );
+	b.input_of	= calloc( count + 1, sizeof(*b.input_of) );
+	b.order		= calloc( count + 1, sizeof(*b.order) );
+	b.workers	= calloc( b.threads, sizeof(*b.workers) );
+
+	JobLength *lengths = calloc( count + 1, sizeof(*lengths) );
+	int ok = b.inputs != NULL && b.input_of != NULL && b.order != NULL && b.workers != NULL &&
+			lengths != NULL;
+
+	if ( ok )
+	{
+		batch_plan( &b, lengths );
+		pthread_mutex_init( &b.lock, NULL );
+
+		// workers that could not be started leave their runs to be stolen by the others
+
+		int started = 0;
+
+		while ( started < b.threads &&
+				pthread_create( &b.workers[started].id, NULL, batch_worker, &b.workers[started] ) == 0 )
+			started++;
+
+		if ( started == 0 )
+			batch_worker( &b.workers[0] );
+
+		for ( int w = 0; w < started; w++ )
+			pthread_join( b.workers[w].id, NULL );
+
+		for ( int i = 0; i < b.input_count; i++ )
+			pthread_mutex_destroy( &b.inputs[i].lock );
+
+		pthread_mutex_destroy( &b.lock );
+		ok = b.failed == 0;
+	}
+	else
+		fprintf( stderr, "Out of memory setting up a batch of %d jobs\n", count );
+
+	free( lengths );
+	free( b.workers );
+	free( b.order );
+	free( b.input_of );
+	free( b.inputs );
+
+	if ( stats != NULL )
+	{
+		*stats = b.total;
+		stats->seconds = now() - start;
+	}
+
+	return ok ? 0 : -1;
+}
+
+/**
+ * Reads a manifest of jobs. Each line holds a job: the input file, the output file, and optionally
+ * the length in seconds and the NSF song (from 1), separated by spaces or tabs. A length or song
+ * of "-" leaves it at the default. Blank lines and lines starting with '#' are skipped. Errors are
+ * reported on stderr.
+ * @param m Manifest to fill in
+ * @param filename Manifest file
+ * @param defaults Job to take the format, sample rate, quality and the lengths and songs not
+ * given from
+ * @return 0 on success, -1 if the file could not be read or has an error in it
+ */
+int
+offline_read_manifest( OfflineManifest *m, const char *filename, const OfflineJob *defaults )
+{
+	FILE *f = fopen( filename, "rb" );
+	long size = -1;
+
+	memset( m, 0, sizeof(*m) );
+
+	if ( f != NULL && fseek( f, 0, SEEK_END ) == 0 )
+		size = ftell( f );
+
+	if ( size >= 0 && fseek( f, 0, SEEK_SET ) == 0 )
+		m->text = malloc( size + 1 );
+
+	if ( m->text == NULL || fread( m->text, 1, size, f ) != (size_t)size )
+	{
+		fprintf( stderr, "Could not read \"%s\"\n", filename );
+
+		if ( f != NULL )
+			fclose( f );
+
+		offline_free_manifest( m );
+		return -1;
+	}
+
+	fclose( f );
+	m->text[size] = '\0';
+
+	// there are at most as many jobs as lines
+
+	int lines = 1;
+
+	for ( long i = 0; i < size; i++ )
+		lines += m->text[i] == '\n';
+
+	m->jobs = calloc( lines, sizeof(*m->jobs) );
+
+	if ( m->jobs == NULL )
+	{
+		fprintf( stderr, "Out of memory reading \"%s\"\n", filename );
+		offline_free_manifest( m );
+		return -1;
+	}
+
+	char *next = m->text;
+
+	for ( int line = 1; next != NULL; line++ )
+	{
+		char *text = next;
+		char *fields[MANIFEST_FIELDS + 1];
+		char *save;
+		int n = 0;
+
+		next = strchr( text, '\n' );
+
+		if ( next != NULL )
+			*next++ = '\0';
+
+		for ( char *field = strtok_r( text, " \t\r", &save ); field != NULL && n <= MANIFEST_FIELDS;
+				field = strtok_r( NULL, " \t\r", &save ) )
+			fields[n++] = field;
+
+		if ( n == 0 || fields[0][0] == '#' )
+			continue;
+
+		// jobs can not share stdout
+
+		OfflineJob *job = &m->jobs[m->count];
+		int ok = n >= 2 && n <= MANIFEST_FIELDS && strcmp( fields[1], "-" ) != 0;
+		char *end;
+
+		*job			= *defaults;
+		job->input		= fields[0];
+		job->output		= ( n > 1 ) ? fields[1] : NULL;
+		job->log		= NULL;
+		job->threads	= 1;
+
+		if ( ok && n > 2 && strcmp( fields[2], "-" ) != 0 )
+		{
+			const double cycles = strtod( fields[2], &end ) * CLOCK_RATE_HZ;
+
+			ok = *end == '\0' && cycles >= 1 && cycles < (double)UINT64_MAX;
+			job->cycles = ok ? cycles : 0;
+		}
+
+		if ( ok && n > 3 && strcmp( fields[3], "-" ) != 0 )
+		{
+			job->song = (int)strtol( fields[3], &end, 10 ) - 1;
+			ok = *end == '\0' && job->song >= 0;
+		}
+
+		if ( !ok )
+		{
+			fprintf( stderr, "%s:%d: expected \"input output [seconds [song]]\"\n", filename,
+					line );
+			offline_free_manifest( m );
+			return -1;
+		}
+
+		m->count++;
+	}
+
+	return 0;
+}
+
+/**
+ * Frees a manifest read with offline_read_manifest()
+ * @param m Manifest
+ */
+void
+offline_free_manifest( OfflineManifest *m )
+{
+	free( m->jobs );
+	free( m->text );
+	memset( m, 0, sizeof(*m) );
+}
@@ -0,0 +1,73 @@
+#ifndef OFFLINE_H
+#define OFFLINE_H
+
+#include <stdint.h>
+
+#define OFFLINE_WAV_F32		0					// 32-bit float WAV
+#define OFFLINE_WAV_S16		1					// 16-bit WAV, rendered with APU_OUTPUT_FIXED
+#define OFFLINE_RAW_F32		2					// headerless native float samples
+#define OFFLINE_RAW_S16		3					// headerless native int16 samples
+
+#define OFFLINE_START_SONG	-1					// song of an NSF job: the file's start song
+
+/*
+ * Offline rendering: plays a song into a file as fast as the CPU allows, with no SDL, no audio
+ * device and no pacing. The input can be a PPMCK song image, an NSF file or a register log, told
+ * apart by their contents. A PPMCK song is compiled with sound_compile() once, and every render of
+ * it plays the timeline, which sounds the same as the driver and is only read, so any number of
+ * threads can play it at once.
+ *
+ * A PPMCK song can be rendered on several threads: it is cut into segments, a quick pass with
+ * apu_skip() takes a snapshot at the start of each, and the threads render the segments at the
+ * same time, each on an emulator of its own. Every segment is rendered from a quarter of a second
+ * before its start, which is long enough for the output filters to settle on the same state as
+ * in a render on one thread, so the segments join up into the same samples.
+ *
+ * A batch renders many jobs, such as those listed in a manifest file, on a pool of threads. Jobs
+ * are dealt out to the threads longest first, and a thread that runs out steals half of the
+ * jobs another one has left. Each input file is opened once, and a PPMCK song compiled once, for
+ * all the jobs that play it, and closed again after the last of them. Each song is compiled by the
+ * thread that first needs it, on a driver of its own, so different songs compile at the same time.
+ */
+
+typedef struct {
+	const char		*input;					// song image, NSF or register log
+	const char		*output;				// file to write, "-" for stdout (raw formats only)
+	const char		*log;					// register log to record alongside, or NULL
+	int				format;					// OFFLINE_*
+	uint64_t		cycles;					// length in CPU cycles, 0 = a register log's own
+	int				sample_rate;			// output sample rate in Hz
+	int				quality;				// APU_QUALITY_*
+	int				song;					// NSF song (0-based) or OFFLINE_START_SONG
+	int				threads;				// threads to render a PPMCK song on, 0 or 1 = one
+} OfflineJob;
+
+typedef struct {
+	uint64_t		cycles;					// CPU cycles rendered
+	uint64_t		samples;				// samples written
+	double			seconds;				// wall time taken
+} OfflineStats;
+
+typedef void ( *OfflineDoneHook )( void *userdata, const OfflineJob *job, const OfflineStats *stats, int ok );
+
+typedef struct {
+	const OfflineJob	*jobs;
+	int				count;					// number of jobs
+	int				threads;				// threads to render on
+	int				pin;					// 1 = pin each thread to a core of its own
+	OfflineDoneHook	done;					// called as each job finishes, one at a time (may be NULL)
+	void			*userdata;				// passed to done
+} OfflineBatch;
+
+typedef struct {
+	OfflineJob		*jobs;
+	int				count;					// number of jobs
+	char			*text;					// contents of the file, which the jobs point into
+} OfflineManifest;
+
+int		offline_render( const OfflineJob *job, OfflineStats *stats );
+int		offline_render_batch( const OfflineBatch *batch, OfflineStats *stats );
+int		offline_read_manifest( OfflineManifest *m, const char *filename, const OfflineJob *defaults );
+void	offline_free_manifest( OfflineManifest *m );
+
+#endif // OFFLINE_H
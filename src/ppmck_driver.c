@@ -1,8 +1,12 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "ppmck_driver.h"
 #include "apu.h"
 #include "bus.h"
+#include "state.h"
+#include "timeline.h"
+#include "trace.h"
 
 // ROM addresses of various tables
 #define DUTYENVE_TABLE			0x8000
@@ -16,17 +20,29 @@
 #define LFO_DATA				0x8218
 #define DPCM_DATA				0x822d
 #define SONG_000_TRACK_TABLE	0x8245
+#define SONG_000_BANK_TABLE		( SONG_000_TRACK_TABLE + 2 * PTR_TRACK_END )	// with bank switching only
+
+// bank switching, see sound_set_bankswitch()
+#define SONG_BANK_PAGE			2			// song data banks are switched in at $a000-$bfff
+#define DPCM_BANK_PAGE			4			// DPCM sample banks are switched in at $c000-$ffff
+#define DPCM_ENTRY_SIZE			4			// bytes per DPCM_DATA entry without DPCM bank switching
 
 // PPMCK driver defines
 #define PTR_TRACK_END			5
 #define PITCH_CORRECTION		0
 #define DPCM_RESTSTOP			0
-#define DPCM_BANKSWITCH			0
 #define DPCM_EXTRA_BANK_START	0
 #define BANK_MAX_IN_4KB			((3 + 0)*2+1)
-#define ALLOW_BANKSWITCH		0
 #define OVERLOAD_DETECT			0
 
+// save states
+#define STATE_MAGIC				0x534d5050	// "PPMS"
+#define STATE_VERSION			2
+
+// compiling, see sound_compile()
+#define HISTORY_BUCKETS			( 1 << 16 )	// hash buckets for the driver states seen so far
+#define HISTORY_NONE			UINT32_MAX
+
 typedef struct {
 	uint16_t		sound_add;
 	uint16_t		soft_add;
@@ -62,9 +78,30 @@ typedef struct {
 	uint8_t			extra_mem2;
 } Channel;
 
-static struct {
-	Channel			channels[5];
-} ppmck;
+struct Ppmck {
+	Apu				*apu;
+	Channel			channels[PTR_TRACK_END];
+	Bus				bus;					// song image, with the banks the driver switched in
+
+	struct {
+		int			song;					// 1 = song data is bank switched (ALLOW_BANKSWITCH)
+		int			dpcm;					// 1 = DPCM samples are bank switched (DPCM_BANKSWITCH)
+	} bankswitch;
+
+	struct {
+		Timeline	*timeline;				// timeline writes go to instead of the APU, or NULL
+		int			error;					// 1 = an event could not be added
+	} recording;
+};
+
+typedef struct {
+	size_t			state_size;				// size of a driver state
+	uint8_t			*states;				// driver state at the start of each frame, back to back
+	uint32_t		*chain;					// earlier frame in the same bucket as each frame
+	uint32_t		*buckets;				// last frame in each bucket, or HISTORY_NONE
+	size_t			count;					// number of frames in states
+	size_t			capacity;				// number of frames that fit in states and chain
+} StateHistory;
 
 static uint16_t psg_frequency_table[16] = {
 	0x06ae, 0x064e, 0x05f4, 0x059e,
@@ -73,11 +110,44 @@ static uint16_t psg_frequency_table[16] = {
 	0x0000, 0x07f2, 0x0780, 0x0714
 };
 
+/**
+ * Writes an APU register, or records the write while compiling
+ * @param p Driver
+ * @param reg Register
+ * @param val Value to write
+ */
+static void
+write_reg( Ppmck *p, uint8_t reg, uint8_t val )
+{
+	if ( p->recording.timeline == NULL )
+		apu_write( p->apu, reg, val );
+	else if ( timeline_add( p->recording.timeline, reg, val ) != 0 )
+		p->recording.error = 1;
+}
+
+/**
+ * Switches a bank in through the bank registers, and records the switch while compiling
+ * @param p Driver
+ * @param page ROM page (0 = $8000, 7 = $f000)
+ * @param bank Bank number
+ */
+static void
+write_bank( Ppmck *p, int page, uint8_t bank )
+{
+	bus_write( &p->bus, BUS_BANK_REG + page, bank );
+
+	if ( p->recording.timeline == NULL )
+		return;
+
+	if ( timeline_add( p->recording.timeline, TIMELINE_BANK_REG + page, bank ) != 0 )
+		p->recording.error = 1;
+}
+
 static uint16_t
-read_word( uint16_t at )
+read_word( Ppmck *p, uint16_t at )
 {
-	uint8_t lsb = cpu_bus[at];
-	uint8_t msb = cpu_bus[at + 1];
+	uint8_t lsb = bus_read( &p->bus, at );
+	uint8_t msb = bus_read( &p->bus, at + 1 );
 	return ( msb << 8 ) | lsb;
 }
 
@@ -106,24 +176,24 @@ detune_minus( Channel *c, uint16_t val )
 }
 
 static void
-sound_software_enverope( Channel *c, int i )
+sound_software_enverope( Ppmck *p, Channel *c, int i )
 {
 	uint8_t data;
 
 	for ( ; ; )
 	{
-		data = cpu_bus[c->soft_add];
+		data = bus_read( &p->bus, c->soft_add );
 		if ( data != 0xff ) break;
-		c->soft_add = read_word( SOFTENVE_LP_TABLE + ( c->softenve_sel << 1 ) );
+		c->soft_add = read_word( p, SOFTENVE_LP_TABLE + ( c->softenve_sel << 1 ) );
 	}
 
 	c->register_low = data;
-	apu_write( i << 2, c->register_high | c->register_low );
+	write_reg( p, i << 2, c->register_high | c->register_low );
 	c->soft_add++;
 }
 
 static void
-sound_duty_enverope( Channel *c, int i )
+sound_duty_enverope( Ppmck *p, Channel *c, int i )
 {
 	uint8_t data;
 
@@ -132,25 +202,25 @@ sound_duty_enverope( Channel *c, int i )
 		// if triangle channel
 		if ( i == 2 ) return;
 		
-		data = cpu_bus[c->duty_add];
+		data = bus_read( &p->bus, c->duty_add );
 		if ( data != 0xff ) break;
-		c->duty_add = read_word( DUTYENVE_LP_TABLE + ( c->duty_sel << 1 ) );
+		c->duty_add = read_word( p, DUTYENVE_LP_TABLE + ( c->duty_sel << 1 ) );
 	}
 
 	c->register_high = ( data << 6 ) | 0x30;
-	apu_write( i << 2, c->register_high | c->register_low );
+	write_reg( p, i << 2, c->register_high | c->register_low );
 	c->duty_add++;
 }
 
 static void
-sound_pitch_enverope( Channel *c, int i )
+sound_pitch_enverope( Ppmck *p, Channel *c, int i )
 {
 	uint8_t temp = c->sound_freq >> 8;
 	uint8_t data;
 
 	for ( ; ; )
 	{
-		data = cpu_bus[c->pitch_add];
+		data = bus_read( &p->bus, c->pitch_add );
 
 		if ( data != 0xff )
 		{
@@ -162,27 +232,27 @@ sound_pitch_enverope( Channel *c, int i )
 			break;
 		}
 
-		c->pitch_add = read_word( PITCHENVE_LP_TABLE + ( c->pitch_sel << 1 ) );
+		c->pitch_add = read_word( p, PITCHENVE_LP_TABLE + ( c->pitch_sel << 1 ) );
 	}
 
-	apu_write( ( i << 2 ) + 2, c->sound_freq & 0xff );
+	write_reg( p, ( i << 2 ) + 2, c->sound_freq & 0xff );
 
 	if ( c->sound_freq >> 8 != temp )
-		apu_write( ( i << 2 ) + 3, c->sound_freq >> 8 );
+		write_reg( p, ( i << 2 ) + 3, c->sound_freq >> 8 );
 
 	c->pitch_add++;
 }
 
 static int
-note_enve_sub( Channel *c )
+note_enve_sub( Ppmck *p, Channel *c )
 {
 	uint8_t data;
 
 	for ( ; ; )
 	{
-		data = cpu_bus[c->arpe_add];
+		data = bus_read( &p->bus, c->arpe_add );
 		if ( data != 0xff ) break;
-		c->arpe_add = read_word( ARPEGGIO_LP_TABLE + ( c->arpeggio_sel << 1 ) );
+		c->arpe_add = read_word( p, ARPEGGIO_LP_TABLE + ( c->arpeggio_sel << 1 ) );
 	}
 
 	if ( data == 0 || data == 0x80 )
@@ -215,7 +285,7 @@ note_enve_sub( Channel *c )
 }
 
 static void
-sound_lfo( Channel *c, int i )
+sound_lfo( Ppmck *p, Channel *c, int i )
 {
 	uint8_t temp = c->sound_freq >> 8;
 
@@ -247,10 +317,10 @@ sound_lfo( Channel *c, int i )
 		c->lfo_adc_sbc_counter++;
 	}
 
-	apu_write( ( i << 2 ) + 2, c->sound_freq & 0xff );
+	write_reg( p, ( i << 2 ) + 2, c->sound_freq & 0xff );
 
 	if ( c->sound_freq >> 8 != temp )
-		apu_write( ( i << 2 ) + 3, c->sound_freq >> 8 );
+		write_reg( p, ( i << 2 ) + 3, c->sound_freq >> 8 );
 }
 
 static void
@@ -290,47 +360,47 @@ frequency_set( Channel *c, int i )
 }
 
 static void
-sound_high_speed_arpeggio( Channel *c, int i )
+sound_high_speed_arpeggio( Ppmck *p, Channel *c, int i )
 {
 	uint8_t temp = c->sound_freq >> 8;
 
-	if ( !note_enve_sub( c ) )
+	if ( !note_enve_sub( p, c ) )
 	{
 		frequency_set( c, i );
-		apu_write( ( i << 2 ) + 2, c->sound_freq & 0xff );
+		write_reg( p, ( i << 2 ) + 2, c->sound_freq & 0xff );
 
 		if ( c->sound_freq >> 8 != temp )
-			apu_write( ( i << 2 ) + 3, c->sound_freq >> 8 );
+			write_reg( p, ( i << 2 ) + 3, c->sound_freq >> 8 );
 	}
 
 	c->arpe_add++;
 }
 
 static void
-do_effect( Channel *c, int i )
+do_effect( Ppmck *p, Channel *c, int i )
 {
 	if ( c->rest_flag & 0x01 )
 		return;
 
 	if ( c->effect_flag & 0x04 )
-		sound_duty_enverope( c, i );
+		sound_duty_enverope( p, c, i );
 
 	if ( c->effect_flag & 0x01 )
-		sound_software_enverope( c, i );
+		sound_software_enverope( p, c, i );
 
 	if ( c->effect_flag & 0x10 )
-		sound_lfo( c, i );
+		sound_lfo( p, c, i );
 
 	if ( c->effect_flag & 0x02 )
-		sound_pitch_enverope( c, i );
+		sound_pitch_enverope( p, c, i );
 
 	if ( c->effect_flag & 0x08 )
 	{
 		if ( !( c->rest_flag & 0x02 ) )
-			sound_high_speed_arpeggio( c, i );
+			sound_high_speed_arpeggio( p, c, i );
 		else
 		{
-			note_enve_sub( c );
+			note_enve_sub( p, c );
 			frequency_set( c, i );
 			c->arpe_add++;
 		}
@@ -338,12 +408,12 @@ do_effect( Channel *c, int i )
 }
 
 static void
-effect_init( Channel *c, int i )
+effect_init( Ppmck *p, Channel *c, int i )
 {
-	c->soft_add = read_word( SOFTENVE_TABLE + ( c->softenve_sel << 1 ) );
-	c->pitch_add = read_word( PITCHENVE_TABLE + ( c->pitch_sel << 1 ) );
-	c->duty_add = read_word( DUTYENVE_TABLE + ( c->duty_sel << 1 ) );
-	c->arpe_add = read_word( ARPEGGIO_TABLE + ( c->arpeggio_sel << 1 ) );
+	c->soft_add = read_word( p, SOFTENVE_TABLE + ( c->softenve_sel << 1 ) );
+	c->pitch_add = read_word( p, PITCHENVE_TABLE + ( c->pitch_sel << 1 ) );
+	c->duty_add = read_word( p, DUTYENVE_TABLE + ( c->duty_sel << 1 ) );
+	c->arpe_add = read_word( p, ARPEGGIO_TABLE + ( c->arpeggio_sel << 1 ) );
 
 	c->lfo_start_counter = c->lfo_start_time;
 	c->lfo_adc_sbc_counter = c->lfo_adc_sbc_time;
@@ -358,11 +428,11 @@ effect_init( Channel *c, int i )
 }
 
 static void
-loop_sub( Channel *c )
+loop_sub( Ppmck *p, Channel *c )
 {
 	uint8_t lsb, msb;
 		
-	if ( ++c->channel_loop == cpu_bus[c->sound_add] )
+	if ( ++c->channel_loop == bus_read( &p->bus, c->sound_add ) )
 	{
 		c->channel_loop = 0;
 		c->sound_add += 4;
@@ -370,114 +440,137 @@ loop_sub( Channel *c )
 	else
 	{
 		c->sound_add++;
-		lsb = cpu_bus[++c->sound_add];
-		msb = cpu_bus[++c->sound_add];
+		lsb = bus_read( &p->bus, ++c->sound_add );
+		msb = bus_read( &p->bus, ++c->sound_add );
 		c->sound_add = ( msb << 8 ) | lsb;
 	}
 }
 
 static void
-loop_sub2( Channel *c )
+loop_sub2( Ppmck *p, Channel *c )
 {
 	uint8_t lsb, msb;
 			
-	if ( ++c->channel_loop != cpu_bus[c->sound_add] )
+	if ( ++c->channel_loop != bus_read( &p->bus, c->sound_add ) )
 		c->sound_add += 4;
 	else
 	{
 		c->channel_loop = 0;
 		c->sound_add++;
-		lsb = cpu_bus[++c->sound_add];
-		msb = cpu_bus[++c->sound_add];
+		lsb = bus_read( &p->bus, ++c->sound_add );
+		msb = bus_read( &p->bus, ++c->sound_add );
 		c->sound_add = ( msb << 8 ) | lsb;
 	}
 }
 
+/**
+ * Switches an 8 KiB song data bank in at $a000-$bfff, as two 4 KiB banks
+ * @param p Driver
+ * @param bank Song bank number
+ */
+static void
+change_bank( Ppmck *p, uint8_t bank )
+{
+	bus_write( &p->bus, BUS_BANK_REG + SONG_BANK_PAGE, bank << 1 );
+	bus_write( &p->bus, BUS_BANK_REG + SONG_BANK_PAGE + 1, ( bank << 1 ) + 1 );
+}
+
 static void
-data_bank_addr( Channel *c )
+data_bank_addr( Ppmck *p, Channel *c )
 {
 	uint8_t lsb, msb;
 
-	lsb = cpu_bus[++c->sound_add];
-	msb = cpu_bus[++c->sound_add];
+	// with bank switching the jump target is preceded by the bank it is in
+
+	if ( p->bankswitch.song )
+	{
+		c->sound_bank = bus_read( &p->bus, ++c->sound_add );
+		change_bank( p, c->sound_bank );
+	}
+
+	lsb = bus_read( &p->bus, ++c->sound_add );
+	msb = bus_read( &p->bus, ++c->sound_add );
 	c->sound_add = ( msb << 8 ) | lsb;
 }
 
 static void
-sound_data_read( Channel *c, int i )
+sound_data_read( Ppmck *p, Channel *c, int i )
 {
+	if ( p->bankswitch.song )
+		change_bank( p, c->sound_bank );
+
 	for ( ; ; )
 	{
-		uint8_t data = cpu_bus[c->sound_add++];
+		uint8_t data = bus_read( &p->bus, c->sound_add++ );
 
 		switch ( data )
 		{
 		case 0xa0:
-			loop_sub( c );
+			loop_sub( p, c );
 			break;
 		case 0xa1:
-			loop_sub2( c );
+			loop_sub2( p, c );
 			break;
 		case 0xee:
-			data_bank_addr( c );
+			data_bank_addr( p, c );
 			break;
 		case 0xfe:
-			data = cpu_bus[c->sound_add++];
+			data = bus_read( &p->bus, c->sound_add++ );
 
 			if ( data & 0x80 )
 			{
 				c->effect_flag &= ~0x04;
 				c->register_high = ( data << 6 ) | 0x30;
-				apu_write( i << 2, c->register_high | c->register_low );
+				write_reg( p, i << 2, c->register_high | c->register_low );
 			}
 			else
 			{
 				c->effect_flag |= 0x04;
 				c->duty_sel = data;
-				c->duty_add = read_word( DUTYENVE_TABLE + ( data << 1 ) );
+				c->duty_add = read_word( p, DUTYENVE_TABLE + ( data << 1 ) );
 			}
 
 			break;
 		case 0xfd:
-			data = cpu_bus[c->sound_add++];
+			data = bus_read( &p->bus, c->sound_add++ );
 
 			if ( data & 0x80 )
 			{
 				c->effect_flag &= ~0x01;
 				c->register_low = data & 0x0f;
-				apu_write( i << 2, c->register_high | c->register_low );
+				write_reg( p, i << 2, c->register_high | c->register_low );
 			}
 			else
 			{
 				c->effect_flag |= 0x01;
 				c->softenve_sel = data;
-				c->soft_add = read_word( SOFTENVE_TABLE + ( data << 1 ) );
+				c->soft_add = read_word( p, SOFTENVE_TABLE + ( data << 1 ) );
 			}
 
 			break;
 		case 0xfc:
 			c->rest_flag |= 1;
-			c->sound_counter = cpu_bus[c->sound_add++];
+			c->sound_counter = bus_read( &p->bus, c->sound_add++ );
 
 			if ( i == 2 )
-				apu_write( i << 2, 0 );
+				write_reg( p, i << 2, 0 );
 			else
-				apu_write( i << 2, c->register_high );
+				write_reg( p, i << 2, c->register_high );
 
 			return;
 		case 0xfb:
-			data = cpu_bus[c->sound_add++];
+			data = bus_read( &p->bus, c->sound_add++ );
 			
 			if ( data == 0xff )
 				c->effect_flag &= ~0x8f;
 			else
 			{
 				c->lfo_sel = data << 2;
-				c->lfo_start_time = cpu_bus[LFO_DATA + ( data << 2 )];
+				c->lfo_start_time = bus_read( &p->bus, LFO_DATA + ( data << 2 ) );
 				c->lfo_start_counter = c->lfo_start_time;
-				c->lfo_reverse_time = cpu_bus[LFO_DATA + ( data << 2 ) + 1];
+				c->lfo_reverse_time = bus_read( &p->bus, LFO_DATA + ( data << 2 ) + 1 );
 				c->lfo_reverse_counter = c->lfo_reverse_time;
-				c->lfo_depth = cpu_bus[LFO_DATA + ( data << 2 ) + 2];
+				c->lfo_depth = bus_read( &p->bus, LFO_DATA + ( data << 2 ) + 2 );
 
 				if ( c->lfo_reverse_time == c->lfo_depth )
 				{
@@ -503,7 +596,7 @@ sound_data_read( Channel *c, int i )
 
 			break;
 		case 0xfa:
-			data = cpu_bus[c->sound_add++];
+			data = bus_read( &p->bus, c->sound_add++ );
 
 			if ( data == 0xff )
 				c->effect_flag &= ~0x80;
@@ -515,165 +608,477 @@ sound_data_read( Channel *c, int i )
 
 			break;
 		case 0xf9:
-			apu_write( ( i << 2 ) + 1, cpu_bus[c->sound_add++] );
+			write_reg( p, ( i << 2 ) + 1, bus_read( &p->bus, c->sound_add++ ) );
 			break;
 		// pitch envelope
 		case 0xf8:
-			data = cpu_bus[c->sound_add++];
+			data = bus_read( &p->bus, c->sound_add++ );
 
 			if ( data == 0xff )
 				c->effect_flag &= ~0x02;
 			else
 			{
 				c->pitch_sel = data;
-				c->pitch_add = read_word( PITCHENVE_TABLE + ( data << 1 ) );
+				c->pitch_add = read_word( p, PITCHENVE_TABLE + ( data << 1 ) );
 				c->effect_flag |= 0x02;
 			}
 
 			break;
 		// arpeggio
 		case 0xf7:
-			data = cpu_bus[c->sound_add++];
+			data = bus_read( &p->bus, c->sound_add++ );
 
 			if ( data == 0xff )
 				c->effect_flag &= ~0x08;
 			else
 			{
 				c->arpeggio_sel = data;
-				c->arpe_add = read_word( ARPEGGIO_TABLE + ( data << 1 ) );
+				c->arpe_add = read_word( p, ARPEGGIO_TABLE + ( data << 1 ) );
 				c->effect_flag |= 0x08;
 			}
 
 			break;
 		// direct frequency
 		case 0xf6:
-			c->sound_freq = read_word( c->sound_add );
+			c->sound_freq = read_word( p, c->sound_add );
 			c->sound_add += 2;
-			effect_init( c, i );
+			effect_init( p, c, i );
 			break;
 		// unused by this program
 		case 0xf5:
 			break;
 		// wait
 		case 0xf4:
-			c->sound_counter = cpu_bus[c->sound_add++];
+			c->sound_counter = bus_read( &p->bus, c->sound_add++ );
 			break;
 		// note
 		default:
 			c->sound_sel = data;
-			c->sound_counter = cpu_bus[c->sound_add++];
+			c->sound_counter = bus_read( &p->bus, c->sound_add++ );
 			frequency_set( c, i );
-			effect_init( c, i );
+			effect_init( p, c, i );
 			return;
 		}
 	}
 }
 
 static void
-sound_internal( int i )
+sound_internal( Ppmck *p, int i )
 {
-	Channel *c = &ppmck.channels[i];
+	Channel *c = &p->channels[i];
 
 	if ( --c->sound_counter > 0 )
 	{
-		do_effect( c, i );
+		do_effect( p, c, i );
 		return;
 	}
 
-	sound_data_read( c, i );
-	do_effect( c, i );
+	sound_data_read( p, c, i );
+	do_effect( p, c, i );
 
 	if ( c->rest_flag & 0x02 )
 	{
-		apu_write( ( i << 2 ) + 0, c->register_low | c->register_high );
-		apu_write( ( i << 2 ) + 2, c->sound_freq & 0xff );
-		apu_write( ( i << 2 ) + 3, c->sound_freq >> 8 );
+		write_reg( p, ( i << 2 ) + 0, c->register_low | c->register_high );
+		write_reg( p, ( i << 2 ) + 2, c->sound_freq & 0xff );
+		write_reg( p, ( i << 2 ) + 3, c->sound_freq >> 8 );
 		c->rest_flag &= ~0x02;
 	}
 }
 
 static void
-sound_dpcm_play( Channel *c )
+sound_dpcm_play( Ppmck *p, Channel *c )
 {
 	uint8_t data, data2;
+	uint16_t entry;
+
+	if ( p->bankswitch.song )
+		change_bank( p, c->sound_bank );
 
 	for ( ; ; )
 	{
-		data = cpu_bus[c->sound_add++];
+		data = bus_read( &p->bus, c->sound_add++ );
 
 		switch ( data )
 		{
 		case 0xa0:
-			loop_sub( c );
+			loop_sub( p, c );
 			break;
 		case 0xa1:
-			loop_sub2( c );
+			loop_sub2( p, c );
 			break;
 		case 0xee:
-			data_bank_addr( c );
+			data_bank_addr( p, c );
 			break;
 		case 0xfc:
-			c->sound_counter = cpu_bus[c->sound_add++];
+			c->sound_counter = bus_read( &p->bus, c->sound_add++ );
 			return;
 		case 0xf5:
 			break;
 		case 0xf4:
-			c->sound_counter = cpu_bus[c->sound_add++];
+			c->sound_counter = bus_read( &p->bus, c->sound_add++ );
 			return;
 		default:
-			apu_write( APU_SNDCHN,  0x0f ); // stop DPCM
-			apu_write( APU_DMCFREQ, cpu_bus[DPCM_DATA + ( data << 2 ) + 0] );
+			entry = DPCM_DATA + data * ( p->bankswitch.dpcm ? DPCM_ENTRY_SIZE + 1 : DPCM_ENTRY_SIZE );
+
+			write_reg( p, APU_SNDCHN,  0x0f ); // stop DPCM
+			write_reg( p, APU_DMCFREQ, bus_read( &p->bus, entry + 0 ) );
 
-			data2 = cpu_bus[DPCM_DATA + ( data << 2 ) + 1];
+			data2 = bus_read( &p->bus, entry + 1 );
 			
 			if ( data2 != 0xff )
-				apu_write( APU_DMCRAW, data2 );
+				write_reg( p, APU_DMCRAW, data2 );
+
+			// with DPCM bank switching each entry ends with the first of the four banks that hold
+			// the sample, which go in at $c000-$ffff
+
+			if ( p->bankswitch.dpcm )
+			{
+				data2 = bus_read( &p->bus, entry + DPCM_ENTRY_SIZE );
+
+				for ( int i = 0; i < 4; i++ )
+					write_bank( p, DPCM_BANK_PAGE + i, DPCM_EXTRA_BANK_START + data2 + i );
+			}
 
-			apu_write( APU_DMCADDR, cpu_bus[DPCM_DATA + ( data << 2 ) + 2] );
-			apu_write( APU_DMCLEN,  cpu_bus[DPCM_DATA + ( data << 2 ) + 3] );
-			apu_write( APU_SNDCHN,  0x1f );
+			write_reg( p, APU_DMCADDR, bus_read( &p->bus, entry + 2 ) );
+			write_reg( p, APU_DMCLEN,  bus_read( &p->bus, entry + 3 ) );
+			write_reg( p, APU_SNDCHN,  0x1f );
 
-			c->sound_counter = cpu_bus[c->sound_add++];
+			c->sound_counter = bus_read( &p->bus, c->sound_add++ );
 			return;
 		}
 	}
 }
 
 static void
-sound_dpcm()
+sound_dpcm( Ppmck *p )
 {
-	Channel *c = &ppmck.channels[4];
+	Channel *c = &p->channels[4];
 
 	if ( --c->sound_counter > 0 )
 		return;
 
-	sound_dpcm_play( c );
+	sound_dpcm_play( p, c );
+}
+
+/**
+ * Creates a driver instance for a song image. Instances share nothing, so each can play or compile
+ * its song on a thread of its own.
+ * @param rom Song image, which has to stay open as long as the driver
+ * @return New driver instance, or NULL if allocation failed
+ */
+Ppmck *
+sound_create( const Rom *rom )
+{
+	Ppmck *p = calloc( 1, sizeof(Ppmck) );
+
+	if ( p == NULL )
+		return NULL;
+
+	bus_init( &p->bus, rom );
+	return p;
 }
 
+/**
+ * Destroys a driver instance
+ * @param p Driver (may be NULL)
+ */
 void
-sound_init()
+sound_destroy( Ppmck *p )
 {
-	memset( &ppmck, 0, sizeof(ppmck) );
+	free( p );
+}
+
+/**
+ * Returns the bus a driver reads the song through. Create the APU the driver plays on with its
+ * page table, so that DMC fetches see the banks the driver switches in.
+ * @param p Driver
+ * @return Bus
+ */
+Bus *
+sound_bus( Ppmck *p )
+{
+	return &p->bus;
+}
 
-	apu_write( APU_SNDCHN,   0x0f );
-	apu_write( APU_SQ1SWEEP, 0x08 );
-	apu_write( APU_SQ2SWEEP, 0x08 );
+/**
+ * Sets a driver up to play the song from the start, with the first banks mapped as by
+ * bus_reset(). Call sound_driver_start() once a frame from then on.
+ * @param p Driver
+ * @param apu APU instance to write to
+ */
+void
+sound_init( Ppmck *p, Apu *apu )
+{
+	memset( p->channels, 0, sizeof(p->channels) );
+	p->apu = apu;
+	bus_reset( &p->bus );
+
+	write_reg( p, APU_SNDCHN,   0x0f );
+	write_reg( p, APU_SQ1SWEEP, 0x08 );
+	write_reg( p, APU_SQ2SWEEP, 0x08 );
 
 	for ( int i = 0; i < PTR_TRACK_END; i++ )
 	{
-		Channel *c = &ppmck.channels[i];
+		Channel *c = &p->channels[i];
 
-		c->sound_add     = read_word( SONG_000_TRACK_TABLE + ( i << 1 ) );
+		c->sound_add     = read_word( p, SONG_000_TRACK_TABLE + ( i << 1 ) );
 		c->effect_flag   = 0;
 		c->sound_counter = 1;
+
+		if ( p->bankswitch.song )
+			c->sound_bank = bus_read( &p->bus, SONG_000_BANK_TABLE + i );
 	}
 }
 
+/**
+ * Sets which parts of the song are bank switched, as the ALLOW_BANKSWITCH and DPCM_BANKSWITCH
+ * options of PPMCK do. Takes effect from the next sound_init(). Both are off by default, as for
+ * aibomb.bin, which fits in 32 KiB.
+ *
+ * With song bank switching the channels' starting banks follow the track table, and every $ee jump
+ * carries the bank of its target. Each channel switches its 8 KiB bank in at $a000-$bfff before
+ * reading its data. With DPCM bank switching each DPCM_DATA entry has a fifth byte, the first of
+ * four 4 KiB banks switched in at $c000-$ffff when the sample starts.
+ * @param p Driver
+ * @param song 1 = song data is bank switched
+ * @param dpcm 1 = DPCM samples are bank switched
+ */
 void
-sound_driver_start()
+sound_set_bankswitch( Ppmck *p, int song, int dpcm )
+{
+	p->bankswitch.song = song;
+	p->bankswitch.dpcm = dpcm;
+}
+
+static void
+driver_tick( Ppmck *p )
 {
 	for ( int i = 0; i < 4; i++ )
-		sound_internal( i );
+		sound_internal( p, i );
+
+	sound_dpcm( p );
+}
+
+/**
+ * Runs the driver for a frame
+ * @param p Driver
+ */
+void
+sound_driver_start( Ppmck *p )
+{
+	TRACE_EVENT( TRACE_DRIVER_BEGIN, apu_cycle( p->apu ), 0, 0 );
+	driver_tick( p );
+	TRACE_EVENT( TRACE_DRIVER_END, apu_cycle( p->apu ), 0, 0 );
+}
+
+/**
+ * Returns the size of a driver save state
+ * @return Size of save state in bytes
+ */
+size_t
+sound_state_size( void )
+{
+	return 3 * sizeof(uint32_t) + PTR_TRACK_END * sizeof(Channel) + BUS_ROM_PAGES;
+}
+
+/**
+ * Saves the playback state of the driver, including the banks switched in on the bus. Together with
+ * an APU save state taken at the same time (between frames) this is enough to resume playback
+ * exactly.
+ * @param p Driver
+ * @param buf Buffer to write the state to
+ * @param size Size of buf in bytes
+ * @return Size of the state in bytes, or 0 if buf is too small
+ */
+size_t
+sound_save_state( const Ppmck *p, void *buf, size_t size )
+{
+	const uint32_t header[3] = { STATE_MAGIC, STATE_VERSION, sizeof(p->channels) };
+	StateWriter w = { buf, 0 };
+
+	if ( size < sound_state_size() )
+		return 0;
 
-	sound_dpcm();
+	state_write( &w, header, sizeof(header) );
+	state_write( &w, p->channels, sizeof(p->channels) );
+	state_write( &w, p->bus.banks, sizeof(p->bus.banks) );
+	return w.pos;
+}
+
+/**
+ * Restores a state saved with sound_save_state(). The driver keeps writing to the APU instance it
+ * was set up with by sound_init().
+ * @param p Driver
+ * @param buf Save state
+ * @param size Size of save state in bytes
+ * @return 0 on success, -1 if the state is invalid or from another build
+ */
+int
+sound_load_state( Ppmck *p, const void *buf, size_t size )
+{
+	StateReader r = { buf, size, 0, 0 };
+	uint32_t header[3];
+
+	state_read( &r, header, sizeof(header) );
+
+	if ( r.error || header[0] != STATE_MAGIC || header[1] != STATE_VERSION ||
+			header[2] != sizeof(p->channels) || size != sound_state_size() )
+		return -1;
+
+	uint8_t banks[BUS_ROM_PAGES];
+
+	state_read( &r, p->channels, sizeof(p->channels) );
+	state_read( &r, banks, sizeof(banks) );
+
+	for ( int i = 0; i < BUS_ROM_PAGES; i++ )
+		bus_switch( &p->bus, i, banks[i] );
+
+	return 0;
+}
+
+/**
+ * Hashes a driver state
+ * @param state State
+ * @param size Size of state in bytes
+ * @return FNV-1a hash
+ */
+static uint32_t
+hash_state( const uint8_t *state, size_t size )
+{
+	uint32_t hash = 0x811c9dc5;
+
+	for ( size_t i = 0; i < size; i++ )
+	{
+		hash ^= state[i];
+		hash *= 0x01000193;
+	}
+
+	return hash;
+}
+
+/**
+ * Saves the driver state at the start of the next frame and looks for an earlier frame that
+ * started in the same state
+ * @param p Driver
+ * @param h History
+ * @param match Pointer to store the earlier frame in, if there is one
+ * @return 1 if an earlier frame matched, 0 if not, -1 if allocation failed
+ */
+static int
+history_add( const Ppmck *p, StateHistory *h, uint32_t *match )
+{
+	if ( h->count == h->capacity )
+	{
+		size_t capacity = ( h->capacity != 0 ) ? 2 * h->capacity : 1024;
+		uint8_t *states = realloc( h->states, capacity * h->state_size );
+
+		if ( states == NULL )
+			return -1;
+
+		h->states = states;
+
+		uint32_t *chain = realloc( h->chain, capacity * sizeof(*chain) );
+
+		if ( chain == NULL )
+			return -1;
+
+		h->chain	= chain;
+		h->capacity	= capacity;
+	}
+
+	uint8_t *state = &h->states[h->count * h->state_size];
+
+	sound_save_state( p, state, h->state_size );
+
+	const uint32_t bucket = hash_state( state, h->state_size ) % HISTORY_BUCKETS;
+
+	for ( uint32_t f = h->buckets[bucket]; f != HISTORY_NONE; f = h->chain[f] )
+	{
+		if ( memcmp( &h->states[f * h->state_size], state, h->state_size ) == 0 )
+		{
+			*match = f;
+			return 1;
+		}
+	}
+
+	h->chain[h->count]	= h->buckets[bucket];
+	h->buckets[bucket]	= h->count;
+	h->count++;
+	return 0;
+}
+
+/**
+ * Compiles the song into a timeline of register writes by running the driver ahead of time, from
+ * sound_init() on, one frame after another. The driver only depends on its own state and the
+ * banks switched in, so the first time a frame starts in the same state as an earlier one, the song
+ * has looped: the timeline ends there and loops back to the earlier frame. Songs that do not loop
+ * within max_frames end after them.
+ *
+ * Only the banks the APU can fetch DMC samples from are recorded, since switching in song data is
+ * of no use once the song is compiled. Resets the driver's bus before and after, and the driver
+ * has to be set up with sound_init() again before it plays live.
+ * @param p Driver
+ * @param tl Timeline to replace the contents of (set up with timeline_init())
+ * @param max_frames Most frames to compile
+ * @return 0 on success, -1 if out of memory
+ */
+int
+sound_compile( Ppmck *p, Timeline *tl, uint32_t max_frames )
+{
+	StateHistory h;
+	int ok = 1;
+
+	memset( &h, 0, sizeof(h) );
+	h.state_size	= sound_state_size();
+	h.buckets		= malloc( HISTORY_BUCKETS * sizeof(*h.buckets) );
+
+	if ( h.buckets == NULL )
+		return -1;
+
+	for ( size_t i = 0; i < HISTORY_BUCKETS; i++ )
+		h.buckets[i] = HISTORY_NONE;
+
+	timeline_free( tl );
+
+	p->recording.timeline	= tl;
+	p->recording.error		= 0;
+
+	sound_init( p, NULL );
+	ok = timeline_end_frame( tl ) == 0;
+
+	for ( uint32_t frame = 0; ok; frame++ )
+	{
+		uint32_t match;
+		const int found = history_add( p, &h, &match );
+
+		if ( found < 0 )
+			ok = 0;
+		else if ( found )
+		{
+			tl->loop_frame = match;
+			break;
+		}
+
+		if ( frame == max_frames )
+			break;
+
+		driver_tick( p );
+		ok = ok && timeline_end_frame( tl ) == 0;
+	}
+
+	ok = ok && !p->recording.error;
+	p->recording.timeline = NULL;
+	bus_reset( &p->bus );
+
+	free( h.states );
+	free( h.chain );
+	free( h.buckets );
+
+	if ( !ok )
+	{
+		timeline_free( tl );
+		return -1;
+	}
+
+	return 0;
 }
@@ -1,7 +1,29 @@
 #ifndef PPMCK_DRIVER_H
 #define PPMCK_DRIVER_H
 
-void sound_init();
-void sound_driver_start();
+#include <stddef.h>
+
+#include "apu.h"
+#include "bus.h"
+#include "rom.h"
+#include "timeline.h"
+
+/*
+ * PPMCK sound driver. Each instance holds the state of the driver and a bus over the song image
+ * it reads, so any number of songs can be played or compiled at once.
+ */
+
+typedef struct Ppmck Ppmck;
+
+Ppmck *sound_create( const Rom *rom );
+void sound_destroy( Ppmck *p );
+Bus *sound_bus( Ppmck *p );
+void sound_init( Ppmck *p, Apu *apu );
+void sound_set_bankswitch( Ppmck *p, int song, int dpcm );
+void sound_driver_start( Ppmck *p );
+size_t sound_state_size( void );
+size_t sound_save_state( const Ppmck *p, void *buf, size_t size );
+int sound_load_state( Ppmck *p, const void *buf, size_t size );
+int sound_compile( Ppmck *p, Timeline *tl, uint32_t max_frames );
 
 #endif // PPMCK_DRIVER_H
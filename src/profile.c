@@ -0,0 +1,223 @@
+#ifdef APU_PROFILE
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#if defined( __x86_64__ ) || defined( __i386__ )
+#include <x86intrin.h>
+#endif
+
+#include "profile.h"
+
+static const char *stage_names[PROFILE_STAGES] = {
+	"other", "driver", "channels", "mixer", "filter", "queue", "wav", "display"
+};
+
+static ProfileFrame ring[PROFILE_FRAMES];	// finished frames, frame n at n % PROFILE_FRAMES
+static uint64_t frames_done;				// number of frames finished
+static ProfileFrame cur;					// frame being recorded
+
+static int stack[PROFILE_DEPTH];			// running stages, innermost at depth
+static int depth;
+static uint64_t last_tick;					// counter value the running stage was last charged at
+static uint64_t frame_tick;					// counter value the current frame started at
+
+static uint64_t start_tick;					// counter value and time at profile_init(), for
+static uint64_t start_ns;					// working out the counter rate
+static double ticks_per_us = 1000.0;
+
+/**
+ * Reads the monotonic clock
+ * @return Time in nanoseconds
+ */
+static uint64_t
+now_ns( void )
+{
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Reads the cycle counter. Falls back to the monotonic clock where there is no counter to read.
+ * @return Counter value in ticks
+ */
+static inline uint64_t
+now_tick( void )
+{
+#if defined( __x86_64__ ) || defined( __i386__ )
+	return __rdtsc();
+#else
+	return now_ns();
+#endif
+}
+
+/**
+ * Charges the time since the last call to the running stage
+ * @return Counter value now
+ */
+static inline uint64_t
+charge( void )
+{
+	const uint64_t t = now_tick();
+
+	cur.ticks[stack[depth]] += t - last_tick;
+	last_tick = t;
+	return t;
+}
+
+/**
+ * Clears all records and starts the first frame
+ */
+void
+profile_init( void )
+{
+	memset( ring, 0, sizeof(ring) );
+	memset( &cur, 0, sizeof(cur) );
+
+	frames_done	= 0;
+	depth		= 0;
+	stack[0]	= PROFILE_OTHER;
+
+	start_ns	= now_ns();
+	start_tick	= now_tick();
+	last_tick	= start_tick;
+	frame_tick	= start_tick;
+}
+
+/**
+ * Starts a stage. Time is charged to it until it is left or another stage is entered inside it.
+ * @param stage Stage (PROFILE_*)
+ */
+void
+profile_enter( int stage )
+{
+	charge();
+	cur.calls[stage]++;
+
+	if ( depth < PROFILE_DEPTH - 1 )
+		depth++;
+
+	stack[depth] = stage;
+}
+
+/**
+ * Ends the innermost running stage and goes back to the one it was entered from
+ */
+void
+profile_leave( void )
+{
+	charge();
+
+	if ( depth > 0 )
+		depth--;
+}
+
+/**
+ * Finishes the current frame's record and starts the next one. Also updates the counter rate from
+ * the time since profile_init().
+ */
+void
+profile_frame( void )
+{
+	const uint64_t t = charge();
+	const uint64_t ns = now_ns();
+
+	cur.total = t - frame_tick;
+	frame_tick = t;
+
+	ring[frames_done % PROFILE_FRAMES] = cur;
+	frames_done++;
+	memset( &cur, 0, sizeof(cur) );
+
+	if ( ns - start_ns >= 1000000 )
+		ticks_per_us = (double)( t - start_tick ) * 1000.0 / (double)( ns - start_ns );
+}
+
+/**
+ * Returns the number of finished frames kept
+ * @return Number of frames, at most PROFILE_FRAMES
+ */
+size_t
+profile_frames( void )
+{
+	return ( frames_done < PROFILE_FRAMES ) ? frames_done : PROFILE_FRAMES;
+}
+
+/**
+ * Returns the record of a finished frame
+ * @param age 0 = the last finished frame, 1 = the one before it, and so on
+ * @return Frame record, or NULL if that frame is no longer kept
+ */
+const ProfileFrame *
+profile_get( size_t age )
+{
+	if ( age >= profile_frames() )
+		return NULL;
+
+	return &ring[( frames_done - 1 - age ) % PROFILE_FRAMES];
+}
+
+/**
+ * Returns the rate of the counter the records are in
+ * @return Ticks per microsecond
+ */
+double
+profile_ticks_per_us( void )
+{
+	return ticks_per_us;
+}
+
+/**
+ * Returns the name of a stage, as used in the CSV header
+ * @param stage Stage (PROFILE_*)
+ * @return Stage name
+ */
+const char *
+profile_stage_name( int stage )
+{
+	return stage_names[stage];
+}
+
+/**
+ * Writes the kept frame records to a CSV file, oldest first, with one row per frame. Each stage has
+ * a column with its time in microseconds and one with the number of times it was entered.
+ * @param filename Path of file to write
+ * @return 0 on success, -1 if the file could not be written
+ */
+int
+profile_write_csv( const char *filename )
+{
+	FILE *f = fopen( filename, "w" );
+
+	if ( !f )
+		return -1;
+
+	const size_t count = profile_frames();
+	const double us = profile_ticks_per_us();
+
+	fprintf( f, "frame,frame_us" );
+
+	for ( int s = 0; s < PROFILE_STAGES; s++ )
+		fprintf( f, ",%s_us,%s_calls", stage_names[s], stage_names[s] );
+
+	fprintf( f, "\n" );
+
+	for ( size_t age = count; age-- > 0; )
+	{
+		const ProfileFrame *pf = profile_get( age );
+
+		fprintf( f, "%llu,%.1f", (unsigned long long)( frames_done - 1 - age ), pf->total / us );
+
+		for ( int s = 0; s < PROFILE_STAGES; s++ )
+			fprintf( f, ",%.1f,%u", pf->ticks[s] / us, (unsigned)pf->calls[s] );
+
+		fprintf( f, "\n" );
+	}
+
+	return ( fclose( f ) == 0 ) ? 0 : -1;
+}
+
+#endif // APU_PROFILE
@@ -0,0 +1,62 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PROFILE_FRAMES		600					// per-frame records kept (ten seconds at 60 Hz)
+#define PROFILE_DEPTH		8					// deepest nesting of stages
+
+/*
+ * Stage profiler for the demo, built with PROFILE=1 (APU_PROFILE). Each stage is bracketed with
+ * PROFILE_ENTER() and PROFILE_LEAVE(), which read the CPU's cycle counter and charge the time
+ * since the last read to whichever stage was running. Stages nest, and time is only charged to the
+ * innermost one, so the driver tick run from the frame hook is not also counted as channel
+ * clocking. Time outside every stage is charged to PROFILE_OTHER.
+ *
+ * profile_frame() closes the current frame's record and starts the next one. The records are kept
+ * in a ring of PROFILE_FRAMES, which the demo draws as an overlay and writes out as CSV on exit.
+ * Without APU_PROFILE the macros compile to nothing and profile.c is empty.
+ */
+
+enum {
+	PROFILE_OTHER,								// outside every stage (event handling, sleeping)
+	PROFILE_DRIVER,								// PPMCK driver tick
+	PROFILE_CHANNELS,							// channel clocking and level recording
+	PROFILE_MIXER,								// mixing levels into DAC outputs
+	PROFILE_FILTER,								// high pass and low pass (output engine)
+	PROFILE_QUEUE,								// SDL_QueueAudio()
+	PROFILE_WAV,								// wav_file_write_samples()
+	PROFILE_DISPLAY,							// display_update()
+	PROFILE_STAGES
+};
+
+typedef struct {
+	uint64_t		ticks[PROFILE_STAGES];	// cycle counter ticks spent in each stage
+	uint32_t		calls[PROFILE_STAGES];	// times each stage was entered
+	uint64_t		total;					// ticks from the start to the end of the frame
+} ProfileFrame;
+
+#ifdef APU_PROFILE
+
+#define PROFILE_ENTER( stage )	profile_enter( stage )
+#define PROFILE_LEAVE()			profile_leave()
+
+void				profile_init( void );
+void				profile_enter( int stage );
+void				profile_leave( void );
+void				profile_frame( void );
+size_t				profile_frames( void );
+const ProfileFrame	*profile_get( size_t age );
+double				profile_ticks_per_us( void );
+const char			*profile_stage_name( int stage );
+int					profile_write_csv( const char *filename );
+
+#else
+
+#define PROFILE_ENTER( stage )
+#define PROFILE_LEAVE()
+
+#endif // APU_PROFILE
+
+#endif // PROFILE_H
@@ -0,0 +1,974 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "reglog.h"
+
+#define REGLOG_MAGIC		0x4c555041				// "APUL"
+#define REGLOG_VERSION		1
+#define CLOCK_RATE_HZ		1789773
+
+#define MAX_PERIOD			64						// most pieces a repeat can play back
+#define MAX_PIECE			256						// longest piece, in bytes, that can be repeated
+#define MAX_VARINT			10						// longest 64-bit varint, in bytes
+#define DMC_PAGE			( BUS_PAGES - REGLOG_DMC_SLOTS )
+
+// registers a write of the value they already hold does nothing to: volumes, the triangle and
+// noise periods (the pulse periods are not, as the sweep units change them) and the DMC sample
+
+#define IDEMPOTENT_REGS		( 1u << APU_SQ1VOL | 1u << APU_SQ2VOL | 1u << APU_TRILO | \
+		1u << APU_NOIVOL | 1u << APU_NOIFREQ | 1u << APU_DMCADDR | 1u << APU_DMCLEN )
+
+/*
+ * Header, little endian: magic (4 bytes), version (2), header size (2), clock (4), region (1) and
+ * padding (3), length in cycles (8), loop cycle (8), loop offset (4), number of DMC blocks (4),
+ * stream size (8), and zeros up to REGLOG_HEADER_SIZE.
+ */
+
+enum {
+	CMD_WAIT				= 0x80,
+	CMD_REPEAT				= 0x81,
+	CMD_MAP					= 0x82,
+	CMD_END					= 0xff
+};
+
+typedef struct {
+	size_t			offset;					// start of piece in stream
+	size_t			size;					// size of piece in bytes
+} Piece;
+
+struct RegLogWriter {
+	const Bus		*bus;					// bus DMC samples are fetched through, or NULL
+	const uint8_t	*mapped[REGLOG_DMC_SLOTS];	// page in each DMC slot as of the stream so far
+	const uint8_t	**block_pages;			// page each DMC block was copied from
+	uint8_t			*blocks;				// DMC blocks
+	size_t			block_count;			// number of DMC blocks
+	size_t			block_capacity;			// number of blocks that fit in blocks
+
+	uint8_t			*stream;				// commands
+	size_t			size;					// size of stream in bytes
+	size_t			capacity;				// bytes that fit in stream
+	uint64_t		cycle;					// cycle the stream has got to
+	uint8_t			regs[APU_APUFRAME + 1];	// value of each register as of the stream so far
+	uint32_t		regs_known;				// bit per register, set if regs holds its value
+	size_t			piece;					// start of piece being built
+
+	// pieces the next one is compared to, back to back in stream, and the repeat being counted
+
+	Piece			recent[MAX_PERIOD];
+	size_t			recent_count;
+	size_t			period;					// pieces in repeat, 0 if there is none
+	size_t			phase;					// pieces matched into the next round of the repeat
+	uint64_t		repeats;				// whole rounds matched
+
+	uint32_t		loop_offset;			// loop point in stream, or REGLOG_NO_LOOP
+	uint64_t		loop_cycle;				// cycle the loop point is on
+	int				failed;					// 1 = out of memory, the log is incomplete
+};
+
+struct RegLogPlayer {
+	const RegLog	*log;					// log being played
+	Apu				*apu;
+	const uint8_t	*pages[BUS_PAGES];		// memory the DMC reads: blocks from $c000, else zeros
+
+	size_t			pos;					// next command in stream
+	uint64_t		wait;					// cycles to render before running pos
+	int				waited;					// 1 = a wait was run since the loop point
+
+	// repeat being played
+
+	uint64_t		repeats;				// rounds left, 0 if there is none
+	size_t			repeat_begin;			// start of commands played back
+	size_t			repeat_end;				// end of commands played back (the repeat command)
+	size_t			repeat_resume;			// command after the repeat command
+	int				repeat_waited;			// 1 = a wait was run in this round
+};
+
+static const uint8_t zero_page[BUS_PAGE_SIZE];
+
+/**
+ * Stores a 16-bit value in little endian byte order
+ * @param p Destination
+ * @param val Value
+ */
+static void
+put16( uint8_t *p, uint16_t val )
+{
+	p[0] = val;
+	p[1] = val >> 8;
+}
+
+/**
+ * Stores a 32-bit value in little endian byte order
+ * @param p Destination
+ * @param val Value
+ */
+static void
+put32( uint8_t *p, uint32_t val )
+{
+	for ( int i = 0; i < 4; i++ )
+		p[i] = val >> ( 8 * i );
+}
+
+/**
+ * Stores a 64-bit value in little endian byte order
+ * @param p Destination
+ * @param val Value
+ */
+static void
+put64( uint8_t *p, uint64_t val )
+{
+	put32( p, (uint32_t)val );
+	put32( p + 4, val >> 32 );
+}
+
+/**
+ * Loads a 16-bit little endian value
+ * @param p Source
+ * @return Value
+ */
+static uint16_t
+get16( const uint8_t *p )
+{
+	return p[0] | p[1] << 8;
+}
+
+/**
+ * Loads a 32-bit little endian value
+ * @param p Source
+ * @return Value
+ */
+static uint32_t
+get32( const uint8_t *p )
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/**
+ * Loads a 64-bit little endian value
+ * @param p Source
+ * @return Value
+ */
+static uint64_t
+get64( const uint8_t *p )
+{
+	return get32( p ) | (uint64_t)get32( p + 4 ) << 32;
+}
+
+/**
+ * Makes room at the end of a writer's stream
+ * @param w Writer
+ * @param bytes Number of bytes to make room for
+ * @return 0 on success, -1 if out of memory (the writer is marked failed)
+ */
+static int
+reserve( RegLogWriter *w, size_t bytes )
+{
+	if ( w->failed )
+		return -1;
+
+	if ( w->size + bytes <= w->capacity )
+		return 0;
+
+	size_t capacity = ( w->capacity != 0 ) ? 2 * w->capacity : 65536;
+
+	while ( capacity < w->size + bytes )
+		capacity *= 2;
+
+	uint8_t *stream = realloc( w->stream, capacity );
+
+	if ( stream == NULL )
+	{
+		w->failed = 1;
+		return -1;
+	}
+
+	w->stream	= stream;
+	w->capacity	= capacity;
+	return 0;
+}
+
+/**
+ * Encodes a varint
+ * @param p Destination, with room for MAX_VARINT bytes
+ * @param val Value
+ * @return Number of bytes stored
+ */
+static size_t
+encode_varint( uint8_t *p, uint64_t val )
+{
+	size_t n = 0;
+
+	while ( val >= 0x80 )
+	{
+		p[n++] = ( val & 0x7f ) | 0x80;
+		val >>= 7;
+	}
+
+	p[n++] = val;
+	return n;
+}
+
+/**
+ * Appends a command with up to two varint arguments to a writer's stream
+ * @param w Writer
+ * @param cmd Command byte
+ * @param args Number of arguments
+ * @param a First argument
+ * @param b Second argument
+ */
+static void
+put_cmd( RegLogWriter *w, uint8_t cmd, int args, uint64_t a, uint64_t b )
+{
+	if ( reserve( w, 1 + 2 * MAX_VARINT ) != 0 )
+		return;
+
+	w->stream[w->size++] = cmd;
+
+	if ( args > 0 )
+		w->size += encode_varint( &w->stream[w->size], a );
+	if ( args > 1 )
+		w->size += encode_varint( &w->stream[w->size], b );
+}
+
+/**
+ * Adds a piece to the end of the pieces a writer compares new ones to
+ * @param w Writer
+ * @param offset Start of piece in stream
+ * @param size Size of piece in bytes
+ */
+static void
+push_piece( RegLogWriter *w, size_t offset, size_t size )
+{
+	if ( w->recent_count == MAX_PERIOD )
+	{
+		memmove( &w->recent[0], &w->recent[1], ( MAX_PERIOD - 1 ) * sizeof(Piece) );
+		w->recent_count--;
+	}
+
+	w->recent[w->recent_count].offset	= offset;
+	w->recent[w->recent_count].size		= size;
+	w->recent_count++;
+}
+
+/**
+ * Writes out the repeat being counted, ahead of the piece being built: the repeat command, if a
+ * whole round was matched, and then the pieces of the round that was only partly matched
+ * @param w Writer
+ */
+static void
+end_repeat( RegLogWriter *w )
+{
+	const Piece *body = &w->recent[w->recent_count - w->period];
+	const Piece *last = &w->recent[w->recent_count - 1];
+	const size_t body_size = last->offset + last->size - body->offset;
+	const size_t piece_size = w->size - w->piece;
+	uint8_t cmd[1 + 2 * MAX_VARINT];
+	size_t cmd_size = 0;
+	size_t insert = 0;
+
+	if ( w->repeats != 0 )
+	{
+		cmd[0] = CMD_REPEAT;
+		cmd_size = 1 + encode_varint( &cmd[1], body_size );
+		cmd_size += encode_varint( &cmd[cmd_size], w->repeats );
+	}
+
+	insert = cmd_size;
+
+	for ( size_t i = 0; i < w->phase; i++ )
+		insert += body[i].size;
+
+	if ( reserve( w, insert ) != 0 )
+		return;
+
+	uint8_t *dst = &w->stream[w->piece];
+	Piece partial[MAX_PERIOD];
+
+	memmove( dst + insert, dst, piece_size );
+	memcpy( dst, cmd, cmd_size );
+	dst += cmd_size;
+
+	for ( size_t i = 0; i < w->phase; i++ )
+	{
+		memcpy( dst, &w->stream[body[i].offset], body[i].size );
+		partial[i].offset	= dst - w->stream;
+		partial[i].size		= body[i].size;
+		dst += body[i].size;
+	}
+
+	// pieces before a repeat command can not be played back again by another repeat
+
+	if ( w->repeats != 0 )
+		w->recent_count = 0;
+
+	for ( size_t i = 0; i < w->phase; i++ )
+		push_piece( w, partial[i].offset, partial[i].size );
+
+	w->size		+= insert;
+	w->piece	+= insert;
+	w->period	= 0;
+	w->phase	= 0;
+	w->repeats	= 0;
+}
+
+/**
+ * Ends the piece being built, and drops it from the stream if it goes on the repeat being counted
+ * or starts a new one
+ * @param w Writer
+ */
+static void
+end_piece( RegLogWriter *w )
+{
+	const size_t size = w->size - w->piece;
+	const uint8_t *piece = &w->stream[w->piece];
+
+	if ( size == 0 || w->failed )
+		return;
+
+	if ( w->period != 0 )
+	{
+		const Piece *next = &w->recent[w->recent_count - w->period + w->phase];
+
+		if ( next->size == size && memcmp( &w->stream[next->offset], piece, size ) == 0 )
+		{
+			w->size = w->piece;
+
+			if ( ++w->phase == w->period )
+			{
+				w->phase = 0;
+				w->repeats++;
+			}
+
+			return;
+		}
+
+		end_repeat( w );
+		piece = &w->stream[w->piece];
+	}
+
+	if ( size > MAX_PIECE )
+	{
+		w->recent_count = 0;
+		w->piece = w->size;
+		return;
+	}
+
+	// the shortest run of pieces that this one starts again becomes the repeat
+
+	for ( size_t period = 1; period <= w->recent_count; period++ )
+	{
+		const Piece *first = &w->recent[w->recent_count - period];
+
+		if ( first->size == size && memcmp( &w->stream[first->offset], piece, size ) == 0 )
+		{
+			w->size		= w->piece;
+			w->period	= period;
+			w->phase	= 1 % period;
+			w->repeats	= ( period == 1 );
+			return;
+		}
+	}
+
+	push_piece( w, w->piece, size );
+	w->piece = w->size;
+}
+
+/**
+ * Ends the piece being built and writes out the repeat being counted, leaving the stream at a
+ * point where playback can start
+ * @param w Writer
+ */
+static void
+flush( RegLogWriter *w )
+{
+	end_piece( w );
+
+	if ( w->period != 0 && !w->failed )
+		end_repeat( w );
+}
+
+/**
+ * Moves a writer's stream up to a cycle
+ * @param w Writer
+ * @param cycle Cycle
+ */
+static void
+advance( RegLogWriter *w, uint64_t cycle )
+{
+	if ( cycle <= w->cycle )
+		return;
+
+	put_cmd( w, CMD_WAIT, 1, cycle - w->cycle, 0 );
+	w->cycle = cycle;
+	end_piece( w );
+}
+
+/**
+ * Finds the DMC block copied from a page, copying the page into a new block if there is none
+ * @param w Writer
+ * @param page Page
+ * @param block Pointer to value to store the block number in
+ * @return 0 on success, -1 if out of memory
+ */
+static int
+find_block( RegLogWriter *w, const uint8_t *page, size_t *block )
+{
+	for ( size_t i = 0; i < w->block_count; i++ )
+	{
+		if ( w->block_pages[i] == page )
+		{
+			*block = i;
+			return 0;
+		}
+	}
+
+	if ( w->block_count == w->block_capacity )
+	{
+		size_t capacity = ( w->block_capacity != 0 ) ? 2 * w->block_capacity : 16;
+		uint8_t *blocks = realloc( w->blocks, capacity * BUS_PAGE_SIZE );
+
+		if ( blocks == NULL )
+			return -1;
+
+		w->blocks = blocks;
+
+		const uint8_t **pages = realloc( w->block_pages, capacity * sizeof(*pages) );
+
+		if ( pages == NULL )
+			return -1;
+
+		w->block_pages		= pages;
+		w->block_capacity	= capacity;
+	}
+
+	memcpy( &w->blocks[w->block_count * BUS_PAGE_SIZE], page, BUS_PAGE_SIZE );
+	w->block_pages[w->block_count] = page;
+	*block = w->block_count++;
+	return 0;
+}
+
+/**
+ * Creates a writer for a session that starts on cycle 0 of a freshly reset APU. Hook
+ * reglog_write() up as the APU's write hook, with the writer as its userdata, to log the session.
+ * @param bus Bus the APU reads DMC samples through, or NULL to log no sample data
+ * @return Writer, or NULL if out of memory
+ */
+RegLogWriter *
+reglog_writer_create( const Bus *bus )
+{
+	RegLogWriter *w = calloc( 1, sizeof(RegLogWriter) );
+
+	if ( w == NULL )
+		return NULL;
+
+	w->bus			= bus;
+	w->loop_offset	= REGLOG_NO_LOOP;
+	return w;
+}
+
+/**
+ * Logs a register write, along with any DMC bank switched in since the last one. A write that
+ * leaves a register as it was and has no other effect is left out. Has the signature of an
+ * ApuWriteHook.
+ * @param userdata Writer
+ * @param cycle Cycle the write lands on
+ * @param reg APU register
+ * @param val Value written
+ */
+void
+reglog_write( void *userdata, uint64_t cycle, uint_fast16_t reg, uint8_t val )
+{
+	RegLogWriter *w = userdata;
+
+	if ( reg > APU_APUFRAME )
+		return;
+
+	if ( ( IDEMPOTENT_REGS & w->regs_known & 1u << reg ) && w->regs[reg] == val )
+		return;
+
+	w->regs[reg] = val;
+	w->regs_known |= 1u << reg;
+
+	advance( w, cycle );
+
+	for ( int slot = 0; w->bus != NULL && slot < REGLOG_DMC_SLOTS; slot++ )
+	{
+		const uint8_t *page = w->bus->pages[DMC_PAGE + slot];
+		size_t block;
+
+		if ( page == w->mapped[slot] )
+			continue;
+
+		if ( find_block( w, page, &block ) != 0 )
+		{
+			w->failed = 1;
+			return;
+		}
+
+		put_cmd( w, CMD_MAP, 2, slot, block );
+		w->mapped[slot] = page;
+	}
+
+	if ( reserve( w, 2 ) == 0 )
+	{
+		w->stream[w->size++] = reg;
+		w->stream[w->size++] = val;
+	}
+}
+
+/**
+ * Marks the point playback goes back to after the end of the log
+ * @param w Writer
+ * @param cycle Cycle of the loop point, not before the last write logged
+ * @return 0 on success, -1 if the cycle is before the last write or the log is too long
+ */
+int
+reglog_mark_loop( RegLogWriter *w, uint64_t cycle )
+{
+	if ( cycle < w->cycle )
+		return -1;
+
+	advance( w, cycle );
+	flush( w );
+
+	if ( w->size >= REGLOG_NO_LOOP )
+		return -1;
+
+	// the banks and registers may be different when playback comes back round, so they are mapped
+	// and written again
+
+	memset( w->mapped, 0, sizeof(w->mapped) );
+	w->regs_known	= 0;
+	w->loop_offset	= w->size;
+	w->loop_cycle	= cycle;
+	return 0;
+}
+
+/**
+ * Ends the log and writes it to a file. The writer can not log any more afterwards.
+ * @param w Writer
+ * @param end_cycle Length of the session in cycles, not before the last write logged
+ * @param filename File to write
+ * @return 0 on success, -1 if the file could not be written or the writer ran out of memory
+ */
+int
+reglog_writer_save( RegLogWriter *w, uint64_t end_cycle, const char *filename )
+{
+	uint8_t header[REGLOG_HEADER_SIZE] = { 0 };
+
+	if ( end_cycle < w->cycle )
+		return -1;
+
+	advance( w, end_cycle );
+	flush( w );
+	put_cmd( w, CMD_END, 0, 0, 0 );
+
+	if ( w->failed )
+		return -1;
+
+	// a loop point at the very end would loop for ever without rendering anything
+
+	const int loop = w->loop_offset != REGLOG_NO_LOOP && w->loop_cycle < end_cycle;
+
+	put32( &header[0], REGLOG_MAGIC );
+	put16( &header[4], REGLOG_VERSION );
+	put16( &header[6], REGLOG_HEADER_SIZE );
+	put32( &header[8], CLOCK_RATE_HZ );
+	header[12] = REGLOG_REGION_NTSC;
+	put64( &header[16], end_cycle );
+	put64( &header[24], loop ? w->loop_cycle : 0 );
+	put32( &header[32], loop ? w->loop_offset : REGLOG_NO_LOOP );
+	put32( &header[36], w->block_count );
+	put64( &header[40], w->size );
+
+	FILE *f = fopen( filename, "wb" );
+
+	if ( f == NULL )
+		return -1;
+
+	int ok = fwrite( header, sizeof(header), 1, f ) == 1;
+
+	ok = ok && fwrite( w->blocks, BUS_PAGE_SIZE, w->block_count, f ) == w->block_count;
+	ok = ok && fwrite( w->stream, 1, w->size, f ) == w->size;
+
+	if ( fclose( f ) != 0 )
+		ok = 0;
+
+	return ok ? 0 : -1;
+}
+
+/**
+ * Destroys a writer
+ * @param w Writer
+ */
+void
+reglog_writer_destroy( RegLogWriter *w )
+{
+	if ( w == NULL )
+		return;
+
+	free( w->block_pages );
+	free( w->blocks );
+	free( w->stream );
+	free( w );
+}
+
+/**
+ * Opens a register log, mapping it read-only
+ * @param log Log to fill in
+ * @param filename Log file
+ * @return 0 on success, -1 if the file could not be opened or is not a register log
+ */
+int
+reglog_open( RegLog *log, const char *filename )
+{
+	memset( log, 0, sizeof(*log) );
+
+	if ( rom_open( &log->file, filename ) != 0 )
+		return -1;
+
+	const uint8_t *data = log->file.data;
+	const size_t size = log->file.size;
+
+	if ( size < REGLOG_HEADER_SIZE || get32( &data[0] ) != REGLOG_MAGIC ||
+			get16( &data[4] ) != REGLOG_VERSION || get16( &data[6] ) < REGLOG_HEADER_SIZE ||
+			get16( &data[6] ) > size )
+	{
+		reglog_close( log );
+		return -1;
+	}
+
+	const size_t header_size = get16( &data[6] );
+	const uint64_t blocks = get32( &data[36] );
+	const uint64_t stream_size = get64( &data[40] );
+
+	// the blocks and the stream have to fit in the file, and the loop point in the stream
+
+	if ( blocks > ( size - header_size ) / BUS_PAGE_SIZE ||
+			stream_size != size - header_size - blocks * BUS_PAGE_SIZE ||
+			( get32( &data[32] ) != REGLOG_NO_LOOP && get32( &data[32] ) >= stream_size ) )
+	{
+		reglog_close( log );
+		return -1;
+	}
+
+	log->clock			= get32( &data[8] );
+	log->region			= data[12];
+	log->cycles			= get64( &data[16] );
+	log->loop_cycle		= get64( &data[24] );
+	log->loop_offset	= get32( &data[32] );
+	log->blocks			= blocks;
+	log->block_data		= &data[header_size];
+	log->stream			= &data[header_size + blocks * BUS_PAGE_SIZE];
+	log->stream_size	= stream_size;
+	return 0;
+}
+
+/**
+ * Closes a register log
+ * @param log Log
+ */
+void
+reglog_close( RegLog *log )
+{
+	rom_close( &log->file );
+}
+
+/**
+ * Creates a player for a register log. Its APU starts with the default output settings, which can
+ * be changed through reglog_player_apu().
+ * @param log Log to play, which must stay open while the player exists
+ * @return Player, or NULL if out of memory
+ */
+RegLogPlayer *
+reglog_player_create( const RegLog *log )
+{
+	RegLogPlayer *p = calloc( 1, sizeof(RegLogPlayer) );
+
+	if ( p == NULL )
+		return NULL;
+
+	p->log = log;
+
+	for ( int i = 0; i < BUS_PAGES; i++ )
+		p->pages[i] = zero_page;
+
+	p->apu = apu_create( p->pages );
+
+	if ( p->apu == NULL )
+	{
+		free( p );
+		return NULL;
+	}
+
+	reglog_start( p );
+	return p;
+}
+
+/**
+ * Destroys a player
+ * @param p Player
+ */
+void
+reglog_player_destroy( RegLogPlayer *p )
+{
+	if ( p == NULL )
+		return;
+
+	apu_destroy( p->apu );
+	free( p );
+}
+
+/**
+ * Returns the APU a player renders with, for setting its output engine, sample rate and so on
+ * @param p Player
+ * @return APU instance
+ */
+Apu *
+reglog_player_apu( RegLogPlayer *p )
+{
+	return p->apu;
+}
+
+/**
+ * Starts playing from the beginning of the log, on a freshly reset APU
+ * @param p Player
+ */
+void
+reglog_start( RegLogPlayer *p )
+{
+	apu_reset( p->apu );
+
+	for ( int i = 0; i < BUS_PAGES; i++ )
+		p->pages[i] = zero_page;
+
+	p->pos		= 0;
+	p->wait		= 0;
+	p->waited	= 0;
+	p->repeats	= 0;
+}
+
+/**
+ * Stops running commands. The APU renders on, with no more writes.
+ * @param p Player
+ */
+static void
+stop( RegLogPlayer *p )
+{
+	p->pos		= p->log->stream_size;
+	p->wait		= UINT64_MAX;
+	p->repeats	= 0;
+}
+
+/**
+ * Decodes a varint from the stream
+ * @param p Player
+ * @param val Pointer to value to store the varint in
+ * @return 0 on success, -1 if the varint runs past the end of the stream or is too long
+ */
+static int
+get_varint( RegLogPlayer *p, uint64_t *val )
+{
+	const uint8_t *stream = p->log->stream;
+
+	*val = 0;
+
+	for ( int shift = 0; shift < 64 && p->pos < p->log->stream_size; shift += 7 )
+	{
+		const uint8_t b = stream[p->pos++];
+
+		*val |= (uint64_t)( b & 0x7f ) << shift;
+
+		if ( ( b & 0x80 ) == 0 )
+			return 0;
+	}
+
+	return -1;
+}
+
+/**
+ * Runs commands up to the next wait, or stops the player at the end of a log that does not loop or
+ * at a malformed command
+ * @param p Player
+ */
+static void
+next_wait( RegLogPlayer *p )
+{
+	const RegLog *log = p->log;
+	const uint8_t *stream = log->stream;
+
+	while ( p->wait == 0 )
+	{
+		// a round of a repeat that renders nothing would render nothing however often it ran
+
+		if ( p->repeats != 0 && p->pos == p->repeat_end )
+		{
+			if ( --p->repeats != 0 && p->repeat_waited )
+				p->pos = p->repeat_begin;
+			else
+				p->pos = p->repeat_resume;
+
+			p->repeat_waited = 0;
+			continue;
+		}
+
+		if ( p->pos >= log->stream_size )
+		{
+			stop( p );
+			return;
+		}
+
+		const size_t at = p->pos++;
+		const uint8_t cmd = stream[at];
+		uint64_t a, b;
+
+		if ( cmd <= APU_APUFRAME )
+		{
+			if ( p->pos >= log->stream_size )
+			{
+				stop( p );
+				return;
+			}
+
+			apu_write( p->apu, cmd, stream[p->pos++] );
+		}
+		else if ( cmd == CMD_WAIT )
+		{
+			if ( get_varint( p, &a ) != 0 )
+			{
+				stop( p );
+				return;
+			}
+
+			p->wait = a;
+
+			if ( a != 0 )
+				p->waited = p->repeat_waited = 1;
+		}
+		else if ( cmd == CMD_REPEAT )
+		{
+			if ( get_varint( p, &a ) != 0 || get_varint( p, &b ) != 0 || p->repeats != 0 ||
+					a == 0 || a > at )
+			{
+				stop( p );
+				return;
+			}
+
+			if ( b != 0 )
+			{
+				p->repeats			= b;
+				p->repeat_begin		= at - a;
+				p->repeat_end		= at;
+				p->repeat_resume	= p->pos;
+				p->repeat_waited	= 0;
+				p->pos				= p->repeat_begin;
+			}
+		}
+		else if ( cmd == CMD_MAP )
+		{
+			if ( get_varint( p, &a ) != 0 || get_varint( p, &b ) != 0 ||
+					a >= REGLOG_DMC_SLOTS || b >= log->blocks )
+			{
+				stop( p );
+				return;
+			}
+
+			p->pages[DMC_PAGE + a] = &log->block_data[b * BUS_PAGE_SIZE];
+		}
+		else if ( cmd == CMD_END && log->loop_offset != REGLOG_NO_LOOP && p->waited )
+		{
+			p->pos		= log->loop_offset;
+			p->waited	= 0;
+			p->repeats	= 0;
+		}
+		else
+		{
+			stop( p );
+			return;
+		}
+	}
+}
+
+/**
+ * Plays the log, stopping when max_cycles cycles have been rendered or the output buffer is full,
+ * as apu_run() does
+ * @param p Player
+ * @param max_cycles Maximum number of CPU cycles to render
+ * @param samples_out Buffer to write float samples to (NULL if s16_out is given)
+ * @param s16_out Buffer to write int16 samples to (NULL if samples_out is given)
+ * @param max_samples Size of the buffer in samples
+ * @param samples_written Pointer to value to store the number of outputted samples in (may be NULL)
+ * @return Number of CPU cycles rendered
+ */
+static size_t
+run( RegLogPlayer *p, size_t max_cycles, float *samples_out, int16_t *s16_out, size_t max_samples,
+		size_t *samples_written )
+{
+	size_t cycles = 0;
+	size_t samples = 0;
+
+	while ( cycles < max_cycles && samples < max_samples )
+	{
+		if ( p->wait == 0 )
+		{
+			next_wait( p );
+			continue;
+		}
+
+		size_t n = max_cycles - cycles;
+		size_t written = 0;
+
+		if ( p->wait < n )
+			n = p->wait;
+
+		const size_t ran = ( samples_out != NULL )
+			? apu_run( p->apu, n, samples_out + samples, max_samples - samples, &written )
+			: apu_run_s16( p->apu, n, s16_out + samples, max_samples - samples, &written );
+
+		cycles	+= ran;
+		samples	+= written;
+		p->wait	-= ran;
+
+		if ( ran < n )
+			break;
+	}
+
+	if ( samples_written != NULL )
+		*samples_written = samples;
+
+	return cycles;
+}
+
+/**
+ * Plays a register log: runs its commands on their cycles and renders the APU. After the end of a
+ * log that does not loop, the APU renders on with no more writes.
+ * @param p Player
+ * @param max_cycles Maximum number of CPU cycles to render
+ * @param samples_out Buffer to write outputted samples to
+ * @param max_samples Size of samples_out in samples
+ * @param samples_written Pointer to value to store the number of outputted samples in (may be NULL)
+ * @return Number of CPU cycles rendered
+ */
+size_t
+reglog_run( RegLogPlayer *p, size_t max_cycles, float *samples_out, size_t max_samples,
+		size_t *samples_written )
+{
+	return run( p, max_cycles, samples_out, NULL, max_samples, samples_written );
+}
+
+/**
+ * Same as reglog_run(), but outputs 16-bit samples as apu_run_s16() does
+ * @param p Player
+ * @param max_cycles Maximum number of CPU cycles to render
+ * @param samples_out Buffer to write outputted samples to
+ * @param max_samples Size of samples_out in samples
+ * @param samples_written Pointer to value to store the number of outputted samples in (may be NULL)
+ * @return Number of CPU cycles rendered
+ */
+size_t
+reglog_run_s16( RegLogPlayer *p, size_t max_cycles, int16_t *samples_out, size_t max_samples,
+		size_t *samples_written )
+{
+	return run( p, max_cycles, NULL, samples_out, max_samples, samples_written );
+}
@@ -0,0 +1,74 @@
+#ifndef REGLOG_H
+#define REGLOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "apu.h"
+#include "bus.h"
+#include "rom.h"
+
+#define REGLOG_HEADER_SIZE	64
+#define REGLOG_REGION_NTSC	0
+#define REGLOG_REGION_PAL	1
+#define REGLOG_NO_LOOP		UINT32_MAX			// loop_offset of a log that does not loop
+#define REGLOG_DMC_SLOTS	4					// pages DMC samples are fetched from ($c000-$ffff)
+
+/*
+ * Register logs: every APU register write of a session, with the cycle it landed on, in a compact
+ * file that plays back without the driver or the ROM that made it (much like a VGM file).
+ *
+ * After a fixed header come the 4 KiB blocks of memory the DMC fetched samples from, then a stream
+ * of commands, one byte each followed by their arguments. Counts are unsigned LEB128 varints:
+ *
+ *   $00-$17 val		write val to an APU register
+ *   $80 n			wait n cycles
+ *   $81 len n		play the len bytes of commands before this one n more times
+ *   $82 slot block	map a block into a DMC page ($c000 + slot * $1000)
+ *   $ff				end of the stream, go back to the loop point if there is one
+ *
+ * The writer cuts the stream after every wait and compares the pieces, so a frame, or a run of up
+ * to 64 pieces, that repeats what came before it is stored once with a repeat command. The
+ * commands a repeat plays back never hold another repeat.
+ *
+ * Only the pages from $c000 are kept, so a sample that wraps around past $ffff plays zeros from
+ * $8000 on. Bank switches are noticed on the next register write, which is when drivers switch
+ * banks (just before starting a sample).
+ *
+ * A RegLog maps the file read-only and a player decodes it in place, so playback allocates
+ * nothing past creating the player.
+ */
+
+typedef struct RegLogWriter RegLogWriter;
+typedef struct RegLogPlayer RegLogPlayer;
+
+typedef struct {
+	uint32_t		clock;					// CPU clock rate in Hz
+	uint8_t			region;					// REGLOG_REGION_*
+	uint64_t		cycles;					// length of the session in cycles
+	uint64_t		loop_cycle;				// cycle the loop point is on
+	uint32_t		loop_offset;			// loop point in stream, or REGLOG_NO_LOOP
+	uint32_t		blocks;					// number of DMC blocks
+	const uint8_t	*block_data;			// DMC blocks in map
+	const uint8_t	*stream;				// commands in map
+	size_t			stream_size;			// size of stream in bytes
+	Rom				file;					// mapping of the file
+} RegLog;
+
+RegLogWriter *	reglog_writer_create( const Bus *bus );
+void		reglog_write( void *userdata, uint64_t cycle, uint_fast16_t reg, uint8_t val );
+int			reglog_mark_loop( RegLogWriter *w, uint64_t cycle );
+int			reglog_writer_save( RegLogWriter *w, uint64_t end_cycle, const char *filename );
+void		reglog_writer_destroy( RegLogWriter *w );
+
+int			reglog_open( RegLog *log, const char *filename );
+void		reglog_close( RegLog *log );
+
+RegLogPlayer *	reglog_player_create( const RegLog *log );
+void		reglog_player_destroy( RegLogPlayer *p );
+Apu *		reglog_player_apu( RegLogPlayer *p );
+void		reglog_start( RegLogPlayer *p );
+size_t		reglog_run( RegLogPlayer *p, size_t max_cycles, float *samples_out, size_t max_samples, size_t *samples_written );
+size_t		reglog_run_s16( RegLogPlayer *p, size_t max_cycles, int16_t *samples_out, size_t max_samples, size_t *samples_written );
+
+#endif // REGLOG_H
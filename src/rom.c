@@ -0,0 +1,217 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "rom.h"
+
+#ifdef _WIN32
+
+/**
+ * Reads a whole file into memory, for platforms without mmap()
+ * @param rom ROM to fill in
+ * @param filename Path of file
+ * @return 0 on success, -1 on failure
+ */
+static int
+map_file( Rom *rom, const char *filename )
+{
+	FILE *f = fopen( filename, "rb" );
+
+	if ( !f )
+		return -1;
+
+	long size = -1;
+
+	if ( fseek( f, 0, SEEK_END ) == 0 )
+		size = ftell( f );
+
+	uint8_t *buf = ( size > 0 ) ? malloc( size ) : NULL;
+
+	if ( buf == NULL || fseek( f, 0, SEEK_SET ) != 0 || fread( buf, 1, size, f ) != (size_t)size )
+	{
+		free( buf );
+		fclose( f );
+		return -1;
+	}
+
+	fclose( f );
+
+	rom->map		= buf;
+	rom->map_size	= size;
+	return 0;
+}
+
+/**
+ * Releases what map_file() set up
+ * @param rom ROM
+ */
+static void
+unmap_file( Rom *rom )
+{
+	free( rom->map );
+}
+
+#else
+
+/**
+ * Maps a whole file read-only
+ * @param rom ROM to fill in
+ * @param filename Path of file
+ * @return 0 on success, -1 on failure
+ */
+static int
+map_file( Rom *rom, const char *filename )
+{
+	int fd = open( filename, O_RDONLY );
+
+	if ( fd < 0 )
+		return -1;
+
+	struct stat st;
+	void *map = MAP_FAILED;
+
+	if ( fstat( fd, &st ) == 0 && st.st_size > 0 )
+		map = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+
+	// the mapping stays valid after the file is closed
+
+	close( fd );
+
+	if ( map == MAP_FAILED )
+		return -1;
+
+	rom->map		= map;
+	rom->map_size	= st.st_size;
+	return 0;
+}
+
+/**
+ * Releases what map_file() set up
+ * @param rom ROM
+ */
+static void
+unmap_file( Rom *rom )
+{
+	munmap( rom->map, rom->map_size );
+}
+
+#endif
+
+/**
+ * Opens a ROM image. The whole file is the image, starting at the start of bank 0.
+ * @param rom ROM to fill in
+ * @param filename Path of image file
+ * @return 0 on success, -1 if the file could not be opened, is empty or out of memory
+ */
+int
+rom_open( Rom *rom, const char *filename )
+{
+	memset( rom, 0, sizeof(*rom) );
+
+	if ( map_file( rom, filename ) != 0 )
+		return -1;
+
+	if ( rom_set_layout( rom, 0, 0 ) != 0 )
+	{
+		rom_close( rom );
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Sets where the image is in the file and where it starts in bank 0
+ * @param rom ROM
+ * @param offset Start of image in the file
+ * @param padding Zero bytes in bank 0 before the image (less than ROM_BANK_SIZE)
+ * @return 0 on success, -1 if the image would be empty or out of memory
+ */
+int
+rom_set_layout( Rom *rom, size_t offset, size_t padding )
+{
+	if ( offset >= rom->map_size || padding >= ROM_BANK_SIZE )
+		return -1;
+
+	free( rom->head );
+	free( rom->tail );
+
+	rom->data		= (const uint8_t *)rom->map + offset;
+	rom->size		= rom->map_size - offset;
+	rom->padding	= padding;
+	rom->banks		= ( padding + rom->size + ROM_BANK_SIZE - 1 ) / ROM_BANK_SIZE;
+	rom->head		= NULL;
+	rom->tail		= NULL;
+
+	const size_t end = ( padding + rom->size ) % ROM_BANK_SIZE;
+
+	if ( padding != 0 || rom->banks == 1 )
+	{
+		size_t n = ROM_BANK_SIZE - padding;
+
+		if ( n > rom->size )
+			n = rom->size;
+
+		rom->head = calloc( 1, ROM_BANK_SIZE );
+
+		if ( rom->head == NULL )
+			return -1;
+
+		memcpy( rom->head + padding, rom->data, n );
+	}
+
+	if ( end != 0 && rom->banks > 1 )
+	{
+		rom->tail = calloc( 1, ROM_BANK_SIZE );
+
+		if ( rom->tail == NULL )
+			return -1;
+
+		memcpy( rom->tail, rom->data + rom->size - end, end );
+	}
+
+	return 0;
+}
+
+/**
+ * Closes a ROM image. Pointers into it are no longer valid afterwards.
+ * @param rom ROM
+ */
+void
+rom_close( Rom *rom )
+{
+	if ( rom->map != NULL )
+		unmap_file( rom );
+
+	free( rom->head );
+	free( rom->tail );
+	memset( rom, 0, sizeof(*rom) );
+}
+
+/**
+ * Returns a bank of a ROM image
+ * @param rom ROM
+ * @param bank Bank number
+ * @return Pointer to the ROM_BANK_SIZE bytes of the bank, or NULL if the image has no such bank
+ */
+const uint8_t *
+rom_bank( const Rom *rom, size_t bank )
+{
+	if ( bank >= rom->banks )
+		return NULL;
+
+	if ( rom->head != NULL && bank == 0 )
+		return rom->head;
+
+	if ( rom->tail != NULL && bank == rom->banks - 1 )
+		return rom->tail;
+
+	return rom->data + bank * ROM_BANK_SIZE - rom->padding;
+}
@@ -0,0 +1,36 @@
+#ifndef ROM_H
+#define ROM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ROM_BANK_SIZE	0x1000					// bank switching granularity (4 KiB, as on NSF)
+
+/*
+ * Read-only ROM image, split into 4 KiB banks. The file is memory-mapped where the platform allows
+ * it, so opening even a large multi-bank image does not read it, and every instance that maps the
+ * same file shares one copy of it in the page cache.
+ *
+ * The image can start part way into the file, after a header, and part way into its first bank,
+ * as NSF images do (see rom_set_layout()). A first or last bank that the image only partly fills
+ * is copied out and padded with zeros, since reading the rest of it through the mapping would
+ * read the header or fault.
+ */
+
+typedef struct {
+	const uint8_t	*data;					// image in map
+	size_t			size;					// size of image in bytes
+	size_t			padding;				// zero bytes in bank 0 before the image
+	size_t			banks;					// number of banks, counting partial ones
+	void			*map;					// mapping or buffer to release
+	size_t			map_size;				// size of map in bytes (the whole file)
+	uint8_t			*head;					// zero padded copy of a partial first bank, or NULL
+	uint8_t			*tail;					// zero padded copy of a partial last bank, or NULL
+} Rom;
+
+int				rom_open( Rom *rom, const char *filename );
+int				rom_set_layout( Rom *rom, size_t offset, size_t padding );
+void			rom_close( Rom *rom );
+const uint8_t	*rom_bank( const Rom *rom, size_t bank );
+
+#endif // ROM_H
@@ -0,0 +1,451 @@
+#include "simd.h"
+#include "mixer.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIMD_X86
+#endif
+
+/*
+ * Kernels:
+ *
+ * dot		Returns the dot product of a and b. n must be a multiple of SIMD_TAPS_ALIGN.
+ * scale	Writes out[i] = s * v[i]. n is at most SIMD_MAX_LANES. Every kernel set produces the
+ *			same bits, since each output is a single rounded multiply.
+ * mix		Writes out[i] = pulse[sq1[i] + sq2[i]] + tnd[MIXER_TND_INDEX( tri[i], noi[i], dmc[i] )].
+ * dot_rows	Writes the dot product of coeffs with each column of n rows of SIMD_STEM_LANES floats to
+ *			out[0 .. SIMD_STEM_LANES - 1]. n must be a multiple of SIMD_TAPS_ALIGN.
+ * dot_q15	Returns the integer dot product of a and b, summed in 64 bits. n must be a multiple of
+ *			SIMD_TAPS_ALIGN, and a must not hold -32768, so that every pair of adjacent products
+ *			fits in 32 bits. Every kernel set produces the same result, since integer addition
+ *			does not round.
+ * decay_q15	Writes out[i] = ( base * powers[i] ) / 2^45, rounded to nearest and clipped to 16 bits,
+ *			for a Q30 base and Q30 powers. n is at most SIMD_MAX_LANES. Every kernel set produces
+ *			the same result.
+ */
+
+static int
+always_supported( void )
+{
+	return 1;
+}
+
+static float
+dot_scalar( const float *a, const float *b, size_t n )
+{
+	float acc = 0.0f;
+
+	for ( size_t i = 0; i < n; i++ )
+		acc += a[i] * b[i];
+
+	return acc;
+}
+
+static void
+scale_scalar( float *out, float s, const float *v, size_t n )
+{
+	for ( size_t i = 0; i < n; i++ )
+		out[i] = s * v[i];
+}
+
+static void
+mix_scalar( float *out, const SimdLevels *lv, const float *pulse, const float *tnd, size_t n )
+{
+	for ( size_t i = 0; i < n; i++ )
+		out[i] = pulse[lv->sq1[i] + lv->sq2[i]] + tnd[MIXER_TND_INDEX( lv->tri[i], lv->noi[i], lv->dmc[i] )];
+}
+
+static void
+dot_rows_scalar( float *out, const float *coeffs, const float *rows, size_t n )
+{
+	float acc[SIMD_STEM_LANES] = { 0.0f };
+
+	for ( size_t k = 0; k < n; k++ )
+	{
+		for ( int l = 0; l < SIMD_STEM_LANES; l++ )
+			acc[l] += coeffs[k] * rows[k * SIMD_STEM_LANES + l];
+	}
+
+	for ( int l = 0; l < SIMD_STEM_LANES; l++ )
+		out[l] = acc[l];
+}
+
+static int64_t
+dot_q15_scalar( const int16_t *a, const int16_t *b, size_t n )
+{
+	int64_t acc = 0;
+
+	for ( size_t i = 0; i < n; i++ )
+		acc += (int32_t)a[i] * b[i];
+
+	return acc;
+}
+
+static void
+decay_q15_scalar( int16_t *out, int32_t base, const int32_t *powers, size_t n )
+{
+	for ( size_t i = 0; i < n; i++ )
+	{
+		const int64_t v = ( (int64_t)base * powers[i] + ( (int64_t)1 << 44 ) ) >> 45;
+
+		out[i] = ( v > INT16_MAX ) ? INT16_MAX : ( v < INT16_MIN ) ? INT16_MIN : v;
+	}
+}
+
+#ifdef SIMD_X86
+
+static int
+sse2_supported( void )
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports( "sse2" );
+}
+
+__attribute__(( target( "sse2" ) ))
+static float
+dot_sse2( const float *a, const float *b, size_t n )
+{
+	__m128 acc0 = _mm_setzero_ps();
+	__m128 acc1 = _mm_setzero_ps();
+	__m128 acc2 = _mm_setzero_ps();
+	__m128 acc3 = _mm_setzero_ps();
+
+	for ( size_t i = 0; i < n; i += 16 )
+	{
+		acc0 = _mm_add_ps( acc0, _mm_mul_ps( _mm_loadu_ps( &a[i +  0] ), _mm_loadu_ps( &b[i +  0] ) ) );
+		acc1 = _mm_add_ps( acc1, _mm_mul_ps( _mm_loadu_ps( &a[i +  4] ), _mm_loadu_ps( &b[i +  4] ) ) );
+		acc2 = _mm_add_ps( acc2, _mm_mul_ps( _mm_loadu_ps( &a[i +  8] ), _mm_loadu_ps( &b[i +  8] ) ) );
+		acc3 = _mm_add_ps( acc3, _mm_mul_ps( _mm_loadu_ps( &a[i + 12] ), _mm_loadu_ps( &b[i + 12] ) ) );
+	}
+
+	__m128 acc = _mm_add_ps( _mm_add_ps( acc0, acc1 ), _mm_add_ps( acc2, acc3 ) );
+
+	acc = _mm_add_ps( acc, _mm_movehl_ps( acc, acc ) );
+	acc = _mm_add_ss( acc, _mm_shuffle_ps( acc, acc, 1 ) );
+	return _mm_cvtss_f32( acc );
+}
+
+__attribute__(( target( "sse2" ) ))
+static void
+scale_sse2( float *out, float s, const float *v, size_t n )
+{
+	const __m128 sv = _mm_set1_ps( s );
+	size_t i = 0;
+
+	for ( ; i + 4 <= n; i += 4 )
+		_mm_storeu_ps( &out[i], _mm_mul_ps( sv, _mm_loadu_ps( &v[i] ) ) );
+
+	scale_scalar( &out[i], s, &v[i], n - i );
+}
+
+__attribute__(( target( "sse2" ) ))
+static void
+dot_rows_sse2( float *out, const float *coeffs, const float *rows, size_t n )
+{
+	__m128 acc0 = _mm_setzero_ps();
+	__m128 acc1 = _mm_setzero_ps();
+
+	for ( size_t k = 0; k < n; k++ )
+	{
+		const __m128 c = _mm_set1_ps( coeffs[k] );
+		const float *row = &rows[k * SIMD_STEM_LANES];
+
+		acc0 = _mm_add_ps( acc0, _mm_mul_ps( c, _mm_loadu_ps( &row[0] ) ) );
+		acc1 = _mm_add_ps( acc1, _mm_mul_ps( c, _mm_loadu_ps( &row[4] ) ) );
+	}
+
+	_mm_storeu_ps( &out[0], acc0 );
+	_mm_storeu_ps( &out[4], acc1 );
+}
+
+__attribute__(( target( "sse2" ) ))
+static int64_t
+dot_q15_sse2( const int16_t *a, const int16_t *b, size_t n )
+{
+	__m128i acc0 = _mm_setzero_si128();
+	__m128i acc1 = _mm_setzero_si128();
+
+	for ( size_t i = 0; i < n; i += 8 )
+	{
+		// pairs of products fit in 32 bits, sign extend them to 64 before summing
+
+		__m128i p = _mm_madd_epi16( _mm_loadu_si128( (const __m128i *)&a[i] ),
+				_mm_loadu_si128( (const __m128i *)&b[i] ) );
+		__m128i sign = _mm_srai_epi32( p, 31 );
+
+		acc0 = _mm_add_epi64( acc0, _mm_unpacklo_epi32( p, sign ) );
+		acc1 = _mm_add_epi64( acc1, _mm_unpackhi_epi32( p, sign ) );
+	}
+
+	__m128i acc = _mm_add_epi64( acc0, acc1 );
+
+	int64_t sum;
+
+	acc = _mm_add_epi64( acc, _mm_unpackhi_epi64( acc, acc ) );
+	_mm_storel_epi64( (__m128i *)&sum, acc );
+	return sum;
+}
+
+static int
+avx2_supported( void )
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports( "avx2" ) && __builtin_cpu_supports( "fma" );
+}
+
+__attribute__(( target( "avx2,fma" ) ))
+static float
+dot_avx2( const float *a, const float *b, size_t n )
+{
+	__m256 acc0 = _mm256_setzero_ps();
+	__m256 acc1 = _mm256_setzero_ps();
+
+	for ( size_t i = 0; i < n; i += 16 )
+	{
+		acc0 = _mm256_fmadd_ps( _mm256_loadu_ps( &a[i + 0] ), _mm256_loadu_ps( &b[i + 0] ), acc0 );
+		acc1 = _mm256_fmadd_ps( _mm256_loadu_ps( &a[i + 8] ), _mm256_loadu_ps( &b[i + 8] ), acc1 );
+	}
+
+	__m256 acc8 = _mm256_add_ps( acc0, acc1 );
+	__m128 acc = _mm_add_ps( _mm256_castps256_ps128( acc8 ), _mm256_extractf128_ps( acc8, 1 ) );
+
+	acc = _mm_add_ps( acc, _mm_movehl_ps( acc, acc ) );
+	acc = _mm_add_ss( acc, _mm_shuffle_ps( acc, acc, 1 ) );
+	return _mm_cvtss_f32( acc );
+}
+
+__attribute__(( target( "avx2,fma" ) ))
+static void
+scale_avx2( float *out, float s, const float *v, size_t n )
+{
+	const __m256 sv = _mm256_set1_ps( s );
+	size_t i = 0;
+
+	for ( ; i + 8 <= n; i += 8 )
+		_mm256_storeu_ps( &out[i], _mm256_mul_ps( sv, _mm256_loadu_ps( &v[i] ) ) );
+
+	scale_scalar( &out[i], s, &v[i], n - i );
+}
+
+__attribute__(( target( "avx2,fma" ) ))
+static void
+mix_avx2( float *out, const SimdLevels *lv, const float *pulse, const float *tnd, size_t n )
+{
+	size_t i = 0;
+
+	for ( ; i + 8 <= n; i += 8 )
+	{
+		__m256i sq1 = _mm256_cvtepu8_epi32( _mm_loadl_epi64( (const __m128i *)&lv->sq1[i] ) );
+		__m256i sq2 = _mm256_cvtepu8_epi32( _mm_loadl_epi64( (const __m128i *)&lv->sq2[i] ) );
+		__m256i tri = _mm256_cvtepu8_epi32( _mm_loadl_epi64( (const __m128i *)&lv->tri[i] ) );
+		__m256i noi = _mm256_cvtepu8_epi32( _mm_loadl_epi64( (const __m128i *)&lv->noi[i] ) );
+		__m256i dmc = _mm256_cvtepu8_epi32( _mm_loadl_epi64( (const __m128i *)&lv->dmc[i] ) );
+
+		__m256i p = _mm256_add_epi32( sq1, sq2 );
+		__m256i t = _mm256_or_si256( _mm256_or_si256( _mm256_slli_epi32( tri, 11 ),
+				_mm256_slli_epi32( noi, 7 ) ), dmc );
+
+		_mm256_storeu_ps( &out[i], _mm256_add_ps( _mm256_i32gather_ps( pulse, p, 4 ),
+				_mm256_i32gather_ps( tnd, t, 4 ) ) );
+	}
+
+	SimdLevels rest = { &lv->sq1[i], &lv->sq2[i], &lv->tri[i], &lv->noi[i], &lv->dmc[i] };
+
+	mix_scalar( &out[i], &rest, pulse, tnd, n - i );
+}
+
+__attribute__(( target( "avx2,fma" ) ))
+static void
+dot_rows_avx2( float *out, const float *coeffs, const float *rows, size_t n )
+{
+	__m256 acc0 = _mm256_setzero_ps();
+	__m256 acc1 = _mm256_setzero_ps();
+
+	for ( size_t k = 0; k < n; k += 2 )
+	{
+		acc0 = _mm256_fmadd_ps( _mm256_set1_ps( coeffs[k + 0] ),
+				_mm256_loadu_ps( &rows[( k + 0 ) * SIMD_STEM_LANES] ), acc0 );
+		acc1 = _mm256_fmadd_ps( _mm256_set1_ps( coeffs[k + 1] ),
+				_mm256_loadu_ps( &rows[( k + 1 ) * SIMD_STEM_LANES] ), acc1 );
+	}
+
+	_mm256_storeu_ps( out, _mm256_add_ps( acc0, acc1 ) );
+}
+
+__attribute__(( target( "avx2,fma" ) ))
+static int64_t
+dot_q15_avx2( const int16_t *a, const int16_t *b, size_t n )
+{
+	__m256i acc0 = _mm256_setzero_si256();
+	__m256i acc1 = _mm256_setzero_si256();
+
+	for ( size_t i = 0; i < n; i += 16 )
+	{
+		// pairs of products fit in 32 bits, sign extend them to 64 before summing
+
+		__m256i p = _mm256_madd_epi16( _mm256_loadu_si256( (const __m256i *)&a[i] ),
+				_mm256_loadu_si256( (const __m256i *)&b[i] ) );
+
+		acc0 = _mm256_add_epi64( acc0, _mm256_cvtepi32_epi64( _mm256_castsi256_si128( p ) ) );
+		acc1 = _mm256_add_epi64( acc1, _mm256_cvtepi32_epi64( _mm256_extracti128_si256( p, 1 ) ) );
+	}
+
+	__m256i acc4 = _mm256_add_epi64( acc0, acc1 );
+	__m128i acc = _mm_add_epi64( _mm256_castsi256_si128( acc4 ), _mm256_extracti128_si256( acc4, 1 ) );
+
+	int64_t sum;
+
+	acc = _mm_add_epi64( acc, _mm_unpackhi_epi64( acc, acc ) );
+	_mm_storel_epi64( (__m128i *)&sum, acc );
+	return sum;
+}
+
+__attribute__(( target( "avx2,fma" ) ))
+static void
+decay_q15_avx2( int16_t *out, int32_t base, const int32_t *powers, size_t n )
+{
+	// there is no 64-bit arithmetic shift, so bias the products to be positive and take the bias
+	// back off after a logical one
+
+	const __m256i b = _mm256_set1_epi32( base );
+	const __m256i bias = _mm256_set1_epi64x( ( (int64_t)1 << 62 ) + ( (int64_t)1 << 44 ) );
+	const __m256i unbias = _mm256_set1_epi64x( (int64_t)1 << 17 );
+	const __m256i low = _mm256_setr_epi32( 0, 2, 4, 6, 0, 2, 4, 6 );
+	size_t i = 0;
+
+	for ( ; i + 4 <= n; i += 4 )
+	{
+		__m256i p = _mm256_cvtepi32_epi64( _mm_loadu_si128( (const __m128i *)&powers[i] ) );
+		__m256i v = _mm256_mul_epi32( b, p );
+
+		v = _mm256_sub_epi64( _mm256_srli_epi64( _mm256_add_epi64( v, bias ), 45 ), unbias );
+		v = _mm256_permutevar8x32_epi32( v, low );
+
+		__m128i v16 = _mm_packs_epi32( _mm256_castsi256_si128( v ), _mm256_castsi256_si128( v ) );
+
+		_mm_storel_epi64( (__m128i *)&out[i], v16 );
+	}
+
+	decay_q15_scalar( &out[i], base, &powers[i], n - i );
+}
+
+// the avx512 set also uses the AVX2 integer kernels, so it needs everything the avx2 set does
+
+static int
+avx512_supported( void )
+{
+	return avx2_supported() && __builtin_cpu_supports( "avx512f" );
+}
+
+__attribute__(( target( "avx512f" ) ))
+static float
+dot_avx512( const float *a, const float *b, size_t n )
+{
+	__m512 acc = _mm512_setzero_ps();
+
+	for ( size_t i = 0; i < n; i += 16 )
+		acc = _mm512_fmadd_ps( _mm512_loadu_ps( &a[i] ), _mm512_loadu_ps( &b[i] ), acc );
+
+	return _mm512_reduce_add_ps( acc );
+}
+
+__attribute__(( target( "avx512f" ) ))
+static void
+scale_avx512( float *out, float s, const float *v, size_t n )
+{
+	const __mmask16 mask = (__mmask16)( ( 1u << n ) - 1 );
+
+	_mm512_mask_storeu_ps( out, mask, _mm512_mul_ps( _mm512_set1_ps( s ), _mm512_maskz_loadu_ps( mask, v ) ) );
+}
+
+__attribute__(( target( "avx512f" ) ))
+static void
+mix_avx512( float *out, const SimdLevels *lv, const float *pulse, const float *tnd, size_t n )
+{
+	size_t i = 0;
+
+	for ( ; i + 16 <= n; i += 16 )
+	{
+		__m512i sq1 = _mm512_cvtepu8_epi32( _mm_loadu_si128( (const __m128i *)&lv->sq1[i] ) );
+		__m512i sq2 = _mm512_cvtepu8_epi32( _mm_loadu_si128( (const __m128i *)&lv->sq2[i] ) );
+		__m512i tri = _mm512_cvtepu8_epi32( _mm_loadu_si128( (const __m128i *)&lv->tri[i] ) );
+		__m512i noi = _mm512_cvtepu8_epi32( _mm_loadu_si128( (const __m128i *)&lv->noi[i] ) );
+		__m512i dmc = _mm512_cvtepu8_epi32( _mm_loadu_si128( (const __m128i *)&lv->dmc[i] ) );
+
+		__m512i p = _mm512_add_epi32( sq1, sq2 );
+		__m512i t = _mm512_or_si512( _mm512_or_si512( _mm512_slli_epi32( tri, 11 ),
+				_mm512_slli_epi32( noi, 7 ) ), dmc );
+
+		_mm512_storeu_ps( &out[i], _mm512_add_ps( _mm512_i32gather_ps( p, pulse, 4 ),
+				_mm512_i32gather_ps( t, tnd, 4 ) ) );
+	}
+
+	SimdLevels rest = { &lv->sq1[i], &lv->sq2[i], &lv->tri[i], &lv->noi[i], &lv->dmc[i] };
+
+	mix_scalar( &out[i], &rest, pulse, tnd, n - i );
+}
+
+__attribute__(( target( "avx512f" ) ))
+static void
+dot_rows_avx512( float *out, const float *coeffs, const float *rows, size_t n )
+{
+	// two rows per vector, with the matching coefficient spread over each half
+
+	const __m512i spread = _mm512_set_epi32( 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0 );
+	__m512 acc = _mm512_setzero_ps();
+
+	for ( size_t k = 0; k < n; k += 2 )
+	{
+		__m512 c = _mm512_castps128_ps512( _mm_castpd_ps( _mm_load_sd( (const double *)&coeffs[k] ) ) );
+
+		acc = _mm512_fmadd_ps( _mm512_permutexvar_ps( spread, c ),
+				_mm512_loadu_ps( &rows[k * SIMD_STEM_LANES] ), acc );
+	}
+
+	__m256 lo = _mm512_castps512_ps256( acc );
+	__m256 hi = _mm256_castpd_ps( _mm512_extractf64x4_pd( _mm512_castps_pd( acc ), 1 ) );
+
+	_mm256_storeu_ps( out, _mm256_add_ps( lo, hi ) );
+}
+
+#endif // SIMD_X86
+
+// best kernel set first. AVX-512F has no 16-bit multiply-add, so the avx512 set uses the AVX2
+// integer kernels. SSE2 has no signed 32-bit multiply, so the sse2 set decays with the scalar one
+
+static const SimdKernels kernel_sets[] = {
+#ifdef SIMD_X86
+	{ "avx512",	avx512_supported,	dot_avx512,	scale_avx512,	mix_avx512,	dot_rows_avx512,	dot_q15_avx2,	decay_q15_avx2 },
+	{ "avx2",	avx2_supported,		dot_avx2,	scale_avx2,		mix_avx2,	dot_rows_avx2,		dot_q15_avx2,	decay_q15_avx2 },
+	{ "sse2",	sse2_supported,		dot_sse2,	scale_sse2,		mix_scalar,	dot_rows_sse2,		dot_q15_sse2,	decay_q15_scalar },
+#endif
+	{ "scalar",	always_supported,	dot_scalar,	scale_scalar,	mix_scalar,	dot_rows_scalar,	dot_q15_scalar,	decay_q15_scalar }
+};
+
+/**
+ * Returns the fastest kernel set the CPU supports
+ * @return Kernel set
+ */
+const SimdKernels *
+simd_best( void )
+{
+	for ( int i = 0; ; i++ )
+	{
+		if ( kernel_sets[i].supported() )
+			return &kernel_sets[i];
+	}
+}
+
+/**
+ * Returns a kernel set by index, whether the CPU supports it or not
+ * @param index Index of kernel set, from fastest to slowest
+ * @return Kernel set, or NULL if index is out of range
+ */
+const SimdKernels *
+simd_kernels( int index )
+{
+	if ( index < 0 || index >= (int)( sizeof(kernel_sets) / sizeof(kernel_sets[0]) ) )
+		return NULL;
+
+	return &kernel_sets[index];
+}
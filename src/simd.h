@@ -0,0 +1,34 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SIMD_TAPS_ALIGN		16				// dot product lengths must be a multiple of this
+#define SIMD_MAX_LANES		16				// max length of scale kernel vectors
+#define SIMD_STEM_LANES		8				// floats per row for dot_rows kernels
+
+typedef struct {
+	const uint8_t	*sq1;					// pulse 1 levels (0-15)
+	const uint8_t	*sq2;					// pulse 2 levels (0-15)
+	const uint8_t	*tri;					// triangle levels (0-15)
+	const uint8_t	*noi;					// noise levels (0-15)
+	const uint8_t	*dmc;					// DMC levels (0-127)
+} SimdLevels;
+
+typedef struct {
+	const char		*name;					// kernel set name
+	int				( *supported )( void );	// returns 1 if the CPU can run this kernel set
+	float			( *dot )( const float *a, const float *b, size_t n );
+	void			( *scale )( float *out, float s, const float *v, size_t n );
+	void			( *mix )( float *out, const SimdLevels *lv, const float *pulse, const float *tnd,
+					size_t n );
+	void			( *dot_rows )( float *out, const float *coeffs, const float *rows, size_t n );
+	int64_t			( *dot_q15 )( const int16_t *a, const int16_t *b, size_t n );
+	void			( *decay_q15 )( int16_t *out, int32_t base, const int32_t *powers, size_t n );
+} SimdKernels;
+
+const SimdKernels	*simd_best( void );
+const SimdKernels	*simd_kernels( int index );
+
+#endif // SIMD_H
@@ -0,0 +1,135 @@
+#include <stdlib.h>
+
+#include "spsc.h"
+
+/**
+ * Allocates an empty queue
+ * @param capacity Number of entries (rounded up to a power of 2)
+ * @return New queue, or NULL if allocation failed
+ */
+SpscQueue *
+spsc_create( size_t capacity )
+{
+	size_t size = 1;
+
+	while ( size < capacity )
+		size <<= 1;
+
+	SpscQueue *q = malloc( sizeof(SpscQueue) );
+
+	if ( q == NULL )
+		return NULL;
+
+	q->buf = malloc( size * sizeof(ApuWrite) );
+
+	if ( q->buf == NULL )
+	{
+		free( q );
+		return NULL;
+	}
+
+	q->mask = size - 1;
+	atomic_init( &q->head, 0 );
+	atomic_init( &q->tail, 0 );
+	atomic_init( &q->horizon, 0 );
+	return q;
+}
+
+/**
+ * Frees a queue
+ * @param q Queue
+ */
+void
+spsc_destroy( SpscQueue *q )
+{
+	if ( q == NULL )
+		return;
+
+	free( q->buf );
+	free( q );
+}
+
+/**
+ * Drops all entries and resets the horizon. Neither side may be using the queue at the time.
+ * @param q Queue
+ */
+void
+spsc_clear( SpscQueue *q )
+{
+	atomic_store( &q->head, 0 );
+	atomic_store( &q->tail, 0 );
+	atomic_store( &q->horizon, 0 );
+}
+
+/**
+ * Adds a write to the queue. Producer side only. Writes must be pushed in cycle order.
+ * @param q Queue
+ * @param w Write to add
+ * @return 0 on success, -1 if the queue is full
+ */
+int
+spsc_push( SpscQueue *q, const ApuWrite *w )
+{
+	const size_t tail = atomic_load_explicit( &q->tail, memory_order_relaxed );
+	const size_t head = atomic_load_explicit( &q->head, memory_order_acquire );
+
+	if ( tail - head > q->mask )
+		return -1;
+
+	q->buf[tail & q->mask] = *w;
+	atomic_store_explicit( &q->tail, tail + 1, memory_order_release );
+	return 0;
+}
+
+/**
+ * Tells the consumer that every write for a cycle before horizon has been pushed. Producer side
+ * only. The horizon must never move backwards.
+ * @param q Queue
+ * @param horizon First cycle that may still get writes
+ */
+void
+spsc_publish( SpscQueue *q, uint64_t horizon )
+{
+	atomic_store_explicit( &q->horizon, horizon, memory_order_release );
+}
+
+/**
+ * Returns the oldest write in the queue without removing it. Consumer side only.
+ * @param q Queue
+ * @return Oldest write, or NULL if the queue is empty
+ */
+const ApuWrite *
+spsc_peek( SpscQueue *q )
+{
+	const size_t head = atomic_load_explicit( &q->head, memory_order_relaxed );
+	const size_t tail = atomic_load_explicit( &q->tail, memory_order_acquire );
+
+	if ( head == tail )
+		return NULL;
+
+	return &q->buf[head & q->mask];
+}
+
+/**
+ * Removes the oldest write from the queue. Consumer side only, after spsc_peek() returned it.
+ * @param q Queue
+ */
+void
+spsc_pop( SpscQueue *q )
+{
+	const size_t head = atomic_load_explicit( &q->head, memory_order_relaxed );
+
+	atomic_store_explicit( &q->head, head + 1, memory_order_release );
+}
+
+/**
+ * Returns the horizon last published by the producer. Consumer side only. Load this before
+ * peeking, so that every write before the horizon is guaranteed to be visible.
+ * @param q Queue
+ * @return First cycle that may still get writes
+ */
+uint64_t
+spsc_horizon( SpscQueue *q )
+{
+	return atomic_load_explicit( &q->horizon, memory_order_acquire );
+}
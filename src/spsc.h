@@ -0,0 +1,39 @@
+#ifndef SPSC_H
+#define SPSC_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "apu.h"
+
+#define SPSC_CACHE_LINE		64					// keeps producer and consumer fields apart
+
+/*
+ * Lock-free single-producer/single-consumer queue of timestamped APU register writes. One thread
+ * pushes writes in cycle order and publishes how far it has got, another thread consumes them
+ * while rendering (see apu_set_write_queue()).
+ */
+
+struct SpscQueue {
+	ApuWrite		*buf;					// ring buffer
+	size_t			mask;					// capacity - 1 (capacity is a power of 2)
+
+	char			pad0[SPSC_CACHE_LINE];
+	atomic_size_t	head;					// next entry to read, written by consumer
+	char			pad1[SPSC_CACHE_LINE];
+	atomic_size_t	tail;					// next entry to write, written by producer
+	atomic_uint_least64_t horizon;			// no writes for cycles before this are still to come
+	char			pad2[SPSC_CACHE_LINE];
+};
+
+SpscQueue		*spsc_create( size_t capacity );
+void			spsc_destroy( SpscQueue *q );
+void			spsc_clear( SpscQueue *q );
+int				spsc_push( SpscQueue *q, const ApuWrite *w );
+void			spsc_publish( SpscQueue *q, uint64_t horizon );
+const ApuWrite	*spsc_peek( SpscQueue *q );
+void			spsc_pop( SpscQueue *q );
+uint64_t		spsc_horizon( SpscQueue *q );
+
+#endif // SPSC_H
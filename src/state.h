@@ -0,0 +1,61 @@
+#ifndef STATE_H
+#define STATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Helpers for writing and reading save states. A writer with a NULL buffer only counts bytes, so
+ * the same save function can be used to work out how big a state is. A reader that runs past the
+ * end of its buffer sets its error flag and reads zeros from then on.
+ */
+
+typedef struct {
+	uint8_t			*buf;					// output buffer, NULL to only count bytes
+	size_t			pos;					// bytes written so far
+} StateWriter;
+
+typedef struct {
+	const uint8_t	*buf;					// input buffer
+	size_t			size;					// size of input buffer
+	size_t			pos;					// bytes read so far
+	int				error;					// 1 = tried to read past the end of the buffer
+} StateReader;
+
+/**
+ * Writes bytes to a save state
+ * @param w Writer
+ * @param src Bytes to write
+ * @param n Number of bytes
+ */
+static inline void
+state_write( StateWriter *w, const void *src, size_t n )
+{
+	if ( w->buf != NULL )
+		memcpy( w->buf + w->pos, src, n );
+
+	w->pos += n;
+}
+
+/**
+ * Reads bytes from a save state
+ * @param r Reader
+ * @param dst Buffer to read into
+ * @param n Number of bytes
+ */
+static inline void
+state_read( StateReader *r, void *dst, size_t n )
+{
+	if ( r->error || r->size - r->pos < n )
+	{
+		r->error = 1;
+		memset( dst, 0, n );
+		return;
+	}
+
+	memcpy( dst, r->buf + r->pos, n );
+	r->pos += n;
+}
+
+#endif // STATE_H
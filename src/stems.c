@@ -0,0 +1,143 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stems.h"
+
+#define STEMS_HP_FLOOR	1e-20f					// high pass output treated as fully decayed
+
+/**
+ * Allocates the history of a multichannel filter. Must be set up with stems_init() before use.
+ * @param s Filter
+ * @return 0 on success, -1 if allocation failed
+ */
+int
+stems_create( Stems *s )
+{
+	s->hist = malloc( 2 * FIR_MAX_TAPS * sizeof(*s->hist) );
+
+	if ( s->hist == NULL )
+		return -1;
+
+	s->taps = SIMD_TAPS_ALIGN;
+	stems_clear( s );
+	return 0;
+}
+
+/**
+ * Frees the history of a multichannel filter
+ * @param s Filter
+ */
+void
+stems_destroy( Stems *s )
+{
+	free( s->hist );
+	s->hist = NULL;
+}
+
+/**
+ * Sets up a multichannel filter with the same high pass and low pass as a single channel one, and
+ * clears its state
+ * @param s Filter
+ * @param fir Filter to copy the design of
+ */
+void
+stems_init( Stems *s, const Fir *fir )
+{
+	memcpy( s->coeffs, fir->coeffs, sizeof(s->coeffs) );
+
+	s->taps		= fir->taps;
+	s->hp_coeff	= fir->hp_coeff;
+	s->kernels	= fir->kernels;
+
+	stems_clear( s );
+}
+
+/**
+ * Clears all filter state
+ * @param s Filter
+ */
+void
+stems_clear( Stems *s )
+{
+	memset( s->hist, 0, 2 * FIR_MAX_TAPS * sizeof(*s->hist) );
+	memset( s->level, 0, sizeof(s->level) );
+	memset( s->hp_out, 0, sizeof(s->hp_out) );
+
+	s->pos = 0;
+}
+
+/**
+ * Clears all filter state as if the inputs had been at the given levels for ever
+ * @param s Filter
+ * @param levels Input level of each channel (STEMS_CHANNELS values)
+ */
+void
+stems_prime( Stems *s, const float *levels )
+{
+	stems_clear( s );
+	memcpy( s->level, levels, STEMS_CHANNELS * sizeof(float) );
+}
+
+/**
+ * Runs the filter for a number of input clocks at constant input levels
+ * @param s Filter
+ * @param levels Input level of each channel (STEMS_CHANNELS values)
+ * @param clocks Number of input clocks to run
+ */
+void
+stems_push( Stems *s, const float *levels, size_t clocks )
+{
+	const float a = s->hp_coeff;
+	float x[STEMS_LANES] = { 0.0f };
+	float hp[STEMS_LANES];
+
+	if ( clocks == 0 )
+		return;
+
+	memcpy( x, levels, STEMS_CHANNELS * sizeof(float) );
+
+	// the first clock sees any input steps, after that the high pass outputs just decay
+
+	for ( int l = 0; l < STEMS_LANES; l++ )
+	{
+		hp[l] = ( x[l] != s->level[l] ) ? a * ( s->hp_out[l] + x[l] - s->level[l] ) : a * s->hp_out[l];
+		s->level[l] = x[l];
+	}
+
+	for ( size_t i = 0; ; )
+	{
+		// don't let the tail of the decay turn into denormals
+
+		for ( int l = 0; l < STEMS_LANES; l++ )
+			hp[l] = ( fabsf( hp[l] ) < STEMS_HP_FLOOR ) ? 0.0f : hp[l];
+
+		memcpy( s->hist[s->pos], hp, sizeof(hp) );
+		memcpy( s->hist[s->pos + s->taps], hp, sizeof(hp) );
+
+		if ( ++s->pos == s->taps )
+			s->pos = 0;
+
+		if ( ++i == clocks )
+			break;
+
+		for ( int l = 0; l < STEMS_LANES; l++ )
+			hp[l] *= a;
+	}
+
+	memcpy( s->hp_out, hp, sizeof(hp) );
+}
+
+/**
+ * Runs the low pass over the history of every channel
+ * @param s Filter
+ * @param out Buffer to write each channel's output sample to (STEMS_CHANNELS values)
+ */
+void
+stems_output( const Stems *s, float *out )
+{
+	float acc[STEMS_LANES];
+
+	s->kernels->dot_rows( acc, s->coeffs, s->hist[s->pos], s->taps );
+	memcpy( out, acc, STEMS_CHANNELS * sizeof(float) );
+}
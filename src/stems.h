@@ -0,0 +1,40 @@
+#ifndef STEMS_H
+#define STEMS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fir.h"
+#include "simd.h"
+
+#define STEMS_CHANNELS	5						// pulse 1, pulse 2, triangle, noise, DMC
+#define STEMS_LANES		SIMD_STEM_LANES			// channels padded up to a whole SIMD vector
+
+/*
+ * Multichannel version of the FIR output engine, for filtering each channel's share of the DAC
+ * output on its own. The channels are interleaved in the history, one row of STEMS_LANES floats
+ * per input clock, so a single pass over the taps filters all of them at once.
+ */
+
+typedef struct {
+	float			coeffs[FIR_MAX_TAPS];	// low pass coefficients, copied from a Fir
+	float			(*hist)[STEMS_LANES];	// high pass output history (mirrored, 2 * FIR_MAX_TAPS rows)
+	uint32_t		taps;					// low pass length after padding
+	uint32_t		pos;					// next write row in history
+
+	float			level[STEMS_LANES];		// previous input levels
+	float			hp_out[STEMS_LANES];	// current outputs of high pass filters
+	float			hp_coeff;				// high pass smoothing factor
+
+	const SimdKernels *kernels;				// convolution kernels
+} Stems;
+
+int		stems_create( Stems *s );
+void	stems_destroy( Stems *s );
+void	stems_init( Stems *s, const Fir *fir );
+void	stems_clear( Stems *s );
+void	stems_prime( Stems *s, const float *levels );
+void	stems_push( Stems *s, const float *levels, size_t clocks );
+void	stems_output( const Stems *s, float *out );
+
+#endif // STEMS_H
@@ -0,0 +1,257 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "timeline.h"
+#include "trace.h"
+
+#define TIMELINE_MAGIC		0x4e494c54				// "TLIN"
+#define TIMELINE_VERSION	1
+
+/**
+ * Sets up an empty timeline. Events added go to the start of the song until the first
+ * timeline_end_frame().
+ * @param tl Timeline
+ */
+void
+timeline_init( Timeline *tl )
+{
+	memset( tl, 0, sizeof(*tl) );
+	tl->loop_frame = TIMELINE_NO_LOOP;
+}
+
+/**
+ * Frees the events of a timeline and leaves it empty
+ * @param tl Timeline
+ */
+void
+timeline_free( Timeline *tl )
+{
+	free( tl->offsets );
+	free( tl->events );
+	timeline_init( tl );
+}
+
+/**
+ * Adds an event to the end of the frame being built
+ * @param tl Timeline
+ * @param reg APU register, or TIMELINE_BANK_REG + ROM page
+ * @param val Value to write, or bank to switch in
+ * @return 0 on success, -1 if allocation failed
+ */
+int
+timeline_add( Timeline *tl, uint8_t reg, uint8_t val )
+{
+	if ( tl->count == tl->capacity )
+	{
+		size_t capacity = ( tl->capacity != 0 ) ? 2 * tl->capacity : 4096;
+		TimelineEvent *events = realloc( tl->events, capacity * sizeof(*events) );
+
+		if ( events == NULL )
+			return -1;
+
+		tl->events		= events;
+		tl->capacity	= capacity;
+	}
+
+	tl->events[tl->count].reg = reg;
+	tl->events[tl->count].val = val;
+	tl->count++;
+	return 0;
+}
+
+/**
+ * Ends the frame being built. The first call ends the events of the start of the song instead.
+ * @param tl Timeline
+ * @return 0 on success, -1 if allocation failed or the timeline is full
+ */
+int
+timeline_end_frame( Timeline *tl )
+{
+	// offsets is only allocated once the start of the song has been ended
+
+	const size_t used = ( tl->offsets != NULL ) ? (size_t)tl->frames + 1 : 0;
+
+	if ( tl->count > UINT32_MAX || tl->frames == UINT32_MAX - 1 )
+		return -1;
+
+	if ( used == tl->offsets_capacity )
+	{
+		size_t capacity = ( tl->offsets_capacity != 0 ) ? 2 * tl->offsets_capacity : 1024;
+		uint32_t *offsets = realloc( tl->offsets, capacity * sizeof(*offsets) );
+
+		if ( offsets == NULL )
+			return -1;
+
+		tl->offsets				= offsets;
+		tl->offsets_capacity	= capacity;
+	}
+
+	tl->offsets[used] = tl->count;
+
+	if ( used > 0 )
+		tl->frames++;
+
+	return 0;
+}
+
+/**
+ * Writes a timeline to a file, in host byte order
+ * @param tl Timeline, with at least the start of the song ended
+ * @param filename File to write
+ * @return 0 on success, -1 if the file could not be written
+ */
+int
+timeline_save( const Timeline *tl, const char *filename )
+{
+	const uint64_t header[5] = {
+		TIMELINE_MAGIC, TIMELINE_VERSION, tl->frames, tl->loop_frame, tl->count
+	};
+	const size_t offsets = (size_t)tl->frames + 1;
+
+	if ( tl->offsets == NULL )
+		return -1;
+
+	FILE *f = fopen( filename, "wb" );
+
+	if ( f == NULL )
+		return -1;
+
+	int ok = fwrite( header, sizeof(header), 1, f ) == 1;
+
+	ok = ok && fwrite( tl->offsets, sizeof(*tl->offsets), offsets, f ) == offsets;
+	ok = ok && fwrite( tl->events, sizeof(*tl->events), tl->count, f ) == tl->count;
+
+	if ( fclose( f ) != 0 )
+		ok = 0;
+
+	return ok ? 0 : -1;
+}
+
+/**
+ * Reads a timeline written by timeline_save(), replacing the contents of a timeline
+ * @param tl Timeline (set up with timeline_init())
+ * @param filename File to read
+ * @return 0 on success, -1 if the file could not be read or is not a timeline
+ */
+int
+timeline_load( Timeline *tl, const char *filename )
+{
+	uint64_t header[5];
+	FILE *f = fopen( filename, "rb" );
+
+	if ( f == NULL )
+		return -1;
+
+	timeline_free( tl );
+
+	if ( fread( header, sizeof(header), 1, f ) != 1 || header[0] != TIMELINE_MAGIC ||
+			header[1] != TIMELINE_VERSION || header[2] >= UINT32_MAX || header[4] > UINT32_MAX ||
+			( header[3] != TIMELINE_NO_LOOP && header[3] >= header[2] ) )
+	{
+		fclose( f );
+		return -1;
+	}
+
+	const size_t offsets = header[2] + 1;
+	const size_t count = header[4];
+
+	tl->offsets	= malloc( offsets * sizeof(*tl->offsets) );
+	tl->events	= malloc( count * sizeof(*tl->events) + 1 );
+
+	int ok = tl->offsets != NULL && tl->events != NULL;
+
+	ok = ok && fread( tl->offsets, sizeof(*tl->offsets), offsets, f ) == offsets;
+	ok = ok && fread( tl->events, sizeof(*tl->events), count, f ) == count;
+	fclose( f );
+
+	// the frames have to follow each other and lie within the events
+
+	for ( size_t i = 0; ok && i < offsets; i++ )
+	{
+		if ( tl->offsets[i] > count || ( i > 0 && tl->offsets[i] < tl->offsets[i - 1] ) )
+			ok = 0;
+	}
+
+	if ( !ok )
+	{
+		timeline_free( tl );
+		return -1;
+	}
+
+	tl->frames				= header[2];
+	tl->loop_frame			= header[3];
+	tl->count				= count;
+	tl->capacity			= count;
+	tl->offsets_capacity	= offsets;
+	return 0;
+}
+
+/**
+ * Plays a run of events
+ * @param p Player
+ * @param begin Index of first event
+ * @param end Index after last event
+ */
+static void
+play_events( TimelinePlayer *p, size_t begin, size_t end )
+{
+	const TimelineEvent *e = &p->timeline->events[begin];
+	const TimelineEvent *last = &p->timeline->events[end];
+
+	for ( ; e < last; e++ )
+	{
+		if ( e->reg < TIMELINE_BANK_REG )
+			apu_write( p->apu, e->reg, e->val );
+		else
+			bus_switch( p->bus, e->reg - TIMELINE_BANK_REG, e->val );
+	}
+}
+
+/**
+ * Starts playing a timeline from the beginning: maps the first banks on the bus as bus_reset()
+ * does and plays the events of the start of the song. Hook timeline_player_frame() up as the APU's
+ * frame hook, with the player as its userdata, to play the frames.
+ * @param p Player
+ * @param tl Timeline
+ * @param apu APU instance to write to
+ * @param bus Bus the APU reads DMC samples through
+ */
+void
+timeline_player_start( TimelinePlayer *p, const Timeline *tl, Apu *apu, Bus *bus )
+{
+	p->timeline	= tl;
+	p->apu		= apu;
+	p->bus		= bus;
+	p->frame	= 0;
+
+	bus_reset( bus );
+
+	if ( tl->offsets != NULL )
+		play_events( p, 0, tl->offsets[0] );
+}
+
+/**
+ * Plays the next frame of a timeline, looping back once past the end. Does nothing after the
+ * last frame of a timeline that does not loop. Has the signature of an ApuFrameHook.
+ * @param userdata Player
+ */
+void
+timeline_player_frame( void *userdata )
+{
+	TimelinePlayer *p = userdata;
+	const Timeline *tl = p->timeline;
+	uint64_t frame = p->frame++;
+
+	if ( frame >= tl->frames )
+	{
+		if ( tl->loop_frame == TIMELINE_NO_LOOP )
+			return;
+
+		frame = tl->loop_frame + ( frame - tl->loop_frame ) % ( tl->frames - tl->loop_frame );
+	}
+
+	TRACE_EVENT( TRACE_DRIVER_BEGIN, apu_cycle( p->apu ), 0, 0 );
+	play_events( p, tl->offsets[frame], tl->offsets[frame + 1] );
+	TRACE_EVENT( TRACE_DRIVER_END, apu_cycle( p->apu ), 0, 0 );
+}
@@ -0,0 +1,55 @@
+#ifndef TIMELINE_H
+#define TIMELINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "apu.h"
+#include "bus.h"
+
+#define TIMELINE_BANK_REG	0x18				// first register that switches banks
+#define TIMELINE_NO_LOOP	UINT32_MAX			// loop_frame of a timeline that does not loop
+
+/*
+ * Register writes of a song, compiled ahead of time (see sound_compile()) and grouped by the frame
+ * they are made on. Playing a frame back is a loop over its events, so none of the driver's work
+ * is repeated at playback time.
+ *
+ * The events of the frames are stored back to back, after the events made when the song starts,
+ * and offsets has one entry per frame plus one, so a frame's events can be found in constant
+ * time. After the last frame the song goes back to loop_frame and plays on from there for ever.
+ */
+
+typedef struct {
+	uint8_t			reg;					// APU register, or TIMELINE_BANK_REG + ROM page
+	uint8_t			val;					// value, or bank to switch into the page
+} TimelineEvent;
+
+typedef struct {
+	uint32_t		frames;					// number of frames
+	uint32_t		loop_frame;				// frame to go back to after the last one
+	uint32_t		*offsets;				// start of the events of each frame, and of the end
+	TimelineEvent	*events;				// events of the start and of every frame
+	size_t			count;					// number of events
+	size_t			capacity;				// number of events that fit in events
+	size_t			offsets_capacity;		// number of entries that fit in offsets
+} Timeline;
+
+typedef struct {
+	const Timeline	*timeline;
+	Apu				*apu;					// APU to write to
+	Bus				*bus;					// bus to switch banks on
+	uint64_t		frame;					// next frame to play
+} TimelinePlayer;
+
+void	timeline_init( Timeline *tl );
+void	timeline_free( Timeline *tl );
+int		timeline_add( Timeline *tl, uint8_t reg, uint8_t val );
+int		timeline_end_frame( Timeline *tl );
+int		timeline_save( const Timeline *tl, const char *filename );
+int		timeline_load( Timeline *tl, const char *filename );
+
+void	timeline_player_start( TimelinePlayer *p, const Timeline *tl, Apu *apu, Bus *bus );
+void	timeline_player_frame( void *userdata );
+
+#endif // TIMELINE_H
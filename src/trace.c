@@ -0,0 +1,239 @@
+#ifdef APU_TRACE
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "trace.h"
+
+#define TRACE_PID		1						// process id of every event in the JSON
+
+enum {
+	TRACK_APU = 1,								// register writes, IRQs and DMC fetches
+	TRACK_DRIVER,								// driver ticks
+	TRACK_AUDIO									// audio queue submissions and underruns
+};
+
+typedef struct {
+	atomic_uint_least64_t seq;				// event number + 1 once the slot is written, 0 while writing
+	uint64_t		cycle;					// CPU cycle
+	uint64_t		ns;						// wall time since trace_init()
+	uint32_t		type;					// TRACE_*
+	uint32_t		a;						// event arguments, see TRACE_*
+	uint32_t		b;
+} TraceSlot;
+
+static const struct {
+	const char		*name;
+	char			ph;						// trace-event phase
+	int				track;
+} event_info[TRACE_TYPES] = {
+	[TRACE_WRITE]			= { "write",		'i', TRACK_APU },
+	[TRACE_DRIVER_BEGIN]	= { "driver tick",	'B', TRACK_DRIVER },
+	[TRACE_DRIVER_END]		= { "driver tick",	'E', TRACK_DRIVER },
+	[TRACE_FRAME_IRQ]		= { "frame IRQ",	'i', TRACK_APU },
+	[TRACE_DMC_IRQ]			= { "DMC IRQ",		'i', TRACK_APU },
+	[TRACE_DMC_FETCH]		= { "DMC fetch",	'i', TRACK_APU },
+	[TRACE_AUDIO_QUEUE]		= { "queue audio",	'i', TRACK_AUDIO },
+	[TRACE_UNDERRUN]		= { "underrun",		'i', TRACK_AUDIO },
+};
+
+static TraceSlot *ring;						// NULL until trace_init()
+static size_t mask;							// capacity - 1 (capacity is a power of 2)
+static atomic_uint_least64_t head;			// number of events recorded
+static uint64_t start_ns;					// monotonic time at trace_init()
+
+/**
+ * Reads the monotonic clock
+ * @return Time in nanoseconds
+ */
+static uint64_t
+now_ns( void )
+{
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Allocates the ring buffer and starts the clock. Any earlier trace is thrown away.
+ * @param capacity Number of events to keep (rounded up to a power of 2, 0 picks
+ * TRACE_DEFAULT_CAPACITY)
+ * @return 0 on success, -1 if out of memory
+ */
+int
+trace_init( size_t capacity )
+{
+	size_t size = 1;
+
+	if ( capacity == 0 )
+		capacity = TRACE_DEFAULT_CAPACITY;
+
+	while ( size < capacity )
+		size <<= 1;
+
+	trace_free();
+
+	TraceSlot *slots = calloc( size, sizeof(TraceSlot) );
+
+	if ( slots == NULL )
+		return -1;
+
+	for ( size_t i = 0; i < size; i++ )
+		atomic_init( &slots[i].seq, 0 );
+
+	mask		= size - 1;
+	start_ns	= now_ns();
+	atomic_store( &head, 0 );
+	ring		= slots;
+	return 0;
+}
+
+/**
+ * Frees the ring buffer. Events recorded after this are dropped.
+ */
+void
+trace_free( void )
+{
+	free( ring );
+	ring = NULL;
+}
+
+/**
+ * Records an event. Does nothing before trace_init().
+ * @param type Event type (TRACE_*)
+ * @param cycle CPU cycle the event happened on
+ * @param a First argument, see TRACE_*
+ * @param b Second argument, see TRACE_*
+ */
+void
+trace_event( int type, uint64_t cycle, uint32_t a, uint32_t b )
+{
+	if ( ring == NULL )
+		return;
+
+	const uint64_t n = atomic_fetch_add_explicit( &head, 1, memory_order_relaxed );
+	TraceSlot *s = &ring[n & mask];
+
+	// mark the slot as being written, so a reader does not take a half-written event for a whole one
+
+	atomic_store_explicit( &s->seq, 0, memory_order_relaxed );
+	atomic_thread_fence( memory_order_release );
+
+	s->cycle	= cycle;
+	s->ns		= now_ns() - start_ns;
+	s->type		= type;
+	s->a		= a;
+	s->b		= b;
+
+	atomic_store_explicit( &s->seq, n + 1, memory_order_release );
+}
+
+/**
+ * Writes the args object of an event
+ * @param f File to write to
+ * @param ev Event
+ */
+static void
+write_args( FILE *f, const TraceSlot *ev )
+{
+	fprintf( f, "\"args\":{\"cycle\":%llu", (unsigned long long)ev->cycle );
+
+	switch ( ev->type )
+	{
+	case TRACE_WRITE:
+		fprintf( f, ",\"reg\":\"$%04x\",\"val\":\"$%02x\"", 0x4000 + ev->a, ev->b );
+		break;
+	case TRACE_DMC_FETCH:
+		fprintf( f, ",\"addr\":\"$%04x\",\"byte\":\"$%02x\"", ev->a, ev->b );
+		break;
+	case TRACE_AUDIO_QUEUE:
+		fprintf( f, ",\"bytes\":%u,\"queued\":%u", ev->a, ev->b );
+		break;
+	}
+
+	fprintf( f, "}" );
+}
+
+/**
+ * Writes the recorded events to a file as Chrome trace-event JSON, oldest first. Timestamps are
+ * wall time; the CPU cycle of each event is in its args. Events that were overwritten or still
+ * being written are left out. Best called while nothing is recording, but safe either way.
+ * @param filename Path of file to write
+ * @return 0 on success, -1 if there is no trace or the file could not be written
+ */
+int
+trace_write_json( const char *filename )
+{
+	if ( ring == NULL )
+		return -1;
+
+	FILE *f = fopen( filename, "w" );
+
+	if ( !f )
+		return -1;
+
+	static const char *track_names[] = { NULL, "APU", "Driver", "Audio" };
+
+	const uint64_t end = atomic_load_explicit( &head, memory_order_acquire );
+	const uint64_t begin = ( end > mask + 1 ) ? end - ( mask + 1 ) : 0;
+	uint64_t dropped = begin;
+
+	fprintf( f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n" );
+	fprintf( f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"apu-emu\"}}",
+			TRACE_PID );
+
+	for ( int t = TRACK_APU; t <= TRACK_AUDIO; t++ )
+	{
+		fprintf( f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+				"\"args\":{\"name\":\"%s\"}}", TRACE_PID, t, track_names[t] );
+	}
+
+	for ( uint64_t n = begin; n < end; n++ )
+	{
+		const TraceSlot *s = &ring[n & mask];
+		TraceSlot ev;
+
+		// copy the event out, then check that it was not overwritten while copying
+
+		if ( atomic_load_explicit( &s->seq, memory_order_acquire ) != n + 1 )
+		{
+			dropped++;
+			continue;
+		}
+
+		ev.cycle	= s->cycle;
+		ev.ns		= s->ns;
+		ev.type		= s->type;
+		ev.a		= s->a;
+		ev.b		= s->b;
+
+		atomic_thread_fence( memory_order_acquire );
+
+		if ( atomic_load_explicit( &s->seq, memory_order_relaxed ) != n + 1 || ev.type >= TRACE_TYPES )
+		{
+			dropped++;
+			continue;
+		}
+
+		const char ph = event_info[ev.type].ph;
+
+		fprintf( f, ",\n{\"name\":\"%s\",\"ph\":\"%c\",", event_info[ev.type].name, ph );
+
+		if ( ph == 'i' )
+			fprintf( f, "\"s\":\"%c\",", ( ev.type == TRACE_UNDERRUN ) ? 'g' : 't' );
+
+		fprintf( f, "\"ts\":%.3f,\"pid\":%d,\"tid\":%d,", ev.ns / 1000.0, TRACE_PID,
+				event_info[ev.type].track );
+		write_args( f, &ev );
+		fprintf( f, "}" );
+	}
+
+	fprintf( f, "\n],\"metadata\":{\"dropped_events\":%llu}}\n", (unsigned long long)dropped );
+
+	return ( fclose( f ) == 0 ) ? 0 : -1;
+}
+
+#endif // APU_TRACE
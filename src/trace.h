@@ -0,0 +1,48 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TRACE_DEFAULT_CAPACITY	( 1 << 20 )		// events kept (40 MiB, a few minutes of the demo)
+
+/*
+ * Event tracer, built with TRACE=1 (APU_TRACE). Events are stamped with the CPU cycle they happen
+ * on and the wall time they were recorded at, and go into a ring buffer that is allocated once by
+ * trace_init(). Recording an event claims a slot with one atomic add, so any thread can record
+ * without locking. When the ring is full the oldest events are overwritten, so the trace always
+ * holds the last capacity events before it is written out.
+ *
+ * trace_write_json() writes the ring as Chrome trace-event JSON, which chrome://tracing and
+ * Perfetto can open. APU events, driver ticks and audio queue events are put on separate tracks.
+ * Without APU_TRACE the macro compiles to nothing and trace.c is empty.
+ */
+
+enum {
+	TRACE_WRITE,								// register write: a = register, b = value
+	TRACE_DRIVER_BEGIN,							// start of a PPMCK driver tick
+	TRACE_DRIVER_END,							// end of a PPMCK driver tick
+	TRACE_FRAME_IRQ,							// frame counter IRQ flag raised
+	TRACE_DMC_IRQ,								// DMC IRQ flag raised
+	TRACE_DMC_FETCH,							// DMC sample byte fetch: a = address, b = byte
+	TRACE_AUDIO_QUEUE,							// audio submitted: a = bytes, b = bytes still queued
+	TRACE_UNDERRUN,								// audio queue had run dry by the next submission
+	TRACE_TYPES
+};
+
+#ifdef APU_TRACE
+
+#define TRACE_EVENT( type, cycle, a, b )	trace_event( type, cycle, a, b )
+
+int		trace_init( size_t capacity );
+void	trace_free( void );
+void	trace_event( int type, uint64_t cycle, uint32_t a, uint32_t b );
+int		trace_write_json( const char *filename );
+
+#else
+
+#define TRACE_EVENT( type, cycle, a, b )	( (void)( cycle ) )
+
+#endif // APU_TRACE
+
+#endif // TRACE_H
@@ -1,10 +1,11 @@
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "wav_file.h"
 
-static struct {
+typedef struct {
 	char			magic1[4];
 	uint32_t		file_size;
 	char			magic2[4];
@@ -18,10 +19,19 @@ static struct {
 	uint16_t		bit_depth;
 	char			magic4[4];
 	uint32_t		subchunk_2_size;
-} wav_header;
-
-static size_t out_size = 0;
+} WavHeader;
 
+/**
+ * Opens a WAV file for writing and writes its header. The sizes in the header are filled in by
+ * wav_file_close(), which works them out from the file itself, so any number of files can be
+ * written at once, on any threads.
+ * @param filename File to write
+ * @param sample_rate Sample rate in Hz
+ * @param format WAV_FMT_*
+ * @param bit_depth Bits per sample
+ * @param num_channels Number of channels
+ * @return Stream to write samples to
+ */
 FILE *
 wav_file_open( char *filename, int sample_rate, int format, int bit_depth, int num_channels )
 {
@@ -33,18 +43,24 @@ wav_file_open( char *filename, int sample_rate, int format, int bit_depth, int n
 		exit( EXIT_FAILURE );
 	}
 
+	WavHeader wav_header;
+
 	memset( &wav_header, 0, sizeof(wav_header) );
-	out_size = 0;
+
+	memcpy( wav_header.magic1, "RIFF", 4 );
+	memcpy( wav_header.magic2, "WAVE", 4 );
+	memcpy( wav_header.magic3, "fmt ", 4 );
+	memcpy( wav_header.magic4, "data", 4 );
 
 	wav_header.subchunk_1_size	= 16;
 	wav_header.format			= format;
 	wav_header.num_channels		= num_channels;
 	wav_header.sample_rate		= sample_rate;
-	wav_header.byte_rate		= sample_rate * bit_depth;
-	wav_header.block_align		= bit_depth / 8;
+	wav_header.byte_rate		= sample_rate * num_channels * bit_depth / 8;
+	wav_header.block_align		= num_channels * bit_depth / 8;
 	wav_header.bit_depth		= bit_depth;
 
-	// temporary, will be overwritten later
+	// sizes are filled in on closing
 	fwrite( &wav_header, sizeof(wav_header), 1, wav_f );
 	return wav_f;
 }
@@ -53,37 +69,22 @@ void
 wav_file_write_samples( FILE *stream, void *samples, size_t len )
 {
 	fwrite( samples, 1, len, stream );
-	out_size += len;
 }
 
+/**
+ * Fills in the sizes in the header of a WAV file and closes it
+ * @param stream Stream returned by wav_file_open()
+ */
 void
 wav_file_close( FILE *stream )
 {
-	wav_header.magic1[0]		= 'R';
-	wav_header.magic1[1]		= 'I';
-	wav_header.magic1[2]		= 'F';
-	wav_header.magic1[3]		= 'F';
-
-	wav_header.file_size		= out_size + 36;
-	
-	wav_header.magic2[0]		= 'W';
-	wav_header.magic2[1]		= 'A';
-	wav_header.magic2[2]		= 'V';
-	wav_header.magic2[3]		= 'E';
-
-	wav_header.magic3[0]		= 'f';
-	wav_header.magic3[1]		= 'm';
-	wav_header.magic3[2]		= 't';
-	wav_header.magic3[3]		= ' ';
-
-	wav_header.magic4[0]		= 'd';
-	wav_header.magic4[1]		= 'a';
-	wav_header.magic4[2]		= 't';
-	wav_header.magic4[3]		= 'a';
-
-	wav_header.subchunk_2_size	= out_size;
+	const long end = ftell( stream );
+	const uint32_t data_size = ( end > (long)sizeof(WavHeader) ) ? end - sizeof(WavHeader) : 0;
+	const uint32_t file_size = data_size + sizeof(WavHeader) - 8;
 
-	rewind( stream );
-	fwrite( &wav_header, sizeof(wav_header), 1, stream );
+	fseek( stream, offsetof( WavHeader, file_size ), SEEK_SET );
+	fwrite( &file_size, sizeof(file_size), 1, stream );
+	fseek( stream, offsetof( WavHeader, subchunk_2_size ), SEEK_SET );
+	fwrite( &data_size, sizeof(data_size), 1, stream );
 	fclose( stream );
 }
@@ -0,0 +1,376 @@
+/*
+ * Mixer test. Checks every entry of the mixer lookup tables against the NES mixer formulas and
+ * their linearized approximations, worked out here in double precision rather than with the
+ * float helpers in mixer.h that the tables are built from.
+ *
+ * Then checks that each mixer mode selected with apu_set_mixer() gives the block output those
+ * formulas predict. The output filters are linear, so a channel switching between silence and a
+ * fixed level comes out as the filters' response to that switching, scaled by the step the mixer
+ * makes for the level. The response is measured once, with the formula mixer at full level, and
+ * every other mode and level has to match it scaled by its own step, with every output engine
+ * that renders float samples.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "apu.h"
+#include "bus.h"
+#include "mixer.h"
+
+#define WARMUP_CYCLES	( 1789773 / 2 )			// long enough for the high pass to settle
+#define TEST_CYCLES		400000					// cycles compared after the warm-up
+#define TEST_SAMPLES	16384					// output buffer size
+#define DMC_PERIOD		1500					// cycles between $4011 writes in the DMC test
+
+#define TABLE_TOLERANCE	1e-6					// largest error allowed in a float table entry
+#define BLOCK_TOLERANCE	1e-4					// largest error allowed, relative to the peak
+
+typedef struct {
+	const char		*name;					// what is being switched on and off
+	void			( *start )( Apu *apu, int level );
+	int				levels;					// levels to test, 1 to levels
+	double			( *step )( int mixer, int level );
+} BlockTest;
+
+static Rom rom;								// no image, every page reads as zero
+static Bus bus;
+static float samples[TEST_SAMPLES];
+static float reference[TEST_SAMPLES];
+static int failures;
+
+static const char *mixer_names[] = { "formula", "linear", "exact" };
+static const char *output_names[] = { "FIR", "BLEP", "DECIM" };
+
+/**
+ * Works out the pulse mixer output in double precision
+ * @param n Sum of the pulse levels (0-30)
+ * @return Pulse mixer output
+ */
+static double
+pulse_reference( int n )
+{
+	return ( n == 0 ) ? 0.0 : 95.88 / ( 8128.0 / n + 100.0 );
+}
+
+/**
+ * Works out the triangle/noise/DMC mixer output in double precision
+ * @param tri Triangle level (0-15)
+ * @param noi Noise level (0-15)
+ * @param dmc DMC level (0-127)
+ * @return TND mixer output
+ */
+static double
+tnd_reference( int tri, int noi, int dmc )
+{
+	const double sum = tri / 8227.0 + noi / 12241.0 + dmc / 22638.0;
+
+	return ( sum == 0.0 ) ? 0.0 : 159.79 / ( 1.0 / sum + 100.0 );
+}
+
+/**
+ * Works out the linearized pulse approximation in double precision
+ * @param n Sum of the pulse levels (0-30)
+ * @return Pulse mixer output
+ */
+static double
+pulse_linear_reference( int n )
+{
+	return ( n == 0 ) ? 0.0 : 95.52 / ( 8128.0 / n + 100.0 );
+}
+
+/**
+ * Works out the linearized triangle/noise/DMC approximation in double precision
+ * @param n 3 * triangle + 2 * noise + DMC level (0-202)
+ * @return TND mixer output
+ */
+static double
+tnd_linear_reference( int n )
+{
+	return ( n == 0 ) ? 0.0 : 163.67 / ( 24329.0 / n + 100.0 );
+}
+
+/**
+ * Reports a failed check
+ * @param what What was checked
+ * @param index Table index or sample
+ * @param got Value found
+ * @param expected Value expected
+ */
+static void
+fail( const char *what, int index, double got, double expected )
+{
+	if ( failures++ < 20 )
+		fprintf( stderr, "FAIL %s [%d]: got %.9f, expected %.9f\n", what, index, got, expected );
+}
+
+/**
+ * Checks a float table against a reference
+ * @param what Table name
+ * @param table Table
+ * @param index Index into table
+ * @param expected Reference value
+ */
+static void
+check_float( const char *what, const float *table, int index, double expected )
+{
+	if ( fabs( table[index] - expected ) > TABLE_TOLERANCE )
+		fail( what, index, table[index], expected );
+}
+
+/**
+ * Checks a Q15 table against a reference. The float the entry was rounded from may land on the
+ * other side of a half from the reference, so one step either way is allowed.
+ * @param what Table name
+ * @param table Table
+ * @param index Index into table
+ * @param expected Reference value (0.0 to 1.0)
+ */
+static void
+check_q15( const char *what, const int16_t *table, int index, double expected )
+{
+	if ( fabs( table[index] - expected * MIXER_Q15_ONE ) > 1.0 )
+		fail( what, index, table[index], expected * MIXER_Q15_ONE );
+}
+
+/**
+ * Checks every entry of the mixer lookup tables
+ */
+static void
+test_tables( void )
+{
+	const MixerTables *t = mixer_tables();
+
+	for ( int n = 0; n < MIXER_PULSE_SIZE; n++ )
+	{
+		check_float( "pulse_exact", t->pulse_exact, n, pulse_reference( n ) );
+		check_float( "pulse_linear", t->pulse_linear, n, pulse_linear_reference( n ) );
+		check_q15( "pulse_exact_q15", t->pulse_exact_q15, n, pulse_reference( n ) );
+		check_q15( "pulse_linear_q15", t->pulse_linear_q15, n, pulse_linear_reference( n ) );
+	}
+
+	for ( int tri = 0; tri < 16; tri++ )
+	{
+		for ( int noi = 0; noi < 16; noi++ )
+		{
+			for ( int dmc = 0; dmc < 128; dmc++ )
+			{
+				const int i = MIXER_TND_INDEX( tri, noi, dmc );
+
+				check_float( "tnd_exact", t->tnd_exact, i, tnd_reference( tri, noi, dmc ) );
+				check_q15( "tnd_exact_q15", t->tnd_exact_q15, i, tnd_reference( tri, noi, dmc ) );
+			}
+		}
+	}
+
+	for ( int n = 0; n < MIXER_TND_LINEAR_SIZE; n++ )
+	{
+		check_float( "tnd_linear", t->tnd_linear, n, tnd_linear_reference( n ) );
+		check_q15( "tnd_linear_q15", t->tnd_linear_q15, n, tnd_linear_reference( n ) );
+	}
+}
+
+/**
+ * Starts pulse 1 on a 50% duty square wave at a constant volume
+ * @param apu APU instance
+ * @param level Volume (1-15)
+ */
+static void
+start_pulse( Apu *apu, int level )
+{
+	const uint64_t at = apu_cycle( apu );
+
+	apu_write_at( apu, at, APU_SNDCHN, 0x01 );
+	apu_write_at( apu, at, APU_SQ1VOL, 0xb0 | level );
+	apu_write_at( apu, at, APU_SQ1SWEEP, 0x08 );
+	apu_write_at( apu, at, APU_SQ1LO, 0xfd );
+	apu_write_at( apu, at, APU_SQ1HI, 0x08 );
+}
+
+/**
+ * Switches the DMC output between 0 and a level with $4011 writes, with the triangle holding the
+ * level it starts on after a reset
+ * @param apu APU instance
+ * @param level DMC level (1-127)
+ */
+static void
+start_dmc( Apu *apu, int level )
+{
+	const uint64_t at = apu_cycle( apu );
+
+	for ( int i = 0; i < TEST_CYCLES / DMC_PERIOD; i++ )
+		apu_write_at( apu, at + (uint64_t)i * DMC_PERIOD, APU_DMCRAW, ( i & 1 ) ? 0 : level );
+}
+
+/**
+ * Returns the step in mixer output pulse 1 makes between silence and a volume
+ * @param mixer Mixer mode (APU_MIXER_*)
+ * @param level Volume (1-15)
+ * @return Step in mixer output
+ */
+static double
+pulse_step( int mixer, int level )
+{
+	if ( mixer == APU_MIXER_LINEAR )
+		return pulse_linear_reference( level );
+
+	return pulse_reference( level );
+}
+
+/**
+ * Returns the step in mixer output the DMC makes between 0 and a level, with the triangle at 15
+ * @param mixer Mixer mode (APU_MIXER_*)
+ * @param level DMC level (1-127)
+ * @return Step in mixer output
+ */
+static double
+dmc_step( int mixer, int level )
+{
+	if ( mixer == APU_MIXER_LINEAR )
+		return tnd_linear_reference( 45 + level ) - tnd_linear_reference( 45 );
+
+	return tnd_reference( 15, 0, level ) - tnd_reference( 15, 0, 0 );
+}
+
+static const BlockTest block_tests[] = {
+	{ "pulse",	start_pulse,	15,		pulse_step },
+	{ "DMC",	start_dmc,		127,	dmc_step },
+};
+
+/**
+ * Renders a test on a new APU, past the warm-up
+ * @param test Test
+ * @param output Output engine (APU_OUTPUT_*)
+ * @param mixer Mixer mode (APU_MIXER_*)
+ * @param level Level to test
+ * @param out Buffer to write the samples to
+ * @return Number of samples rendered, or 0 on failure
+ */
+static size_t
+render_test( const BlockTest *test, int output, int mixer, int level, float *out )
+{
+	Apu *apu = apu_create( bus.pages );
+	size_t samples_out = 0;
+	size_t n;
+
+	if ( apu == NULL )
+	{
+		fprintf( stderr, "FAIL allocating an APU\n" );
+		failures++;
+		return 0;
+	}
+
+	if ( apu_set_output( apu, output ) != 0 || apu_set_mixer( apu, mixer ) != 0 )
+	{
+		fprintf( stderr, "FAIL setting up an APU\n" );
+		failures++;
+		apu_destroy( apu );
+		return 0;
+	}
+
+	for ( size_t cycles = 0; cycles < WARMUP_CYCLES; )
+		cycles += apu_run( apu, WARMUP_CYCLES - cycles, out, TEST_SAMPLES, NULL );
+
+	test->start( apu, level );
+
+	for ( size_t cycles = 0; cycles < TEST_CYCLES && samples_out < TEST_SAMPLES; )
+	{
+		cycles += apu_run( apu, TEST_CYCLES - cycles, out + samples_out, TEST_SAMPLES - samples_out,
+				&n );
+		samples_out += n;
+	}
+
+	apu_destroy( apu );
+	return samples_out;
+}
+
+/**
+ * Checks the block output of every mixer mode and level of a test against the formulas
+ * @param test Test
+ * @param output Output engine (APU_OUTPUT_*)
+ */
+static void
+test_block( const BlockTest *test, int output )
+{
+	const double full = test->step( APU_MIXER_FORMULA, test->levels );
+	const size_t count = render_test( test, output, APU_MIXER_FORMULA, test->levels, reference );
+	double peak = 0.0;
+	char what[64];
+
+	for ( size_t i = 0; i < count; i++ )
+		peak = fmax( peak, fabs( reference[i] ) );
+
+	if ( count == 0 || peak == 0.0 )
+	{
+		fprintf( stderr, "FAIL %s with %s: no output\n", test->name, output_names[output] );
+		failures++;
+		return;
+	}
+
+	for ( int mixer = APU_MIXER_FORMULA; mixer <= APU_MIXER_EXACT; mixer++ )
+	{
+		for ( int level = 1; level <= test->levels; level++ )
+		{
+			const double scale = test->step( mixer, level ) / full;
+
+			if ( render_test( test, output, mixer, level, samples ) != count )
+			{
+				fprintf( stderr, "FAIL %s with %s: sample counts differ\n", test->name,
+						output_names[output] );
+				failures++;
+				return;
+			}
+
+			snprintf( what, sizeof(what), "%s %s level %d, %s mixer", output_names[output],
+					test->name, level, mixer_names[mixer] );
+
+			for ( size_t i = 0; i < count; i++ )
+			{
+				const double expected = reference[i] * scale;
+
+				if ( fabs( samples[i] - expected ) > BLOCK_TOLERANCE * peak )
+				{
+					fail( what, (int)i, samples[i], expected );
+					break;
+				}
+			}
+		}
+	}
+}
+
+int
+main( void )
+{
+	bus_init( &bus, &rom );
+	test_tables();
+
+	for ( int output = APU_OUTPUT_FIR; output <= APU_OUTPUT_DECIM; output++ )
+	{
+		for ( size_t t = 0; t < sizeof(block_tests) / sizeof(block_tests[0]); t++ )
+			test_block( &block_tests[t], output );
+	}
+
+	Apu *apu = apu_create( bus.pages );
+
+	if ( apu != NULL )
+	{
+		if ( apu_set_mixer( apu, APU_MIXER_EXACT + 1 ) != -1 || apu_set_mixer( apu, -1 ) != -1 ||
+				apu_set_output( apu, APU_OUTPUT_FIXED + 1 ) != -1 )
+		{
+			fprintf( stderr, "FAIL an unknown mixer mode or output engine was taken\n" );
+			failures++;
+		}
+
+		apu_destroy( apu );
+	}
+
+	if ( failures != 0 )
+	{
+		fprintf( stderr, "mixer: %d checks failed\n", failures );
+		return EXIT_FAILURE;
+	}
+
+	printf( "mixer: all checks passed\n" );
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,229 @@
+/*
+ * Register log round trip test. Renders aibomb.bin past the end of its first time round while
+ * recording a register log, and checks that the log has the song's loop point marked and ends on
+ * a whole number of times round. Then plays the log back for more than twice its own length and
+ * checks that it renders the same samples as the song itself, so the log loops exactly where the
+ * song does.
+ *
+ * Run from the top of the tree, where aibomb.bin is.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "apu.h"
+#include "offline.h"
+#include "ppmck_driver.h"
+#include "reglog.h"
+#include "rom.h"
+#include "timeline.h"
+
+#define SONG_FILE		"aibomb.bin"
+#define MAX_SONG_FRAMES	( 60 * 60 * 30 )		// most frames to compile (half an hour)
+#define EXTRA_FRAMES	600						// frames rendered past the end of a time round
+
+static char dir[] = "/tmp/reglog_testXXXXXX";
+static char log_file[64];
+static char song_out[64];
+static char log_out[64];
+static int failures;
+
+/**
+ * Reports a failed check
+ * @param what What went wrong
+ */
+static void
+fail( const char *what )
+{
+	fprintf( stderr, "FAIL %s\n", what );
+	failures++;
+}
+
+/**
+ * Compiles the song to find out where it loops
+ * @param tl Timeline to compile into (set up with timeline_init())
+ * @return 0 on success, -1 on failure
+ */
+static int
+compile_song( Timeline *tl )
+{
+	Rom rom;
+
+	if ( rom_open( &rom, SONG_FILE ) != 0 )
+		return -1;
+
+	Ppmck *driver = sound_create( &rom );
+	const int ret = ( driver != NULL && sound_compile( driver, tl, MAX_SONG_FRAMES ) == 0 ) ? 0 : -1;
+
+	sound_destroy( driver );
+	rom_close( &rom );
+	return ret;
+}
+
+/**
+ * Renders a file into headerless int16 samples at a low rate, which is all the comparison needs
+ * @param input Input file
+ * @param output Output file
+ * @param log Register log to record, or NULL
+ * @param cycles Length in CPU cycles
+ * @return 0 on success, -1 on failure
+ */
+static int
+render( const char *input, const char *output, const char *log, uint64_t cycles )
+{
+	const OfflineJob job = {
+		.input			= input,
+		.output			= output,
+		.log			= log,
+		.format			= OFFLINE_RAW_S16,
+		.cycles			= cycles,
+		.sample_rate	= APU_SAMPLE_RATE_MIN,
+		.quality		= APU_QUALITY_DRAFT,
+		.song			= OFFLINE_START_SONG,
+		.threads		= 1
+	};
+	OfflineStats stats;
+
+	return offline_render( &job, &stats );
+}
+
+/**
+ * Reads a whole file
+ * @param filename File to read
+ * @param size Pointer to store the size of the file in
+ * @return Contents, to be freed, or NULL on failure
+ */
+static uint8_t *
+read_file( const char *filename, size_t *size )
+{
+	FILE *f = fopen( filename, "rb" );
+	uint8_t *data = NULL;
+	long n;
+
+	if ( f == NULL )
+		return NULL;
+
+	if ( fseek( f, 0, SEEK_END ) == 0 && ( n = ftell( f ) ) >= 0 && fseek( f, 0, SEEK_SET ) == 0 )
+	{
+		data = malloc( n + 1 );
+
+		if ( data != NULL && fread( data, 1, n, f ) != (size_t)n )
+		{
+			free( data );
+			data = NULL;
+		}
+
+		*size = n;
+	}
+
+	fclose( f );
+	return data;
+}
+
+/**
+ * Checks the loop point and length of the recorded log
+ * @param tl Song the log was recorded from
+ * @param cycles Length rendered while recording
+ * @return Length of the log in cycles, or 0 if it is not usable
+ */
+static uint64_t
+check_log( const Timeline *tl, uint64_t cycles )
+{
+	const uint64_t loop_cycle = (uint64_t)tl->loop_frame * APU_FRAME_CYCLES;
+	const uint64_t period = (uint64_t)( tl->frames - tl->loop_frame ) * APU_FRAME_CYCLES;
+	RegLog log;
+
+	if ( reglog_open( &log, log_file ) != 0 )
+	{
+		fail( "the log could not be opened" );
+		return 0;
+	}
+
+	const uint64_t length = log.cycles;
+
+	if ( log.loop_offset == REGLOG_NO_LOOP )
+		fail( "the log has no loop point" );
+	else if ( log.loop_cycle != loop_cycle )
+		fail( "the loop point of the log is not on the song's loop frame" );
+
+	if ( length <= loop_cycle || ( length - loop_cycle ) % period != 0 )
+		fail( "the log does not end on a whole time round the loop" );
+	if ( length > cycles || cycles - length >= period )
+		fail( "the log leaves out more than the last part time round" );
+
+	reglog_close( &log );
+	return length;
+}
+
+int
+main( void )
+{
+	Timeline tl;
+
+	timeline_init( &tl );
+
+	if ( compile_song( &tl ) != 0 || tl.loop_frame == TIMELINE_NO_LOOP )
+	{
+		fprintf( stderr, "FAIL could not compile \"%s\", or it does not loop\n", SONG_FILE );
+		return EXIT_FAILURE;
+	}
+
+	if ( mkdtemp( dir ) == NULL )
+	{
+		fprintf( stderr, "FAIL could not make a directory to work in\n" );
+		return EXIT_FAILURE;
+	}
+
+	snprintf( log_file, sizeof(log_file), "%s/song.log", dir );
+	snprintf( song_out, sizeof(song_out), "%s/song.raw", dir );
+	snprintf( log_out, sizeof(log_out), "%s/log.raw", dir );
+
+	// record once round the song and some way into the second time round
+
+	const uint64_t record = ( (uint64_t)tl.frames + EXTRA_FRAMES ) * APU_FRAME_CYCLES;
+	uint64_t length = 0;
+
+	if ( render( SONG_FILE, song_out, log_file, record ) != 0 )
+		fail( "recording the log" );
+	else
+		length = check_log( &tl, record );
+
+	// play the log for more than twice its length, so it has to loop at least twice
+
+	if ( length != 0 )
+	{
+		const uint64_t play = 2 * length + (uint64_t)EXTRA_FRAMES * APU_FRAME_CYCLES;
+		size_t song_size = 0, log_size = 0;
+
+		if ( render( SONG_FILE, song_out, NULL, play ) != 0 || render( log_file, log_out, NULL, play ) != 0 )
+			fail( "rendering the song or the log" );
+
+		uint8_t *song = read_file( song_out, &song_size );
+		uint8_t *played = read_file( log_out, &log_size );
+
+		if ( song == NULL || played == NULL || song_size == 0 )
+			fail( "reading the renders back" );
+		else if ( song_size != log_size || memcmp( song, played, song_size ) != 0 )
+			fail( "the log played back differs from the song" );
+
+		free( song );
+		free( played );
+	}
+
+	unlink( log_file );
+	unlink( song_out );
+	unlink( log_out );
+	rmdir( dir );
+	timeline_free( &tl );
+
+	if ( failures != 0 )
+	{
+		fprintf( stderr, "reglog: %d checks failed\n", failures );
+		return EXIT_FAILURE;
+	}
+
+	printf( "reglog: all checks passed\n" );
+	return EXIT_SUCCESS;
+}